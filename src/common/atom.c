@@ -0,0 +1,162 @@
+#include "atom.h"
+
+// interned strings live in fixed-size pages that never move once allocated,
+// so looking one up can't race with the table growing on the interning thread.
+#define ATOM_PAGE_SIZE (1u << 12)
+#define ATOM_MAX_PAGES (1u << 12)
+
+static string* atom_pages[ATOM_MAX_PAGES];
+static u32 atoms_len = 1; // ATOM_NONE is never handed out
+
+typedef struct {
+    u32 hash;
+    Atom atom; // ATOM_NONE if the slot is empty
+} AtomSlot;
+
+static AtomSlot* atom_table;
+static u32 atom_table_cap;
+
+// interned strings get copied in, so an atom outlives the text it came from,
+// like a file the compile server has since read in again
+#define ATOM_TEXT_CHUNK (1u << 16)
+static char* atom_text;
+static usize atom_text_left;
+
+static string atom_copy(string s) {
+    if (s.len > atom_text_left) {
+        atom_text_left = s.len > ATOM_TEXT_CHUNK ? s.len : ATOM_TEXT_CHUNK;
+        atom_text = malloc(atom_text_left);
+    }
+    string copy = {.raw = atom_text, .len = s.len};
+    memcpy(copy.raw, s.raw, s.len);
+    atom_text += s.len;
+    atom_text_left -= s.len;
+    return copy;
+}
+
+static u32 atom_hash(string s) {
+    u32 hash = 2166136261u;
+    for_n(i, 0, s.len) {
+        hash ^= (u32)(u8)s.raw[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void atom_table_grow() {
+    u32 old_cap = atom_table_cap;
+    AtomSlot* old_table = atom_table;
+
+    atom_table_cap = old_cap ? old_cap * 2 : 1024;
+    atom_table = malloc(sizeof(AtomSlot) * atom_table_cap);
+    memset(atom_table, 0, sizeof(AtomSlot) * atom_table_cap);
+
+    for_n(i, 0, old_cap) {
+        AtomSlot slot = old_table[i];
+        if (slot.atom == ATOM_NONE) continue;
+        u32 j = slot.hash & (atom_table_cap - 1);
+        while (atom_table[j].atom != ATOM_NONE) {
+            j = (j + 1) & (atom_table_cap - 1);
+        }
+        atom_table[j] = slot;
+    }
+    free(old_table);
+}
+
+string atom_str(Atom a) {
+    return atom_pages[a / ATOM_PAGE_SIZE][a % ATOM_PAGE_SIZE];
+}
+
+u32 atom_count() {
+    return atoms_len;
+}
+
+Atom atom_intern(string s) {
+    // keep the load under half so probes stay short
+    if (atoms_len * 2 >= atom_table_cap) {
+        atom_table_grow();
+    }
+
+    u32 hash = atom_hash(s);
+    u32 i = hash & (atom_table_cap - 1);
+    for (; atom_table[i].atom != ATOM_NONE; i = (i + 1) & (atom_table_cap - 1)) {
+        if (atom_table[i].hash == hash && string_eq(atom_str(atom_table[i].atom), s)) {
+            return atom_table[i].atom;
+        }
+    }
+
+    Atom a = atoms_len;
+    if (a / ATOM_PAGE_SIZE >= ATOM_MAX_PAGES) {
+        CRASH("too many distinct identifiers");
+    }
+    if (atom_pages[a / ATOM_PAGE_SIZE] == nullptr) {
+        atom_pages[a / ATOM_PAGE_SIZE] = malloc(sizeof(string) * ATOM_PAGE_SIZE);
+    }
+    atom_pages[a / ATOM_PAGE_SIZE][a % ATOM_PAGE_SIZE] = atom_copy(s);
+    ++atoms_len;
+
+    atom_table[i] = (AtomSlot){.hash = hash, .atom = a};
+    return a;
+}
+
+// atoms are handed out densely, so a multiplicative hash spreads them out enough
+static u32 atommap_index(AtomMap* am, Atom key) {
+    return (key * 2654435769u) & (am->cap - 1);
+}
+
+void atommap_init(AtomMap* am, u32 capacity) {
+    // round up to a power of two
+    u32 cap = 16;
+    while (cap < capacity) cap *= 2;
+
+    am->size = 0;
+    am->cap = cap;
+    am->keys = malloc(sizeof(am->keys[0]) * am->cap);
+    am->vals = malloc(sizeof(am->vals[0]) * am->cap);
+    memset(am->keys, 0, sizeof(am->keys[0]) * am->cap);
+}
+
+void atommap_destroy(AtomMap* am) {
+    if (am->keys) free(am->keys);
+    if (am->vals) free(am->vals);
+    *am = (AtomMap){0};
+}
+
+void atommap_reset(AtomMap* am) {
+    memset(am->keys, 0, sizeof(am->keys[0]) * am->cap);
+    am->size = 0;
+}
+
+void atommap_put(AtomMap* am, Atom key, void* val) {
+    if (key == ATOM_NONE) return;
+
+    if ((am->size + 1) * 2 > am->cap) {
+        AtomMap new_am;
+        atommap_init(&new_am, am->cap * 2);
+        for_n(i, 0, am->cap) {
+            if (am->keys[i] == ATOM_NONE) continue;
+            atommap_put(&new_am, am->keys[i], am->vals[i]);
+        }
+        atommap_destroy(am);
+        *am = new_am;
+    }
+
+    u32 i = atommap_index(am, key);
+    while (am->keys[i] != ATOM_NONE && am->keys[i] != key) {
+        i = (i + 1) & (am->cap - 1);
+    }
+    if (am->keys[i] == ATOM_NONE) {
+        ++am->size;
+    }
+    am->keys[i] = key;
+    am->vals[i] = val;
+}
+
+void* atommap_get(AtomMap* am, Atom key) {
+    for (u32 i = atommap_index(am, key); am->keys[i] != ATOM_NONE; i = (i + 1) & (am->cap - 1)) {
+        if (am->keys[i] == key) {
+            return am->vals[i];
+        }
+    }
+    return ATOMMAP_NOT_FOUND;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "orbit.h"
+
+// atoms are small integers standing in for interned strings.
+// equal strings always intern to the same atom, so comparing and hashing
+// names is just comparing and hashing integers.
+
+typedef u32 Atom;
+
+#define ATOM_NONE ((Atom)0)
+
+// interning is not thread safe, only one thread may intern at a time.
+// atom_str can be called from anywhere on an atom that was already handed out,
+// the strings are copied in when they're interned, and never move after that.
+Atom atom_intern(string s);
+string atom_str(Atom a);
+// one more than the largest atom handed out so far
+u32 atom_count();
+
+// atommap associates an atom with a void*.
+
+typedef struct AtomMap {
+    Atom* keys;
+    void** vals;
+    u32 cap; // capacity, always a power of two
+    u32 size; // number of items
+} AtomMap;
+
+#define ATOMMAP_NOT_FOUND ((void*)0xDEADBEEF)
+
+void atommap_init(AtomMap* am, u32 capacity);
+void atommap_reset(AtomMap* am);
+void atommap_destroy(AtomMap* am);
+void atommap_put(AtomMap* am, Atom key, void* val);
+void* atommap_get(AtomMap* am, Atom key);
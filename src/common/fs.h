@@ -32,20 +32,39 @@ typedef struct FsFile {
     usize size;
     // units unspecified, but greater means more recent
     usize last_modified;
+    // non-zero if the contents are currently mapped by fs_map_entire
+    usize mapped_len;
     FsPath path;
 } FsFile;
 
+// fs_map_entire guarantees at least this many zero bytes after the contents,
+// so scanners can read past the end without bounds checks.
+#define FS_MAP_PADDING 64
+
 #define fs_from_path(pathptr) (string){.len = (pathptr)->len, .raw = (pathptr)->raw}
 
 bool fs_real_path(const char* path, FsPath* out);
 FsFile* fs_open(const char* path, bool create, bool overwrite);
 usize fs_read(FsFile* f, void* buf, usize len);
+// returns how much was actually written
+usize fs_write(FsFile* f, const void* buf, usize len);
 string fs_read_entire(FsFile* f);
+// maps the file's contents into memory (zero-copy where possible), followed by
+// FS_MAP_PADDING zero bytes. falls back to reading for pipes and other unmappables.
+string fs_map_entire(FsFile* f);
+void fs_unmap_entire(FsFile* f, string contents);
 void fs_close(FsFile* f);
 void fs_destroy(FsFile* f);
 
 char* fs_get_current_dir();
 bool fs_set_current_dir(const char* dir);
+// succeeds if the directory already exists
+bool fs_make_dir(const char* path);
+// replaces to if it exists
+bool fs_rename(const char* from, const char* to);
+
+// number of cores we can reasonably spread work across, at least 1
+u32 fs_cpu_count();
 
 Vec_typedef(string);
 // returns contents. if contents == nullptr, return a newly allocated vec.
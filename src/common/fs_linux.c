@@ -1,3 +1,5 @@
+// for MAP_ANONYMOUS and madvise
+#define _DEFAULT_SOURCE
 #include "fs.h"
 
 #ifdef OS_LINUX
@@ -6,9 +8,15 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 bool fs_real_path(const char* path, FsPath* out) {
-    if (!realpath(path, out->raw)) return true;
+    if (!realpath(path, out->raw)) {
+        // things like pipes might not have a real path, just use what we were given
+        out->len = strlen(path);
+        memcpy(out->raw, path, out->len + 1);
+        return false;
+    }
     out->len = strlen(out->raw);
     return true;
 }
@@ -17,9 +25,9 @@ FsFile* fs_open(const char* path, bool create, bool overwrite) {
     FsFile* f = malloc(sizeof(FsFile));
     if (create) {
         if (overwrite) {
-            f->handle = open(path, O_WRONLY | O_CREAT);
+            f->handle = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
         } else {
-            f->handle = open(path, O_WRONLY);
+            f->handle = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
         }
     } else {
         f->handle = open(path, O_RDONLY);
@@ -33,6 +41,7 @@ FsFile* fs_open(const char* path, bool create, bool overwrite) {
     f->size = info.st_size;
     // convert to microseconds, that's easier and more reliable to deal with in 64 bits
     f->last_modified = ((usize)info.st_mtim.tv_sec * 1000000) + (usize)info.st_mtim.tv_nsec / 1000;
+    f->mapped_len = 0;
     fs_real_path(path, &f->path);
     return f;
 }
@@ -43,11 +52,76 @@ usize fs_read(FsFile* f, void* buf, usize len) {
     return num_read;
 }
 
+usize fs_write(FsFile* f, const void* buf, usize len) {
+    usize total = 0;
+    while (total < len) {
+        isize num_written = write(f->handle, (const char*)buf + total, len - total);
+        if (num_written <= 0) break;
+        total += num_written;
+    }
+    return total;
+}
+
 string fs_read_entire(FsFile* f) {
     string s = string_alloc(f->size);
     read(f->handle, s.raw, s.len);
     return s;
 }
+// read everything until EOF into a zero-padded buffer.
+// used for pipes, stdin, and anything else we can't map.
+static string read_padded(FsFile* f) {
+    usize cap = f->size != 0 ? f->size : 4096;
+    char* buf = malloc(cap + FS_MAP_PADDING);
+    usize len = 0;
+    while (true) {
+        if (len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap + FS_MAP_PADDING);
+        }
+        isize num_read = read(f->handle, buf + len, cap - len);
+        if (num_read <= 0) break;
+        len += num_read;
+    }
+    memset(buf + len, 0, FS_MAP_PADDING);
+    return (string){.raw = buf, .len = len};
+}
+
+string fs_map_entire(FsFile* f) {
+    struct stat info;
+    if (fstat(f->handle, &info) == -1 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+        return read_padded(f);
+    }
+
+    usize size = info.st_size;
+    usize page_size = sysconf(_SC_PAGESIZE);
+    usize mapped_len = (size + FS_MAP_PADDING + page_size - 1) & ~(page_size - 1);
+
+    // reserve zeroed anonymous pages first, then map the file over the front of them.
+    // the kernel zero-fills the tail of the file's last page, and the anonymous pages
+    // after it cover the case where the file ends right on a page boundary.
+    char* base = mmap(nullptr, mapped_len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return read_padded(f);
+    }
+    if (mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, f->handle, 0) == MAP_FAILED) {
+        munmap(base, mapped_len);
+        return read_padded(f);
+    }
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    f->mapped_len = mapped_len;
+    return (string){.raw = base, .len = size};
+}
+
+void fs_unmap_entire(FsFile* f, string contents) {
+    if (f->mapped_len != 0) {
+        munmap(contents.raw, f->mapped_len);
+        f->mapped_len = 0;
+    } else {
+        free(contents.raw);
+    }
+}
+
 void fs_close(FsFile* f) {
     close(f->handle);
     f->handle = -1;
@@ -82,4 +156,19 @@ Vec(string) fs_dir_contents(const char* path, Vec(string)* _contents) {
     return contents;
 }
 
+bool fs_make_dir(const char* path) {
+    if (mkdir(path, 0755) == 0) return true;
+    struct stat info;
+    return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+bool fs_rename(const char* from, const char* to) {
+    return rename(from, to) == 0;
+}
+
+u32 fs_cpu_count() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+}
+
 #endif
\ No newline at end of file
@@ -55,6 +55,8 @@ FsFile* fs_open(const char* path, bool create, bool overwrite) {
     windows_why_are_u_say_zis.LowPart  = info.nFileSizeLow;
     f->size = (usize) windows_why_are_u_say_zis.QuadPart;
 
+    f->mapped_len = 0;
+
     fs_real_path(path, &f->path);
 
     return f;
@@ -67,6 +69,12 @@ usize fs_read(FsFile* f, void* buf, usize len) {
     return num_read;
 }
 
+usize fs_write(FsFile* f, const void* buf, usize len) {
+    DWORD num_written = 0;
+    WriteFile((HANDLE)f->handle, buf, len, &num_written, nullptr);
+    return num_written;
+}
+
 string fs_read_entire(FsFile* f) {
     string buf = string_alloc(f->size);
     DWORD num_read;
@@ -74,6 +82,67 @@ string fs_read_entire(FsFile* f) {
     return buf;
 }
 
+// read everything until EOF into a zero-padded buffer.
+// used for pipes, stdin, and anything else we can't map.
+static string read_padded(FsFile* f) {
+    usize cap = f->size != 0 ? f->size : 4096;
+    char* buf = malloc(cap + FS_MAP_PADDING);
+    usize len = 0;
+    while (true) {
+        if (len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap + FS_MAP_PADDING);
+        }
+        DWORD num_read = 0;
+        if (!ReadFile((HANDLE)f->handle, buf + len, cap - len, &num_read, nullptr) || num_read == 0) {
+            break;
+        }
+        len += num_read;
+    }
+    memset(buf + len, 0, FS_MAP_PADDING);
+    return (string){.raw = buf, .len = len};
+}
+
+string fs_map_entire(FsFile* f) {
+    if (GetFileType((HANDLE)f->handle) != FILE_TYPE_DISK || f->size == 0) {
+        return read_padded(f);
+    }
+
+    SYSTEM_INFO sys;
+    GetSystemInfo(&sys);
+    usize page_size = sys.dwPageSize;
+    usize mapped_len = (f->size + page_size - 1) & ~(page_size - 1);
+
+    // windows zero-fills the tail of the last page, but we can't put anything
+    // right after a view. if the padding doesn't fit in that tail, just read it.
+    if (mapped_len - f->size < FS_MAP_PADDING) {
+        return read_padded(f);
+    }
+
+    HANDLE mapping = CreateFileMappingA((HANDLE)f->handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr) {
+        return read_padded(f);
+    }
+    char* base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    // the view keeps the mapping object alive
+    CloseHandle(mapping);
+    if (base == nullptr) {
+        return read_padded(f);
+    }
+
+    f->mapped_len = mapped_len;
+    return (string){.raw = base, .len = f->size};
+}
+
+void fs_unmap_entire(FsFile* f, string contents) {
+    if (f->mapped_len != 0) {
+        UnmapViewOfFile(contents.raw);
+        f->mapped_len = 0;
+    } else {
+        free(contents.raw);
+    }
+}
+
 void fs_close(FsFile* f) {
     CloseHandle((HANDLE)f->handle);
     f->handle = (isize)INVALID_HANDLE_VALUE;
@@ -133,4 +202,19 @@ bool fs_set_current_dir(const char* dir) {
     return SetCurrentDirectoryA(dir);
 }
 
+bool fs_make_dir(const char* path) {
+    if (CreateDirectoryA(path, nullptr)) return true;
+    return GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+bool fs_rename(const char* from, const char* to) {
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+u32 fs_cpu_count() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors ? info.dwNumberOfProcessors : 1;
+}
+
 #endif
\ No newline at end of file
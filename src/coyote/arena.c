@@ -1,16 +1,32 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "common/util.h"
 #include "coyote.h"
 
-#define ARENA_CHUNK_DATA_SIZE 32768
+// chunks start out small and double from there, so a small arena stays small
+// and a big one doesn't have to go back to malloc every 32K
+#define ARENA_CHUNK_MIN 32768
+#define ARENA_CHUNK_MAX (1 << 20)
+
+// anything bigger than this gets a block of its own instead of going in a chunk,
+// so it can't leave the rest of a chunk empty, and any chunk fits everything else
+#define ARENA_BIG_ALLOC (ARENA_CHUNK_MIN / 2)
+
 typedef struct Arena__Chunk {
     Arena__Chunk* prev;
     Arena__Chunk* next;
     usize used;
-    u8 data[ARENA_CHUNK_DATA_SIZE];
+    usize cap;
+    u8 data[];
 } Arena__Chunk;
 
+typedef struct Arena__Big {
+    Arena__Big* prev;
+    usize size;
+    u8 data[];
+} Arena__Big;
+
 // assume align is a power of two
 static inline uintptr_t align_forward(uintptr_t ptr, uintptr_t align) {
     return (ptr + align - 1) & ~(align - 1);
@@ -19,7 +35,7 @@ static inline uintptr_t align_forward(uintptr_t ptr, uintptr_t align) {
 // return nullptr if cannot allocate
 static void* chunk_alloc(Arena__Chunk* ch, usize size, usize align) {
     usize new_used = align_forward(ch->used, align);
-    if (new_used + size > ARENA_CHUNK_DATA_SIZE) {
+    if (new_used + size > ch->cap) {
         return nullptr;
     }
     ch->used = new_used;
@@ -28,11 +44,29 @@ static void* chunk_alloc(Arena__Chunk* ch, usize size, usize align) {
     return mem;
 }
 
+static Arena__Chunk* chunk_new(Arena* arena, usize cap) {
+    Arena__Chunk* ch = malloc(sizeof(Arena__Chunk) + cap);
+    if (ch == nullptr) {
+        CRASH("unable to allocate an arena chunk of size %zu", cap);
+    }
+    ch->prev = nullptr;
+    ch->next = nullptr;
+    ch->used = 0;
+    ch->cap = cap;
+    arena->stats.chunks++;
+    arena->stats.reserved += cap;
+    arena->stats.mallocs++;
+    return ch;
+}
+
 void arena_init(Arena* arena) {
-    arena->top = malloc(sizeof(*arena->top));
-    arena->top->next = nullptr;
-    arena->top->prev = nullptr;
-    arena->top->used = 0;
+    *arena = (Arena){};
+    arena->top = chunk_new(arena, ARENA_CHUNK_MIN);
+}
+
+static void big_free(Arena* arena, Arena__Big* big) {
+    arena->stats.reserved -= big->size;
+    free(big);
 }
 
 void arena_destroy(Arena* arena) {
@@ -42,23 +76,56 @@ void arena_destroy(Arena* arena) {
         top = top->next;
     }
     // destroy any saved blocks below
-    for (Arena__Chunk* ch = top, *prev = ch->prev; ch != nullptr; ch = prev, prev = prev->prev) {
+    for (Arena__Chunk* ch = top, *prev; ch != nullptr; ch = prev) {
+        prev = ch->prev;
         free(ch);
     }
+    for (Arena__Big* big = arena->big, *prev; big != nullptr; big = prev) {
+        prev = big->prev;
+        free(big);
+    }
     arena->top = nullptr;
+    arena->big = nullptr;
+}
+
+static void* big_alloc(Arena* arena, usize size, usize align) {
+    // the block itself is only as aligned as malloc makes it
+    usize block_size = size + align;
+    Arena__Big* big = malloc(sizeof(Arena__Big) + block_size);
+    if (big == nullptr) {
+        CRASH("unable to arena-alloc size %zu align %zu", size, align);
+    }
+    big->prev = arena->big;
+    big->size = block_size;
+    arena->big = big;
+
+    arena->stats.bigs++;
+    arena->stats.mallocs++;
+    arena->stats.reserved += block_size;
+    return (void*)align_forward((uintptr_t)big->data, align);
 }
 
 void* arena_alloc(Arena* arena, usize size, usize align) {
+    arena->stats.requested += size;
+    if (size > ARENA_BIG_ALLOC) {
+        return big_alloc(arena, size, align);
+    }
+
+    usize used = arena->top->used;
     void* mem = chunk_alloc(arena->top, size, align);
     if (mem) {
+        arena->stats.wasted += arena->top->used - used - size;
         return mem;
     }
 
+    // whatever's left at the end of this one is lost for good
+    arena->stats.wasted += arena->top->cap - arena->top->used;
+
+    // chunks that got restored past are still around to be reused
     Arena__Chunk* new_chunk = arena->top->next;
-    if (new_chunk == NULL) {
-        new_chunk = malloc(sizeof(*new_chunk));
+    if (new_chunk == nullptr) {
+        new_chunk = chunk_new(arena, min(arena->top->cap * 2, ARENA_CHUNK_MAX));
         new_chunk->prev = arena->top;
-        new_chunk->next = nullptr;
         arena->top->next = new_chunk;
     }
     new_chunk->used = 0;
@@ -67,17 +134,63 @@ void* arena_alloc(Arena* arena, usize size, usize align) {
     if (mem) {
         return mem;
     }
-    CRASH("unable to arena-alloc size %zu align %zu", size, align);
+    UNREACHABLE;
 }
 
 ArenaState arena_save(Arena* arena) {
     return (ArenaState){
         .top = arena->top,
         .used = arena->top->used,
+        .big = arena->big,
+        .live = arena->stats.requested - arena->stats.restored,
+        .wasted = arena->stats.wasted,
     };
 }
 
 void arena_restore(Arena* arena, ArenaState save) {
     arena->top = save.top;
     arena->top->used = save.used;
+    // big allocations go back to malloc right away, they're too big to sit around
+    while (arena->big != save.big) {
+        Arena__Big* prev = arena->big->prev;
+        big_free(arena, arena->big);
+        arena->big = prev;
+    }
+    // the chunks are back where they were, padding and abandoned ends included
+    arena->stats.restored = arena->stats.requested - save.live;
+    arena->stats.wasted = save.wasted;
+}
+
+// only scratch scopes allocate from it, so nothing that has to outlive one can end up in it
+static thread_local Arena scratch_arena;
+
+ArenaScratch arena_scratch_begin() {
+    Arena* arena = &scratch_arena;
+    if (arena->top == nullptr) {
+        arena_init(arena);
+    }
+    return (ArenaScratch){
+        .arena = arena,
+        .save = arena_save(arena),
+        .depth = ++arena->scratch_depth,
+    };
+}
+
+void arena_scratch_end(ArenaScratch scratch) {
+    Arena* arena = scratch.arena;
+    if (scratch.depth != arena->scratch_depth) {
+        CRASH("arena scratch scope %u ended inside scope %u", scratch.depth, arena->scratch_depth);
+    }
+    arena->scratch_depth--;
+    arena_restore(arena, scratch.save);
+}
+
+void arena_scratch_release() {
+    Arena* arena = &scratch_arena;
+    if (arena->top == nullptr) {
+        return;
+    }
+    // an error can jump out of scopes without ending them, so don't check the depth
+    arena_destroy(arena);
+    *arena = (Arena){};
 }
@@ -0,0 +1,614 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "parse.h"
+
+// what each kind keeps besides its first child, which is always the next node.
+// a list in extra is its length followed by its items.
+//
+//     STMT_EXPR                   first child is the expression
+//     STMT_RETURN                 first child is the expression, see ast_has_expr
+//     STMT_VAR_DECL               data = entity, first child is the value, see ast_has_expr
+//     STMT_FN_DECL                data = extra: entity, the node right after its last one, body list
+//     STMT_ASSIGN*                first child is the lhs, data = rhs
+//     STMT_BREAK, STMT_CONTINUE   data = loop
+//     STMT_IF                     first child is the condition, data = extra: else or AST_NONE, block list
+//     STMT_WHILE                  first child is the condition, data = extra: block list
+//     STMT_LABEL, STMT_GOTO       data = entity
+//
+//     binary, EXPR_SUBSCRIPT      first child is the lhs, data = rhs
+//     unary and member kinds      first child is the operand
+//     EXPR_LITERAL                data = the value, see ast_literal
+//     EXPR_STR_LITERAL            data = extra: the CompactString
+//     EXPR_ENTITY                 data = entity
+//     EXPR_CALL                   first child is the callee, data = extra: argument list
+//     EXPR_ARRAY_LITERAL          data = extra: list of (index low word, index high word, value)
+//     EXPR_STRUCT_LITERAL         data = extra: list of (field index, value)
+
+typedef struct {
+    Entity* entity;
+    u32 index;
+} AstEntitySlot;
+
+// from an Entity* to its index, open addressing
+typedef struct {
+    AstEntitySlot* slots;
+    u32 cap;
+    u32 len;
+} AstEntityMap;
+
+typedef struct {
+    Stmt* stmt;
+    AstNode node;
+} AstLoop;
+Vec_typedef(AstLoop);
+
+typedef struct AstBuilder {
+    Ast ast;
+    u32 cap;
+    u32 extra_cap;
+    u32 entities_cap;
+    u32 part; // in CompilationUnit.ast_parts
+
+    // locals only ever get used in their own function, so they get a map that's
+    // small enough to stay in cache and is cleared out after every function
+    AstEntityMap globals;
+    AstEntityMap locals;
+
+    // enclosing loops, so BREAK and CONTINUE can find theirs
+    Vec(AstLoop) loops;
+} AstBuilder;
+
+static AstNode ast_node(AstBuilder* b, u8 kind, TyIndex ty, u32 token) {
+    Ast* ast = &b->ast;
+    if (ast->len == b->cap) {
+        b->cap *= 2;
+        ast->kinds = realloc(ast->kinds, sizeof(ast->kinds[0]) * b->cap);
+        ast->tys = realloc(ast->tys, sizeof(ast->tys[0]) * b->cap);
+        ast->tokens = realloc(ast->tokens, sizeof(ast->tokens[0]) * b->cap);
+        ast->data = realloc(ast->data, sizeof(ast->data[0]) * b->cap);
+    }
+    AstNode node = ast->len++;
+    ast->kinds[node] = kind;
+    ast->tys[node] = ty;
+    ast->tokens[node] = token;
+    ast->data[node] = 0;
+    return node;
+}
+
+// reserves len words of extra, returning where they start
+static u32 ast_extra(AstBuilder* b, u32 len) {
+    Ast* ast = &b->ast;
+    while (ast->extra_len + len > b->extra_cap) {
+        b->extra_cap *= 2;
+        ast->extra = realloc(ast->extra, sizeof(ast->extra[0]) * b->extra_cap);
+    }
+    u32 start = ast->extra_len;
+    ast->extra_len += len;
+    return start;
+}
+
+static void entity_map_init(AstEntityMap* map, u32 cap) {
+    map->slots = calloc(cap, sizeof(map->slots[0]));
+    map->cap = cap;
+    map->len = 0;
+}
+
+static AstEntitySlot* entity_map_slot(AstEntityMap* map, Entity* entity) {
+    u32 mask = map->cap - 1;
+    u32 i = ((uintptr_t)entity >> 4) * 0x9e3779b97f4a7c15ull >> 40 & mask;
+    while (map->slots[i].entity != nullptr && map->slots[i].entity != entity) {
+        i = (i + 1) & mask;
+    }
+    return &map->slots[i];
+}
+
+static void entity_map_put(AstEntityMap* map, AstEntitySlot* slot, Entity* entity, u32 index) {
+    *slot = (AstEntitySlot){entity, index};
+    if (++map->len * 2 <= map->cap) {
+        return;
+    }
+    AstEntityMap old = *map;
+    entity_map_init(map, old.cap * 2);
+    map->len = old.len;
+    for_n(i, 0, old.cap) {
+        if (old.slots[i].entity != nullptr) {
+            *entity_map_slot(map, old.slots[i].entity) = old.slots[i];
+        }
+    }
+    free(old.slots);
+}
+
+static void entity_map_clear(AstEntityMap* map) {
+    if (map->len != 0) {
+        memset(map->slots, 0, sizeof(map->slots[0]) * map->cap);
+        map->len = 0;
+    }
+}
+
+static bool entity_is_local(Entity* entity) {
+    return entity->storage == STORAGE_LOCAL || entity->storage == STORAGE_OUT_PARAM;
+}
+
+static u32 ast_entity_append(AstBuilder* b, Entity* entity) {
+    Ast* ast = &b->ast;
+    if (ast->entities_len == b->entities_cap) {
+        b->entities_cap *= 2;
+        ast->entities = realloc(ast->entities, sizeof(ast->entities[0]) * b->entities_cap);
+    }
+    u32 index = ast->entities_len++;
+    ast->entities[index] = entity;
+    return index;
+}
+
+static u32 ast_entity(AstBuilder* b, Entity* entity) {
+    if (entity == nullptr) {
+        return AST_NONE;
+    }
+    AstEntityMap* map = entity_is_local(entity) ? &b->locals : &b->globals;
+    AstEntitySlot* slot = entity_map_slot(map, entity);
+    if (slot->entity != nullptr) {
+        return slot->index;
+    }
+    u32 index = ast_entity_append(b, entity);
+    entity_map_put(map, slot, entity, index);
+    return index;
+}
+
+static AstNode ast_expr(AstBuilder* b, Expr* expr) {
+    if (expr == nullptr) {
+        return AST_NONE;
+    }
+    AstNode node = ast_node(b, AST_EXPR + expr->kind, expr->ty, expr->token_index);
+    u32 data = 0;
+
+    switch (expr->kind) {
+    case EXPR_ADD:
+    case EXPR_SUB:
+    case EXPR_MUL:
+    case EXPR_DIV:
+    case EXPR_MOD:
+    case EXPR_AND:
+    case EXPR_OR:
+    case EXPR_XOR:
+    case EXPR_LSH:
+    case EXPR_RSH:
+    case EXPR_EQ:
+    case EXPR_NEQ:
+    case EXPR_LESS_EQ:
+    case EXPR_GREATER_EQ:
+    case EXPR_LESS:
+    case EXPR_GREATER:
+    case EXPR_BOOL_AND:
+    case EXPR_BOOL_OR:
+    case EXPR_SUBSCRIPT:
+        ast_expr(b, expr->binary.lhs);
+        data = ast_expr(b, expr->binary.rhs);
+        break;
+    case EXPR_ADDROF:
+    case EXPR_NEG:
+    case EXPR_NOT:
+    case EXPR_BOOL_NOT:
+    case EXPR_SIZEOFVALUE:
+    case EXPR_OUT_ARG:
+    case EXPR_CONTAINEROF:
+    case EXPR_CAST:
+    case EXPR_DEREF:
+    case EXPR_DEREF_MEMBER:
+    case EXPR_MEMBER:
+        ast_expr(b, expr->unary);
+        break;
+    case EXPR_LITERAL:
+        if (expr->literal < AST_BIG_LITERAL) {
+            data = expr->literal;
+        } else {
+            data = ast_extra(b, 2);
+            b->ast.extra[data] = (u32)expr->literal;
+            b->ast.extra[data + 1] = (u32)(expr->literal >> 32);
+            data |= AST_BIG_LITERAL;
+        }
+        break;
+    case EXPR_STR_LITERAL: {
+        u32 words = (sizeof(CompactString) + sizeof(u32) - 1) / sizeof(u32);
+        data = ast_extra(b, words);
+        memcpy(&b->ast.extra[data], &expr->lit_string, sizeof(CompactString));
+    } break;
+    case EXPR_ENTITY:
+        data = ast_entity(b, expr->entity);
+        break;
+    case EXPR_CALL: {
+        ast_expr(b, expr->call.callee);
+        data = ast_extra(b, 1 + expr->call.args_len);
+        b->ast.extra[data] = expr->call.args_len;
+        for_n(i, 0, expr->call.args_len) {
+            AstNode arg = ast_expr(b, expr->call.args[i]);
+            b->ast.extra[data + 1 + i] = arg;
+        }
+    } break;
+    case EXPR_ARRAY_LITERAL: {
+        u32 len = expr->lit_array.len;
+        data = ast_extra(b, 1 + 3 * len);
+        b->ast.extra[data] = len;
+        for_n(i, 0, len) {
+            u64 index = expr->lit_array.indices[i];
+            AstNode value = ast_expr(b, expr->lit_array.values[i]);
+            u32* item = &b->ast.extra[data + 1 + 3 * i];
+            item[0] = (u32)index;
+            item[1] = (u32)(index >> 32);
+            item[2] = value;
+        }
+    } break;
+    case EXPR_STRUCT_LITERAL: {
+        u32 len = expr->lit_struct.len;
+        data = ast_extra(b, 1 + 2 * len);
+        b->ast.extra[data] = len;
+        for_n(i, 0, len) {
+            AstNode value = ast_expr(b, expr->lit_struct.values[i]);
+            u32* item = &b->ast.extra[data + 1 + 2 * i];
+            item[0] = expr->lit_struct.field_indices[i];
+            item[1] = value;
+        }
+    } break;
+    default:
+        CRASH("unknown expr kind %u", expr->kind);
+    }
+
+    b->ast.data[node] = data;
+    return node;
+}
+
+static AstNode ast_stmt(AstBuilder* b, Stmt* stmt);
+
+// the list goes in extra after skip words the caller fills in
+static u32 ast_stmt_list(AstBuilder* b, StmtList list, u32 skip) {
+    u32 start = ast_extra(b, skip + 1 + list.len);
+    b->ast.extra[start + skip] = list.len;
+    for_n(i, 0, list.len) {
+        AstNode node = ast_stmt(b, list.stmts[i]);
+        b->ast.extra[start + skip + 1 + i] = node;
+    }
+    return start;
+}
+
+static AstNode ast_stmt(AstBuilder* b, Stmt* stmt) {
+    if (stmt == nullptr) {
+        return AST_NONE;
+    }
+    AstNode node = ast_node(b, stmt->kind, stmt->retkind, stmt->token_index);
+    u32 data = 0;
+
+    switch (stmt->kind) {
+    case STMT_EXPR:
+    case STMT_RETURN:
+        ast_expr(b, stmt->expr);
+        break;
+    case STMT_VAR_DECL:
+        data = ast_entity(b, stmt->var_decl.var);
+        ast_expr(b, stmt->var_decl.expr);
+        // the Stmt might not be around much longer, see ast_flatten_fn
+        if (entity_is_local(stmt->var_decl.var)) {
+            stmt->var_decl.var->decl = nullptr;
+        }
+        break;
+    case STMT_FN_DECL: {
+        data = ast_stmt_list(b, stmt->fn_decl.body, 2);
+        u32 fn = ast_entity(b, stmt->fn_decl.fn);
+        b->ast.extra[data] = fn;
+        b->ast.extra[data + 1] = b->ast.len;
+        entity_map_clear(&b->locals);
+    } break;
+    case STMT_ASSIGN:
+    case STMT_ASSIGN_ADD:
+    case STMT_ASSIGN_SUB:
+    case STMT_ASSIGN_MUL:
+    case STMT_ASSIGN_DIV:
+    case STMT_ASSIGN_MOD:
+    case STMT_ASSIGN_AND:
+    case STMT_ASSIGN_OR:
+    case STMT_ASSIGN_XOR:
+    case STMT_ASSIGN_LSH:
+    case STMT_ASSIGN_RSH:
+        ast_expr(b, stmt->assign.lhs);
+        data = ast_expr(b, stmt->assign.rhs);
+        break;
+    case STMT_BARRIER:
+    case STMT_LEAVE:
+        break;
+    case STMT_BREAK:
+    case STMT_CONTINUE:
+        // loops only ever get broken out of from inside
+        for (u32 i = b->loops.len; i != 0; --i) {
+            if (b->loops.at[i - 1].stmt == stmt->break_continue.loop) {
+                data = b->loops.at[i - 1].node;
+                break;
+            }
+        }
+        break;
+    case STMT_IF: {
+        ast_expr(b, stmt->if_.cond);
+        data = ast_stmt_list(b, stmt->if_.block, 1);
+        AstNode else_ = ast_stmt(b, stmt->if_.else_);
+        b->ast.extra[data] = else_;
+    } break;
+    case STMT_WHILE:
+        vec_append(&b->loops, ((AstLoop){stmt, node}));
+        ast_expr(b, stmt->while_.cond);
+        data = ast_stmt_list(b, stmt->while_.block, 0);
+        b->loops.len--;
+        break;
+    case STMT_LABEL:
+        data = ast_entity(b, stmt->label);
+        break;
+    case STMT_GOTO:
+        data = ast_entity(b, stmt->goto_);
+        break;
+    default:
+        CRASH("unknown stmt kind %u", stmt->kind);
+    }
+
+    b->ast.data[node] = data;
+    return node;
+}
+
+static int decl_compare(const void* a, const void* b) {
+    const Entity* x = *(const Entity**)a;
+    const Entity* y = *(const Entity**)b;
+    if (x->decl->token_index != y->decl->token_index) {
+        return x->decl->token_index < y->decl->token_index ? -1 : 1;
+    }
+    return 0;
+}
+
+AstBuilder* ast_builder_new(u32 part, u32 tokens_len) {
+    AstBuilder* b = malloc(sizeof(AstBuilder));
+    *b = (AstBuilder){.part = part};
+    // nodes almost always have a token to themselves, so this is usually enough.
+    // the pages that don't get used are never touched.
+    b->cap = max(tokens_len, 1024);
+    b->ast.kinds = malloc(sizeof(b->ast.kinds[0]) * b->cap);
+    b->ast.tys = malloc(sizeof(b->ast.tys[0]) * b->cap);
+    b->ast.tokens = malloc(sizeof(b->ast.tokens[0]) * b->cap);
+    b->ast.data = malloc(sizeof(b->ast.data[0]) * b->cap);
+    b->extra_cap = max(tokens_len / 4, 1024);
+    b->ast.extra = malloc(sizeof(b->ast.extra[0]) * b->extra_cap);
+    b->entities_cap = 256;
+    b->ast.entities = malloc(sizeof(b->ast.entities[0]) * b->entities_cap);
+    entity_map_init(&b->globals, 1024);
+    entity_map_init(&b->locals, 64);
+    vec_init(&b->loops, 16);
+
+    // AST_NONE, for both
+    ast_node(b, STMT_BARRIER, TY__INVALID, 0);
+    b->ast.entities[b->ast.entities_len++] = nullptr;
+    return b;
+}
+
+static void ast_builder_free(AstBuilder* b) {
+    free(b->globals.slots);
+    free(b->locals.slots);
+    vec_destroy(&b->loops);
+    free(b);
+}
+
+AstNode ast_flatten_fn(AstBuilder* b, Stmt* fn_decl) {
+    AstNode node = ast_stmt(b, fn_decl);
+    fn_decl->fn_decl.flat = node;
+    fn_decl->fn_decl.part = b->part;
+    return node;
+}
+
+void ast_move_tokens(AstBuilder* b, u32 from, i32 by) {
+    Ast* ast = &b->ast;
+    for_n(node, 1, ast->len) {
+        if (ast->tokens[node] >= from) {
+            ast->tokens[node] += by;
+        }
+    }
+}
+
+static inline u32 moved(u32 node, u32 by) {
+    return node != AST_NONE ? node + by : AST_NONE;
+}
+
+// the nodes in every stride'th word of a list
+static void move_list(u32* list, u32 stride, u32 by) {
+    for_n(i, 0, list[0]) {
+        u32* item = &list[1 + stride * i];
+        *item = moved(*item, by);
+    }
+}
+
+// puts part's nodes after b's, with everything they refer to moved along
+// with them, then frees part. gives back how far its nodes moved.
+static u32 ast_append_part(AstBuilder* b, AstBuilder* part) {
+    Ast* ast = &b->ast;
+    Ast* from = &part->ast;
+    // part's AST_NONE stays behind
+    u32 first = ast->len;
+    u32 by = first - 1;
+    u32 extra_by = ast->extra_len;
+    u32 len = from->len - 1;
+
+    if (ast->len + len > b->cap) {
+        b->cap = ast->len + len;
+        ast->kinds = realloc(ast->kinds, sizeof(ast->kinds[0]) * b->cap);
+        ast->tys = realloc(ast->tys, sizeof(ast->tys[0]) * b->cap);
+        ast->tokens = realloc(ast->tokens, sizeof(ast->tokens[0]) * b->cap);
+        ast->data = realloc(ast->data, sizeof(ast->data[0]) * b->cap);
+    }
+    memcpy(&ast->kinds[first], &from->kinds[1], sizeof(ast->kinds[0]) * len);
+    memcpy(&ast->tys[first], &from->tys[1], sizeof(ast->tys[0]) * len);
+    memcpy(&ast->tokens[first], &from->tokens[1], sizeof(ast->tokens[0]) * len);
+    memcpy(&ast->data[first], &from->data[1], sizeof(ast->data[0]) * len);
+    ast->len += len;
+    if (ast->extra_len + from->extra_len > b->extra_cap) {
+        b->extra_cap = ast->extra_len + from->extra_len;
+        ast->extra = realloc(ast->extra, sizeof(ast->extra[0]) * b->extra_cap);
+    }
+    memcpy(&ast->extra[extra_by], from->extra, sizeof(ast->extra[0]) * from->extra_len);
+    ast->extra_len += from->extra_len;
+
+    // a global might already be in b, but part's locals are only ever in part
+    u32* entities = malloc(sizeof(entities[0]) * from->entities_len);
+    entities[AST_NONE] = AST_NONE;
+    for_n(i, 1, from->entities_len) {
+        Entity* e = from->entities[i];
+        entities[i] = entity_is_local(e) ? ast_entity_append(b, e) : ast_entity(b, e);
+    }
+
+    for_n(node, first, ast->len) {
+        u32* data = &ast->data[node];
+        u8 kind = ast->kinds[node];
+        if (kind >= AST_EXPR) {
+            switch (kind - AST_EXPR) {
+            case EXPR_ENTITY:
+                *data = entities[*data];
+                break;
+            case EXPR_LITERAL:
+                if (*data & AST_BIG_LITERAL) {
+                    *data = ((*data & ~AST_BIG_LITERAL) + extra_by) | AST_BIG_LITERAL;
+                }
+                break;
+            case EXPR_STR_LITERAL:
+                *data += extra_by;
+                break;
+            case EXPR_CALL:
+                *data += extra_by;
+                move_list(&ast->extra[*data], 1, by);
+                break;
+            case EXPR_ARRAY_LITERAL:
+                *data += extra_by;
+                // (index low word, index high word, value)
+                move_list(&ast->extra[*data + 2], 3, by);
+                break;
+            case EXPR_STRUCT_LITERAL:
+                *data += extra_by;
+                move_list(&ast->extra[*data + 1], 2, by);
+                break;
+            default:
+                // binary kinds and EXPR_SUBSCRIPT have their rhs, the rest nothing
+                *data = moved(*data, by);
+                break;
+            }
+            continue;
+        }
+
+        switch (kind) {
+        case STMT_VAR_DECL:
+        case STMT_LABEL:
+        case STMT_GOTO:
+            *data = entities[*data];
+            break;
+        case STMT_FN_DECL: {
+            *data += extra_by;
+            u32* extra = &ast->extra[*data];
+            extra[0] = entities[extra[0]];
+            extra[1] += by;
+            move_list(&extra[2], 1, by);
+        } break;
+        case STMT_IF: {
+            *data += extra_by;
+            u32* extra = &ast->extra[*data];
+            extra[0] = moved(extra[0], by);
+            move_list(&extra[1], 1, by);
+        } break;
+        case STMT_WHILE:
+            *data += extra_by;
+            move_list(&ast->extra[*data], 1, by);
+            break;
+        default:
+            // ASSIGN kinds have their rhs, BREAK and CONTINUE their loop, the rest nothing
+            *data = moved(*data, by);
+            break;
+        }
+    }
+    free(entities);
+
+    free(from->kinds);
+    free(from->tys);
+    free(from->tokens);
+    free(from->data);
+    free(from->extra);
+    free(from->entities);
+    ast_builder_free(part);
+    return by;
+}
+
+// with FlagSet.ast, the FN bodies are already flattened, one part per parser.
+// the biggest part stays where it is and the others get appended to it, each
+// freed as soon as it's in, so only one of them is ever around twice. that
+// leaves each FN_DECL's nodes in one piece, but not in the order of decls.
+Ast ast_build(CompilationUnit* cu) {
+    u32 parts_len = max(cu->ast_parts_len, 1);
+    u32* moved_by = calloc(parts_len, sizeof(moved_by[0]));
+    AstBuilder* b;
+    if (cu->ast_parts_len == 0) {
+        b = ast_builder_new(0, cu->tokens_len);
+    } else {
+        u32 biggest = 0;
+        for_n(i, 1, cu->ast_parts_len) {
+            if (cu->ast_parts[i]->ast.len > cu->ast_parts[biggest]->ast.len) {
+                biggest = i;
+            }
+        }
+        b = cu->ast_parts[biggest];
+        for_n(i, 0, cu->ast_parts_len) {
+            if (i != biggest) {
+                moved_by[i] = ast_append_part(b, cu->ast_parts[i]);
+            }
+        }
+        free(cu->ast_parts);
+        cu->ast_parts = nullptr;
+        cu->ast_parts_len = 0;
+    }
+
+    // every global that got declared here, and not just in an interface
+    ParseScopes* globals = &cu->scopes;
+    Entity** decls = malloc(sizeof(decls[0]) * (globals->bindings.len + 1));
+    u32 decls_len = 0;
+    for_n(i, 0, globals->bindings.len) {
+        Entity* entity = globals->bindings.at[i].entity;
+        if (entity->decl != nullptr) {
+            decls[decls_len++] = entity;
+        }
+    }
+    qsort(decls, decls_len, sizeof(decls[0]), decl_compare);
+
+    b->ast.decls = malloc(sizeof(b->ast.decls[0]) * (decls_len + 1));
+    b->ast.decls_len = decls_len;
+    for_n(i, 0, decls_len) {
+        Stmt* stmt = decls[i]->decl;
+        AstNode decl;
+        if (stmt->kind == STMT_FN_DECL && stmt->fn_decl.flat != AST_NONE) {
+            decl = stmt->fn_decl.flat + moved_by[stmt->fn_decl.part];
+        } else {
+            decl = ast_stmt(b, stmt);
+        }
+        b->ast.decls[i] = decl;
+    }
+    free(decls);
+    free(moved_by);
+
+    // give back what the doubling didn't end up using
+    Ast ast = b->ast;
+    ast_builder_free(b);
+    ast.kinds = realloc(ast.kinds, sizeof(ast.kinds[0]) * ast.len);
+    ast.tys = realloc(ast.tys, sizeof(ast.tys[0]) * ast.len);
+    ast.tokens = realloc(ast.tokens, sizeof(ast.tokens[0]) * ast.len);
+    ast.data = realloc(ast.data, sizeof(ast.data[0]) * ast.len);
+    if (ast.extra_len != 0) {
+        ast.extra = realloc(ast.extra, sizeof(ast.extra[0]) * ast.extra_len);
+    }
+    return ast;
+}
+
+void ast_destroy(Ast* ast) {
+    free(ast->kinds);
+    free(ast->tys);
+    free(ast->tokens);
+    free(ast->data);
+    free(ast->extra);
+    free(ast->entities);
+    free(ast->decls);
+    *ast = (Ast){};
+}
@@ -0,0 +1,431 @@
+// front-end throughput benchmark. lexes (with preprocessing), parses and flattens
+// each input a number of times and reports how fast each stage went.
+//
+//     bin/coyote-bench [-n runs] [--lex-only] [--parallel] [--tree] [files...]
+//
+// FN bodies get flattened as they're parsed, like --emit-ir does, so building the
+// AST is timed as part of parsing, in the p+ast row. with --tree, the whole tree gets
+// parsed first and flattened after, which takes more memory, and each gets a row.
+//
+// without any files, it runs over generated inputs that scale file size,
+// macro nesting depth, identifier density and how many types there are instead.
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "common/orbit.h"
+
+#include "common/util.h"
+#include "coyote/lex.h"
+#include "coyote/parse.h"
+
+#if defined(OS_WINDOWS)
+    #include <psapi.h>
+#elif defined(OS_LINUX)
+    #include <time.h>
+#endif
+
+thread_local FlagSet flags = {};
+
+// for inputs the parser can't handle yet
+static bool lex_only = false;
+static bool tree = false;
+
+static f64 now_seconds() {
+#if defined(OS_WINDOWS)
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (f64)count.QuadPart / (f64)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (f64)ts.tv_sec + (f64)ts.tv_nsec * 1e-9;
+#endif
+}
+
+// the front end never frees much, so memory only ever goes up.
+// a stage's peak is how far the resident set got above where it started.
+
+static usize memory_current() {
+#if defined(OS_WINDOWS)
+    PROCESS_MEMORY_COUNTERS pmc;
+    K32GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+    return pmc.WorkingSetSize;
+#else
+    usize pages = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f != nullptr) {
+        unsigned long size, resident;
+        if (fscanf(f, "%lu %lu", &size, &resident) == 2) {
+            pages = resident;
+        }
+        fclose(f);
+    }
+    return pages * 4096;
+#endif
+}
+
+// start measuring a new peak from here, where the os lets us
+static void memory_reset_peak() {
+#if defined(OS_WINDOWS)
+    // no way to reset it, so stages only see the process peak
+#else
+    FILE* f = fopen("/proc/self/clear_refs", "w");
+    if (f != nullptr) {
+        fputs("5", f);
+        fclose(f);
+    }
+#endif
+}
+
+static usize memory_peak() {
+#if defined(OS_WINDOWS)
+    PROCESS_MEMORY_COUNTERS pmc;
+    K32GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+    return pmc.PeakWorkingSetSize;
+#else
+    usize peak = 0;
+    FILE* f = fopen("/proc/self/status", "r");
+    if (f != nullptr) {
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            unsigned long kb;
+            if (sscanf(line, "VmHWM: %lu kB", &kb) == 1) {
+                peak = kb * 1024;
+                break;
+            }
+        }
+        fclose(f);
+    }
+    return peak;
+#endif
+}
+
+// ------------------------- GENERATED INPUTS -------------------------
+
+typedef struct {
+    const char* name;
+    usize size; // keeps adding functions until the source is at least this big
+    u32 macro_depth; // 0 for no macros, otherwise how deep each expansion nests
+    u32 ident_percent; // how many expression operands are identifiers, the rest are literals
+    bool types; // every function gets a type of its own, and a signature of its own with it
+} Synthetic;
+
+static Synthetic synthetics[] = {
+    {"size-256k",       256 << 10, 0, 50},
+    {"size-1m",         1 << 20,   0, 50},
+    {"size-4m",         4 << 20,   0, 50},
+    {"size-16m",        16 << 20,  0, 50},
+
+    {"macro-depth-1",   1 << 20,   1, 50},
+    {"macro-depth-4",   1 << 20,   4, 50},
+    {"macro-depth-16",  1 << 20,   16, 50},
+    // each level takes up two of MAX_EMIT_DEPTH, one for the macro and one for its argument
+    {"macro-depth-32",  1 << 20,   32, 50},
+
+    {"ident-0%",        1 << 20,   0, 0},
+    {"ident-25%",       1 << 20,   0, 25},
+    {"ident-75%",       1 << 20,   0, 75},
+    {"ident-100%",      1 << 20,   0, 100},
+
+    // more types than 16-bit handles could tell apart
+    {"types-16m",       16 << 20,  0, 50, true},
+};
+
+#define SYNTH_LOCALS 24
+#define SYNTH_OPERANDS 4
+
+static u32 rng_state;
+
+// deterministic, so every run gets the same inputs
+static u32 rng_next() {
+    rng_state = rng_state * 1664525u + 1013904223u;
+    return rng_state >> 8;
+}
+
+static void put(Vec(char)* out, string s) {
+    vec_reserve(out, s.len);
+    memcpy(&out->at[out->len], s.raw, s.len);
+    out->len += s.len;
+}
+
+static void putf(Vec(char)* out, char* format, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    put(out, (string){.raw = buf, .len = len});
+}
+
+static void synth_operand(Vec(char)* out, Synthetic* s, u32 locals) {
+    if (rng_next() % 100 < s->ident_percent) {
+        u32 local = rng_next() % (locals + 1);
+        if (local == locals) {
+            put(out, constr("param"));
+        } else {
+            putf(out, "value%u", local);
+        }
+    } else {
+        putf(out, "%u", rng_next() % 10000);
+    }
+}
+
+static SrcFile synth_generate(Synthetic* s) {
+    rng_state = 12345;
+    Vec(char) out = vec_new(char, s->size + 4096);
+
+    putf(&out, "// generated: %s\n\n", s->name);
+    if (s->macro_depth != 0) {
+        put(&out, constr("#MACRO Nest1(x1) [ ((x1) + 1) ]\n"));
+        for_n_eq(i, 2, s->macro_depth) {
+            putf(&out, "#MACRO Nest%u(x%u) [ (Nest%u(x%u) + 1) ]\n", (u32)i, (u32)i, (u32)i - 1, (u32)i);
+        }
+        put(&out, constr("\n"));
+    }
+
+    for (u32 fn = 0; out.len < s->size; ++fn) {
+        if (s->types) {
+            // aliases, pointers to them and the FN type
+            putf(&out, "TYPE Type%u : UWORD\nTYPE Handle%u : ^^Type%u\nTYPE Table%u : ^^Handle%u\n", fn, fn, fn, fn, fn);
+            putf(&out, "FN Function%u(IN param : UWORD, IN handle : ^Handle%u, IN table : ^^Table%u) : UWORD\n", fn, fn, fn);
+        } else {
+            putf(&out, "FN Function%u(IN param : UWORD) : UWORD\n", fn);
+        }
+        for_n(local, 0, SYNTH_LOCALS) {
+            putf(&out, "    value%u : UWORD = ", (u32)local);
+            if (s->macro_depth != 0) {
+                putf(&out, "Nest%u(", s->macro_depth);
+                synth_operand(&out, s, local);
+                put(&out, constr(") + "));
+            }
+            for_n(op, 0, SYNTH_OPERANDS) {
+                if (op != 0) {
+                    put(&out, op % 2 ? constr(" + ") : constr(" * "));
+                }
+                synth_operand(&out, s, local);
+            }
+            put(&out, constr("\n"));
+        }
+        putf(&out, "    RETURN value%u\nEND\n\n", SYNTH_LOCALS - 1);
+    }
+
+    // scanners read past the end, see FS_MAP_PADDING
+    usize len = out.len;
+    vec_reserve(&out, FS_MAP_PADDING);
+    memset(&out.at[out.len], 0, FS_MAP_PADDING);
+
+    return (SrcFile){
+        .src = {.raw = out.at, .len = len},
+        .path = strprintf("<%s>", s->name),
+    };
+}
+
+// ------------------------- RUNNING -------------------------
+
+typedef struct {
+    f64 best; // seconds, fastest run
+    f64 total;
+    usize peak; // bytes above the starting resident set, first run
+} StageTimes;
+
+static void stage_begin(f64* start, usize* mem_start) {
+    memory_reset_peak();
+    *mem_start = memory_current();
+    *start = now_seconds();
+}
+
+static void stage_end(StageTimes* st, u32 run, f64 start, usize mem_start) {
+    f64 elapsed = now_seconds() - start;
+    if (run == 0 || elapsed < st->best) {
+        st->best = elapsed;
+    }
+    st->total += elapsed;
+    if (run == 0) {
+        usize peak = memory_peak();
+        st->peak = peak > mem_start ? peak - mem_start : 0;
+    }
+}
+
+// expansions is UINT32_MAX for stages that don't expand anything
+static void print_stage(const char* stage, usize bytes, u32 tokens, u32 expansions, StageTimes* st, u32 runs) {
+    printf("    %-6s %9.2f MB/s %9.2f Mtok/s ", stage,
+        (f64)bytes / st->best / 1e6,
+        (f64)tokens / st->best / 1e6
+    );
+    if (expansions != UINT32_MAX) {
+        printf("%9.3f Mexp/s ", (f64)expansions / st->best / 1e6);
+    } else {
+        printf("%9s        ", "-");
+    }
+    printf("%9.2f ms avg %8.1f MB peak\n", st->total / runs * 1e3, (f64)st->peak / (1 << 20));
+}
+
+static void arena_stats_add(ArenaStats* total, ArenaStats* s) {
+    total->requested += s->requested;
+    total->restored += s->restored;
+    total->wasted += s->wasted;
+    total->reserved += s->reserved;
+    total->chunks += s->chunks;
+    total->bigs += s->bigs;
+    total->mallocs += s->mallocs;
+}
+
+// everything the unit's arenas went through, parallel bodies included
+static ArenaStats unit_arena_stats(CompilationUnit* cu) {
+    ArenaStats total = cu->arena.stats;
+    arena_stats_add(&total, &cu->nodes.stats);
+    for_n(i, 0, cu->body_arenas_len) {
+        arena_stats_add(&total, &cu->body_arenas[i].stats);
+    }
+    return total;
+}
+
+// wasted is out of what's still live, since that's what it sits in between
+static void print_arena(ArenaStats* s) {
+    usize live = s->requested - s->restored;
+    printf("    %-6s %9.2f MB requested %8.2f MB restored %8.2f MB reserved %6.2f%% wasted %6u chunks %6u big %6u mallocs\n", "arena",
+        (f64)s->requested / (1 << 20),
+        (f64)s->restored / (1 << 20),
+        (f64)s->reserved / (1 << 20),
+        live ? (f64)s->wasted * 100 / (f64)live : 0.0,
+        s->chunks, s->bigs, s->mallocs
+    );
+}
+
+// what the arrays hold, not what they have room for
+static usize ast_size(Ast* ast) {
+    usize per_node = sizeof(ast->kinds[0]) + sizeof(ast->tys[0]) + sizeof(ast->tokens[0]) + sizeof(ast->data[0]);
+    return ast->len * per_node
+        + ast->extra_len * sizeof(ast->extra[0])
+        + ast->entities_len * sizeof(ast->entities[0])
+        + ast->decls_len * sizeof(ast->decls[0]);
+}
+
+static void bench(SrcFile* f, u32 runs) {
+    StageTimes lex = {};
+    StageTimes parse = {};
+    StageTimes ast = {};
+    u32 tokens = 0;
+    u32 expansions = 0;
+    ArenaStats arena = {};
+    usize compact_size = 0;
+    usize both_peak = 0; // parsing and building the AST together
+    u32 ty_slots = 0;
+    usize ty_bytes = 0;
+
+    for_n(run, 0, runs) {
+        f64 start;
+        usize mem_start;
+
+        stage_begin(&start, &mem_start);
+        Parser p = lex_entrypoint(f);
+        stage_end(&lex, run, start, mem_start);
+        p.flags = flags;
+
+        if (run == 0) {
+            tokens = p.tokens_len;
+            expansions = p.expansions_len;
+        }
+
+        if (lex_only) {
+            continue;
+        }
+        stage_begin(&start, &mem_start);
+        usize parse_start = mem_start;
+        CompilationUnit cu = parse_unit(&p);
+        Ast compact;
+        if (tree) {
+            stage_end(&parse, run, start, mem_start);
+            stage_begin(&start, &mem_start);
+            compact = ast_build(&cu);
+            stage_end(&ast, run, start, mem_start);
+        } else {
+            // all that's left is putting the parts together
+            compact = ast_build(&cu);
+            stage_end(&parse, run, start, mem_start);
+        }
+        if (run == 0) {
+            arena = unit_arena_stats(&cu);
+            ty_table_stats(&ty_slots, &ty_bytes);
+            compact_size = ast_size(&compact);
+            usize peak = memory_peak();
+            both_peak = max(parse.peak, peak > parse_start ? peak - parse_start : 0);
+        }
+        ast_destroy(&compact);
+    }
+
+    printf(str_fmt": %.2f MB, %u tokens, %u expansions, best of %u\n", str_arg(f->path),
+        (f64)f->src.len / (1 << 20), tokens, expansions, runs);
+    print_stage("lex", f->src.len, tokens, expansions, &lex, runs);
+    if (!lex_only) {
+        if (tree) {
+            print_stage("parse", f->src.len, tokens, UINT32_MAX, &parse, runs);
+            print_stage("ast", f->src.len, tokens, UINT32_MAX, &ast, runs);
+        } else {
+            print_stage("p+ast", f->src.len, tokens, UINT32_MAX, &parse, runs);
+        }
+        print_arena(&arena);
+        printf("    %-6s %9.2f MB compact, %8.1f MB peak parsing and building it\n", "ast",
+            (f64)compact_size / (1 << 20),
+            (f64)both_peak / (1 << 20)
+        );
+        printf("    %-6s %9u slots %8.2f MB\n", "types", ty_slots, (f64)ty_bytes / (1 << 20));
+    }
+}
+
+int main(int argc, char** argv) {
+    u32 runs = 5;
+    const char* files[256];
+    usize files_len = 0;
+
+    for_n(i, 1, argc) {
+        char* arg = argv[i];
+        if (strcmp(arg, "-n") == 0) {
+            if (i + 1 == argc || atoi(argv[i + 1]) <= 0) {
+                printf("expected a number of runs after '-n'\n");
+                exit(1);
+            }
+            runs = atoi(argv[++i]);
+        } else if (strcmp(arg, "--lex-only") == 0) {
+            lex_only = true;
+        } else if (strcmp(arg, "--parallel") == 0) {
+            flags.parallel = true;
+        } else if (strcmp(arg, "--tree") == 0) {
+            tree = true;
+        } else if (arg[0] == '-') {
+            printf("unknown flag '%s'\n", arg);
+            exit(1);
+        } else if (files_len == sizeof(files) / sizeof(files[0])) {
+            printf("too many files\n");
+            exit(1);
+        } else {
+            files[files_len++] = arg;
+        }
+    }
+
+    scan_init(SCAN_BEST);
+    flags.ast = !tree;
+
+    if (files_len == 0) {
+        for_n(i, 0, sizeof(synthetics) / sizeof(synthetics[0])) {
+            SrcFile f = synth_generate(&synthetics[i]);
+            bench(&f, runs);
+        }
+        return 0;
+    }
+
+    for_n(i, 0, files_len) {
+        FsFile* file = fs_open(files[i], false, false);
+        if (file == nullptr) {
+            printf("cannot open file %s\n", files[i]);
+            return 1;
+        }
+        SrcFile f = {
+            .src = fs_map_entire(file),
+            .path = fs_from_path(&file->path),
+        };
+        bench(&f, runs);
+    }
+}
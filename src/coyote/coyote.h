@@ -6,16 +6,38 @@
 #include "common/orbit.h"
 #include "common/vec.h"
 #include "common/strmap.h"
+#include "common/atom.h"
 
 
 typedef struct Arena__Chunk Arena__Chunk;
+typedef struct Arena__Big Arena__Big;
+
+// for sizing arenas to what actually goes in them
+typedef struct ArenaStats {
+    usize requested; // bytes asked for, over the arena's whole life
+    usize restored; // bytes of those that arena_restore took back, so the rest are live
+    usize wasted; // bytes in the chunks under the live allocations that none of them use:
+                  // alignment, and the ends of chunks the next allocation didn't fit in
+    usize reserved; // bytes malloc'd and not freed yet
+    u32 chunks;
+    u32 bigs; // allocations too big for a chunk, which got a block of their own
+    u32 mallocs;
+} ArenaStats;
+
 typedef struct Arena {
     Arena__Chunk* top;
+    Arena__Big* big; // most recent first
+    u32 scratch_depth;
+    ArenaStats stats;
 } Arena;
 
 typedef struct ArenaState {
     Arena__Chunk* top;
     usize used;
+    Arena__Big* big;
+    // the stats to go back to
+    usize live;
+    usize wasted;
 } ArenaState;
 
 void arena_init(Arena* arena);
@@ -25,4 +47,19 @@ void* arena_alloc(Arena* arena, usize size, usize align);
 ArenaState arena_save(Arena* arena);
 void arena_restore(Arena* arena, ArenaState save);
 
+// a scope for temporaries, allocated from scratch.arena: a per-thread arena that only
+// scratch scopes use. everything allocated there after it begins goes away when it ends,
+// and allocations in any other arena in the meantime stay. scopes nest, and have to end
+// in the opposite order they began.
+typedef struct ArenaScratch {
+    Arena* arena;
+    ArenaState save;
+    u32 depth;
+} ArenaScratch;
+
+ArenaScratch arena_scratch_begin();
+void arena_scratch_end(ArenaScratch scratch);
+// free the calling thread's scratch arena, once it's done parsing
+void arena_scratch_release();
+
 #endif
@@ -0,0 +1,122 @@
+// generates the keyword perfect hash table used by lex_categorize_keyword.
+// run at build time, writes a header to stdout. driven by _LEX_KEYWORDS_,
+// so adding a keyword needs nothing else.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "coyote/lex.h"
+
+static const char* keywords[] = {
+    #define T(ident) #ident,
+        _LEX_KEYWORDS_
+    #undef T
+};
+#define KEYWORDS_LEN (sizeof(keywords) / sizeof(keywords[0]))
+
+// keywords are loaded as two little-endian words, so 16 chars max
+#define KEYWORD_MAX_LEN 16
+
+// fixed odd constant to fold the second word into the first
+#define KEYWORD_HASH_FOLD 0x9E3779B97F4A7C15ull
+
+static void load_words(const char* kw, u64 w[2]) {
+    char buf[KEYWORD_MAX_LEN] = {};
+    memcpy(buf, kw, strlen(kw));
+    memcpy(&w[0], &buf[0], 8);
+    memcpy(&w[1], &buf[8], 8);
+}
+
+static u64 hash(u64 w[2], u64 mul, u32 bits) {
+    return ((w[0] + w[1] * KEYWORD_HASH_FOLD) * mul) >> (64 - bits);
+}
+
+static u64 splitmix_state = 0x636F796F7465ull;
+static u64 splitmix() {
+    u64 z = (splitmix_state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// try to find a multiplier that maps every keyword to its own slot
+static bool search(u32 bits, u64* mul_out) {
+    u8 used[1 << 10];
+    for_n(attempt, 0, 1000000) {
+        u64 mul = splitmix() | 1;
+        memset(used, 0, sizeof(used));
+        bool ok = true;
+        for_n(i, 0, KEYWORDS_LEN) {
+            u64 w[2];
+            load_words(keywords[i], w);
+            u64 h = hash(w, mul, bits);
+            if (used[h]) {
+                ok = false;
+                break;
+            }
+            used[h] = true;
+        }
+        if (ok) {
+            *mul_out = mul;
+            return true;
+        }
+    }
+    return false;
+}
+
+int main() {
+    for_n(i, 0, KEYWORDS_LEN) {
+        if (strlen(keywords[i]) > KEYWORD_MAX_LEN) {
+            fprintf(stderr, "keyword %s is longer than %d chars\n", keywords[i], KEYWORD_MAX_LEN);
+            return 1;
+        }
+    }
+
+    // smallest table that still has a reasonable chance of a perfect fit
+    u32 bits = 1;
+    while ((1u << bits) < KEYWORDS_LEN * 2) {
+        bits++;
+    }
+    u64 mul = 0;
+    while (!search(bits, &mul)) {
+        if (++bits > 10) {
+            fprintf(stderr, "could not find a perfect hash for the keyword table\n");
+            return 1;
+        }
+    }
+
+    u32 table_len = 1u << bits;
+    const char* entries[1 << 10] = {};
+    for_n(i, 0, KEYWORDS_LEN) {
+        u64 w[2];
+        load_words(keywords[i], w);
+        entries[hash(w, mul, bits)] = keywords[i];
+    }
+
+    printf("// generated by src/coyote/gen/keyword_hash.c, do not edit\n\n");
+    printf("#define KEYWORD_MAX_LEN %d\n", KEYWORD_MAX_LEN);
+    printf("#define KEYWORD_HASH_FOLD 0x%016llXull\n", (unsigned long long)KEYWORD_HASH_FOLD);
+    printf("#define KEYWORD_HASH_MUL 0x%016llXull\n", (unsigned long long)mul);
+    printf("#define KEYWORD_HASH_SHIFT %u\n\n", 64 - bits);
+
+    // empty slots are left all zero, which no identifier can load as
+    printf("static const KeywordEntry keyword_table[%u] = {\n", table_len);
+    for_n(i, 0, table_len) {
+        if (entries[i] == nullptr) continue;
+        u64 w[2];
+        load_words(entries[i], w);
+        printf("    [%3zd] = {{0x%016llXull, 0x%016llXull}, TOK_KW_%s},\n", i,
+            (unsigned long long)w[0], (unsigned long long)w[1], entries[i]);
+    }
+    printf("};\n\n");
+
+    // masks that keep only the first len bytes of the two candidate words
+    printf("static const u64 keyword_masks[KEYWORD_MAX_LEN + 1][2] = {\n");
+    for_n_eq(len, 0, KEYWORD_MAX_LEN) {
+        u64 m0 = len >= 8 ? ~0ull : (1ull << (len * 8)) - 1;
+        u64 m1 = len >= 16 ? ~0ull : len <= 8 ? 0 : (1ull << ((len - 8) * 8)) - 1;
+        printf("    {0x%016llXull, 0x%016llXull},\n", (unsigned long long)m0, (unsigned long long)m1);
+    }
+    printf("};\n");
+    return 0;
+}
@@ -1,5 +1,7 @@
+#include <threads.h>
+
 #include "lex.h"
-#include "common/strmap.h"
+#include "common/atom.h"
 #include "common/util.h"
 #include "common/vec.h"
 
@@ -70,6 +72,7 @@ const char* token_kind[_TOK_COUNT] = {
     [TOK_PREPROC_DEFINE_PASTE]    = "DEFINE_PASTE",
     [TOK_PREPROC_INCLUDE_PASTE]   = "INCLUDE_PASTE",
     [TOK_PREPROC_PASTE_END]       = "PASTE_END",
+    [TOK_PREPROC_INCLUDE_END]     = "INCLUDE_END",
 
     [TOK_PREPROC_SECTION]      = "#SECTION",
     [TOK_PREPROC_ENTERSECTION] = "#ENTERSECTION",
@@ -77,47 +80,40 @@ const char* token_kind[_TOK_COUNT] = {
     [TOK_PREPROC_ASM]          = "#ASM",
 };
 
+// move the cursor to an absolute position.
+static void seek(Lexer* l, usize cursor) {
+    l->cursor = cursor;
+    l->eof = cursor >= l->src.len;
+    l->current = l->eof ? '\0' : l->src.raw[cursor];
+}
+
 static void advance(Lexer* l) {
-    l->cursor++;
-    if (l->cursor >= l->src.len) {
-        l->eof = true;
-        l->current = '\0';
-    } else {
-        l->current = l->src.raw[l->cursor];
-    }
+    seek(l, l->cursor + 1);
 }
 
 static char peek(Lexer* l, usize n) {
     usize cursor = l->cursor + n;
-    if (cursor >= l->src.len) {
-        return '\0';
-    } else {
-        return l->src.raw[cursor];
-    }
+    return cursor < l->src.len ? l->src.raw[cursor] : '\0';
 }
 
 static void advance_n(Lexer* l, usize n) {
-    l->cursor += n;
-    if (l->cursor >= l->src.len) {
-        l->eof = true;
-        l->current = '\0';
-    } else {
-        l->current = l->src.raw[l->cursor];
-    }
+    seek(l, l->cursor + n);
 }
 
 static Token eof_token(Lexer* l) {
-    Token t;
+    Token t = {};
     t.kind = TOK_EOF;
     t.len = 0;
     t.raw = (i64)&l->src.raw[l->src.len];
+    l->token_len = 0;
     return t;
 }
 
-static Token construct_and_advance(Lexer* l, u8 kind, u8 len) {
-    Token t;
+static Token construct_and_advance(Lexer* l, u8 kind, usize len) {
+    Token t = {};
     t.kind = kind;
-    t.len = len;
+    t.len = len < TOK_LEN_EXTENDED ? len : TOK_LEN_EXTENDED;
+    l->token_len = len;
     t.raw = (i64)&l->src.raw[l->cursor];
     assert((char*)(i64)t.raw == &l->src.raw[l->cursor]);
     advance_n(l, len);
@@ -131,29 +127,40 @@ string tok_span(Token t) {
     };
 }
 
-// perfect hash function
-// WARNING: THIS HAS TO BE REMADE EVERY TIME A KEYWORD IS ADDED
-static u8 hashfunc(const char* raw, u32 len) {
-    u8 hash = 134;
-
-    for (usize i = 0; i < len; ++i) {
-        hash ^= raw[i];
-        hash *= 19;
-    }
-    return hash % 126;
+// full span of the token most recently lexed by l
+static string lex_span(Lexer* l, Token t) {
+    return (string){
+        .raw = tok_raw(t),
+        .len = l->token_len,
+    };
 }
 
-static const char* keyword_table[126];
-static u8 keyword_len_table[126];
-static u8 keyword_code_table[126];
+typedef struct {
+    u64 words[2];
+    u8 kind;
+} KeywordEntry;
 
-static u8 lex_categorize_keyword(char* s, size_t len) {
-    u8 index = hashfunc(s, len);
-
-    if (keyword_len_table[index] != len) return TOK_IDENTIFIER;
-    if (strncmp(keyword_table[index], s, len) != 0) return TOK_IDENTIFIER;
+// keyword_table, keyword_masks, and the hash constants are
+// generated at build time from _LEX_KEYWORDS_ (see gen/keyword_hash.c)
+#include "keyword_hash.h"
+static_assert(KEYWORD_MAX_LEN <= FS_MAP_PADDING);
 
-    return keyword_code_table[index];
+// the candidate is loaded as two 8-byte words, masked down to its length,
+// and compared against the single table slot it hashes to.
+// this reads up to KEYWORD_MAX_LEN bytes from s, which the source padding covers.
+static u8 lex_categorize_keyword(char* s, size_t len) {
+    if (len > KEYWORD_MAX_LEN) return TOK_IDENTIFIER;
+
+    u64 w0, w1;
+    memcpy(&w0, s, sizeof(w0));
+    memcpy(&w1, s + sizeof(w0), sizeof(w1));
+    w0 &= keyword_masks[len][0];
+    w1 &= keyword_masks[len][1];
+
+    u64 hash = ((w0 + w1 * KEYWORD_HASH_FOLD) * KEYWORD_HASH_MUL) >> KEYWORD_HASH_SHIFT;
+    const KeywordEntry* entry = &keyword_table[hash];
+    bool is_keyword = ((entry->words[0] ^ w0) | (entry->words[1] ^ w1)) == 0;
+    return is_keyword ? entry->kind : TOK_IDENTIFIER;
 }
 
 static bool is_alphabetic(char c) {
@@ -183,7 +190,7 @@ static bool is_whitespace(char c) {
 }
 
 static Lexer lexer_from_string(string src) {
-    Lexer l;
+    Lexer l = {};
     l.cursor = 0;
     l.src = src;
     if (src.len == 0) {
@@ -198,9 +205,15 @@ static Lexer lexer_from_string(string src) {
 
 
 static void skip_whitespace(Lexer* l) {
-    while (!l->eof && is_whitespace(l->current)) {
-        advance(l);
+    if (!is_whitespace(l->current)) {
+        return; // usually a single space between tokens, if anything
     }
+    seek(l, scan.whitespace(l->src.raw, l->cursor, l->src.len));
+}
+
+// length of the identifier/number run starting at cursor + from
+static usize ident_len(Lexer* l, usize from) {
+    return scan.ident(l->src.raw, l->cursor + from, l->src.len) - l->cursor;
 }
 
 static char* span_begin(Lexer* l) {
@@ -219,8 +232,18 @@ static string span_end(Lexer* l, char* begin) {
     return (string){.raw = begin, .len = (usize)c - (usize)begin};
 }
 
-// lex next token without preprocessor modification.
-static Token lex_next_raw(Lexer* l) {
+// a chunk lexer that started mid-token can run into garbage,
+// which only counts as an error if the chunk turns out to be real.
+#define lex_fail(l, ...) do { \
+    if ((l)->speculative) { \
+        (l)->failed = true; \
+        return eof_token(l); \
+    } \
+    TODO(__VA_ARGS__); \
+} while (0)
+
+// lex next token from source text without preprocessor modification.
+static Token lex_scan_token(Lexer* l) {
     skip_whitespace(l);
 
     if (l->eof) return eof_token(l);
@@ -258,14 +281,7 @@ static Token lex_next_raw(Lexer* l) {
                 return construct_and_advance(l, TOK_PLUS, 1);
         case '-':
             if (is_numeric(peek(l, 1))) {
-                usize length = 2;
-                while (is_alphanumeric(peek(l, length))) {
-                    ++length;
-                }
-        
-                if (length > LEX_MAX_TOKEN_LEN) {
-                    TODO("token is longer than max token len");
-                }
+                usize length = ident_len(l, 2);
                 return construct_and_advance(l, TOK_INTEGER, length);
             } else if (peek(l, 1) == '=')
                 return construct_and_advance(l, TOK_MINUS_EQ, 2);
@@ -278,10 +294,8 @@ static Token lex_next_raw(Lexer* l) {
                 return construct_and_advance(l, TOK_MUL, 1);
         case '/':
             if (peek(l, 1) == '/') {
-                while (!l->eof && l->current != '\n') {
-                    advance(l);
-                }
-                return lex_next_raw(l); // tail-call hopefully
+                seek(l, scan.line_end(l->src.raw, l->cursor, l->src.len));
+                return lex_scan_token(l); // tail-call hopefully
             } else if (peek(l, 1) == '=')
                 return construct_and_advance(l, TOK_DIV_EQ, 2);
             else
@@ -342,19 +356,20 @@ static Token lex_next_raw(Lexer* l) {
             else
                 return construct_and_advance(l, TOK_GREATER, 1);
         case '\"': {
-            usize length = 1;
-            bool seen_slash = false;
-            char c = peek(l, length);
-            while (c != '\"' || seen_slash) {
-                ++length;
-                seen_slash = c == '\\';
-                c = peek(l, length);
+            // find the closing quote, hopping over escapes
+            usize end = l->cursor + 1;
+            while (true) {
+                end = scan.string(l->src.raw, end, l->src.len);
+                if (end >= l->src.len || l->src.raw[end] == '\"') {
+                    break;
+                }
+                end += 2; // skip the backslash and whatever it escapes
             }
-            // length--;
-            l->cursor++;
-            if (length > LEX_MAX_TOKEN_LEN) {
-                TODO("token is longer than max token len");
+            if (end >= l->src.len) {
+                lex_fail(l, "error: unterminated string literal");
             }
+            usize length = end - l->cursor;
+            l->cursor++;
             Token string_token = construct_and_advance(l, TOK_STRING, length-1);
             advance(l);
             return string_token;
@@ -364,6 +379,9 @@ static Token lex_next_raw(Lexer* l) {
             bool seen_slash = false;
             char c = peek(l, length);
             while (c != '\'' || seen_slash) {
+                if (l->cursor + length >= l->src.len) {
+                    lex_fail(l, "error: unterminated char literal");
+                }
                 if (seen_slash) {
                     seen_slash = false;
                 } else {
@@ -374,122 +392,622 @@ static Token lex_next_raw(Lexer* l) {
                 c = peek(l, length);
             }
             length++;
-            if (length > LEX_MAX_TOKEN_LEN) {
-                TODO("token is longer than max token len");
-            }
             return construct_and_advance(l, TOK_CHAR, length);
         }
     }
 
     if (is_alphabetic(l->current)) {
-        usize length = 1;
-        while (is_alphanumeric(peek(l, length))) {
-            ++length;
+        usize length = ident_len(l, 1);
+        u8 kind = lex_categorize_keyword(&l->src.raw[l->cursor], length);
+        return construct_and_advance(l, kind, length);
+    }
+
+    if (is_numeric(l->current)) {
+        usize length = ident_len(l, 1);
+        return construct_and_advance(l, TOK_INTEGER, length);
+    }
+
+    if (l->speculative) {
+        lex_fail(l, "unexpected character");
+    }
+    UNREACHABLE;
+}
+
+// ------------------------- PRELEXING ------------------------- 
+
+// before preprocessing, a whole file gets lexed into an array of raw tokens.
+// big files are cut into chunks at newlines and the chunks are lexed in parallel,
+// each on the assumption that it starts between two tokens. that only fails to
+// hold when a token (a multi-line string, really) crosses a chunk boundary, and
+// then the chunk after it gets lexed again once we know where it really starts.
+//
+// a TOK_LEN_EXTENDED token is followed by an extra slot holding its real length in .raw.
+
+#define PRELEX_CHUNK_MIN (1u << 18)
+#define PRELEX_MAX_CHUNKS 64
+
+typedef struct {
+    Lexer l;
+    usize start;
+    usize end;
+    Vec(Token) tokens;
+    // where the last token in the chunk ended
+    usize stop;
+} PrelexChunk;
+
+static void prelex_append(Vec(Token)* tokens, Lexer* l, Token t) {
+    vec_append(tokens, t);
+    if (t.len == TOK_LEN_EXTENDED) {
+        Token len_slot = {};
+        len_slot.raw = (i64)l->token_len;
+        vec_append(tokens, len_slot);
+    }
+}
+
+// lex every token that starts before chunk->end
+static int prelex_chunk(void* arg) {
+    PrelexChunk* chunk = arg;
+    Lexer* l = &chunk->l;
+    chunk->stop = l->cursor;
+    while (true) {
+        Token t = lex_scan_token(l);
+        if (t.kind == TOK_EOF || tok_raw(t) >= l->src.raw + chunk->end) {
+            break;
+        }
+        prelex_append(&chunk->tokens, l, t);
+        // strings don't include their closing quote
+        chunk->stop = tok_raw(t) - l->src.raw + l->token_len + (t.kind == TOK_STRING);
+    }
+    return 0;
+}
+
+static Token* lex_prelex(string src) {
+    usize chunks_len = min(max(src.len / PRELEX_CHUNK_MIN, 1), min(fs_cpu_count(), PRELEX_MAX_CHUNKS));
+    PrelexChunk chunks[PRELEX_MAX_CHUNKS];
+    thrd_t threads[PRELEX_MAX_CHUNKS];
+
+    usize start = 0;
+    for_n(i, 0, chunks_len) {
+        PrelexChunk* chunk = &chunks[i];
+        chunk->l = lexer_from_string(src);
+        seek(&chunk->l, start);
+        chunk->l.speculative = i != 0;
+
+        // end each chunk just after a newline
+        usize end = (i + 1 == chunks_len) ? src.len : src.len / chunks_len * (i + 1);
+        end = min(scan.line_end(src.raw, max(end, start), src.len) + 1, src.len);
+        chunk->start = start;
+        chunk->end = end;
+        chunk->tokens = vec_new(Token, max((end - start) / 4, 16));
+        start = end;
+    }
+
+    for_n(i, 1, chunks_len) {
+        if (thrd_create(&threads[i], prelex_chunk, &chunks[i]) != thrd_success) {
+            CRASH("unable to start lexer thread");
         }
+    }
+    prelex_chunk(&chunks[0]);
+    for_n(i, 1, chunks_len) {
+        thrd_join(threads[i], nullptr);
+    }
 
-        if (length > LEX_MAX_TOKEN_LEN) {
-            TODO("token is longer than max token len");
+    // stitch the chunks together, fixing up any that started in the wrong place
+    Vec(Token) tokens = chunks[0].tokens;
+    for_n(i, 1, chunks_len) {
+        PrelexChunk* prev = &chunks[i - 1];
+        PrelexChunk* chunk = &chunks[i];
+        if (chunk->l.failed || prev->stop > chunk->start) {
+            vec_destroy(&chunk->tokens);
+            chunk->tokens = vec_new(Token, 16);
+            chunk->l = lexer_from_string(src);
+            seek(&chunk->l, prev->stop);
+            prelex_chunk(chunk);
         }
+        vec_reserve(&tokens, chunk->tokens.len);
+        memcpy(&tokens.at[tokens.len], chunk->tokens.at, chunk->tokens.len * sizeof(Token));
+        tokens.len += chunk->tokens.len;
+        vec_destroy(&chunk->tokens);
+    }
 
-        u8 kind = lex_categorize_keyword(&l->src.raw[l->cursor], length);
-        return construct_and_advance(l, kind, length);
+    Lexer l = lexer_from_string(src);
+    vec_append(&tokens, eof_token(&l));
+    return tokens.at;
+}
+
+static Lexer lexer_from_prelexed(string src, Token** prelexed, usize index) {
+    Lexer l = lexer_from_string(src);
+    l.prelexed = prelexed;
+    l.prelexed_cursor = index;
+    return l;
+}
+
+// lex next token without preprocessor modification.
+static Token lex_next_raw(Lexer* l) {
+    if (l->prelexed == nullptr) {
+        return lex_scan_token(l);
     }
 
-    if (is_numeric(l->current)) {
-        usize length = 1;
-        while (is_alphanumeric(peek(l, length))) {
-            ++length;
+    Token* prelexed = *l->prelexed;
+    Token t = prelexed[l->prelexed_cursor];
+    if (t.kind == TOK_EOF) {
+        seek(l, l->src.len);
+        l->token_len = 0;
+        return t;
+    }
+    ++l->prelexed_cursor;
+    usize len = t.len;
+    if (t.len == TOK_LEN_EXTENDED) {
+        len = prelexed[l->prelexed_cursor++].raw;
+    }
+    // leave the cursor where the text lexer would have, just past the token.
+    // strings don't include their closing quote
+    l->token_len = len;
+    seek(l, tok_raw(t) - l->src.raw + len + (t.kind == TOK_STRING));
+    return t;
+}
+
+// ------------------------- LITERALS ------------------------- 
+
+static i32 digit_value(char c) {
+    if ('0' <= c && c <= '9') return c - '0';
+    if ('a' <= c && c <= 'z') return c - 'a' + 10;
+    if ('A' <= c && c <= 'Z') return c - 'A' + 10;
+    return INT32_MAX;
+}
+
+// decode an integer literal, with an optional - and 0x/0o/0b prefix.
+// returns false if it has digits that don't fit the base.
+static bool decode_integer(string s, u64* out) {
+    usize i = 0;
+    bool is_negative = s.len != 0 && s.raw[0] == '-';
+    i += is_negative;
+
+    u32 base = 10;
+    if (i + 1 < s.len && s.raw[i] == '0') {
+        switch (s.raw[i + 1]) {
+        case 'x': case 'X': base = 16; i += 2; break;
+        case 'o': case 'O': base = 8;  i += 2; break;
+        case 'b': case 'B': base = 2;  i += 2; break;
         }
+    }
 
-        if (length > LEX_MAX_TOKEN_LEN) {
-            TODO("token is longer than max token len");
+    u64 val = 0;
+    bool valid = i < s.len;
+    for (; i < s.len; ++i) {
+        i32 digit = digit_value(s.raw[i]);
+        if (digit >= base) {
+            valid = false;
+            break;
         }
-        return construct_and_advance(l, TOK_INTEGER, length);
+        val = val * base + digit;
     }
 
-    UNREACHABLE;
+    *out = is_negative ? -val : val;
+    return valid;
+}
+
+// append the unescaped contents of a string/char literal to out.
+// returns false on a malformed escape.
+static bool unescape(string s, Vec(char)* out) {
+    for (usize i = 0; i < s.len; ++i) {
+        char c = s.raw[i];
+        if (c != '\\') {
+            vec_append(out, c);
+            continue;
+        }
+        if (++i == s.len) {
+            return false;
+        }
+        switch (s.raw[i]) {
+        case 'n':  vec_append(out, '\n'); break;
+        case 't':  vec_append(out, '\t'); break;
+        case 'r':  vec_append(out, '\r'); break;
+        case 'v':  vec_append(out, '\v'); break;
+        case 'b':  vec_append(out, '\b'); break;
+        case '0':  vec_append(out, '\0'); break;
+        case 'x':
+            if (i + 2 >= s.len || digit_value(s.raw[i + 1]) >= 16 || digit_value(s.raw[i + 2]) >= 16) {
+                return false;
+            }
+            vec_append(out, (char)(digit_value(s.raw[i + 1]) * 16 + digit_value(s.raw[i + 2])));
+            i += 2;
+            break;
+        default: // \\ \" \' and anything else stand for themselves
+            vec_append(out, s.raw[i]);
+            break;
+        }
+    }
+    return true;
+}
+
+static Vec(TokenPayload) payloads;
+static Vec(char) payload_bytes;
+// parallel to the token vector, see Parser.atoms
+static Vec(Atom) token_atoms;
+// one bit per token in the token vector, see Parser.newlines
+Vec_typedef(u64);
+static Vec(u64) newline_bits;
+// a newline came through and the next token gets its bit
+static bool newline_pending;
+
+// see Parser.expansions. open_expansions are the ones being pasted right now, innermost last.
+Vec_typedef(Expansion);
+static Vec(Expansion) expansions;
+static u32 open_expansions[MAX_EXPANSION_DEPTH];
+static u32 open_expansions_len;
+
+// non-null while lexing in streaming mode. the token, payload, payload byte and expansion
+// vectors are then just staging buffers that get flushed into the stream in batches,
+// and tokens_flushed is how many tokens came before the ones being staged.
+static TokenStream* stream;
+static u32 tokens_flushed;
+static u32 expansions_flushed;
+
+static void token_stream_flush(Vec(Token)* tokens);
+
+// see INCLUDE CACHE (ON DISK)
+static u32 recordings_len;
+static void record_token(Vec(Token)* tokens, Token t, Atom atom);
+static void record_lookup(Atom key, u32 found);
+
+static TokenPayload* new_payload(Vec(Token)* tokens, usize span_len) {
+    TokenPayload payload = {
+        .token_index = tokens_flushed + tokens->len,
+        .span_len = span_len,
+    };
+    vec_append(&payloads, payload);
+    return &payloads.at[payloads.len - 1];
+}
+
+static Expansion* stream_expansion(u32 index);
+
+static void expansion_open(Vec(Token)* tokens, Token site) {
+    if (open_expansions_len == MAX_EXPANSION_DEPTH) {
+        TODO("error: max define/macro depth reached");
+    }
+    u32 index = expansions_flushed + expansions.len;
+    Expansion e = {
+        .start = tokens_flushed + tokens->len,
+        .end = EXPANSION_OPEN,
+        .parent = open_expansions_len != 0 ? open_expansions[open_expansions_len - 1] : EXPANSION_NONE,
+        .site = site,
+    };
+    vec_append(&expansions, e);
+    open_expansions[open_expansions_len++] = index;
+}
+
+static void expansion_close(Vec(Token)* tokens, Token call) {
+    u32 index = open_expansions[--open_expansions_len];
+    u32 end = tokens_flushed + tokens->len;
+    if (index < expansions_flushed) {
+        // already in the stream, and the parser might be inside it.
+        // end is written last so call is there once it sees it.
+        Expansion* e = stream_expansion(index);
+        e->call = call;
+        e->end = end;
+        return;
+    }
+    Expansion* e = &expansions.at[index - expansions_flushed];
+    if (e->start == end) {
+        // nothing got pasted, so nothing can come from it.
+        // anything opened after it was inside it and is already gone.
+        expansions.len--;
+        return;
+    }
+    e->call = call;
+    e->end = end;
+}
+
+static void push_token_atom(Vec(Token)* tokens, Token t, Atom atom) {
+    if (recordings_len != 0) {
+        record_token(tokens, t, atom);
+    }
+    switch (t.kind) {
+    case TOK_NEWLINE:
+        newline_pending = true;
+        return;
+    case TOK_PREPROC_MACRO_PASTE:
+    case TOK_PREPROC_DEFINE_PASTE:
+        expansion_open(tokens, t);
+        return;
+    case TOK_PREPROC_PASTE_END:
+        expansion_close(tokens, t);
+        return;
+    }
+    if (tokens->len % 64 == 0) {
+        vec_append(&newline_bits, 0);
+    }
+    newline_bits.at[tokens->len / 64] |= (u64)newline_pending << (tokens->len % 64);
+    newline_pending = false;
+    vec_append(tokens, t);
+    vec_append(&token_atoms, atom);
+    if (stream && tokens->len >= TOKEN_STREAM_BATCH) {
+        token_stream_flush(tokens);
+    }
+}
+
+static void push_token(Vec(Token)* tokens, Token t) {
+    push_token_atom(tokens, t, ATOM_NONE);
+}
+
+// append a token to the stream along with any payload it needs.
+// span is the token's full span, since t.len may not be able to hold it.
+// atom is the identifier's interned name, or ATOM_NONE for other tokens.
+static void emit_token(Vec(Token)* tokens, Token t, string span, Atom atom) {
+    TokenPayload* payload;
+    switch (t.kind) {
+    case TOK_INTEGER:
+        payload = new_payload(tokens, span.len);
+        payload->malformed = !decode_integer(span, &payload->integer);
+        break;
+    case TOK_CHAR:
+        ;
+        payload = new_payload(tokens, span.len);
+        usize start = payload_bytes.len;
+        payload->malformed = !unescape(substring(span, 1, span.len - 1), &payload_bytes);
+        if (payload_bytes.len - start != 1) {
+            payload->malformed = true;
+        }
+        payload->integer = payload_bytes.len != start ? (u8)payload_bytes.at[start] : 0;
+        payload_bytes.len = start; // chars dont need to keep their bytes
+        break;
+    case TOK_STRING:
+        // string spans already exclude the quotes
+        payload = new_payload(tokens, span.len);
+        payload->string.offset = payload_bytes.len;
+        payload->malformed = !unescape(span, &payload_bytes);
+        payload->string.len = payload_bytes.len - payload->string.offset;
+        if (payload->string.len == span.len) {
+            // every escape makes the string shorter, so this one had none
+            // and its bytes are just the span. see tok_payload_string.
+            payload_bytes.len = payload->string.offset;
+        }
+        break;
+    default:
+        if (t.len == TOK_LEN_EXTENDED) {
+            new_payload(tokens, span.len);
+        }
+        break;
+    }
+    push_token_atom(tokens, t, atom);
+}
+
+TokenPayload* tok_payload(Parser* p, u32 index) {
+    u32 lo = p->payloads_start;
+    u32 hi = p->payloads_len;
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        if (p->payloads[mid & p->payloads_mask].token_index < index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < p->payloads_len && p->payloads[lo & p->payloads_mask].token_index == index) {
+        return &p->payloads[lo & p->payloads_mask];
+    }
+    return nullptr;
+}
+
+u32 tok_expansion(Parser* p, u32 index) {
+    // last one to start at or before index
+    u32 lo = p->expansions_start;
+    u32 hi = p->expansions_len;
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        if (expansion_at(p, mid)->start <= index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == p->expansions_start) {
+        return EXPANSION_NONE;
+    }
+    // the innermost one around index is either it or one of its parents
+    u32 e = lo - 1;
+    while (e != EXPANSION_NONE && e >= p->expansions_start) {
+        if (expansion_at(p, e)->end > index) {
+            return e;
+        }
+        e = expansion_at(p, e)->parent;
+    }
+    return EXPANSION_NONE;
+}
+
+string tok_span_at(Parser* p, u32 index) {
+    Token t = tok_at(p, index);
+    if (t.len != TOK_LEN_EXTENDED) {
+        return tok_span(t);
+    }
+    return (string){
+        .raw = tok_raw(t),
+        .len = tok_payload(p, index)->span_len,
+    };
+}
+
+string tok_payload_string(Parser* p, TokenPayload* payload) {
+    if (payload->string.len == payload->span_len) {
+        return tok_span_at(p, payload->token_index);
+    }
+    return (string){
+        .raw = p->payload_bytes + (payload->string.offset & p->payload_bytes_mask),
+        .len = payload->string.len,
+    };
 }
 
 // ------------------------- PREPROCESSOR ------------------------- 
 
 static Token lex_with_preproc(Lexer* l, Vec(Token)* tokens, PreprocScope* scope);
+static Token preproc_token(u8 kind, string span);
 
-Vec(Token) macro_arg_pool;
+Vec(Atom) macro_param_pool;
 Vec(PreprocVal) preproc_val_pool;
+// raw tokens of complex strings and macro args, laid out like lex_prelex's output
+Vec(Token) preproc_token_pool;
+
+// every definition lives on one binding stack, and one array goes from a name's atom
+// to its innermost binding. a binding links to the one it shadows, so leaving a scope just
+// pops its bindings and puts the shadowed ones back.
+//
+// since macro args are expanded in their caller's scope, the scope chain can skip
+// over scopes that are still on the stack, and the innermost binding isn't always
+// visible. walking the shadow chain against the scope chain sorts that out.
+
+typedef struct {
+    Atom key;
+    PreprocVal val;
+    u32 depth;
+    u32 shadowed;
+    bool removed; // by #UNDEFINE, but still shadowing
+} PreprocBinding;
+
+Vec_typedef(PreprocBinding);
+static Vec(PreprocBinding) bindings;
+static Vec(u32) innermost_bindings;
+// one bit for every name that's been defined anywhere so far, see lex_relex
+static Vec(u64) defined_names;
+
+static u32 innermost_binding(Atom key) {
+    return key < innermost_bindings.len ? innermost_bindings.at[key] : NO_BINDING;
+}
+
+static void set_innermost_binding(Atom key, u32 index) {
+    while (innermost_bindings.len <= key) {
+        vec_append(&innermost_bindings, NO_BINDING);
+    }
+    innermost_bindings.at[key] = index;
+}
+
+static bool binding_visible(PreprocBinding* b, PreprocScope* scope) {
+    while (scope->depth > b->depth) {
+        scope = scope->parent;
+    }
+    return scope->depth == b->depth;
+}
 
-static bool replacement_exists_immediate(string key, PreprocScope* scope) {
-    if (scope == nullptr) return false;
-    return STRMAP_NOT_FOUND != strmap_get(&scope->map, key);
+// returns nullptr if there's no visible definition
+static PreprocBinding* find_binding(Atom key, PreprocScope* scope) {
+    for (u32 i = innermost_binding(key); i != NO_BINDING; i = bindings.at[i].shadowed) {
+        PreprocBinding* b = &bindings.at[i];
+        if (!b->removed && binding_visible(b, scope)) {
+            record_lookup(key, i);
+            return b;
+        }
+    }
+    record_lookup(key, NO_BINDING);
+    return nullptr;
 }
 
-static bool replacement_exists(string key, PreprocScope* scope) {
-    if (scope == nullptr) return false;
-    return replacement_exists_immediate(key, scope) 
-        || replacement_exists(key, scope->parent);
+static void enter_preproc_scope(PreprocScope* scope, PreprocScope* parent, u32 depth) {
+    scope->parent = parent;
+    scope->depth = depth;
+    scope->bindings_start = bindings.len;
 }
 
-static void remove_replacement(string key, PreprocScope* scope) {
-    strmap_remove(&scope->map, key);
-    if (scope->parent != nullptr) {
-        remove_replacement(key, scope->parent);
+static void exit_preproc_scope(PreprocScope* scope) {
+    while (bindings.len > scope->bindings_start) {
+        PreprocBinding* b = &bindings.at[--bindings.len];
+        set_innermost_binding(b->key, b->shadowed);
     }
 }
 
-static PreprocVal get_replacement_value(string key, PreprocScope* scope) {
-    usize val = (usize)strmap_get(&scope->map, key);
-    if (val == (usize)STRMAP_NOT_FOUND) {
-        if (scope->parent != nullptr) {
-            return get_replacement_value(key, scope->parent);
+static bool replacement_exists_immediate(Atom key, PreprocScope* scope) {
+    u32 i = innermost_binding(key);
+    record_lookup(key, i);
+    return i != NO_BINDING && bindings.at[i].depth == scope->depth && !bindings.at[i].removed;
+}
+
+static bool replacement_exists(Atom key, PreprocScope* scope) {
+    return find_binding(key, scope) != nullptr;
+}
+
+static void remove_replacement(Atom key, PreprocScope* scope) {
+    // remove it from every scope that can see it
+    bool found = false;
+    for (u32 i = innermost_binding(key); i != NO_BINDING; i = bindings.at[i].shadowed) {
+        PreprocBinding* b = &bindings.at[i];
+        if (binding_visible(b, scope)) {
+            record_lookup(key, i);
+            b->removed = true;
+            found = true;
         }
-        return (PreprocVal){.kind = PPVAL_NONE};
     }
-    return preproc_val_pool.at[val];
+    if (!found) {
+        record_lookup(key, NO_BINDING);
+    }
 }
 
-static void put_replacement_value(string key, PreprocScope* scope, PreprocVal val) {
-    vec_append(&preproc_val_pool, val);
+static void put_replacement_value(Atom key, PreprocScope* scope, PreprocVal val) {
+    while (defined_names.len <= key / 64) {
+        vec_append(&defined_names, 0);
+    }
+    defined_names.at[key / 64] |= 1ull << (key % 64);
+
     // place at innermost scope
-    strmap_put(&scope->map, key, (void*)(preproc_val_pool.len - 1));
+    u32 i = innermost_binding(key);
+    if (i != NO_BINDING && bindings.at[i].depth == scope->depth) {
+        // only #UNDEFINEd ones get here, the rest are redefinition errors
+        record_lookup(key, i);
+        bindings.at[i].val = val;
+        bindings.at[i].removed = false;
+        return;
+    }
+    PreprocBinding b = {
+        .key = key,
+        .val = val,
+        .depth = scope->depth,
+        .shadowed = i,
+    };
+    vec_append(&bindings, b);
+    set_innermost_binding(key, bindings.len - 1);
+}
+
+// finish off a token run in the pool started at tokens_index and make a complex string of it
+static PreprocVal preproc_end_token_run(string text, u32 tokens_index) {
+    if (text.len > COMPACT_STR_MAX_LEN) {
+        TODO("error: string too long");
+    }
+    Token eof = {};
+    eof.kind = TOK_EOF;
+    eof.raw = (i64)(text.raw + text.len);
+    vec_append(&preproc_token_pool, eof);
+
+    return (PreprocVal){
+        .kind = PPVAL_COMPLEX_STRING,
+        .complex = {
+            .text = to_compact(text),
+            .tokens_index = tokens_index,
+        },
+    };
 }
 
-static CompactString preproc_collect_complex_string(Lexer* l) {
+// collect everything up to the matching ]
+static PreprocVal preproc_collect_complex_string(Lexer* l) {
     string span;
     span.raw = &l->src.raw[l->cursor];
     span.len = l->cursor;
+    u32 tokens_index = preproc_token_pool.len;
 
     usize bracket_depth = 1;
-    while (bracket_depth != 0) {    
+    while (true) {    
         Token t = lex_next_raw(l);
         switch (t.kind) {
         case TOK_OPEN_BRACKET:  ++bracket_depth; break;
         case TOK_CLOSE_BRACKET: --bracket_depth; break;
+        case TOK_EOF: TODO("error: expected ]");
         default:
             break;
         }
+        if (bracket_depth == 0) {
+            break;
+        }
+        prelex_append(&preproc_token_pool, l, t);
     }
 
     span.len = l->cursor - span.len - 1;
-    if (span.len > COMPACT_STR_MAX_LEN) {
-        TODO("error: string too long");
-    }
-    return to_compact(span);
-}
-
-static i64 eval_integer(Token t) {
-    i64 val = 0;
-    char* raw = tok_raw(t);
-    bool is_negative = raw[0] == '-';
-
-    for (usize i = is_negative; i < t.len; ++i) {
-        val *= 10;
-        isize char_val = raw[i] - '0';
-        // if (char_val < 0 || char_val > 9) {
-        //     TODO("invalid digit");
-        // }
-        val += raw[i] - '0';
-    }
-
-    return is_negative ? -val : val;
+    return preproc_end_token_run(span, tokens_index);
 }
 
 static PreprocVal preproc_collect_value(Lexer* l, PreprocScope* scope) {
@@ -497,24 +1015,29 @@ static PreprocVal preproc_collect_value(Lexer* l, PreprocScope* scope) {
     Token t = lex_next_raw(l);
     v.raw = t.raw;
     v.len = t.len;
+    string span = lex_span(l, t);
 
     switch (t.kind) {
     case TOK_OPEN_BRACKET:
-        v.kind = PPVAL_COMPLEX_STRING;
-        v.string = preproc_collect_complex_string(l);
+        ;
+        PreprocVal complex = preproc_collect_complex_string(l);
+        v.kind = complex.kind;
+        v.complex = complex.complex;
         break;
     case TOK_IDENTIFIER:
         ;
-        string span = tok_span(t);
-        if (replacement_exists(span, scope)) {
-            v = get_replacement_value(span, scope);
+        PreprocBinding* b = find_binding(atom_intern(span), scope);
+        if (b) {
+            v = b->val;
         } else {
             TODO("error: preprocessor symbol undefined");
         }
         break;
     case TOK_INTEGER:
         v.kind = PPVAL_INTEGER;
-        v.integer = eval_integer(t);
+        if (!decode_integer(span, (u64*)&v.integer)) {
+            TODO("error: invalid integer literal");
+        }
         break;
     case TOK_OPEN_PAREN:
         ;
@@ -527,7 +1050,7 @@ static PreprocVal preproc_collect_value(Lexer* l, PreprocScope* scope) {
                     TODO("error: expected identifier");
                 }
                 v.kind = PPVAL_INTEGER;
-                v.integer = replacement_exists(tok_span(ident), scope);
+                v.integer = replacement_exists(atom_intern(lex_span(l, ident)), scope);
             } else if (string_eq(tok_span(op), constr("STRCAT"))) {
                 PreprocVal lhs = preproc_collect_value(l, scope);
                 PreprocVal rhs = preproc_collect_value(l, scope);
@@ -609,8 +1132,10 @@ static PreprocVal preproc_collect_value(Lexer* l, PreprocScope* scope) {
         break;
     case TOK_STRING:
         v.kind = PPVAL_STRING;
-        v.string.len = t.len - 2;
-        v.string.raw = t.raw + 1;
+        if (span.len > COMPACT_STR_MAX_LEN) {
+            TODO("error: string too long");
+        }
+        v.string = to_compact(span);
         break;
     default:
         TODO("error: expected value, got token '%s'", token_kind[t.kind]);
@@ -625,6 +1150,7 @@ static void preproc_define(Lexer* l, PreprocScope* scope) {
     if (name.kind != TOK_IDENTIFIER) {
         TODO("error: expected identifier");
     }
+    Atom name_atom = atom_intern(lex_span(l, name));
 
     // consume value
     PreprocVal v = preproc_collect_value(l, scope);
@@ -633,11 +1159,11 @@ static void preproc_define(Lexer* l, PreprocScope* scope) {
         .raw = name.raw,
     };
 
-    if (replacement_exists_immediate(tok_span(name), scope)) {
+    if (replacement_exists_immediate(name_atom, scope)) {
         TODO("error: redefinition in current scope");
     }
 
-    put_replacement_value(tok_span(name), scope, v);
+    put_replacement_value(name_atom, scope, v);
 }
 
 static void preproc_undefine(Lexer* l, PreprocScope* scope) {
@@ -647,7 +1173,7 @@ static void preproc_undefine(Lexer* l, PreprocScope* scope) {
         TODO("error: expected identifier");
     }
 
-    remove_replacement(tok_span(name), scope);
+    remove_replacement(atom_intern(lex_span(l, name)), scope);
 }
 
 static void preproc_macro(Lexer* l, PreprocScope* scope) {
@@ -657,7 +1183,8 @@ static void preproc_macro(Lexer* l, PreprocScope* scope) {
         TODO("error: expected identifier");
     }
 
-    if (replacement_exists_immediate(tok_span(name), scope)) {
+    Atom name_atom = atom_intern(lex_span(l, name));
+    if (replacement_exists_immediate(name_atom, scope)) {
         TODO("error: redefinition in current scope");
     }
 
@@ -667,14 +1194,14 @@ static void preproc_macro(Lexer* l, PreprocScope* scope) {
 
     // consume param list
     usize params_len = 0;
-    usize macro_params_index = macro_arg_pool.len;
+    usize macro_params_index = macro_param_pool.len;
     for (Token t = lex_next_raw(l); t.kind != TOK_CLOSE_PAREN; t = lex_next_raw(l)) {
         if (t.kind != TOK_IDENTIFIER) {
             TODO("error: expected identifier");
         }
 
         ++params_len;
-        vec_append(&macro_arg_pool, t);
+        vec_append(&macro_param_pool, atom_intern(lex_span(l, t)));
 
         t = lex_next_raw(l);
         if (t.kind != TOK_COMMA) {
@@ -706,36 +1233,1086 @@ static void preproc_macro(Lexer* l, PreprocScope* scope) {
             .params_len = params_len,
         },
     };
-    put_replacement_value(tok_span(name), scope, macro);
+    put_replacement_value(name_atom, scope, macro);
 }
 
-static void preproc_if(Lexer* l, Vec(Token)* tokens, PreprocScope* scope) {
-    
-    PreprocVal cond_val = preproc_collect_value(l, scope);
-    if (cond_val.kind != PPVAL_INTEGER) {
-        TODO("#IF condition is not an integer");
+// included files are read and raw-lexed once per process, no matter how many
+// files include them or how many compilations run. a file that's wrapped entirely
+// in an include guard doesn't even get looked at again once its guard is defined.
+
+typedef struct IncludeCacheFile IncludeCacheFile;
+
+typedef struct {
+    FsFile* handle;
+    SrcFile file;
+    Token* prelexed; // nullptr until the file actually has to be lexed
+    Atom guard; // ATOM_NONE if the file has no include guard
+
+    bool hashed;
+    u64 hash; // of the contents, see include_file_hash
+
+    // its preprocessed output from the on-disk cache, if there's a usable one
+    IncludeCacheFile* cached;
+} IncludeFile;
+
+VecPtr_typedef(IncludeFile);
+
+static once_flag include_cache_once = ONCE_FLAG_INIT;
+static mtx_t include_cache_lock;
+static StrMap include_cache; // real path -> IncludeFile*
+
+static void include_cache_init() {
+    // recursive, since loading a file's on-disk cache opens the files it included
+    mtx_init(&include_cache_lock, mtx_plain | mtx_recursive);
+    strmap_init(&include_cache, 64);
+}
+
+// the file being lexed right now, includes are relative to it
+static SrcFile* current_file;
+// every file included while lexing the current compilation, in order of first inclusion
+static VecPtr(SrcFile) lexed_sources;
+
+static usize include_depth = 0;
+
+static void include_file_lex(IncludeFile* inc) {
+    mtx_lock(&include_cache_lock);
+    if (inc->prelexed == nullptr) {
+        inc->prelexed = lex_prelex(inc->file.src);
     }
-    bool case_succeeds = cond_val.integer != 0;
-    // if this case suceeds, we include everything inside and then discard everything else
-    if (case_succeeds) {
-        // get the rest of this case
-        Token last = lex_with_preproc(l, tokens, scope);
+    mtx_unlock(&include_cache_lock);
+}
 
-        // discard everything else until the last #END
-        if (last.kind == TOK_KW_END) {
-            return;
+// an include guard is an #IF (NOT (DEFINED X)) whose #END is the last thing in the file.
+// returns X, or ATOM_NONE if the file isn't guarded.
+static Atom include_guard(IncludeFile* inc) {
+    include_file_lex(inc);
+    Lexer l = lexer_from_prelexed(inc->file.src, &inc->prelexed, 0);
+    Token t = lex_next_raw(&l);
+    while (t.kind == TOK_NEWLINE) {
+        t = lex_next_raw(&l);
+    }
+
+    if (t.kind != TOK_HASH 
+        || lex_next_raw(&l).kind != TOK_KW_IF
+        || lex_next_raw(&l).kind != TOK_OPEN_PAREN
+        || lex_next_raw(&l).kind != TOK_KW_NOT
+        || lex_next_raw(&l).kind != TOK_OPEN_PAREN
+    ) {
+        return ATOM_NONE;
+    }
+    t = lex_next_raw(&l);
+    if (t.kind != TOK_IDENTIFIER || !string_eq(lex_span(&l, t), constr("DEFINED"))) {
+        return ATOM_NONE;
+    }
+    t = lex_next_raw(&l);
+    if (t.kind != TOK_IDENTIFIER) {
+        return ATOM_NONE;
+    }
+    Atom guard = atom_intern(lex_span(&l, t));
+    if (lex_next_raw(&l).kind != TOK_CLOSE_PAREN || lex_next_raw(&l).kind != TOK_CLOSE_PAREN) {
+        return ATOM_NONE;
+    }
+
+    // find the matching #END, same as preproc_if skipping a case
+    u32 depth = 1;
+    while (depth != 0) {
+        t = lex_next_raw(&l);
+        if (t.kind == TOK_EOF) {
+            return ATOM_NONE;
         }
-        u32 depth = 1;
-        while (last.kind != TOK_KW_END || depth != 0) {
-            last = lex_next_raw(l);
-            if (last.kind == TOK_EOF) {
-                TODO("unexpected EOF");
-                return;
+        if (t.kind != TOK_HASH) {
+            continue;
+        }
+        switch (lex_next_raw(&l).kind) {
+        case TOK_KW_IF:
+            depth++;
+            break;
+        case TOK_KW_ELSE:
+        case TOK_KW_ELSEIF:
+            if (depth == 1) {
+                return ATOM_NONE; // the rest of the file isn't just skipped then
             }
-            if (last.kind != TOK_HASH) {
-                continue;
+            break;
+        case TOK_KW_END:
+            depth--;
+            break;
+        }
+    }
+
+    do {
+        t = lex_next_raw(&l);
+    } while (t.kind == TOK_NEWLINE);
+    return t.kind == TOK_EOF ? guard : ATOM_NONE;
+}
+
+static IncludeCacheFile* include_cache_load(IncludeFile* inc);
+
+// returns nullptr if the file can't be opened
+static IncludeFile* include_file_open(FsPath* real) {
+    call_once(&include_cache_once, include_cache_init);
+    mtx_lock(&include_cache_lock);
+
+    IncludeFile* inc = strmap_get(&include_cache, fs_from_path(real));
+    if (inc == STRMAP_NOT_FOUND) {
+        inc = nullptr;
+        FsFile* handle = fs_open(real->raw, false, false);
+        if (handle != nullptr) {
+            inc = malloc(sizeof(IncludeFile));
+            *inc = (IncludeFile){};
+            inc->handle = handle;
+            inc->file = (SrcFile){
+                .src = fs_map_entire(handle),
+                .path = fs_from_path(&handle->path),
+            };
+            // put it in the map first, in case its on-disk cache leads back to it
+            strmap_put(&include_cache, inc->file.path, inc);
+
+            inc->cached = include_cache_load(inc);
+            if (inc->cached == nullptr) {
+                inc->guard = include_guard(inc);
             }
-            last = lex_next_raw(l);
+        }
+    }
+
+    mtx_unlock(&include_cache_lock);
+    return inc;
+}
+
+static bool is_absolute_path(string path) {
+    return path.len != 0 && (path.raw[0] == '/' || path.raw[0] == '\\' || (path.len > 1 && path.raw[1] == ':'));
+}
+
+// find an included file relative to the file including it, falling back to the working directory
+static IncludeFile* include_file_get(string path) {
+    FsPath real;
+    bool found = false;
+    if (!is_absolute_path(path) && current_file) {
+        string dir = current_file->path;
+        while (dir.len != 0 && dir.raw[dir.len - 1] != '/' && dir.raw[dir.len - 1] != '\\') {
+            --dir.len;
+        }
+        string joined = strprintf(str_fmt str_fmt, str_arg(dir), str_arg(path));
+        found = fs_real_path(joined.raw, &real);
+        string_free(joined);
+    }
+    if (!found) {
+        char* cpath = clone_to_cstring(path);
+        found = fs_real_path(cpath, &real);
+        free(cpath);
+    }
+    if (!found) {
+        TODO("error: cannot find included file '"str_fmt"'", str_arg(path));
+    }
+
+    IncludeFile* inc = include_file_open(&real);
+    if (inc == nullptr) {
+        TODO("error: cannot open included file '"str_fmt"'", str_arg(path));
+    }
+    return inc;
+}
+
+static u64 hash_bytes(string s) {
+    u64 hash = 14695981039346656037ull;
+    for_n(i, 0, s.len) {
+        hash ^= (u64)(u8)s.raw[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static u64 include_file_hash(IncludeFile* inc) {
+    if (!inc->hashed) {
+        inc->hash = hash_bytes(inc->file.src);
+        inc->hashed = true;
+    }
+    return inc->hash;
+}
+
+// ------------------------- INCLUDE CACHE (ON DISK) -------------------------
+
+// with an include cache directory set, the output of preprocessing an included file,
+// meaning its tokens and the definitions it leaves behind, gets saved to disk.
+// later runs paste that in instead of lexing and preprocessing the file again.
+//
+// the saved output still applies as long as the file (and anything it included)
+// hasn't changed, and none of the names it looked up without finding are defined.
+// a file that used or changed a definition from outside isn't saved at all, since
+// what it expands to depends on who included it. only includes at global scope are
+// saved or pasted, so any definition from outside is visible to every lookup.
+//
+// cache files are mapped straight in and don't contain any pointers. spans are offsets
+// into the source files they come from, and identifiers are indices into a name table.
+
+static const char* include_cache_dir = nullptr;
+
+void lex_set_include_cache(const char* dir) {
+    if (!fs_make_dir(dir)) {
+        CRASH("unable to create include cache directory '%s'", dir);
+    }
+    include_cache_dir = dir;
+}
+
+#define CACHE_MAGIC 0x43505943u // "CYPC"
+#define CACHE_VERSION 1
+#define CACHE_NONE UINT32_MAX
+
+// an array in the cache file, as a byte offset from its start and an item count
+typedef struct {
+    u32 offset;
+    u32 len;
+} CacheArray;
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u32 guard; // name index, or CACHE_NONE
+    u32 _pad;
+    CacheArray sources;  // CacheSource, the cached file itself comes first
+    CacheArray names;    // CacheArray, into strings
+    CacheArray undefs;   // u32 name indices, these have to be undefined at the #INCLUDE
+    CacheArray tokens;   // CacheToken
+    CacheArray payloads; // TokenPayload, token_index counts from the first token
+    CacheArray bytes;    // char, payload bytes
+    CacheArray defs;     // CacheDef
+    CacheArray runs;     // CacheToken, raw tokens of complex strings in prelex layout
+    CacheArray params;   // u32 name indices of macro parameters
+    CacheArray strings;  // char
+} CacheHeader;
+
+typedef struct {
+    u64 id;
+    u64 last_modified;
+    u64 size;
+    u64 hash;
+    CacheArray path; // into strings
+} CacheSource;
+
+typedef struct {
+    u32 source; // CACHE_NONE if the span is null
+    u32 offset;
+    u32 len;
+} CacheSpan;
+
+typedef struct {
+    u8 kind;
+    u8 generated;
+    u8 len;
+    u8 _pad;
+    u32 name; // an identifier's name index, or CACHE_NONE
+    // where it starts. the length is in len or a payload, and the length slot after
+    // a TOK_LEN_EXTENDED token in a run keeps the length in offset instead.
+    u32 source;
+    u32 offset;
+} CacheToken;
+
+typedef struct {
+    i64 integer;
+    u32 name;
+    u32 kind;
+    CacheSpan raw; // PreprocVal.raw and len
+    CacheSpan source;
+    CacheSpan text; // the string, complex string text or macro body text
+    u32 run; // complex strings and macro bodies, index of the first token in runs
+    u32 params; // macros, index of the first parameter
+    u32 params_len;
+} CacheDef;
+
+Vec_typedef(CacheToken);
+Vec_typedef(CacheDef);
+Vec_typedef(CacheSource);
+Vec_typedef(CacheArray);
+
+typedef struct IncludeCacheFile {
+    FsFile* handle;
+    string data;
+    CacheHeader* header;
+    IncludeFile** sources;
+    Atom* names;
+} IncludeCacheFile;
+
+#define cache_array(c, field, type) ((type*)((c)->data.raw + (c)->header->field.offset))
+
+// a file being preprocessed for the first time, whose output is being recorded.
+// includes nest, so the recorded vectors are shared and each recording keeps
+// track of where its part of them starts.
+typedef struct {
+    IncludeFile* inc;
+    bool cacheable;
+    u32 tokens_start;
+    u32 payloads_start;
+    u32 bytes_start;
+    u32 undefs_start;
+    u32 files_start;
+    u32 bindings_start;
+} Recording;
+
+static Recording recordings[MAX_INCLUDE_DEPTH];
+static u32 recordings_len = 0;
+
+static Vec(Token) recorded_tokens;
+static Vec(Atom) recorded_atoms;
+static Vec(TokenPayload) recorded_payloads; // token_index is into recorded_tokens
+static Vec(char) recorded_bytes;
+static Vec(Atom) recorded_undefs;
+static VecPtr(IncludeFile) recorded_files;
+
+// called with every token on its way out, just before it's pushed
+static void record_token(Vec(Token)* tokens, Token t, Atom atom) {
+    u32 index = tokens_flushed + tokens->len;
+    if (payloads.len != 0 && payloads.at[payloads.len - 1].token_index == index) {
+        TokenPayload payload = payloads.at[payloads.len - 1];
+        payload.token_index = recorded_tokens.len;
+        if (t.kind == TOK_STRING && payload.string.len != payload.span_len) {
+            vec_reserve(&recorded_bytes, payload.string.len);
+            memcpy(&recorded_bytes.at[recorded_bytes.len], &payload_bytes.at[payload.string.offset], payload.string.len);
+            payload.string.offset = recorded_bytes.len;
+            recorded_bytes.len += payload.string.len;
+        }
+        vec_append(&recorded_payloads, payload);
+    }
+    vec_append(&recorded_tokens, t);
+    vec_append(&recorded_atoms, atom);
+}
+
+// called with the result of every lookup the preprocessor makes, NO_BINDING if it found nothing
+static void record_lookup(Atom key, u32 found) {
+    if (recordings_len == 0) {
+        return;
+    }
+    if (found == NO_BINDING) {
+        vec_append(&recorded_undefs, key);
+        return;
+    }
+    for_n(i, 0, recordings_len) {
+        if (found < recordings[i].bindings_start) {
+            recordings[i].cacheable = false;
+        }
+    }
+}
+
+// a file is about to be pasted in
+static void include_file_used(IncludeFile* inc) {
+    bool seen = false;
+    for_n(i, 0, lexed_sources.len) {
+        seen |= lexed_sources.at[i] == &inc->file;
+    }
+    if (!seen) {
+        vec_append(&lexed_sources, &inc->file);
+    }
+    if (recordings_len != 0) {
+        vec_append(&recorded_files, inc);
+    }
+}
+
+static Recording* record_begin(IncludeFile* inc) {
+    if (recorded_tokens.at == nullptr) {
+        recorded_tokens = vec_new(Token, 1024);
+        recorded_atoms = vec_new(Atom, 1024);
+        recorded_payloads = vec_new(TokenPayload, 128);
+        recorded_bytes = vec_new(char, 256);
+        recorded_undefs = vec_new(Atom, 256);
+        recorded_files = vecptr_new(IncludeFile, 16);
+    }
+    Recording* r = &recordings[recordings_len++];
+    *r = (Recording){
+        .inc = inc,
+        .cacheable = true,
+        .tokens_start = recorded_tokens.len,
+        .payloads_start = recorded_payloads.len,
+        .bytes_start = recorded_bytes.len,
+        .undefs_start = recorded_undefs.len,
+        .files_start = recorded_files.len,
+        .bindings_start = bindings.len,
+    };
+    return r;
+}
+
+static string include_cache_path(IncludeFile* inc) {
+    return strprintf("%s/%016llx.cyc", include_cache_dir, (unsigned long long)hash_bytes(inc->file.path));
+}
+
+typedef struct {
+    Recording* r;
+    bool ok; // false once something turns up that can't be saved
+    VecPtr(IncludeFile) sources;
+    usize last_source;
+    AtomMap name_indices; // atom -> index + 1
+    Vec(Atom) names;
+    Vec(CacheToken) tokens;
+    Vec(CacheToken) runs;
+    Vec(CacheDef) defs;
+    Vec(u32) params;
+    Vec(u32) undefs;
+} CacheWriter;
+
+static u32 cache_name(CacheWriter* w, Atom a) {
+    usize index = (usize)atommap_get(&w->name_indices, a);
+    if (index == (usize)ATOMMAP_NOT_FOUND) {
+        vec_append(&w->names, a);
+        index = w->names.len;
+        atommap_put(&w->name_indices, a, (void*)index);
+    }
+    return index - 1;
+}
+
+static CacheSpan cache_span(CacheWriter* w, char* raw, usize len) {
+    if (raw == nullptr) {
+        return (CacheSpan){.source = CACHE_NONE};
+    }
+    for_n(n, 0, w->sources.len) {
+        // usually the same file as last time
+        usize i = (w->last_source + n) % w->sources.len;
+        string src = w->sources.at[i]->file.src;
+        if (src.raw <= raw && raw + len <= src.raw + src.len) {
+            w->last_source = i;
+            return (CacheSpan){.source = i, .offset = raw - src.raw, .len = len};
+        }
+    }
+    // probably a string made by STRCAT
+    w->ok = false;
+    return (CacheSpan){.source = CACHE_NONE};
+}
+
+static CacheToken cache_token(CacheWriter* w, Token t, Atom atom) {
+    CacheSpan span = cache_span(w, tok_raw(t), 0);
+    return (CacheToken){
+        .kind = t.kind,
+        .generated = t.generated,
+        .len = t.len,
+        .name = atom != ATOM_NONE ? cache_name(w, atom) : CACHE_NONE,
+        .source = span.source,
+        .offset = span.offset,
+    };
+}
+
+// save a raw token run from the preproc token pool
+static u32 cache_run(CacheWriter* w, u32 tokens_index) {
+    u32 run = w->runs.len;
+    for (u32 i = tokens_index;; ++i) {
+        Token t = preproc_token_pool.at[i];
+        vec_append(&w->runs, cache_token(w, t, ATOM_NONE));
+        if (t.kind == TOK_EOF) {
+            break;
+        }
+        if (t.len == TOK_LEN_EXTENDED) {
+            ++i;
+            vec_append(&w->runs, ((CacheToken){.source = CACHE_NONE, .offset = preproc_token_pool.at[i].raw}));
+        }
+    }
+    return run;
+}
+
+static void cache_def(CacheWriter* w, PreprocBinding* b) {
+    PreprocVal v = b->val;
+    CacheDef def = {
+        .name = cache_name(w, b->key),
+        .kind = v.kind,
+        .raw = cache_span(w, (char*)(i64)v.raw, v.len),
+        .source = cache_span(w, from_compact(v.source).raw, v.source.len),
+        .text = {.source = CACHE_NONE},
+        .run = CACHE_NONE,
+    };
+    switch (v.kind) {
+    case PPVAL_INTEGER:
+        def.integer = v.integer;
+        break;
+    case PPVAL_STRING:
+        def.text = cache_span(w, from_compact(v.string).raw, v.string.len);
+        break;
+    case PPVAL_COMPLEX_STRING:
+        def.text = cache_span(w, from_compact(v.complex.text).raw, v.complex.text.len);
+        def.run = cache_run(w, v.complex.tokens_index);
+        break;
+    case PPVAL_MACRO:
+        ;
+        PreprocVal body = preproc_val_pool.at[v.macro.body_index];
+        def.text = cache_span(w, from_compact(body.complex.text).raw, body.complex.text.len);
+        def.run = cache_run(w, body.complex.tokens_index);
+        def.params = w->params.len;
+        def.params_len = v.macro.params_len;
+        for_n(i, 0, v.macro.params_len) {
+            vec_append(&w->params, cache_name(w, macro_param_pool.at[v.macro.params_index + i]));
+        }
+        break;
+    default:
+        UNREACHABLE;
+    }
+    vec_append(&w->defs, def);
+}
+
+// append an array to the file, 8-byte aligned
+static CacheArray cache_put(Vec(char)* out, const void* items, usize len, usize stride) {
+    while (out->len % 8 != 0) {
+        vec_append(out, 0);
+    }
+    CacheArray array = {.offset = out->len, .len = len};
+    vec_reserve(out, len * stride);
+    memcpy(&out->at[out->len], items, len * stride);
+    out->len += len * stride;
+    return array;
+}
+
+static void include_cache_save(Recording* r) {
+    CacheWriter w = {
+        .r = r,
+        .ok = true,
+        .sources = vecptr_new(IncludeFile, 8),
+        .names = vec_new(Atom, 256),
+        .tokens = vec_new(CacheToken, recorded_tokens.len - r->tokens_start + 16),
+        .runs = vec_new(CacheToken, 64),
+        .defs = vec_new(CacheDef, 16),
+        .params = vec_new(u32, 16),
+        .undefs = vec_new(u32, 64),
+    };
+    atommap_init(&w.name_indices, 256);
+
+    // the file itself, then everything it included
+    vec_append(&w.sources, r->inc);
+    for_n(i, r->files_start, recorded_files.len) {
+        bool seen = false;
+        for_n(j, 0, w.sources.len) {
+            seen |= w.sources.at[j] == recorded_files.at[i];
+        }
+        if (!seen) {
+            vec_append(&w.sources, recorded_files.at[i]);
+        }
+    }
+
+    AtomMap undef_seen;
+    atommap_init(&undef_seen, 256);
+    for_n(i, r->undefs_start, recorded_undefs.len) {
+        Atom a = recorded_undefs.at[i];
+        if (atommap_get(&undef_seen, a) == ATOMMAP_NOT_FOUND) {
+            atommap_put(&undef_seen, a, nullptr);
+            vec_append(&w.undefs, cache_name(&w, a));
+        }
+    }
+    atommap_destroy(&undef_seen);
+
+    for_n(i, r->tokens_start, recorded_tokens.len) {
+        vec_append(&w.tokens, cache_token(&w, recorded_tokens.at[i], recorded_atoms.at[i]));
+    }
+
+    // only the definitions it leaves behind in the includer's scope
+    for_n(i, r->bindings_start, bindings.len) {
+        if (!bindings.at[i].removed) {
+            cache_def(&w, &bindings.at[i]);
+        }
+    }
+
+    u32 guard = r->inc->guard != ATOM_NONE ? cache_name(&w, r->inc->guard) : CACHE_NONE;
+
+    if (w.ok) {
+        Vec(char) out = vec_new(char, 4096);
+        Vec(char) strings = vec_new(char, 1024);
+
+        Vec(CacheSource) sources = vec_new(CacheSource, w.sources.len + 8);
+        for_n(i, 0, w.sources.len) {
+            IncludeFile* inc = w.sources.at[i];
+            CacheSource source = {
+                .id = inc->handle->id,
+                .last_modified = inc->handle->last_modified,
+                .size = inc->file.src.len,
+                .hash = include_file_hash(inc),
+                .path = {.offset = strings.len, .len = inc->file.path.len},
+            };
+            vec_reserve(&strings, inc->file.path.len);
+            memcpy(&strings.at[strings.len], inc->file.path.raw, inc->file.path.len);
+            strings.len += inc->file.path.len;
+            vec_append(&sources, source);
+        }
+        Vec(CacheArray) names = vec_new(CacheArray, w.names.len + 8);
+        for_n(i, 0, w.names.len) {
+            string name = atom_str(w.names.at[i]);
+            vec_append(&names, ((CacheArray){.offset = strings.len, .len = name.len}));
+            vec_reserve(&strings, name.len);
+            memcpy(&strings.at[strings.len], name.raw, name.len);
+            strings.len += name.len;
+        }
+
+        Vec(TokenPayload) cached_payloads = vec_new(TokenPayload, recorded_payloads.len - r->payloads_start + 8);
+        for_n(i, r->payloads_start, recorded_payloads.len) {
+            TokenPayload payload = recorded_payloads.at[i];
+            Token t = recorded_tokens.at[payload.token_index];
+            payload.token_index -= r->tokens_start;
+            if (t.kind == TOK_STRING && payload.string.len != payload.span_len) {
+                payload.string.offset -= r->bytes_start;
+            }
+            vec_append(&cached_payloads, payload);
+        }
+
+        CacheHeader header = {
+            .magic = CACHE_MAGIC,
+            .version = CACHE_VERSION,
+            .guard = guard,
+        };
+        vec_reserve(&out, sizeof(header));
+        out.len = sizeof(header);
+        header.sources  = cache_put(&out, sources.at, sources.len, sizeof(CacheSource));
+        header.names    = cache_put(&out, names.at, names.len, sizeof(CacheArray));
+        header.undefs   = cache_put(&out, w.undefs.at, w.undefs.len, sizeof(u32));
+        header.tokens   = cache_put(&out, w.tokens.at, w.tokens.len, sizeof(CacheToken));
+        header.payloads = cache_put(&out, cached_payloads.at, cached_payloads.len, sizeof(TokenPayload));
+        header.bytes    = cache_put(&out, &recorded_bytes.at[r->bytes_start], recorded_bytes.len - r->bytes_start, 1);
+        header.defs     = cache_put(&out, w.defs.at, w.defs.len, sizeof(CacheDef));
+        header.runs     = cache_put(&out, w.runs.at, w.runs.len, sizeof(CacheToken));
+        header.params   = cache_put(&out, w.params.at, w.params.len, sizeof(u32));
+        header.strings  = cache_put(&out, strings.at, strings.len, 1);
+        memcpy(out.at, &header, sizeof(header));
+
+        // write it next to where it goes and then move it in,
+        // so nobody ever maps a half-written cache file
+        string path = include_cache_path(r->inc);
+        string temp = strprintf(str_fmt".tmp", str_arg(path));
+        FsFile* f = fs_open(temp.raw, true, true);
+        if (f != nullptr) {
+            bool written = fs_write(f, out.at, out.len) == out.len;
+            fs_destroy(f);
+            if (!written || !fs_rename(temp.raw, path.raw)) {
+                remove(temp.raw);
+            }
+        }
+        string_free(temp);
+        string_free(path);
+
+        vec_destroy(&out);
+        vec_destroy(&strings);
+        vec_destroy(&sources);
+        vec_destroy(&names);
+        vec_destroy(&cached_payloads);
+    }
+
+    vec_destroy(&w.sources);
+    atommap_destroy(&w.name_indices);
+    vec_destroy(&w.names);
+    vec_destroy(&w.tokens);
+    vec_destroy(&w.runs);
+    vec_destroy(&w.defs);
+    vec_destroy(&w.params);
+    vec_destroy(&w.undefs);
+}
+
+static void record_end(Recording* r) {
+    if (r->cacheable) {
+        include_cache_save(r);
+    }
+    --recordings_len;
+    if (recordings_len == 0) {
+        vec_clear(&recorded_tokens);
+        vec_clear(&recorded_atoms);
+        vec_clear(&recorded_payloads);
+        vec_clear(&recorded_bytes);
+        vec_clear(&recorded_undefs);
+        vec_clear(&recorded_files);
+    }
+}
+
+// ----- loading
+
+static bool cache_array_fits(IncludeCacheFile* c, CacheArray array, usize stride) {
+    return array.offset % 8 == 0
+        && array.offset <= c->data.len
+        && (u64)array.len * stride <= c->data.len - array.offset;
+}
+
+static bool cache_range_fits(CacheArray range, usize len) {
+    return range.offset <= len && range.len <= len - range.offset;
+}
+
+static bool cache_span_fits(IncludeCacheFile* c, CacheSpan span) {
+    if (span.source == CACHE_NONE) {
+        return true;
+    }
+    return span.source < c->header->sources.len
+        && cache_range_fits((CacheArray){span.offset, span.len}, c->sources[span.source]->file.src.len);
+}
+
+static bool cache_token_fits(IncludeCacheFile* c, CacheToken t) {
+    return t.kind < _TOK_COUNT
+        && (t.name == CACHE_NONE || t.name < c->header->names.len)
+        && cache_span_fits(c, (CacheSpan){t.source, t.offset, 0});
+}
+
+static bool cache_run_fits(IncludeCacheFile* c, u32 run) {
+    CacheToken* runs = cache_array(c, runs, CacheToken);
+    for (u32 i = run; i < c->header->runs.len; ++i) {
+        CacheToken t = runs[i];
+        if (!cache_token_fits(c, t)) {
+            return false;
+        }
+        if (t.kind == TOK_EOF) {
+            return true;
+        }
+        if (t.len == TOK_LEN_EXTENDED) {
+            ++i;
+            if (i >= c->header->runs.len || !cache_span_fits(c, (CacheSpan){t.source, t.offset, runs[i].offset})) {
+                return false;
+            }
+        }
+    }
+    return false;
+}
+
+// check every index and offset once, so using the cache doesn't have to
+static bool cache_fits(IncludeCacheFile* c) {
+    CacheHeader* h = c->header;
+
+    CacheArray* names = cache_array(c, names, CacheArray);
+    for_n(i, 0, h->names.len) {
+        if (!cache_range_fits(names[i], h->strings.len)) return false;
+    }
+    if (h->guard != CACHE_NONE && h->guard >= h->names.len) {
+        return false;
+    }
+    u32* undefs = cache_array(c, undefs, u32);
+    for_n(i, 0, h->undefs.len) {
+        if (undefs[i] >= h->names.len) return false;
+    }
+    CacheToken* tokens = cache_array(c, tokens, CacheToken);
+    for_n(i, 0, h->tokens.len) {
+        if (!cache_token_fits(c, tokens[i])) return false;
+    }
+    TokenPayload* payloads = cache_array(c, payloads, TokenPayload);
+    for_n(i, 0, h->payloads.len) {
+        TokenPayload payload = payloads[i];
+        if (payload.token_index >= h->tokens.len || (i != 0 && payload.token_index <= payloads[i - 1].token_index)) {
+            return false;
+        }
+        CacheToken t = tokens[payload.token_index];
+        if (!cache_span_fits(c, (CacheSpan){t.source, t.offset, payload.span_len})) {
+            return false;
+        }
+        if (t.kind == TOK_STRING && payload.string.len != payload.span_len
+            && !cache_range_fits((CacheArray){payload.string.offset, payload.string.len}, h->bytes.len)
+        ) {
+            return false;
+        }
+    }
+    u32* params = cache_array(c, params, u32);
+    for_n(i, 0, h->params.len) {
+        if (params[i] >= h->names.len) return false;
+    }
+    CacheDef* defs = cache_array(c, defs, CacheDef);
+    for_n(i, 0, h->defs.len) {
+        CacheDef def = defs[i];
+        if (def.name >= h->names.len
+            || !cache_span_fits(c, def.raw)
+            || !cache_span_fits(c, def.source)
+            || !cache_span_fits(c, def.text)
+        ) {
+            return false;
+        }
+        switch (def.kind) {
+        case PPVAL_INTEGER:
+        case PPVAL_STRING:
+            break;
+        case PPVAL_MACRO:
+            if (!cache_range_fits((CacheArray){def.params, def.params_len}, h->params.len) || def.params_len > MAX_MACRO_ARGS) {
+                return false;
+            }
+            // fallthrough
+        case PPVAL_COMPLEX_STRING:
+            if (def.text.source == CACHE_NONE || !cache_run_fits(c, def.run)) {
+                return false;
+            }
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool cache_source_unchanged(IncludeFile* inc, CacheSource* source) {
+    if (inc->file.src.len != source->size) {
+        return false;
+    }
+    if (inc->handle->id == source->id && inc->handle->last_modified == source->last_modified) {
+        return true;
+    }
+    // touched, but maybe not changed
+    return include_file_hash(inc) == source->hash;
+}
+
+static IncludeCacheFile* include_cache_load(IncludeFile* inc) {
+    if (include_cache_dir == nullptr) {
+        return nullptr;
+    }
+    string path = include_cache_path(inc);
+    FsFile* handle = fs_open(path.raw, false, false);
+    string_free(path);
+    if (handle == nullptr) {
+        return nullptr;
+    }
+
+    IncludeCacheFile* c = malloc(sizeof(IncludeCacheFile));
+    *c = (IncludeCacheFile){
+        .handle = handle,
+        .data = fs_map_entire(handle),
+    };
+    c->header = (CacheHeader*)c->data.raw;
+    CacheHeader* h = c->header;
+
+    if (c->data.len < sizeof(CacheHeader)
+        || h->magic != CACHE_MAGIC
+        || h->version != CACHE_VERSION
+        || !cache_array_fits(c, h->sources, sizeof(CacheSource))
+        || !cache_array_fits(c, h->names, sizeof(CacheArray))
+        || !cache_array_fits(c, h->undefs, sizeof(u32))
+        || !cache_array_fits(c, h->tokens, sizeof(CacheToken))
+        || !cache_array_fits(c, h->payloads, sizeof(TokenPayload))
+        || !cache_array_fits(c, h->bytes, 1)
+        || !cache_array_fits(c, h->defs, sizeof(CacheDef))
+        || !cache_array_fits(c, h->runs, sizeof(CacheToken))
+        || !cache_array_fits(c, h->params, sizeof(u32))
+        || !cache_array_fits(c, h->strings, 1)
+        || h->sources.len == 0
+    ) {
+        goto unusable;
+    }
+
+    // every file that went into it has to be the same as it was
+    c->sources = malloc(sizeof(IncludeFile*) * h->sources.len);
+    CacheSource* sources = cache_array(c, sources, CacheSource);
+    char* strings = cache_array(c, strings, char);
+    for_n(i, 0, h->sources.len) {
+        IncludeFile* source = inc;
+        if (i != 0) {
+            CacheArray path = sources[i].path;
+            if (!cache_range_fits(path, h->strings.len) || path.len >= PATH_MAX) {
+                goto unusable;
+            }
+            FsPath real;
+            real.len = path.len;
+            memcpy(real.raw, &strings[path.offset], path.len);
+            real.raw[path.len] = '\0';
+            source = include_file_open(&real);
+        }
+        if (source == nullptr || !cache_source_unchanged(source, &sources[i])) {
+            goto unusable;
+        }
+        c->sources[i] = source;
+    }
+
+    if (!cache_fits(c)) {
+        goto unusable;
+    }
+
+    CacheArray* names = cache_array(c, names, CacheArray);
+    c->names = malloc(sizeof(Atom) * h->names.len);
+    for_n(i, 0, h->names.len) {
+        c->names[i] = atom_intern((string){.raw = &strings[names[i].offset], .len = names[i].len});
+    }
+    inc->guard = h->guard != CACHE_NONE ? c->names[h->guard] : ATOM_NONE;
+    return c;
+
+unusable:
+    fs_unmap_entire(handle, c->data);
+    fs_destroy(handle);
+    free(c->sources);
+    free(c);
+    return nullptr;
+}
+
+static char* cache_ptr(IncludeCacheFile* c, u32 source, u32 offset) {
+    if (source == CACHE_NONE) {
+        return nullptr;
+    }
+    return c->sources[source]->file.src.raw + offset;
+}
+
+static CompactString cache_str(IncludeCacheFile* c, CacheSpan span) {
+    string s = {.len = span.len, .raw = cache_ptr(c, span.source, span.offset)};
+    return to_compact(s);
+}
+
+static Token cache_token_to_token(IncludeCacheFile* c, CacheToken ct) {
+    Token t = {};
+    t.kind = ct.kind;
+    t.generated = ct.generated;
+    t.len = ct.len;
+    t.raw = (i64)cache_ptr(c, ct.source, ct.offset);
+    return t;
+}
+
+// put a raw token run into the preproc token pool
+static u32 cache_replay_run(IncludeCacheFile* c, u32 run) {
+    u32 tokens_index = preproc_token_pool.len;
+    CacheToken* runs = cache_array(c, runs, CacheToken);
+    for (u32 i = run;; ++i) {
+        Token t = cache_token_to_token(c, runs[i]);
+        vec_append(&preproc_token_pool, t);
+        if (t.kind == TOK_EOF) {
+            break;
+        }
+        if (t.len == TOK_LEN_EXTENDED) {
+            Token len_slot = {};
+            len_slot.raw = runs[++i].offset;
+            vec_append(&preproc_token_pool, len_slot);
+        }
+    }
+    return tokens_index;
+}
+
+// paste a file's output from its on-disk cache.
+// returns false without doing anything if it doesn't apply here.
+static bool include_cache_replay(IncludeFile* inc, Vec(Token)* tokens, PreprocScope* scope) {
+    IncludeCacheFile* c = inc->cached;
+    CacheHeader* h = c->header;
+
+    u32* undefs = cache_array(c, undefs, u32);
+    for_n(i, 0, h->undefs.len) {
+        if (find_binding(c->names[undefs[i]], scope)) {
+            return false;
+        }
+    }
+
+    for_n(i, 1, h->sources.len) {
+        include_file_used(c->sources[i]);
+    }
+
+    CacheToken* cached_tokens = cache_array(c, tokens, CacheToken);
+    TokenPayload* cached_payloads = cache_array(c, payloads, TokenPayload);
+    char* bytes = cache_array(c, bytes, char);
+    u32 next_payload = 0;
+    for_n(i, 0, h->tokens.len) {
+        CacheToken ct = cached_tokens[i];
+        Token t = cache_token_to_token(c, ct);
+        if (next_payload < h->payloads.len && cached_payloads[next_payload].token_index == i) {
+            TokenPayload cached = cached_payloads[next_payload++];
+            TokenPayload* payload = new_payload(tokens, cached.span_len);
+            cached.token_index = payload->token_index;
+            if (t.kind == TOK_STRING && cached.string.len != cached.span_len) {
+                vec_reserve(&payload_bytes, cached.string.len);
+                memcpy(&payload_bytes.at[payload_bytes.len], &bytes[cached.string.offset], cached.string.len);
+                cached.string.offset = payload_bytes.len;
+                payload_bytes.len += cached.string.len;
+            }
+            *payload = cached;
+        }
+        push_token_atom(tokens, t, ct.name != CACHE_NONE ? c->names[ct.name] : ATOM_NONE);
+    }
+
+    CacheDef* defs = cache_array(c, defs, CacheDef);
+    u32* params = cache_array(c, params, u32);
+    for_n(i, 0, h->defs.len) {
+        CacheDef def = defs[i];
+        PreprocVal v = {
+            .kind = def.kind,
+            .len = def.raw.len,
+            .raw = (i64)cache_ptr(c, def.raw.source, def.raw.offset),
+            .source = cache_str(c, def.source),
+        };
+        switch (def.kind) {
+        case PPVAL_INTEGER:
+            v.integer = def.integer;
+            break;
+        case PPVAL_STRING:
+            v.string = cache_str(c, def.text);
+            break;
+        case PPVAL_COMPLEX_STRING:
+            v.complex.text = cache_str(c, def.text);
+            v.complex.tokens_index = cache_replay_run(c, def.run);
+            break;
+        case PPVAL_MACRO:
+            ;
+            PreprocVal body = {
+                .kind = PPVAL_COMPLEX_STRING,
+                .complex = {
+                    .text = cache_str(c, def.text),
+                    .tokens_index = cache_replay_run(c, def.run),
+                },
+            };
+            vec_append(&preproc_val_pool, body);
+            v.macro.body_index = preproc_val_pool.len - 1;
+            v.macro.params_index = macro_param_pool.len;
+            v.macro.params_len = def.params_len;
+            for_n(j, 0, def.params_len) {
+                vec_append(&macro_param_pool, c->names[params[def.params + j]]);
+            }
+            break;
+        }
+        put_replacement_value(c->names[def.name], scope, v);
+    }
+    return true;
+}
+
+// ------------------------- INCLUDE -------------------------
+
+static void preproc_include(Lexer* l, Vec(Token)* tokens, PreprocScope* scope) {
+    Token path_token = lex_next_raw(l);
+    if (path_token.kind != TOK_STRING) {
+        TODO("error: expected file path string");
+    }
+    string path = lex_span(l, path_token);
+
+    IncludeFile* inc = include_file_get(path);
+    if (inc->guard != ATOM_NONE && replacement_exists(inc->guard, scope)) {
+        // it would all get skipped anyway
+        return;
+    }
+
+    ++include_depth;
+    if (include_depth > MAX_INCLUDE_DEPTH) {
+        TODO("error: max include depth reached");
+    }
+
+    include_file_used(inc);
+
+    // the included file shares the includer's scope, so its definitions stay around
+    push_token(tokens, preproc_token(TOK_PREPROC_INCLUDE_PASTE, path));
+
+    bool global = scope->depth == 0;
+    if (!(global && inc->cached && include_cache_replay(inc, tokens, scope))) {
+        Recording* r = nullptr;
+        if (global && include_cache_dir && !inc->cached) {
+            r = record_begin(inc);
+        }
+
+        SrcFile* includer = current_file;
+        current_file = &inc->file;
+        include_file_lex(inc);
+        Lexer inc_lexer = lexer_from_prelexed(inc->file.src, &inc->prelexed, 0);
+        lex_with_preproc(&inc_lexer, tokens, scope);
+        current_file = includer;
+
+        if (r) {
+            record_end(r);
+        }
+    }
+
+    push_token(tokens, preproc_token(TOK_PREPROC_INCLUDE_END, path));
+
+    --include_depth;
+}
+
+static void preproc_if(Lexer* l, Vec(Token)* tokens, PreprocScope* scope) {
+    
+    PreprocVal cond_val = preproc_collect_value(l, scope);
+    if (cond_val.kind != PPVAL_INTEGER) {
+        TODO("#IF condition is not an integer");
+    }
+    bool case_succeeds = cond_val.integer != 0;
+    // if this case suceeds, we include everything inside and then discard everything else
+    if (case_succeeds) {
+        // get the rest of this case
+        Token last = lex_with_preproc(l, tokens, scope);
+
+        // discard everything else until the last #END
+        if (last.kind == TOK_KW_END) {
+            return;
+        }
+        u32 depth = 1;
+        while (last.kind != TOK_KW_END || depth != 0) {
+            last = lex_next_raw(l);
+            if (last.kind == TOK_EOF) {
+                TODO("unexpected EOF");
+                return;
+            }
+            if (last.kind != TOK_HASH) {
+                continue;
+            }
+            last = lex_next_raw(l);
             switch (last.kind) {
             case TOK_KW_IF:
                 depth++;
@@ -816,13 +2393,15 @@ static Token preproc_dispatch(Lexer* l, Vec(Token)* tokens, PreprocScope* scope)
         return t;
     }
     
-    string span = tok_span(t);
+    string span = lex_span(l, t);
     if (string_eq(span, constr("DEFINE"))) {
         preproc_define(l, scope);
     } else if (string_eq(span, constr("UNDEFINE"))) {
         preproc_undefine(l, scope);
     } else if (string_eq(span, constr("MACRO"))) {
         preproc_macro(l, scope);
+    } else if (string_eq(span, constr("INCLUDE"))) {
+        preproc_include(l, tokens, scope);
     } else {
         // TODO("error: unrecognized directive");
     }
@@ -844,41 +2423,37 @@ static void emit_preproc_val(PreprocVal val, Vec(Token)* tokens, PreprocScope* s
     switch (val.kind) {
     case PPVAL_INTEGER:
         if (val.raw != 0) {
-            Token t;
+            // the span is just for diagnostics, the value goes in the payload
+            Token t = {};
             t.kind = TOK_INTEGER;
             t.len = val.len;
             t.raw = val.raw;
-            vec_append(tokens, t);
+            new_payload(tokens, val.len)->integer = val.integer;
+            push_token(tokens, t);
         } else {
             UNREACHABLE;
         }
         break;
     case PPVAL_COMPLEX_STRING:
         ;
-        Lexer local_lexer = lexer_from_string(from_compact(val.string));
-        // PreprocScope _local_scope_ = {};
-        // PreprocScope* local_scope = &_local_scope_;
+        Lexer local_lexer = lexer_from_prelexed(from_compact(val.complex.text), &preproc_token_pool.at, val.complex.tokens_index);
         PreprocScope* local_scope = &local_scopes[emit_depth - 1];
-        local_scope->parent = scope;
+        PreprocScope* parent = scope;
         if (val.is_macro_arg) { // prevent name conflicts/infinite recursion bullshit
-            local_scope->parent = scope->parent;
-        }
-        if (local_scope->map.vals) {
-            strmap_reset(&local_scope->map);
-        } else {
-            strmap_init(&local_scope->map, 4);
+            parent = scope->parent;
         }
+        enter_preproc_scope(local_scope, parent, emit_depth);
 
         lex_with_preproc(&local_lexer, tokens, local_scope);
-        // strmap_destroy(&local_scope->map);
+        exit_preproc_scope(local_scope);
         break;
     case PPVAL_STRING:
         ;
-        Token t;
+        Token t = {};
         t.kind = TOK_STRING;
-        t.len = val.string.len;
+        t.len = val.string.len < TOK_LEN_EXTENDED ? val.string.len : TOK_LEN_EXTENDED;
         t.raw = val.string.raw;
-        vec_append(tokens, t);
+        emit_token(tokens, t, from_compact(val.string), ATOM_NONE);
         break;
     default:
         UNREACHABLE;
@@ -886,11 +2461,11 @@ static void emit_preproc_val(PreprocVal val, Vec(Token)* tokens, PreprocScope* s
     --emit_depth;
 }
 
-static CompactString collect_macro_arg(Lexer* l, PreprocScope* scope) {
+static PreprocVal collect_macro_arg(Lexer* l, PreprocScope* scope) {
     string span;
     span.raw = &l->src.raw[l->cursor];
     span.len = l->cursor;
-    usize cap = 0;
+    u32 tokens_index = preproc_token_pool.len;
 
     usize bracket_depth = 0;
     for (Token t = lex_next_raw(l);; t = lex_next_raw(l)) {
@@ -899,26 +2474,21 @@ static CompactString collect_macro_arg(Lexer* l, PreprocScope* scope) {
             break;
         }
 
-
         switch (t.kind) {
-        // case TOK_IDENTIFIER:
-            // if (!replacement_exists(tok_span(t), scope)) {
-            //     break;
-            // }
-            // // we have to expand this. break out the backing buffer if necessary
-            // if (cap == 0) {
-
-            // }
         case TOK_OPEN_PAREN: ++bracket_depth; break;
         case TOK_CLOSE_PAREN: --bracket_depth; break;
+        case TOK_EOF: TODO("error: expected )");
         }
+        prelex_append(&preproc_token_pool, l, t);
     }
 
     span.len = l->cursor - span.len - 1;
     if (span.len > COMPACT_STR_MAX_LEN) {
         TODO("error: argument too long");
     }
-    return to_compact(span);
+    PreprocVal arg = preproc_end_token_run(span, tokens_index);
+    arg.is_macro_arg = true;
+    return arg;
 }
 
 static void collect_macro_args_and_emit(Lexer* l, PreprocVal macro, Vec(Token)* tokens, PreprocScope* scope) {
@@ -928,15 +2498,8 @@ static void collect_macro_args_and_emit(Lexer* l, PreprocVal macro, Vec(Token)*
     }
     assert(macro.kind == PPVAL_MACRO);
 
-    // PreprocScope _local_scope_ = {};
-    // PreprocScope* local_scope = &_local_scope_;
     PreprocScope* local_scope = &local_scopes[emit_depth - 1];
-    local_scope->parent = scope;
-    if (local_scope->map.vals) {
-        strmap_reset(&local_scope->map);
-    } else {
-        strmap_init(&local_scope->map, 4);
-    }
+    enter_preproc_scope(local_scope, scope, emit_depth);
 
     // collect args as complex strings, define them in the new scope
 
@@ -946,6 +2509,7 @@ static void collect_macro_args_and_emit(Lexer* l, PreprocVal macro, Vec(Token)*
     }
 
     usize saved_ppv_len = preproc_val_pool.len;
+    usize saved_token_pool_len = preproc_token_pool.len;
 
     if (macro.macro.params_len == 0) {
         Token t = lex_next_raw(l);
@@ -956,39 +2520,38 @@ static void collect_macro_args_and_emit(Lexer* l, PreprocVal macro, Vec(Token)*
         // consume arg list
         usize arg_len = 0;
         while (l->src.raw[l->cursor - 1] != ')') {
-            CompactString arg_span = collect_macro_arg(l, scope);
-            PreprocVal arg = {
-                .kind = PPVAL_COMPLEX_STRING,
-                .is_macro_arg = true,
-                .string = arg_span,
-            };
+            PreprocVal arg = collect_macro_arg(l, scope);
 
             if (arg_len >= macro.macro.params_len) {
                 TODO("error: too many parameters, expected %u", macro.macro.params_len);
             }
-            string param_name = tok_span(macro_arg_pool.at[macro.macro.params_index + arg_len]);
+            Atom param_name = macro_param_pool.at[macro.macro.params_index + arg_len];
             put_replacement_value(param_name, local_scope, arg);
             ++arg_len;
         }
     }
 
     PreprocVal body = preproc_val_pool.at[macro.macro.body_index];
-    Lexer local_lexer = lexer_from_string(from_compact(body.string));
+    Lexer local_lexer = lexer_from_prelexed(from_compact(body.complex.text), &preproc_token_pool.at, body.complex.tokens_index);
     lex_with_preproc(&local_lexer, tokens, local_scope);
 
-    strmap_destroy(&local_scope->map);
-    preproc_val_pool.len = saved_ppv_len; // allow reuse of pool space
+    exit_preproc_scope(local_scope);
+    // allow reuse of pool space
+    preproc_val_pool.len = saved_ppv_len;
+    preproc_token_pool.len = saved_token_pool_len;
     --emit_depth;
 }
 
 // ------------------------- LEX THAT FILE DAMMIT ------------------------- 
 
+// marker spans are only used for diagnostics, so they are cut short
+// instead of getting a payload.
 static Token preproc_token(u8 kind, string span) {
     Token t;
     t.generated = true;
     t.kind = kind;
     t.raw = (i64)span.raw;
-    t.len = span.len;
+    t.len = min(span.len, TOK_LEN_EXTENDED - 1);
     return t;
 }
 
@@ -1007,29 +2570,32 @@ static Token lex_with_preproc(Lexer* l, Vec(Token)* tokens, PreprocScope* scope)
         switch (t.kind) {
         case TOK_IDENTIFIER:
             ;
-            string span = tok_span(t);
-            if (replacement_exists(span, scope)) {
-                PreprocVal val = get_replacement_value(span, scope);
+            string span = lex_span(l, t);
+            Atom atom = atom_intern(span);
+            PreprocBinding* binding = find_binding(atom, scope);
+            if (binding) {
+                PreprocVal val = binding->val;
                 if (val.kind == PPVAL_MACRO) {
                     // string from_span;
                     // from_span.len = val.len;
                     // from_span.raw = (char*)(i64)val.raw;
-                    vec_append(tokens, preproc_token(TOK_PREPROC_MACRO_PASTE, from_compact(val.source)));
+                    push_token(tokens, preproc_token(TOK_PREPROC_MACRO_PASTE, from_compact(val.source)));
                     collect_macro_args_and_emit(l, val, tokens, scope);
                     span.len = (usize)l->cursor - (usize)span.raw + (usize)l->src.raw;
-                    vec_append(tokens, preproc_token(TOK_PREPROC_PASTE_END, span));
+                    push_token(tokens, preproc_token(TOK_PREPROC_PASTE_END, span));
                 } else {
                     if (!val.is_macro_arg) {
-                        vec_append(tokens, preproc_token(TOK_PREPROC_DEFINE_PASTE, from_compact(val.source)));
+                        push_token(tokens, preproc_token(TOK_PREPROC_DEFINE_PASTE, from_compact(val.source)));
                     }
                     emit_preproc_val(val, tokens, scope);
                     if (!val.is_macro_arg) {
-                        vec_append(tokens, preproc_token(TOK_PREPROC_PASTE_END, span));
+                        push_token(tokens, preproc_token(TOK_PREPROC_PASTE_END, span));
                     }
                 }
                 continue;
             }
-            break;
+            emit_token(tokens, t, span, atom);
+            continue;
         case TOK_HASH:
             ;
             Token t = preproc_dispatch(l, tokens, scope);
@@ -1045,66 +2611,557 @@ static Token lex_with_preproc(Lexer* l, Vec(Token)* tokens, PreprocScope* scope)
             }
             continue;
         }
-        vec_append(tokens, t);
+        emit_token(tokens, t, lex_span(l, t), ATOM_NONE);
     }
     return t;
 }
 
-Parser lex_entrypoint(SrcFile* f) {
-    // init keyword perfect hash table
-    for (usize i = _TOK_KEYWORDS_BEGIN + 1; i < _TOK_KEYWORDS_END; ++i) {
-        const char* keyword = token_kind[i];
-        u8 hash = hashfunc(keyword, strlen(keyword));
-        if (keyword_table[hash]) {
-            TODO("keyword table hash collision");
-        }
-        keyword_table[hash] = keyword;
-        keyword_len_table[hash] = strlen(keyword);
-        keyword_code_table[hash] = i;
-    }
-
+// lex an entire file into tokens, ending with TOK_EOF.
+// in streaming mode this runs on the lexer thread.
+static void lex_file(SrcFile* f, Vec(Token)* tokens) {
     // init macro info arena
-    macro_arg_pool = vec_new(Token, 128);
+    macro_param_pool = vec_new(Atom, 128);
     preproc_val_pool = vec_new(PreprocVal, 128);
+    preproc_token_pool = vec_new(Token, 1024);
+
+    payloads = vec_new(TokenPayload, 128);
+    payload_bytes = vec_new(char, 256);
+    token_atoms = vec_new(Atom, 512);
+    newline_bits = vec_new(u64, 16);
+    newline_pending = false;
+    expansions = vec_new(Expansion, 64);
+    open_expansions_len = 0;
+    tokens_flushed = 0;
+    expansions_flushed = 0;
+    lexed_sources = vecptr_new(SrcFile, 16);
+    current_file = f;
     
-    Vec(Token) tokens = vec_new(Token, 512);
-    Lexer l = lexer_from_string(f->src);
-    strmap_init(&global_scope.map, 64);
+    // the streaming lexer lexes straight from the text so it never holds the whole file's tokens
+    Token* prelexed = stream ? nullptr : lex_prelex(f->src);
+    Lexer l = lexer_from_prelexed(f->src, prelexed ? &prelexed : nullptr, 0);
+    bindings = vec_new(PreprocBinding, 64);
+    innermost_bindings = vec_new(u32, 256);
+    if (defined_names.at == nullptr) {
+        defined_names = vec_new(u64, 16);
+    }
+    vec_clear(&defined_names);
+    enter_preproc_scope(&global_scope, nullptr, 0);
 
-    lex_with_preproc(&l, &tokens, &global_scope);
+    lex_with_preproc(&l, tokens, &global_scope);
 
-    vec_append(&tokens, eof_token(&l));
+    push_token(tokens, eof_token(&l));
 
-    strmap_destroy(&global_scope.map);
+    vec_destroy(&innermost_bindings);
+    vec_destroy(&bindings);
     vec_destroy(&preproc_val_pool);
-    vec_destroy(&macro_arg_pool);
-
-    vec_shrink(&tokens);
+    vec_destroy(&macro_param_pool);
+    vec_destroy(&preproc_token_pool);
+    free(prelexed);
+}
 
+static Parser new_parser(SrcFile* f) {
     Parser ctx = {
-        .tokens = tokens.at,
-        .tokens_len = tokens.len,
         .sources = vecptr_new(SrcFile, 16),
         .cursor = 0,
+        .tokens_mask = UINT32_MAX,
+        .payloads_mask = UINT32_MAX,
+        .payload_bytes_mask = UINT32_MAX,
+        .expansions_mask = UINT32_MAX,
+    };
+    ctx.scopes = (ParseScopes){
+        .bindings = vec_new(ScopeBinding, 256),
+        .innermost = vec_new(u32, 1024),
+        .marks = vec_new(u32, 64),
     };
-    ctx.global_scope = malloc(sizeof(ParseScope));
-    ctx.global_scope->sub = nullptr;
-    ctx.global_scope->super = nullptr;
-    strmap_init(&ctx.global_scope->map, 128);
-    ctx.current_scope = ctx.global_scope;
     
     arena_init(&ctx.arena);
+    arena_init(&ctx.nodes);
+
+    vec_append(&ctx.sources, f);
 
+    return ctx;
+}
 
-    for_n(i, 0, tokens.len) {
-        if (tokens.at[i].kind < _TOK_LEX_IGNORE) {
-            ctx.current = tokens.at[i];
-            ctx.cursor = i;
+// put the parser on the first token it actually cares about
+static void parser_start(Parser* ctx) {
+    for (u32 i = 0;; ++i) {
+        Token t = tok_at(ctx, i);
+        if (t.kind < _TOK_LEX_IGNORE) {
+            ctx->current = t;
+            ctx->cursor = i;
             break;
         }
     }
+}
 
-    vec_append(&ctx.sources, f);
+static void stream_finish();
+
+Parser lex_entrypoint(SrcFile* f) {
+    stream_finish();
+    Vec(Token) tokens = vec_new(Token, 512);
+    lex_file(f, &tokens);
+
+    vec_shrink(&tokens);
+    vec_shrink(&token_atoms);
+    vec_shrink(&newline_bits);
+    vec_shrink(&payloads);
+    vec_shrink(&expansions);
+
+    Parser ctx = new_parser(f);
+    ctx.tokens = tokens.at;
+    ctx.tokens_len = tokens.len;
+    ctx.atoms = token_atoms.at;
+    ctx.newlines = newline_bits.at;
+    ctx.payloads = payloads.at;
+    ctx.payloads_len = payloads.len;
+    ctx.payload_bytes = payload_bytes.at;
+    ctx.expansions = expansions.at;
+    ctx.expansions_len = expansions.len;
+    for_n(i, 0, lexed_sources.len) {
+        vec_append(&ctx.sources, lexed_sources.at[i]);
+    }
+    vec_destroy(&lexed_sources);
+
+    parser_start(&ctx);
+    return ctx;
+}
+
+// ------------------------- RE-LEXING -------------------------
+
+// a unit the compile server keeps around (see RESIDENT UNITS in parse.c) only gets
+// the tokens an edit touched lexed again, straight from the text with nothing else
+// around them. the preprocessor's state is gone once lex_file is done, so that only
+// works for text the preprocessor would have passed through as it is: no directives,
+// and no name that was ever defined, wherever that was.
+
+bool lex_relex(string src, usize from, usize until, Relexed* out) {
+    payloads = vec_new(TokenPayload, 16);
+    payload_bytes = vec_new(char, 64);
+    token_atoms = vec_new(Atom, 64);
+    newline_bits = vec_new(u64, 4);
+    newline_pending = false;
+    tokens_flushed = 0;
+    Vec(Token) tokens = vec_new(Token, 64);
+
+    Lexer l = lexer_from_string(src);
+    seek(&l, from);
+    // the cold lexer has the last word on anything it can't lex
+    l.speculative = true;
+    bool ok = true;
+    while (ok) {
+        Token t = lex_scan_token(&l);
+        if (l.failed || t.kind == TOK_EOF) {
+            ok = false;
+            break;
+        }
+        usize at = tok_raw(t) - src.raw;
+        if (at >= until) {
+            // anything after this lexes just like it did before
+            ok = at == until;
+            break;
+        }
+        string span = lex_span(&l, t);
+        switch (t.kind) {
+        case TOK_HASH:
+            ok = false;
+            break;
+        case TOK_NEWLINE:
+            push_token(&tokens, t);
+            break;
+        case TOK_IDENTIFIER:
+            ;
+            Atom atom = atom_intern(span);
+            if (atom / 64 < defined_names.len && (defined_names.at[atom / 64] >> (atom % 64) & 1)) {
+                ok = false;
+                break;
+            }
+            emit_token(&tokens, t, span, atom);
+            break;
+        default:
+            emit_token(&tokens, t, span, ATOM_NONE);
+            break;
+        }
+    }
+
+    *out = (Relexed){
+        .tokens = tokens.at,
+        .atoms = token_atoms.at,
+        .newlines = newline_bits.at,
+        .tokens_len = tokens.len,
+        .newline_after = newline_pending,
+        .payloads = payloads.at,
+        .payloads_len = payloads.len,
+        .payload_bytes = payload_bytes.at,
+        .payload_bytes_len = payload_bytes.len,
+    };
+    if (!ok) {
+        lex_relexed_free(out);
+    }
+    return ok;
+}
 
+void lex_relexed_free(Relexed* r) {
+    free(r->tokens);
+    free(r->atoms);
+    free(r->newlines);
+    free(r->payloads);
+    free(r->payload_bytes);
+    *r = (Relexed){};
+}
+
+// ------------------------- STREAMING ------------------------- 
+
+VecPtr_typedef(void);
+
+// all of the counters here are logical indices that only ever go up.
+// ring slots are found by masking them.
+//
+// the rings start out at TOKEN_STREAM_CAP and TOKEN_STREAM_BYTES_CAP, which is
+// plenty unless the parser needs more of the input at once than that: a string
+// bigger than the byte ring, or an expansion that's still open around more
+// expansions than fit. a ring only grows when it's full and the parser is waiting
+// on tokens that haven't been published, so ordinary input stays bounded.
+typedef struct TokenStream {
+    Token* tokens;
+    Atom* atoms;
+    u64* newlines;
+    // there's at most one payload per token, so these can't run out before the tokens do
+    TokenPayload* payloads;
+    u32 cap; // of all of the above
+    char* bytes;
+    u32 bytes_cap;
+    // there's at most one expansion starting per token, but open ones can't be reclaimed
+    Expansion* expansions;
+    u32 expansions_cap;
+    // rings that got outgrown. the parser keeps reading the old ones until its next
+    // pull, so they stay around as long as the stream does.
+    VecPtr(void) outgrown;
+
+    mtx_t lock;
+    cnd_t changed;
+    thrd_t thread;
+    SrcFile* file;
+    // the lexer's batch, out here so it's still good after bailing out of lex_file
+    Vec(Token) staged;
+    jmp_buf bail;
+    // included files, copied out of lexed_sources as the tokens from them get published
+    VecPtr(SrcFile) sources;
+
+    // written by the lexer
+    u32 produced;
+    u32 payloads_produced;
+    u32 payloads_tail; // oldest payload that hasn't been reclaimed yet
+    u32 bytes_head;
+    u32 bytes_tail;
+    u32 expansions_produced;
+    u32 expansions_tail;
+    bool done;
+
+    // written by the parser.
+    // its cursor as of its last pull, nothing before released - TOKEN_STREAM_HISTORY
+    // will be looked at again.
+    u32 released;
+    bool parser_waiting;
+    u32 parser_wants;
+    // it isn't going to pull again, see token_stream_cancel
+    bool cancelled;
+} TokenStream;
+
+static u32 stream_window_start(TokenStream* s) {
+    return s->released > TOKEN_STREAM_HISTORY ? s->released - TOKEN_STREAM_HISTORY : 0;
+}
+
+static Expansion* stream_expansion(u32 index) {
+    return &stream->expansions[index & (stream->expansions_cap - 1)];
+}
+
+// drop payloads (and their bytes) for tokens that fell out of the parser's window,
+// and expansions that ended before it.
+// the tokens themselves don't need anything, their slots just get overwritten.
+static void stream_reclaim(TokenStream* s) {
+    u32 window_start = stream_window_start(s);
+    // an open expansion holds up everything after it, since the parser might be inside it.
+    // token_stream_pull skips the same ones, so the parser never looks at a reused slot.
+    while (s->expansions_tail != s->expansions_produced) {
+        u32 end = s->expansions[s->expansions_tail & (s->expansions_cap - 1)].end;
+        if (end == EXPANSION_OPEN || end > window_start) {
+            break;
+        }
+        ++s->expansions_tail;
+    }
+    while (s->payloads_tail != s->payloads_produced) {
+        TokenPayload* payload = &s->payloads[s->payloads_tail & (s->cap - 1)];
+        if (payload->token_index >= window_start) {
+            break;
+        }
+        // the token is behind the window, but its slot can't have been reused yet
+        Token t = s->tokens[payload->token_index & (s->cap - 1)];
+        if (t.kind == TOK_STRING && payload->string.len != payload->span_len) {
+            s->bytes_tail = payload->string.offset + payload->string.len;
+        }
+        ++s->payloads_tail;
+    }
+}
+
+// the parser's gone, so there's nobody to lex for. back to token_stream_main.
+[[noreturn]] static void stream_bail(TokenStream* s) {
+    mtx_unlock(&s->lock);
+    longjmp(s->bail, 1);
+}
+
+// wait for the parser to move along, after reclaiming whatever it's done with.
+// false if it never will, because it wants tokens we haven't published and we want
+// it to free space first. then the ring has to grow instead.
+static bool stream_wait_for_room(TokenStream* s) {
+    if (s->parser_waiting && s->parser_wants >= s->produced) {
+        return false;
+    }
+    cnd_wait(&s->changed, &s->lock);
+    if (s->cancelled) {
+        stream_bail(s);
+    }
+    stream_reclaim(s);
+    return true;
+}
+
+// a ring twice the size with the items from tail to head moved over. caps are
+// powers of two, so an item that didn't wrap around the old ring doesn't in the new one.
+static void* stream_ring_grow(TokenStream* s, void* ring, usize item_size, u32 cap, u32 tail, u32 head) {
+    u8* old = ring;
+    u8* new = malloc(item_size * cap * 2);
+    for (u32 i = tail; i != head; ++i) {
+        memcpy(&new[(i & (cap * 2 - 1)) * item_size], &old[(i & (cap - 1)) * item_size], item_size);
+    }
+    vec_append(&s->outgrown, ring);
+    return new;
+}
+
+static void stream_grow_tokens(TokenStream* s) {
+    u32 cap = s->cap;
+    u32 window_start = stream_window_start(s);
+    u64* newlines = calloc(cap * 2 / 64, sizeof(u64));
+    for (u32 i = window_start; i != s->produced; ++i) {
+        u32 from = i & (cap - 1);
+        u32 to = i & (cap * 2 - 1);
+        newlines[to / 64] |= (s->newlines[from / 64] >> (from % 64) & 1) << (to % 64);
+    }
+    vec_append(&s->outgrown, s->newlines);
+    s->newlines = newlines;
+    s->tokens = stream_ring_grow(s, s->tokens, sizeof(Token), cap, window_start, s->produced);
+    s->atoms = stream_ring_grow(s, s->atoms, sizeof(Atom), cap, window_start, s->produced);
+    s->payloads = stream_ring_grow(s, s->payloads, sizeof(TokenPayload), cap, s->payloads_tail, s->payloads_produced);
+    s->cap = cap * 2;
+}
+
+static void token_stream_flush(Vec(Token)* tokens) {
+    TokenStream* s = stream;
+    mtx_lock(&s->lock);
+    if (s->cancelled) {
+        stream_bail(s);
+    }
+    stream_reclaim(s);
+
+    while (s->produced + tokens->len - stream_window_start(s) > s->cap) {
+        if (!stream_wait_for_room(s)) {
+            stream_grow_tokens(s);
+        }
+    }
+    while (s->expansions_produced + expansions.len - s->expansions_tail > s->expansions_cap) {
+        if (!stream_wait_for_room(s)) {
+            s->expansions = stream_ring_grow(s, s->expansions, sizeof(Expansion), s->expansions_cap,
+                s->expansions_tail, s->expansions_produced);
+            s->expansions_cap *= 2;
+        }
+    }
+
+    for_n(i, 0, payloads.len) {
+        TokenPayload payload = payloads.at[i];
+        Token t = tokens->at[payload.token_index - tokens_flushed];
+        if (t.kind == TOK_STRING && payload.string.len != payload.span_len) {
+            // strings never wrap around the end of the ring
+            u32 offset;
+            while (true) {
+                offset = s->bytes_head;
+                u32 to_end = s->bytes_cap - (offset & (s->bytes_cap - 1));
+                if (payload.string.len > to_end) {
+                    offset += to_end;
+                }
+                if (offset + payload.string.len - s->bytes_tail <= s->bytes_cap) {
+                    break;
+                }
+                // one that's bigger than the whole ring is never going to fit
+                if (payload.string.len > s->bytes_cap || !stream_wait_for_room(s)) {
+                    s->bytes = stream_ring_grow(s, s->bytes, 1, s->bytes_cap, s->bytes_tail, s->bytes_head);
+                    s->bytes_cap *= 2;
+                }
+            }
+            memcpy(&s->bytes[offset & (s->bytes_cap - 1)], 
+                &payload_bytes.at[payload.string.offset], payload.string.len);
+            payload.string.offset = offset;
+            s->bytes_head = offset + payload.string.len;
+        }
+        s->payloads[s->payloads_produced++ & (s->cap - 1)] = payload;
+    }
+    for_n(i, 0, tokens->len) {
+        u32 slot = s->produced++ & (s->cap - 1);
+        u64 newline = (newline_bits.at[i / 64] >> (i % 64)) & 1;
+        s->newlines[slot / 64] = (s->newlines[slot / 64] & ~(1ull << (slot % 64))) | (newline << (slot % 64));
+        s->atoms[slot] = token_atoms.at[i];
+        s->tokens[slot] = tokens->at[i];
+    }
+    for_n(i, 0, expansions.len) {
+        s->expansions[s->expansions_produced++ & (s->expansions_cap - 1)] = expansions.at[i];
+    }
+    for_n(i, s->sources.len, lexed_sources.len) {
+        vec_append(&s->sources, lexed_sources.at[i]);
+    }
+
+    cnd_broadcast(&s->changed);
+    mtx_unlock(&s->lock);
+
+    tokens_flushed += tokens->len;
+    expansions_flushed += expansions.len;
+    vec_clear(tokens);
+    vec_clear(&token_atoms);
+    vec_clear(&newline_bits);
+    vec_clear(&payloads);
+    vec_clear(&payload_bytes);
+    vec_clear(&expansions);
+}
+
+static int token_stream_main(void* arg) {
+    TokenStream* s = arg;
+    s->staged = vec_new(Token, TOKEN_STREAM_BATCH);
+    if (setjmp(s->bail) == 0) {
+        lex_file(s->file, &s->staged);
+        token_stream_flush(&s->staged);
+    } else {
+        // lex_file didn't get to clean up after itself
+        vec_destroy(&innermost_bindings);
+        vec_destroy(&bindings);
+        vec_destroy(&preproc_val_pool);
+        vec_destroy(&macro_param_pool);
+        vec_destroy(&preproc_token_pool);
+    }
+
+    mtx_lock(&s->lock);
+    s->done = true;
+    cnd_broadcast(&s->changed);
+    mtx_unlock(&s->lock);
+
+    vec_destroy(&s->staged);
+    vec_destroy(&token_atoms);
+    vec_destroy(&newline_bits);
+    vec_destroy(&payloads);
+    vec_destroy(&payload_bytes);
+    vec_destroy(&expansions);
+    vec_destroy(&lexed_sources);
+    return 0;
+}
+
+void token_stream_cancel(TokenStream* s) {
+    mtx_lock(&s->lock);
+    s->cancelled = true;
+    cnd_broadcast(&s->changed);
+    mtx_unlock(&s->lock);
+}
+
+// the lexer thread of the last stream might still be cleaning up the lexer's state,
+// which the next file needs. it's done once the parser has gotten to the end,
+// or once it's been cancelled if the parser stopped early.
+static void stream_finish() {
+    if (stream != nullptr) {
+        token_stream_cancel(stream);
+        thrd_join(stream->thread, nullptr);
+        stream = nullptr;
+    }
+}
+
+Parser lex_entrypoint_streaming(SrcFile* f) {
+    stream_finish();
+    TokenStream* s = malloc(sizeof(TokenStream));
+    *s = (TokenStream){};
+    s->file = f;
+    s->sources = vecptr_new(SrcFile, 16);
+    s->cap = TOKEN_STREAM_CAP;
+    s->tokens = malloc(sizeof(s->tokens[0]) * s->cap);
+    s->atoms = malloc(sizeof(s->atoms[0]) * s->cap);
+    s->newlines = calloc(s->cap / 64, sizeof(s->newlines[0]));
+    s->payloads = malloc(sizeof(s->payloads[0]) * s->cap);
+    s->bytes_cap = TOKEN_STREAM_BYTES_CAP;
+    s->bytes = malloc(s->bytes_cap);
+    s->expansions_cap = TOKEN_STREAM_CAP;
+    s->expansions = malloc(sizeof(s->expansions[0]) * s->expansions_cap);
+    s->outgrown = vecptr_new(void, 4);
+    mtx_init(&s->lock, mtx_plain);
+    cnd_init(&s->changed);
+
+    stream = s;
+    if (thrd_create(&s->thread, token_stream_main, s) != thrd_success) {
+        CRASH("unable to start lexer thread");
+    }
+
+    Parser ctx = new_parser(f);
+    ctx.stream = s;
+    // the rings get picked up by the first pull, in parser_start
+
+    parser_start(&ctx);
     return ctx;
 }
+
+void token_stream_pull(Parser* p, u32 index) {
+    TokenStream* s = p->stream;
+    if (s == nullptr) {
+        CRASH("token index %u is past the end of the token array", index);
+    }
+
+    mtx_lock(&s->lock);
+    s->released = p->cursor;
+    cnd_broadcast(&s->changed);
+    while (s->produced <= index && !s->done) {
+        s->parser_waiting = true;
+        s->parser_wants = index;
+        cnd_wait(&s->changed, &s->lock);
+    }
+    s->parser_waiting = false;
+    if (s->produced <= index) {
+        CRASH("token index %u is past the end of the token stream", index);
+    }
+
+    // the rings might have grown since last time
+    p->tokens = s->tokens;
+    p->tokens_mask = s->cap - 1;
+    p->atoms = s->atoms;
+    p->newlines = s->newlines;
+    p->payloads = s->payloads;
+    p->payloads_mask = s->cap - 1;
+    p->payload_bytes = s->bytes;
+    p->payload_bytes_mask = s->bytes_cap - 1;
+    p->expansions = s->expansions;
+    p->expansions_mask = s->expansions_cap - 1;
+
+    // come back once the cursor is a batch further along, so the lexer gets room steadily
+    p->tokens_len = min(s->produced, max(index + 1, p->cursor + TOKEN_STREAM_BATCH));
+    p->window_start = stream_window_start(s);
+    p->payloads_len = s->payloads_produced;
+    p->payloads_start = s->payloads_tail;
+    // the main file is sources[0] in the parser, but not in the stream
+    for_n(i, p->sources.len - 1, s->sources.len) {
+        vec_append(&p->sources, s->sources.at[i]);
+    }
+    while (p->payloads_start != p->payloads_len 
+        && s->payloads[p->payloads_start & (s->cap - 1)].token_index < p->window_start
+    ) {
+        ++p->payloads_start;
+    }
+    p->expansions_len = s->expansions_produced;
+    p->expansions_start = s->expansions_tail;
+    while (p->expansions_start != p->expansions_len) {
+        u32 end = expansion_at(p, p->expansions_start)->end;
+        if (end == EXPANSION_OPEN || end > p->window_start) {
+            break;
+        }
+        ++p->expansions_start;
+    }
+    mtx_unlock(&s->lock);
+}
@@ -1,6 +1,8 @@
 #ifndef LEX_H
 #define LEX_H
 
+#include <setjmp.h>
+
 #include "coyote.h"
 
 #define _LEX_KEYWORDS_ \
@@ -58,18 +60,37 @@
     T(WORD) \
 
 typedef struct {
+    // must be followed by FS_MAP_PADDING zero bytes, see fs_map_entire
     string src;
     string path;
+
+    // where each line starts in src, built the first time
+    // something in the file gets reported. see report.c.
+    u32* line_starts;
+    u32 lines_len;
 } SrcFile;
 
+// bulk scanning kernels used by the raw lexer (scan.c).
+// each returns the index of the first byte at or after i that stops the scan, or len.
 typedef struct {
-    string src;
-    usize cursor;
-    char current;
-    bool eof;
-} Lexer;
+    usize (*whitespace)(const char* s, usize i, usize len); // skip spaces, tabs, \r, \v, \0
+    usize (*line_end)(const char* s, usize i, usize len);   // up to a newline
+    usize (*ident)(const char* s, usize i, usize len);      // skip [A-Za-z0-9_]
+    usize (*string)(const char* s, usize i, usize len);     // up to a quote or backslash
+} ScanKernels;
+
+// how far past len the vector kernels may read
+#define SCAN_OVERREAD 32
 
-#define LEX_MAX_TOKEN_LEN 127
+typedef enum : u8 {
+    SCAN_BEST,
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2,
+} ScanLevel;
+
+extern ScanKernels scan;
+void scan_init(ScanLevel level);
 
 #ifndef __x86_64__
     #error "this trick only works on x86-64 lmao"
@@ -79,14 +100,55 @@ typedef struct {
     // was this token "generated" by the preprocessor?
     // this means that the span might not correspond to source text.
     u64 generated : 1;
-    // textual content
+    // textual content.
+    // if this is TOK_LEN_EXTENDED, the real length is in the token's payload.
     u64 len : 8;
     i64 raw : 48;
 } Token;
 static_assert(sizeof(Token) == 8);
 
+#define TOK_LEN_EXTENDED 255
+
 #define tok_raw(t) ((char*)(i64)((t).raw))
 
+typedef struct {
+    string src;
+    usize cursor;
+    // full length of the last token lexed, even if it didn't fit in Token.len
+    usize token_len;
+    char current;
+    bool eof;
+
+    // set on chunk lexers that might have started in the middle of a token.
+    // lexing errors then just mark the chunk as failed instead of being reported.
+    bool speculative;
+    bool failed;
+
+    // if set, raw tokens are read from (*prelexed)[prelexed_cursor] onwards instead of
+    // being lexed from src. this points at the array pointer so the array can grow
+    // while it's being read. see lex_prelex in lex.c for the layout.
+    Token** prelexed;
+    usize prelexed_cursor;
+} Lexer;
+
+// out-of-line data for tokens that need more than 8 bytes.
+// integer and char literals carry their decoded value, strings carry their
+// unescaped bytes, and any token with len == TOK_LEN_EXTENDED carries its real length.
+// payloads are kept sorted by token index.
+typedef struct {
+    u32 token_index;
+    u32 span_len : 31;
+    u32 malformed : 1; // literal couldn't be decoded
+    union {
+        u64 integer;
+        struct {
+            u32 offset; // into the payload byte buffer
+            u32 len;
+        } string;
+    };
+} TokenPayload;
+static_assert(sizeof(TokenPayload) == 16);
+
 enum {
     _TOK_INVALID,
     TOK_EOF,
@@ -167,13 +229,16 @@ enum {
     // can correctly scope things later
     _TOK_LEX_IGNORE,
 
+        // macro and define pastes only go as far as the lexer,
+        // the parser gets them as Expansions instead
         TOK_PREPROC_MACRO_PASTE, // before a macro is invoked in source code
         // TOK_PREPROC_MACRO_ARG_PASTE, // before an argument to a macro gets replaced in the macro's body
         TOK_PREPROC_DEFINE_PASTE, // before a define's replacement gets pasted
         TOK_PREPROC_INCLUDE_PASTE, // before a file is included
-        TOK_PREPROC_PASTE_END, // marks the end of a paste action
+        TOK_PREPROC_PASTE_END, // marks the end of a macro/define paste action
+        TOK_PREPROC_INCLUDE_END, // marks the end of an included file
 
-        TOK_NEWLINE, 
+        TOK_NEWLINE, // only between raw tokens, see Parser.newlines
 
     _TOK_PREPROC_TRANSPARENT_END,
 
@@ -183,35 +248,141 @@ static_assert(_TOK_COUNT < (1 << 7));
 
 extern const char* token_kind[_TOK_COUNT];
 
+// a macro or define that got pasted in, covering the tokens [start, end).
+// expansions nest and are kept in the order they start in, so the innermost one
+// around a token can be binary searched for, see tok_expansion.
+typedef struct {
+    u32 start;
+    // EXPANSION_OPEN while the lexer is still inside it, which the parser
+    // only ever sees in streaming mode
+    _Atomic(u32) end;
+    u32 parent; // EXPANSION_NONE if it's not inside another one
+    Token site; // TOK_PREPROC_MACRO_PASTE or DEFINE_PASTE, spanning the name where it was defined
+    Token call; // spans where it was used, once it's closed
+} Expansion;
+
+#define EXPANSION_NONE UINT32_MAX
+#define EXPANSION_OPEN UINT32_MAX
+
+// expansions can't nest any deeper than this, it's the preprocessor's own limit
+#define MAX_EXPANSION_DEPTH 64
+#define MAX_INCLUDE_DEPTH 64
+
 VecPtr_typedef(SrcFile);
-typedef struct ParseScope ParseScope;
-typedef struct ParseScope {
-    StrMap map;
-    ParseScope* super;
-    ParseScope* sub;
-} ParseScope;
+Vec_typedef(u32);
 
 typedef struct Entity Entity;
 
+#define NO_BINDING UINT32_MAX
+
+typedef struct {
+    Atom name;
+    u32 shadowed; // NO_BINDING if it doesn't shadow anything
+    Entity* entity;
+} ScopeBinding;
+
+Vec_typedef(ScopeBinding);
+
+// everything the parser can see lives on one binding stack, and one array goes
+// from a name's atom to its innermost binding, just like the preprocessor's
+// definitions (see lex.c). entering a scope only marks where its bindings start,
+// and leaving it pops them and puts the shadowed ones back.
+typedef struct {
+    Vec(ScopeBinding) bindings;
+    Vec(u32) innermost;
+    Vec(u32) marks; // where each scope's bindings start, not counting the global scope
+    // FN bodies parsed on their own thread only see the globals that were declared
+    // before them, so bindings from globals_visible up to globals_len are skipped
+    u32 globals_visible;
+    u32 globals_len;
+} ParseScopes;
+
 typedef struct FlagSet {
     bool strict: 1;
     bool error_on_warn: 1;
+    bool stream: 1;
+    bool parallel: 1;
+    bool interface_only: 1; // skip FN bodies, only the declarations matter
+    bool ast: 1; // flatten FN bodies as soon as they're parsed, see Parser.ast
+    bool resident: 1; // the tokens get edited after parsing, see RESIDENT UNITS in parse.c
 } FlagSet;
 
+Vec_typedef(char);
+Vec_typedef(TokenPayload);
+Vec_typedef(Atom);
+
+typedef struct TokenStream TokenStream;
+typedef struct FnBodyQueue FnBodyQueue;
+typedef struct FnBodyCache FnBodyCache;
+typedef struct BodyRecording BodyRecording;
+typedef struct AstBuilder AstBuilder;
+
 typedef struct {
     Token current;
     Token* tokens;
     u32 tokens_len;
     u32 cursor;
 
-    ParseScope* global_scope;
-    ParseScope* current_scope;
+    // interned name of every TOK_IDENTIFIER, ATOM_NONE for everything else.
+    // indexed just like tokens.
+    Atom* atoms;
+    // newlines aren't tokens, a token just has its bit set here if there was
+    // at least one newline right before it. see tok_newline_before.
+    u64* newlines;
+
+    TokenPayload* payloads;
+    u32 payloads_len;
+    char* payload_bytes;
+
+    Expansion* expansions;
+    u32 expansions_len;
+
+    // in streaming mode, tokens/atoms/payloads/payload_bytes/expansions are rings indexed with
+    // these masks, and only tokens from window_start onwards are still around.
+    // tokens_len is then just how far the parser can read before it has to
+    // pull from the stream again. otherwise the masks are all ones.
+    TokenStream* stream;
+    u32 tokens_mask;
+    u32 payloads_mask;
+    u32 payload_bytes_mask;
+    u32 expansions_mask;
+    u32 payloads_start;
+    u32 expansions_start;
+    u32 window_start;
+
+    // the expansions the cursor is in, see update_expansions in parse.c.
+    // expansion is the innermost one, and expansion_scopes has how many scopes deep
+    // the parser was once each of them got its own, or 0 if nothing's been declared in it yet.
+    u32 expansion;
+    u32 expansion_depth;
+    u32 expansion_scopes[MAX_EXPANSION_DEPTH];
+    u32 next_expansion; // first one the cursor hasn't gotten to
+    u32 expansion_boundary; // nothing changes until the cursor gets here
+
+    // INCLUDE_PASTE markers of the files the cursor is in, innermost last,
+    // and the last include marker it went over
+    u32 includes[MAX_INCLUDE_DEPTH];
+    u32 includes_len;
+    u32 includes_changed;
+
+    ParseScopes scopes;
 
     VecPtr(SrcFile) sources;
 
     Entity* current_function;
+    // in parallel mode, FN bodies get skipped over and queued up here, see parse_unit
+    FnBodyQueue* fn_bodies;
+    // bodies that reported the same things last time don't get parsed again,
+    // see FN BODY CACHE in parse.c
+    FnBodyCache* body_cache;
+    BodyRecording* recording; // what the body being parsed has reported so far
+
+    // with FlagSet.ast, every FN body goes into this as soon as it's parsed,
+    // and its Stmts and Exprs are given back to nodes. see ast_flatten_fn.
+    AstBuilder* ast;
 
     Arena arena;
+    Arena nodes; // Stmts, Exprs and statement lists, everything else goes in arena
 
     FlagSet flags;
 } Parser;
@@ -219,7 +390,85 @@ typedef struct {
 Vec_typedef(Token);
 
 Parser lex_entrypoint(SrcFile* f);
+
+// the tokens that start in [from, until) of src, lexed again after an edit.
+// payloads are numbered from the first of them, and their strings are in payload_bytes.
+typedef struct {
+    Token* tokens;
+    Atom* atoms;
+    u64* newlines; // like Parser.newlines
+    u32 tokens_len;
+    bool newline_after; // there's a newline between the last one and until
+    TokenPayload* payloads;
+    u32 payloads_len;
+    char* payload_bytes;
+    u32 payload_bytes_len;
+} Relexed;
+
+// false if that can't be done without the preprocessor, or until isn't where a token
+// starts anymore, or there's something in there that doesn't lex. see RE-LEXING in lex.c.
+bool lex_relex(string src, usize from, usize until, Relexed* out);
+void lex_relexed_free(Relexed* r);
+
+// save the preprocessed output of included files into dir and reuse it in later runs,
+// for as long as the files haven't changed. see INCLUDE CACHE (ON DISK) in lex.c.
+void lex_set_include_cache(const char* dir);
+
+// streaming mode: the lexer runs on its own thread and writes into rings that the
+// parser pulls from, so the whole token array never exists at once. the rings only
+// grow past these sizes for input that can't get through them, see TokenStream in lex.c.
+// only TOKEN_STREAM_HISTORY tokens behind the parser's cursor are kept for diagnostics,
+// so nothing that runs after parsing can point at a token.
+#define TOKEN_STREAM_CAP        (1u << 16)
+#define TOKEN_STREAM_HISTORY    (1u << 13)
+#define TOKEN_STREAM_BATCH      (1u << 9)
+#define TOKEN_STREAM_BYTES_CAP  (1u << 20)
+static_assert((TOKEN_STREAM_CAP & (TOKEN_STREAM_CAP - 1)) == 0);
+static_assert((TOKEN_STREAM_BYTES_CAP & (TOKEN_STREAM_BYTES_CAP - 1)) == 0);
+static_assert(TOKEN_STREAM_HISTORY + 2 * TOKEN_STREAM_BATCH <= TOKEN_STREAM_CAP);
+
+Parser lex_entrypoint_streaming(SrcFile* f);
+// block until the token at index is available
+void token_stream_pull(Parser* p, u32 index);
+// the parser won't pull again, because of an error or because it's being torn down.
+// the lexer thread stops instead of waiting on it for room.
+void token_stream_cancel(TokenStream* s);
+
+static inline Token tok_at(Parser* p, u32 index) {
+    if (index >= p->tokens_len) {
+        token_stream_pull(p, index);
+    }
+    return p->tokens[index & p->tokens_mask];
+}
+
+static inline Atom tok_atom(Parser* p, u32 index) {
+    if (index >= p->tokens_len) {
+        token_stream_pull(p, index);
+    }
+    return p->atoms[index & p->tokens_mask];
+}
+
+static inline bool tok_newline_before(Parser* p, u32 index) {
+    if (index >= p->tokens_len) {
+        token_stream_pull(p, index);
+    }
+    u32 slot = index & p->tokens_mask;
+    return (p->newlines[slot / 64] >> (slot % 64)) & 1;
+}
+
+static inline Expansion* expansion_at(Parser* p, u32 index) {
+    return &p->expansions[index & p->expansions_mask];
+}
+
+// innermost expansion the token at index came from, EXPANSION_NONE if it's from source text
+u32 tok_expansion(Parser* p, u32 index);
+
+// span of a token, if it's known not to be TOK_LEN_EXTENDED
 string tok_span(Token t);
+string tok_span_at(Parser* p, u32 index);
+// returns nullptr if the token doesn't have a payload
+TokenPayload* tok_payload(Parser* p, u32 index);
+string tok_payload_string(Parser* p, TokenPayload* payload);
 
 #define MAX_MACRO_ARGS 255
 
@@ -245,14 +494,17 @@ enum {
     
     PPVAL_STRING,
     PPVAL_INTEGER,
-    PPVAL_COMPLEX_STRING,
+    PPVAL_COMPLEX_STRING, // [ ... ], lexed once when it's defined
 
     PPVAL_MACRO,
 };
 
+// scopes only decide which definitions are visible.
+// the definitions themselves all live in a single table, see lex.c.
 typedef struct PreprocScope {
-    StrMap map;
     struct PreprocScope* parent;
+    u32 depth; // position on the scope stack, the global scope is 0
+    u32 bindings_start; // this scope's definitions start here in the binding stack
 } PreprocScope;
 
 typedef struct {
@@ -269,6 +521,10 @@ typedef struct {
             u64 params_len : 8;
             u64 body_index : 32;
         } macro;
+        struct {
+            CompactString text; // between the brackets
+            u32 tokens_index; // raw tokens in the preproc token pool, ending in TOK_EOF
+        } complex;
     };
 } PreprocVal;
 
@@ -282,8 +538,8 @@ typedef enum : u8 {
 
 typedef struct {
     ReportKind kind;
-    string src; 
-    string path; 
+    u32 token_index; // reports come out in token order
+    SrcFile* file; // snippet is somewhere in here
     string snippet; 
     string msg;
 
@@ -291,6 +547,23 @@ typedef struct {
     string reconstructed_snippet;
 } ReportLine;
 
+typedef enum : u8 {
+    REPORT_FORMAT_TEXT,
+    REPORT_FORMAT_JSON, // one object per line, for tools
+} ReportFormat;
+
+// reports are buffered, and come out sorted by token_index when there's an error,
+// when report_flush is called, or when the program exits.
+// notes go with the next error or warning reported after them on the same thread.
 void report_line(ReportLine* line);
+void report_flush();
+void report_set_format(ReportFormat format);
+// while catch is set, an ERROR on this thread just gets buffered and jumps to it,
+// instead of flushing everything and exiting.
+void report_catch_errors(jmp_buf* catch);
+// forget everything buffered that was reported past token_index
+void report_discard_after(u32 token_index);
+// forget everything buffered, and this thread's notes that haven't gone with anything yet
+void report_clear();
 
 #endif // LEX_H
@@ -0,0 +1,1132 @@
+// lowering the compact AST into iron, building SSA as it goes.
+//
+// this is Braun et al., "Simple and Efficient Construction of Static Single
+// Assignment Form". locals never touch memory: every write is remembered as the
+// variable's current value in its block, and a read looks that up, walking back
+// through predecessors when the block doesn't have one. a block joining several
+// paths gets a phi. phis that turn out to only ever see one value get folded into
+// it right away, so what comes out is already minimal for anything structured.
+//
+// the catch is that a block's predecessors have to be known before a read can go
+// through them. until then a block is unsealed, and reads there get a phi with no
+// sources yet, which gets filled in when the block is sealed. the arms of an IF
+// are sealed right after the branch, its join once both arms are done. a loop
+// header is sealed once the body's back edge is in, and labels are sealed at the
+// end of the FN, since a GOTO can show up anywhere.
+//
+// globals and anything reached through a pointer go through loads and stores.
+// the return value and OUT parameters of a FN all become its returns.
+//
+// anything the parser takes that can't be lowered yet, like aggregates, gets
+// reported as an error where it is.
+//
+// the parser doesn't make IF, WHILE, BREAK, CONTINUE, LABEL, GOTO or calls yet, so
+// no .jkl file gets to those paths, and neither does a call through a ^FN value,
+// since there's no way to write the type. they're written against the layout in
+// ast.c and only tested on ASTs built by hand to match it, see LOWERING in
+// test/test.c. each one wants an --emit-ir test once the parser makes it.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "common/util.h"
+#include "parse.h"
+#include "iron/iron.h"
+
+typedef struct {
+    u64 key;
+    void* value;
+} LowerSlot;
+
+// u64 to pointer, open addressing. keys are never 0.
+typedef struct {
+    LowerSlot* slots;
+    u32 cap;
+    u32 len;
+} LowerMap;
+
+static void map_init(LowerMap* m, u32 cap) {
+    m->slots = calloc(cap, sizeof(m->slots[0]));
+    m->cap = cap;
+    m->len = 0;
+}
+
+static LowerSlot* map_slot(LowerMap* m, u64 key) {
+    u32 i = (u32)((key * 0x9E3779B97F4A7C15ull) >> 32) & (m->cap - 1);
+    while (m->slots[i].key != 0 && m->slots[i].key != key) {
+        i = (i + 1) & (m->cap - 1);
+    }
+    return &m->slots[i];
+}
+
+static void* map_get(LowerMap* m, u64 key) {
+    return map_slot(m, key)->value;
+}
+
+static void map_put(LowerMap* m, u64 key, void* value) {
+    if ((m->len + 1) * 4 > m->cap * 3) {
+        LowerSlot* old = m->slots;
+        u32 old_cap = m->cap;
+        map_init(m, old_cap * 2);
+        for_n(i, 0, old_cap) {
+            if (old[i].key != 0) {
+                map_put(m, old[i].key, old[i].value);
+            }
+        }
+        free(old);
+    }
+    LowerSlot* slot = map_slot(m, key);
+    if (slot->key == 0) {
+        slot->key = key;
+        m->len++;
+    }
+    slot->value = value;
+}
+
+static void map_clear(LowerMap* m) {
+    memset(m->slots, 0, sizeof(m->slots[0]) * m->cap);
+    m->len = 0;
+}
+
+typedef struct {
+    u32 var;
+    FeInst* phi;
+} LowerIncompletePhi;
+Vec_typedef(LowerIncompletePhi);
+
+typedef struct {
+    FeBlock* block;
+    Vec(u32) preds;
+    Vec(LowerIncompletePhi) incomplete; // waiting for the block to be sealed
+    bool sealed;
+} LowerBlock;
+Vec_typedef(LowerBlock);
+
+VecPtr_typedef(FeInst);
+
+typedef struct {
+    AstNode node;
+    u32 header;
+    u32 after;
+} LowerLoop;
+Vec_typedef(LowerLoop);
+
+// phi flags while lowering
+#define LOWER_PHI_FILLING 1 // sources aren't all in, so it can't be folded yet
+#define LOWER_PHI_GONE 2    // folded away, see Lowerer.gone
+
+// where instructions go after a terminator, until something jumps in again
+#define LOWER_NO_BLOCK UINT32_MAX
+
+typedef struct {
+    Parser* p; // for reporting
+    Ast* ast;
+    FeModule* mod;
+    FeSymbol** syms; // by entity index, made when they first come up
+    LowerMap sigs; // TyIndex to FeFuncSig*
+
+    // the FN being lowered
+    FeFunc* f;
+    TyFn* fn_ty;
+    u32 param_vars[TY_FN_MAX_PARAMS]; // entity index of each parameter, AST_NONE if it's never used
+    FeInst* zeros[FE_TY_I64 + 1]; // reads of variables that were never written
+    bool has_labels; // so code nothing can reach might still have to be lowered
+
+    Vec(LowerBlock) blocks;
+    u32 current;
+    LowerMap defs; // (block, variable) to its current value there
+    LowerMap gone; // folded phis to what they were folded into
+    VecPtr(FeInst) gone_list;
+    LowerMap labels; // entity index to block index + 1
+
+    Vec(LowerLoop) loops;
+} Lowerer;
+
+// for what the parser takes, but lowering can't do yet
+static void unsupported(Lowerer* L, AstNode node, const char* fmt, ...) {
+    char msg[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    u32 token = L->ast->tokens[node];
+    token_error(L->p, REPORT_ERROR, token, token, msg);
+    UNREACHABLE; // errors don't come back
+}
+
+// ------------------------- TYPES -------------------------
+
+// scalars and pointers, which is all that fits in a single iron value for now
+static bool ty_lowerable(TyIndex t) {
+    switch (ty_kind(t)) {
+    case TY_VOID:
+    case TY_BYTE ... TY_UQUAD:
+    case TY_PTR:
+    case TY_FN:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void check_ty(Lowerer* L, TyIndex t, AstNode node) {
+    if (!ty_lowerable(t)) {
+        unsupported(L, node, "values of type %s are not supported yet", ty_name(t));
+    }
+}
+
+// anything that gets here went through check_ty first
+static FeTy lower_ty(TyIndex t) {
+    switch (ty_kind(t)) {
+    case TY_PTR:
+    case TY_FN:
+        t = TY_VOID + TY_PTR;
+        break;
+    case TY_VOID:
+        return FE_TY_VOID;
+    case TY_BYTE ... TY_UQUAD:
+        break;
+    default:
+        CRASH("lowering a value of type %s", ty_name(t));
+    }
+    switch (ty_size(t)) {
+    case 1: return FE_TY_I8;
+    case 2: return FE_TY_I16;
+    case 4: return FE_TY_I32;
+    case 8: return FE_TY_I64;
+    }
+    UNREACHABLE;
+}
+
+static FeTy lower_ptr_ty() {
+    return lower_ty(TY_VOID + TY_PTR);
+}
+
+static u32 lower_ty_size(FeTy ty) {
+    switch (ty) {
+    case FE_TY_I8:  return 1;
+    case FE_TY_I16: return 2;
+    case FE_TY_I32: return 4;
+    case FE_TY_I64: return 8;
+    default: UNREACHABLE;
+    }
+}
+
+// node is the FN or call it's for, in case it can't be lowered
+static FeFuncSig* lower_sig(Lowerer* L, TyIndex t, AstNode node) {
+    FeFuncSig* sig = map_get(&L->sigs, t);
+    if (sig != nullptr) {
+        return sig;
+    }
+    TyFn* fn = ty_fn(t);
+    if (fn->variadic) {
+        unsupported(L, node, "variadic FNs are not supported yet");
+    }
+    check_ty(L, fn->ret_ty, node);
+    u16 params = 0, returns = fn->ret_ty != TY_VOID;
+    for_n(i, 0, fn->len) {
+        check_ty(L, fn->params[i].ty, node);
+        if (fn->params[i].out) {
+            returns++;
+        } else {
+            params++;
+        }
+    }
+    sig = fe_funcsig_new(FE_CCONV_JACKAL, params, returns);
+    params = 0, returns = 0;
+    if (fn->ret_ty != TY_VOID) {
+        fe_funcsig_return(sig, returns++)->ty = lower_ty(fn->ret_ty);
+    }
+    for_n(i, 0, fn->len) {
+        if (fn->params[i].out) {
+            fe_funcsig_return(sig, returns++)->ty = lower_ty(fn->params[i].ty);
+        } else {
+            fe_funcsig_param(sig, params++)->ty = lower_ty(fn->params[i].ty);
+        }
+    }
+    map_put(&L->sigs, t, sig);
+    return sig;
+}
+
+static FeSymbol* lower_sym(Lowerer* L, u32 index) {
+    if (L->syms[index] != nullptr) {
+        return L->syms[index];
+    }
+    Entity* e = L->ast->entities[index];
+    FeSymbolBinding bind;
+    switch (e->storage) {
+    case STORAGE_PUBLIC:  bind = FE_BIND_GLOBAL; break;
+    case STORAGE_PRIVATE: bind = FE_BIND_LOCAL; break;
+    case STORAGE_EXPORT:  bind = FE_BIND_SHARED_EXPORT; break;
+    case STORAGE_EXTERN:  bind = FE_BIND_EXTERN; break;
+    default: UNREACHABLE;
+    }
+    string name = atom_str(e->name);
+    FeSymbol* sym = fe_symbol_new(L->mod, name.raw, name.len, bind);
+    if (e->kind == ENTKIND_VAR) {
+        sym->kind = FE_SYMKIND_DATA;
+    }
+    L->syms[index] = sym;
+    return sym;
+}
+
+static bool is_local(Entity* e) {
+    return e->kind == ENTKIND_VAR && (e->storage == STORAGE_LOCAL || e->storage == STORAGE_OUT_PARAM);
+}
+
+// ------------------------- BLOCKS -------------------------
+
+static u32 block_new(Lowerer* L) {
+    LowerBlock b = {.block = fe_block_new(L->f)};
+    vec_init(&b.preds, 2);
+    vec_init(&b.incomplete, 2);
+    vec_append(&L->blocks, b);
+    return L->blocks.len - 1;
+}
+
+// blocks get made before their code does, so they get moved to the end when
+// they're started, keeping the function in source order. one that's sealed with
+// nothing jumping to it can't be reached, and its code doesn't get lowered.
+static void block_start(Lowerer* L, u32 index) {
+    if (L->blocks.at[index].sealed && L->blocks.at[index].preds.len == 0) {
+        L->current = LOWER_NO_BLOCK;
+        return;
+    }
+    FeFunc* f = L->f;
+    FeBlock* b = L->blocks.at[index].block;
+    if (b != f->last_block && b != f->entry_block) {
+        b->list_prev->list_next = b->list_next;
+        b->list_next->list_prev = b->list_prev;
+        b->list_prev = f->last_block;
+        b->list_next = nullptr;
+        f->last_block->list_next = b;
+        f->last_block = b;
+    }
+    L->current = index;
+}
+
+static FeInst* read_var(Lowerer* L, u32 var, u32 block);
+
+static FeInst* resolve(Lowerer* L, FeInst* v) {
+    while (v->kind == FE_PHI && v->flags == LOWER_PHI_GONE) {
+        v = map_get(&L->gone, (u64)(usize)v);
+    }
+    return v;
+}
+
+static FeInst* zero(Lowerer* L, FeTy ty) {
+    if (L->zeros[ty] == nullptr) {
+        FeFunc* f = L->f;
+        u16 params = f->sig->param_len;
+        FeInst* after = params ? f->params[params - 1] : f->entry_block->bookend;
+        L->zeros[ty] = fe_insert_after(after, fe_inst_const(f, ty, 0));
+    }
+    return L->zeros[ty];
+}
+
+// phis are the only thing that can get folded away, so they're the only
+// instructions whose users need to be known
+static void track_uses(Lowerer* L, FeInst* inst) {
+    usize len;
+    FeInst** inputs = fe_inst_list_inputs(L->mod->target, inst, &len);
+    for_n(i, 0, len) {
+        if (inputs[i]->kind == FE_PHI) {
+            fe_inst_add_use(inputs[i], inst);
+        }
+    }
+}
+
+// nothing jumps here, but the code still has to go somewhere. block_start would
+// see it can't be reached and not start it, so this goes around it.
+static void start_dead_block(Lowerer* L) {
+    u32 dead = block_new(L);
+    L->blocks.at[dead].sealed = true;
+    L->current = dead;
+}
+
+static FeInst* emit(Lowerer* L, FeInst* inst) {
+    if (L->current == LOWER_NO_BLOCK) {
+        start_dead_block(L);
+    }
+    fe_append_end(L->blocks.at[L->current].block, inst);
+    track_uses(L, inst);
+    return inst;
+}
+
+static void edge(Lowerer* L, u32 from, u32 to) {
+    if (L->blocks.at[to].sealed) {
+        CRASH("edge into a sealed block");
+    }
+    vec_append(&L->blocks.at[to].preds, from);
+}
+
+static void jump(Lowerer* L, u32 to) {
+    if (L->current == LOWER_NO_BLOCK) {
+        return;
+    }
+    emit(L, fe_inst_jump(L->f, L->blocks.at[to].block));
+    edge(L, L->current, to);
+    L->current = LOWER_NO_BLOCK;
+}
+
+static void branch(Lowerer* L, FeInst* cond, u32 if_true, u32 if_false) {
+    emit(L, fe_inst_branch(L->f, cond, L->blocks.at[if_true].block, L->blocks.at[if_false].block));
+    edge(L, L->current, if_true);
+    edge(L, L->current, if_false);
+    L->current = LOWER_NO_BLOCK;
+}
+
+// ------------------------- SSA -------------------------
+
+static u64 def_key(u32 block, u32 var) {
+    return (u64)(block + 1) << 32 | var;
+}
+
+static void write_var(Lowerer* L, u32 var, u32 block, FeInst* value) {
+    map_put(&L->defs, def_key(block, var), value);
+}
+
+static FeInst* new_phi(Lowerer* L, u32 var, u32 block) {
+    FeInst* phi = fe_inst_phi(L->f, lower_ty(L->ast->entities[var]->ty), 0);
+    phi->flags = LOWER_PHI_FILLING;
+    fe_append_begin(L->blocks.at[block].block, phi);
+    return phi;
+}
+
+static FeInst* try_remove_trivial_phi(Lowerer* L, FeInst* phi) {
+    FeInstPhi* p = fe_extra(phi);
+    FeInst* same = nullptr;
+    for_n(i, 0, p->len) {
+        FeInst* op = resolve(L, p->vals[i]);
+        if (op == same || op == phi) {
+            continue;
+        }
+        if (same != nullptr) {
+            return phi;
+        }
+        same = op;
+    }
+    if (same == nullptr) {
+        // unreachable, or only ever sees itself
+        same = zero(L, phi->ty);
+    }
+
+    fe_inst_remove_pos(phi);
+    phi->flags = LOWER_PHI_GONE;
+    map_put(&L->gone, (u64)(usize)phi, same);
+    vec_append(&L->gone_list, phi);
+
+    for_n(i, 0, phi->use_len) {
+        FeInst* user = phi->uses[i];
+        if (user == phi || (user->kind == FE_PHI && user->flags == LOWER_PHI_GONE)) {
+            continue;
+        }
+        usize len;
+        FeInst** inputs = fe_inst_list_inputs(L->mod->target, user, &len);
+        bool replaced = false;
+        for_n(j, 0, len) {
+            if (inputs[j] == phi) {
+                inputs[j] = same;
+                replaced = true;
+            }
+        }
+        if (replaced && same->kind == FE_PHI) {
+            fe_inst_add_use(same, user);
+        }
+    }
+    // folding this one might have made its users trivial too
+    for_n(i, 0, phi->use_len) {
+        FeInst* user = phi->uses[i];
+        if (user != phi && user->kind == FE_PHI && user->flags == 0) {
+            try_remove_trivial_phi(L, user);
+        }
+    }
+    return same;
+}
+
+static FeInst* add_phi_operands(Lowerer* L, u32 var, FeInst* phi, u32 block) {
+    for_n(i, 0, L->blocks.at[block].preds.len) {
+        u32 pred = L->blocks.at[block].preds.at[i];
+        FeInst* value = read_var(L, var, pred);
+        fe_phi_append_src(phi, value, L->blocks.at[pred].block);
+        if (value->kind == FE_PHI) {
+            fe_inst_add_use(value, phi);
+        }
+    }
+    phi->flags = 0;
+    return try_remove_trivial_phi(L, phi);
+}
+
+// what a variable is before anything's written to it
+static FeInst* read_var_initial(Lowerer* L, u32 var) {
+    u16 param = 0;
+    for_n(i, 0, L->fn_ty->len) {
+        if (L->fn_ty->params[i].out) {
+            continue;
+        }
+        if (L->param_vars[i] == var) {
+            return L->f->params[param];
+        }
+        param++;
+    }
+    return zero(L, lower_ty(L->ast->entities[var]->ty));
+}
+
+static FeInst* read_var_recursive(Lowerer* L, u32 var, u32 block) {
+    LowerBlock* b = &L->blocks.at[block];
+    FeInst* value;
+    if (!b->sealed) {
+        value = new_phi(L, var, block);
+        vec_append(&b->incomplete, ((LowerIncompletePhi){var, value}));
+    } else if (b->preds.len == 0) {
+        value = read_var_initial(L, var);
+    } else if (b->preds.len == 1) {
+        value = read_var(L, var, b->preds.at[0]);
+    } else {
+        // breaks cycles through loops
+        FeInst* phi = new_phi(L, var, block);
+        write_var(L, var, block, phi);
+        value = add_phi_operands(L, var, phi, block);
+    }
+    write_var(L, var, block, value);
+    return value;
+}
+
+static FeInst* read_var(Lowerer* L, u32 var, u32 block) {
+    FeInst* value = map_get(&L->defs, def_key(block, var));
+    if (value != nullptr) {
+        return resolve(L, value);
+    }
+    return read_var_recursive(L, var, block);
+}
+
+static void seal(Lowerer* L, u32 block) {
+    // sealing can read through this block again, and add more to fill in
+    for (u32 i = 0; i < L->blocks.at[block].incomplete.len; i++) {
+        LowerIncompletePhi inc = L->blocks.at[block].incomplete.at[i];
+        add_phi_operands(L, inc.var, inc.phi, block);
+    }
+    L->blocks.at[block].incomplete.len = 0;
+    L->blocks.at[block].sealed = true;
+}
+
+static u32 current_block(Lowerer* L) {
+    if (L->current == LOWER_NO_BLOCK) {
+        start_dead_block(L);
+    }
+    return L->current;
+}
+
+// ------------------------- EXPRESSIONS -------------------------
+
+static FeInst* lower_expr(Lowerer* L, AstNode node);
+static void lower_cond(Lowerer* L, AstNode node, u32 if_true, u32 if_false);
+
+static FeInst* convert_to(Lowerer* L, FeInst* v, bool is_signed, FeTy ty) {
+    if (v->ty == ty) {
+        return v;
+    }
+    if (v->ty == FE_TY_BOOL) {
+        return emit(L, fe_inst_unop(L->f, ty, FE_ZERO_EXT, v));
+    }
+    if (lower_ty_size(v->ty) > lower_ty_size(ty)) {
+        return emit(L, fe_inst_unop(L->f, ty, FE_TRUNC, v));
+    }
+    return emit(L, fe_inst_unop(L->f, ty, is_signed ? FE_SIGN_EXT : FE_ZERO_EXT, v));
+}
+
+static FeInst* convert(Lowerer* L, FeInst* v, TyIndex from, TyIndex to) {
+    return convert_to(L, v, ty_is_signed(from), lower_ty(to));
+}
+
+// an expression, as a value of type to
+static FeInst* lower_value(Lowerer* L, AstNode node, TyIndex to) {
+    if (L->ast->kinds[node] == AST_EXPR + EXPR_LITERAL) {
+        return emit(L, fe_inst_const(L->f, lower_ty(to), ast_literal(L->ast, node)));
+    }
+    return convert(L, lower_expr(L, node), L->ast->tys[node], to);
+}
+
+// where an assignment goes
+typedef struct {
+    u32 var; // AST_NONE if it's in memory
+    FeInst* ptr;
+    TyIndex ty;
+} LowerPlace;
+
+// where something in memory is
+static FeInst* lower_address(Lowerer* L, AstNode node) {
+    Ast* ast = L->ast;
+    switch (ast->kinds[node] - AST_EXPR) {
+    case EXPR_ENTITY:
+        if (is_local(ast->entities[ast->data[node]])) {
+            unsupported(L, node, "taking the address of a local is not supported yet");
+        }
+        return emit(L, fe_inst_sym_addr(L->f, lower_ptr_ty(), lower_sym(L, ast->data[node])));
+    case EXPR_DEREF:
+        return lower_expr(L, node + 1);
+    case EXPR_SUBSCRIPT: {
+        AstNode base = node + 1, index = ast->data[node];
+        if (ty_kind(ast->tys[base]) != TY_PTR) {
+            unsupported(L, base, "indexing into a value of type %s is not supported yet", ty_name(ast->tys[base]));
+        }
+        check_ty(L, ast->tys[node], node);
+        FeTy ptr_ty = lower_ptr_ty();
+        FeInst* ptr = lower_expr(L, base);
+        FeInst* i = convert_to(L, lower_expr(L, index), ty_is_signed(ast->tys[index]), ptr_ty);
+        FeInst* size = emit(L, fe_inst_const(L->f, ptr_ty, ty_size(ast->tys[node])));
+        FeInst* offset = emit(L, fe_inst_binop(L->f, ptr_ty, FE_IMUL, i, size));
+        return emit(L, fe_inst_binop(L->f, ptr_ty, FE_IADD, ptr, offset));
+    }
+    default:
+        unsupported(L, node, "this expression is not supported yet");
+    }
+    UNREACHABLE;
+}
+
+static LowerPlace lower_place(Lowerer* L, AstNode node) {
+    Ast* ast = L->ast;
+    LowerPlace place = {.ty = ast->tys[node]};
+    check_ty(L, place.ty, node);
+    if (ast->kinds[node] == AST_EXPR + EXPR_ENTITY && is_local(ast->entities[ast->data[node]])) {
+        place.var = ast->data[node];
+    } else {
+        place.ptr = lower_address(L, node);
+    }
+    return place;
+}
+
+static FeInst* place_read(Lowerer* L, LowerPlace place) {
+    if (place.var != AST_NONE) {
+        return read_var(L, place.var, current_block(L));
+    }
+    return emit(L, fe_inst_load(L->f, lower_ty(place.ty), place.ptr));
+}
+
+static void place_write(Lowerer* L, LowerPlace place, FeInst* value) {
+    if (place.var != AST_NONE) {
+        write_var(L, place.var, current_block(L), value);
+        return;
+    }
+    emit(L, fe_inst_store(L->f, place.ptr, value, value->ty));
+}
+
+static FeInstKind binary_op(ExprKind kind, TyIndex ty) {
+    bool is_signed = ty_is_signed(ty);
+    switch (kind) {
+    case EXPR_ADD: return FE_IADD;
+    case EXPR_SUB: return FE_ISUB;
+    case EXPR_MUL: return FE_IMUL;
+    case EXPR_DIV: return is_signed ? FE_IDIV : FE_UDIV;
+    case EXPR_MOD: return is_signed ? FE_IREM : FE_UREM;
+    case EXPR_AND: return FE_AND;
+    case EXPR_OR:  return FE_OR;
+    case EXPR_XOR: return FE_XOR;
+    case EXPR_LSH: return FE_SHL;
+    case EXPR_RSH: return is_signed ? FE_ISR : FE_USR;
+    default: UNREACHABLE;
+    }
+}
+
+// a comparison as a bool. iron only has some of them, so the rest swap their
+// operands, and NEQ comes out backwards.
+static FeInst* lower_compare(Lowerer* L, AstNode node, bool* negated) {
+    Ast* ast = L->ast;
+    AstNode lhs = node + 1, rhs = ast->data[node];
+    // the same operand type the parser checked against
+    TyIndex ty = ast->kinds[lhs] == AST_EXPR + EXPR_LITERAL ? ast->tys[rhs] : ast->tys[lhs];
+    bool is_signed = ty_is_signed(ty);
+    FeInst* l = lower_value(L, lhs, ty);
+    FeInst* r = lower_value(L, rhs, ty);
+
+    *negated = false;
+    FeInstKind op;
+    switch (ast->kinds[node] - AST_EXPR) {
+    case EXPR_EQ: op = FE_IEQ; break;
+    case EXPR_NEQ: op = FE_IEQ; *negated = true; break;
+    case EXPR_LESS:
+    case EXPR_GREATER: op = is_signed ? FE_ILT : FE_ULT; break;
+    case EXPR_LESS_EQ:
+    case EXPR_GREATER_EQ: op = is_signed ? FE_ILE : FE_ULE; break;
+    default: UNREACHABLE;
+    }
+    ExprKind kind = ast->kinds[node] - AST_EXPR;
+    if (kind == EXPR_GREATER || kind == EXPR_GREATER_EQ) {
+        return emit(L, fe_inst_binop(L->f, FE_TY_BOOL, op, r, l));
+    }
+    return emit(L, fe_inst_binop(L->f, FE_TY_BOOL, op, l, r));
+}
+
+// AND and OR as a value, through the same jumping code as a condition
+static FeInst* lower_bool_value(Lowerer* L, AstNode node) {
+    FeTy ty = lower_ty(L->ast->tys[node]);
+    u32 arms[2] = {block_new(L), block_new(L)};
+    u32 join = block_new(L);
+    lower_cond(L, node, arms[0], arms[1]);
+    seal(L, arms[0]);
+    seal(L, arms[1]);
+
+    // a side that can't be reached doesn't need a phi
+    for_n(i, 0, 2) {
+        if (L->blocks.at[arms[1 - i]].preds.len == 0) {
+            block_start(L, arms[i]);
+            jump(L, join);
+            seal(L, join);
+            block_start(L, join);
+            return emit(L, fe_inst_const(L->f, ty, i == 0));
+        }
+    }
+    FeInst* phi = fe_inst_phi(L->f, ty, 2);
+    for_n(i, 0, 2) {
+        block_start(L, arms[i]);
+        fe_phi_set_src(phi, i, emit(L, fe_inst_const(L->f, ty, i == 0)), L->blocks.at[arms[i]].block);
+        jump(L, join);
+    }
+    seal(L, join);
+    block_start(L, join);
+    return fe_append_begin(L->blocks.at[join].block, phi);
+}
+
+static FeInst* lower_call(Lowerer* L, AstNode node) {
+    Ast* ast = L->ast;
+    AstNode callee = node + 1;
+    TyIndex fn_ty = ast->tys[callee];
+    if (ty_kind(fn_ty) == TY_PTR && ty_kind(ty_target(fn_ty)) == TY_FN) {
+        // the pointer is already the address to call
+        fn_ty = ty_target(fn_ty);
+    } else if (ty_kind(fn_ty) != TY_FN) {
+        unsupported(L, callee, "calling a value of type %s", ty_name(fn_ty));
+    }
+    TyFn* fn = ty_fn(fn_ty);
+    FeFuncSig* sig = lower_sig(L, fn_ty, node);
+
+    // OUT arguments are places, worked out before the call and written after
+    u32* args = &ast->extra[ast->data[node]];
+    FeInst* arg_values[TY_FN_MAX_PARAMS];
+    LowerPlace outs[TY_FN_MAX_PARAMS];
+    u16 ins_len = 0, outs_len = 0;
+    for_n(i, 0, args[0]) {
+        AstNode arg = args[1 + i];
+        if (!fn->params[i].out) {
+            arg_values[ins_len++] = lower_value(L, arg, fn->params[i].ty);
+            continue;
+        }
+        if (ast->kinds[arg] == AST_EXPR + EXPR_OUT_ARG) {
+            arg++;
+        }
+        outs[outs_len++] = lower_place(L, arg);
+    }
+    FeInst* call = fe_inst_call(L->f, lower_expr(L, callee), sig);
+    for_n(i, 0, ins_len) {
+        fe_call_set_arg(call, i, arg_values[i]);
+    }
+    emit(L, call);
+    if (outs_len == 0) {
+        return call;
+    }
+
+    // the return value comes back first, then the OUT arguments in order,
+    // all as one tuple unless there's only one of them
+    FeInst* value = call;
+    u16 returns = 0;
+    u16 out = 0;
+    if (fn->ret_ty != TY_VOID) {
+        value = emit(L, fe_inst_proj(L->f, call, returns++));
+    }
+    for_n(i, 0, fn->len) {
+        if (!fn->params[i].out) {
+            continue;
+        }
+        FeInst* result = sig->return_len == 1 ? call : emit(L, fe_inst_proj(L->f, call, returns++));
+        place_write(L, outs[out], convert(L, result, fn->params[i].ty, outs[out].ty));
+        out++;
+    }
+    return value;
+}
+
+static FeInst* lower_expr(Lowerer* L, AstNode node) {
+    Ast* ast = L->ast;
+    FeFunc* f = L->f;
+    TyIndex ty = ast->tys[node];
+    ExprKind kind = ast->kinds[node] - AST_EXPR;
+    check_ty(L, ty, node);
+    switch (kind) {
+    case EXPR_LITERAL:
+        return emit(L, fe_inst_const(f, lower_ty(ty), ast_literal(ast, node)));
+    case EXPR_ENTITY: {
+        u32 index = ast->data[node];
+        Entity* e = ast->entities[index];
+        if (is_local(e)) {
+            return read_var(L, index, current_block(L));
+        }
+        FeInst* addr = emit(L, fe_inst_sym_addr(f, lower_ptr_ty(), lower_sym(L, index)));
+        // FNs are entities of kind VAR too, so go by the type
+        if (ty_kind(e->ty) == TY_FN) {
+            return addr;
+        }
+        return emit(L, fe_inst_load(f, lower_ty(ty), addr));
+    }
+    case EXPR_ADD ... EXPR_RSH: {
+        FeInst* lhs = lower_value(L, node + 1, ty);
+        FeInst* rhs = lower_value(L, ast->data[node], ty);
+        return emit(L, fe_inst_binop(f, lower_ty(ty), binary_op(kind, ty), lhs, rhs));
+    }
+    case EXPR_EQ ... EXPR_GREATER: {
+        bool negated;
+        FeInst* cmp = emit(L, fe_inst_unop(f, lower_ty(ty), FE_ZERO_EXT, lower_compare(L, node, &negated)));
+        if (negated) {
+            cmp = emit(L, fe_inst_binop(f, cmp->ty, FE_XOR, cmp, emit(L, fe_inst_const(f, cmp->ty, 1))));
+        }
+        return cmp;
+    }
+    case EXPR_BOOL_AND:
+    case EXPR_BOOL_OR:
+        return lower_bool_value(L, node);
+    case EXPR_BOOL_NOT: {
+        FeInst* v = lower_expr(L, node + 1);
+        FeInst* is_zero = emit(L, fe_inst_binop(f, FE_TY_BOOL, FE_IEQ, v, zero(L, v->ty)));
+        return emit(L, fe_inst_unop(f, lower_ty(ty), FE_ZERO_EXT, is_zero));
+    }
+    case EXPR_NEG:
+    case EXPR_NOT:
+        return emit(L, fe_inst_unop(f, lower_ty(ty), kind == EXPR_NEG ? FE_NEG : FE_NOT, lower_value(L, node + 1, ty)));
+    case EXPR_CAST:
+        return lower_value(L, node + 1, ty);
+    case EXPR_DEREF:
+    case EXPR_SUBSCRIPT:
+        return emit(L, fe_inst_load(f, lower_ty(ty), lower_address(L, node)));
+    case EXPR_ADDROF:
+        return lower_address(L, node + 1);
+    case EXPR_SIZEOFVALUE: {
+        usize size = ty_size(ast->tys[node + 1]);
+        if (size == 0) {
+            unsupported(L, node, "SIZEOFVALUE of type %s is not supported yet", ty_name(ast->tys[node + 1]));
+        }
+        return emit(L, fe_inst_const(f, lower_ty(ty), size));
+    }
+    case EXPR_CALL:
+        return lower_call(L, node);
+    default:
+        unsupported(L, node, "this expression is not supported yet");
+    }
+    UNREACHABLE;
+}
+
+// jumping code, so AND and OR never have to make a value
+static void lower_cond(Lowerer* L, AstNode node, u32 if_true, u32 if_false) {
+    Ast* ast = L->ast;
+    if (L->current == LOWER_NO_BLOCK) {
+        // the other side of an AND or OR already decided it
+        return;
+    }
+    switch (ast->kinds[node] - AST_EXPR) {
+    case EXPR_EQ ... EXPR_GREATER: {
+        bool negated;
+        FeInst* cmp = lower_compare(L, node, &negated);
+        if (negated) {
+            branch(L, cmp, if_false, if_true);
+        } else {
+            branch(L, cmp, if_true, if_false);
+        }
+        break;
+    }
+    case EXPR_BOOL_NOT:
+        lower_cond(L, node + 1, if_false, if_true);
+        break;
+    case EXPR_BOOL_AND: {
+        u32 rhs = block_new(L);
+        lower_cond(L, node + 1, rhs, if_false);
+        seal(L, rhs);
+        block_start(L, rhs);
+        lower_cond(L, ast->data[node], if_true, if_false);
+        break;
+    }
+    case EXPR_BOOL_OR: {
+        u32 rhs = block_new(L);
+        lower_cond(L, node + 1, if_true, rhs);
+        seal(L, rhs);
+        block_start(L, rhs);
+        lower_cond(L, ast->data[node], if_true, if_false);
+        break;
+    }
+    case EXPR_LITERAL:
+        jump(L, ast_literal(ast, node) ? if_true : if_false);
+        break;
+    default: {
+        FeInst* v = lower_expr(L, node);
+        FeInst* is_zero = emit(L, fe_inst_binop(L->f, FE_TY_BOOL, FE_IEQ, v, zero(L, v->ty)));
+        branch(L, is_zero, if_false, if_true);
+    }
+    }
+}
+
+// ------------------------- STATEMENTS -------------------------
+
+static void lower_stmt(Lowerer* L, AstNode node);
+
+static void lower_block(Lowerer* L, u32* list) {
+    for_n(i, 0, list[0]) {
+        lower_stmt(L, list[1 + i]);
+    }
+}
+
+static u32 label_block(Lowerer* L, u32 label) {
+    usize index = (usize)map_get(&L->labels, label);
+    if (index == 0) {
+        index = block_new(L) + 1;
+        map_put(&L->labels, label, (void*)index);
+    }
+    return index - 1;
+}
+
+static void lower_return(Lowerer* L, AstNode node) {
+    FeInst* ret = fe_inst_return(L->f);
+    u16 returns = 0;
+    if (L->fn_ty->ret_ty != TY_VOID) {
+        FeInst* value = ast_has_expr(L->ast, node)
+            ? lower_value(L, node + 1, L->fn_ty->ret_ty)
+            : zero(L, lower_ty(L->fn_ty->ret_ty));
+        fe_return_set_arg(ret, returns++, value);
+    }
+    u32 block = current_block(L);
+    for_n(i, 0, L->fn_ty->len) {
+        if (!L->fn_ty->params[i].out) {
+            continue;
+        }
+        FeInst* value = L->param_vars[i] != AST_NONE
+            ? read_var(L, L->param_vars[i], block)
+            : zero(L, lower_ty(L->fn_ty->params[i].ty));
+        fe_return_set_arg(ret, returns++, value);
+    }
+    emit(L, ret);
+    L->current = LOWER_NO_BLOCK;
+}
+
+static void lower_stmt(Lowerer* L, AstNode node) {
+    Ast* ast = L->ast;
+    StmtKind kind = ast->kinds[node];
+
+    // nothing can reach this, and it doesn't need lowering unless something jumps in.
+    // that can only be a GOTO to a label, which can also be inside an IF or a loop.
+    if (L->current == LOWER_NO_BLOCK && kind != STMT_LABEL) {
+        bool can_hold_label = kind == STMT_IF || kind == STMT_WHILE;
+        if (!(can_hold_label && L->has_labels)) {
+            return;
+        }
+    }
+
+    switch (kind) {
+    case STMT_EXPR:
+        lower_expr(L, node + 1);
+        break;
+    case STMT_VAR_DECL: {
+        u32 var = ast->data[node];
+        TyIndex ty = ast->entities[var]->ty;
+        check_ty(L, ty, node);
+        FeInst* value = ast_has_expr(ast, node) ? lower_value(L, node + 1, ty) : zero(L, lower_ty(ty));
+        write_var(L, var, current_block(L), value);
+        break;
+    }
+    case STMT_ASSIGN ... STMT_ASSIGN_RSH: {
+        LowerPlace place = lower_place(L, node + 1);
+        FeInst* value = lower_value(L, ast->data[node], place.ty);
+        if (kind != STMT_ASSIGN) {
+            ExprKind op = EXPR_ADD + (kind - STMT_ASSIGN_ADD);
+            FeInst* old = place_read(L, place);
+            value = emit(L, fe_inst_binop(L->f, old->ty, binary_op(op, place.ty), old, value));
+        }
+        place_write(L, place, value);
+        break;
+    }
+    case STMT_RETURN:
+    case STMT_LEAVE:
+        lower_return(L, node);
+        break;
+    case STMT_BARRIER:
+        break;
+    case STMT_IF: {
+        u32* extra = &ast->extra[ast->data[node]];
+        AstNode else_ = extra[0];
+        if (!ast_has_expr(ast, node)) {
+            // a bare ELSE
+            lower_block(L, &extra[1]);
+            break;
+        }
+        u32 then = block_new(L);
+        u32 otherwise = else_ != AST_NONE ? block_new(L) : LOWER_NO_BLOCK;
+        u32 join = block_new(L);
+        lower_cond(L, node + 1, then, else_ != AST_NONE ? otherwise : join);
+        seal(L, then);
+        block_start(L, then);
+        lower_block(L, &extra[1]);
+        jump(L, join);
+        if (else_ != AST_NONE) {
+            seal(L, otherwise);
+            block_start(L, otherwise);
+            lower_stmt(L, else_);
+            jump(L, join);
+        }
+        seal(L, join);
+        block_start(L, join);
+        break;
+    }
+    case STMT_WHILE: {
+        u32* extra = &ast->extra[ast->data[node]];
+        u32 header = block_new(L), body = block_new(L), after = block_new(L);
+        jump(L, header);
+        block_start(L, header);
+        lower_cond(L, node + 1, body, after);
+        seal(L, body);
+        block_start(L, body);
+        vec_append(&L->loops, ((LowerLoop){node, header, after}));
+        lower_block(L, &extra[0]);
+        jump(L, header);
+        L->loops.len--;
+        seal(L, header);
+        seal(L, after);
+        block_start(L, after);
+        break;
+    }
+    case STMT_BREAK:
+    case STMT_CONTINUE:
+        for_n_reverse(i, L->loops.len, 0) {
+            if (L->loops.at[i].node == ast->data[node]) {
+                jump(L, kind == STMT_BREAK ? L->loops.at[i].after : L->loops.at[i].header);
+                break;
+            }
+        }
+        break;
+    case STMT_LABEL: {
+        u32 block = label_block(L, ast->data[node]);
+        jump(L, block);
+        block_start(L, block);
+        break;
+    }
+    case STMT_GOTO:
+        jump(L, label_block(L, ast->data[node]));
+        break;
+    default:
+        UNREACHABLE;
+    }
+}
+
+// ------------------------- FNS -------------------------
+
+static void lower_fn(Lowerer* L, AstNode node) {
+    Ast* ast = L->ast;
+    u32* extra = &ast->extra[ast->data[node]];
+    AstNode end = extra[1];
+    Entity* fn = ast->entities[extra[0]];
+    L->f = L->syms[extra[0]]->func;
+    L->fn_ty = ty_fn(fn->ty);
+
+    // nothing local can have a parameter's name, see get_or_create,
+    // so a local that does is the parameter
+    memset(L->param_vars, 0, sizeof(L->param_vars));
+    L->has_labels = false;
+    for_n(n, node, end) {
+        if (ast->kinds[n] == STMT_LABEL) {
+            L->has_labels = true;
+        }
+        if (ast->kinds[n] != AST_EXPR + EXPR_ENTITY) {
+            continue;
+        }
+        Entity* e = ast->entities[ast->data[n]];
+        if (!is_local(e)) {
+            continue;
+        }
+        for_n(i, 0, L->fn_ty->len) {
+            if (L->fn_ty->params[i].name == e->name) {
+                L->param_vars[i] = ast->data[n];
+            }
+        }
+    }
+
+    memset(L->zeros, 0, sizeof(L->zeros));
+    L->blocks.len = 0;
+    map_clear(&L->defs);
+    map_clear(&L->gone);
+    map_clear(&L->labels);
+    L->gone_list.len = 0;
+    L->loops.len = 0;
+
+    LowerBlock entry = {.block = L->f->entry_block, .sealed = true};
+    vec_init(&entry.preds, 2);
+    vec_init(&entry.incomplete, 2);
+    vec_append(&L->blocks, entry);
+    L->current = 0;
+
+    lower_block(L, &extra[2]);
+    if (L->current != LOWER_NO_BLOCK) {
+        lower_return(L, AST_NONE);
+    }
+
+    // every GOTO is in now
+    for_n(i, 0, L->blocks.len) {
+        if (!L->blocks.at[i].sealed) {
+            seal(L, i);
+        }
+    }
+    for_n(i, 0, L->blocks.len) {
+        LowerBlock* b = &L->blocks.at[i];
+        FeInst* last = b->block->bookend->prev;
+        if (last->kind == FE_BOOKEND && b->preds.len == 0 && i != 0) {
+            // made for code that turned out to be unreachable
+            fe_block_destroy(b->block);
+        } else if (!fe_inst_has_trait(last->kind, FE_TRAIT_TERMINATOR)) {
+            // anything that gets started is lowered up to a jump, or a return at the end
+            CRASH("block %zu was left without a terminator", i);
+        }
+        vec_destroy(&b->preds);
+        vec_destroy(&L->blocks.at[i].incomplete);
+    }
+    for_n(i, 0, L->gone_list.len) {
+        fe_inst_free(L->f, L->gone_list.at[i]);
+    }
+}
+
+void lower_unit(Parser* p, Ast* ast, FeModule* mod, FeInstPool* ipool, FeVRegBuffer* vregs) {
+    if (p->stream != nullptr) {
+        CRASH("a streamed unit can't be lowered, its tokens are gone");
+    }
+    Lowerer L = {
+        .p = p,
+        .ast = ast,
+        .mod = mod,
+        .syms = calloc(ast->entities_len, sizeof(FeSymbol*)),
+    };
+    map_init(&L.sigs, 64);
+    map_init(&L.defs, 256);
+    map_init(&L.gone, 64);
+    map_init(&L.labels, 16);
+    vec_init(&L.blocks, 16);
+    vec_init(&L.gone_list, 16);
+    vec_init(&L.loops, 16);
+
+    // every FN gets its symbol first, so calls can find the ones further down
+    for_n(i, 0, ast->decls_len) {
+        AstNode node = ast->decls[i];
+        if (ast->kinds[node] != STMT_FN_DECL) {
+            continue;
+        }
+        u32 fn = ast->extra[ast->data[node]];
+        FeSymbol* sym = lower_sym(&L, fn);
+        fe_func_new(mod, sym, lower_sig(&L, ast->entities[fn]->ty, node), ipool, vregs);
+    }
+    for_n(i, 0, ast->decls_len) {
+        AstNode node = ast->decls[i];
+        if (ast->kinds[node] == STMT_FN_DECL) {
+            lower_fn(&L, node);
+        }
+    }
+
+    free(L.syms);
+    free(L.sigs.slots);
+    free(L.defs.slots);
+    free(L.gone.slots);
+    free(L.labels.slots);
+    vec_destroy(&L.blocks);
+    vec_destroy(&L.gone_list);
+    vec_destroy(&L.loops);
+}
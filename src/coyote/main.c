@@ -5,9 +5,15 @@
 #include "common/util.h"
 #include "lex.h"
 #include "parse.h"
+#include "iron/iron.h"
 
 thread_local const char* filepath = nullptr;
 thread_local FlagSet flags = {};
+static const char* interface_out = nullptr;
+static bool emit_ir = false;
+static const char* serve_socket = nullptr;
+static const char* connect_socket = nullptr;
+static ReportFormat format = REPORT_FORMAT_TEXT;
 
 static void parse_args(int argc, char** argv) {
     for_n(i, 0, argc) {
@@ -16,6 +22,46 @@ static void parse_args(int argc, char** argv) {
             flags.strict = true;
         } else if (strcmp(arg, "--error-on-warn") == 0) {
             flags.error_on_warn = true;
+        } else if (strcmp(arg, "--stream") == 0) {
+            flags.stream = true;
+        } else if (strcmp(arg, "--parallel") == 0) {
+            flags.parallel = true;
+        } else if (strcmp(arg, "--json-diagnostics") == 0) {
+            format = REPORT_FORMAT_JSON;
+            report_set_format(format);
+        } else if (strcmp(arg, "--cache") == 0) {
+            if (i + 1 == argc) {
+                printf("expected a directory after '--cache'\n");
+                exit(1);
+            }
+            lex_set_include_cache(argv[++i]);
+        } else if (strcmp(arg, "--interface") == 0) {
+            if (i + 1 == argc) {
+                printf("expected a file after '--interface'\n");
+                exit(1);
+            }
+            parse_add_interface(argv[++i]);
+        } else if (strcmp(arg, "--emit-interface") == 0) {
+            if (i + 1 == argc) {
+                printf("expected a file after '--emit-interface'\n");
+                exit(1);
+            }
+            interface_out = argv[++i];
+            flags.interface_only = true;
+        } else if (strcmp(arg, "--emit-ir") == 0) {
+            emit_ir = true;
+        } else if (strcmp(arg, "--serve") == 0) {
+            if (i + 1 == argc) {
+                printf("expected a socket after '--serve'\n");
+                exit(1);
+            }
+            serve_socket = argv[++i];
+        } else if (strcmp(arg, "--connect") == 0) {
+            if (i + 1 == argc) {
+                printf("expected a socket after '--connect'\n");
+                exit(1);
+            }
+            connect_socket = argv[++i];
         } else if (arg[0] == '-') {
             printf("unknown flag '%s'\n", arg);
             exit(1);
@@ -23,12 +69,26 @@ static void parse_args(int argc, char** argv) {
             filepath = arg;
         }
     }
+    // lowering reports against tokens, and a stream doesn't keep them
+    if (flags.stream && emit_ir) {
+        printf("'--stream' can't be used with '--emit-ir'\n");
+        exit(1);
+    }
 }
 
 int main(int argc, char** argv) {
 
     parse_args(argc, argv);
 
+    scan_init(SCAN_BEST);
+
+    if (serve_socket != nullptr) {
+        return serve(serve_socket);
+    }
+    if (connect_socket != nullptr) {
+        return serve_connect(connect_socket, filepath, flags, format);
+    }
+
     FsFile* file = fs_open(filepath, false, false);
     if (file == nullptr) {
         printf("cannot open file %s\n", filepath);
@@ -36,12 +96,14 @@ int main(int argc, char** argv) {
     }
 
     SrcFile f = {
-        .src = fs_read_entire(file),
+        .src = fs_map_entire(file),
         .path = fs_from_path(&file->path),
     };
 
-    Parser p = lex_entrypoint(&f);
+    Parser p = flags.stream ? lex_entrypoint_streaming(&f) : lex_entrypoint(&f);
     p.flags = flags;
+    // nothing needs the tree once the AST's built, so it never gets built whole
+    p.flags.ast = emit_ir;
     
     // p.flags.strict = true;
     // p.flags.error_on_warn = true;
@@ -68,4 +130,23 @@ int main(int argc, char** argv) {
     // printf("\n");
 
     CompilationUnit cu = parse_unit(&p);
+    if (interface_out != nullptr) {
+        parse_write_interface(&cu, interface_out);
+    }
+    if (emit_ir) {
+        Ast ast = ast_build(&cu);
+        FeModule* mod = fe_module_new(FE_ARCH_XR17032, FE_SYSTEM_FREESTANDING);
+        FeInstPool ipool;
+        fe_ipool_init(&ipool);
+        FeVRegBuffer vregs;
+        fe_vrbuf_init(&vregs, 2048);
+        lower_unit(&p, &ast, mod, &ipool, &vregs);
+
+        FeDataBuffer db;
+        fe_db_init(&db, 2048);
+        for_funcs(func, mod) {
+            fe_emit_ir_func(&db, func, false);
+        }
+        printf("%.*s", (int)db.len, db.at);
+    }
 }
@@ -2,17 +2,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <stddef.h>
+#include <threads.h>
+#include <setjmp.h>
 
 #include "parse.h"
 #include "common/str.h"
-#include "common/strmap.h"
+#include "common/atom.h"
 #include "common/util.h"
 #include "common/vec.h"
 #include "coyote.h"
 #include "lex.h"
 
 
-Vec_typedef(char);
 
 static void vec_char_append_str(Vec(char)* vec, const char* data) {
     usize len = strlen(data);
@@ -27,52 +28,91 @@ static void vec_char_append_many(Vec(char)* vec, const char* data, usize len) {
     }
 }
 
-thread_local static struct {
-    TyBufSlot* at;
-    TyIndex* ptrs;
+typedef struct {
+    u32 hash;
+    TyIndex ty; // TY__INVALID if the slot is empty
+} TyInternSlot;
+
+// tybuf is split into pages that never move once allocated, so function bodies
+// being parsed on other threads can look at types while new ones get added.
+// a type never crosses a page boundary.
+#define TY_PAGE_SIZE (1u << 14)
+#define TY_MAX_PAGES ((TY_INDEX_MAX + 1) / TY_PAGE_SIZE)
+
+typedef struct {
+    TyBufSlot at[TY_PAGE_SIZE];
+    _Atomic(TyIndex) ptrs[TY_PAGE_SIZE]; // pointer to this type, if there is one yet
+    bool forward[TY_PAGE_SIZE]; // mentions a type that was only forward-declared when it was built
+} TyPage;
+
+// structural types (pointers, arrays, functions) are hash-consed, so the same
+// structure is only ever in tybuf once and comparing types is comparing indices.
+// pointers get looked up through ptrs, the rest through interned.
+// adding a type takes the lock, looking at one doesn't.
+typedef struct {
+    TyPage* pages[TY_MAX_PAGES];
     u32 len;
-    u32 cap;
-} tybuf;
+    mtx_t lock;
 
-#define TY(index, T) ((T*)&tybuf.at[index])
-#define TY_KIND(index) ((TyBase*)&tybuf.at[index])->kind
+    TyInternSlot* interned;
+    u32 interned_len;
+    u32 interned_cap;
+} TyBuf;
+
+// shared by every thread working on the same compilation unit
+thread_local static TyBuf* tybuf;
+
+#define TY_SLOT(index, field) tybuf->pages[(index) / TY_PAGE_SIZE]->field[(index) % TY_PAGE_SIZE]
+#define TY(index, T) ((T*)&TY_SLOT(index, at))
+#define TY_KIND(index) ((TyBase*)&TY_SLOT(index, at))->kind
+#define TY_PTR_TO(index) TY_SLOT(index, ptrs)
+#define TY_FORWARD(index) TY_SLOT(index, forward)
 
 void ty_init() {
-    tybuf.len = 0;
-    tybuf.cap = 1024;
-    tybuf.at = malloc(sizeof(tybuf.at[0]) * tybuf.cap);
-    tybuf.ptrs = malloc(sizeof(tybuf.ptrs[0]) * tybuf.cap);
-    memset(tybuf.ptrs, 0, sizeof(tybuf.ptrs[0]) * tybuf.cap);
-    
+    tybuf = malloc(sizeof(*tybuf));
+    memset(tybuf->pages, 0, sizeof(tybuf->pages));
+    tybuf->pages[0] = calloc(1, sizeof(TyPage));
+    mtx_init(&tybuf->lock, mtx_plain);
+
+    tybuf->interned_len = 0;
+    tybuf->interned_cap = 256;
+    tybuf->interned = malloc(sizeof(tybuf->interned[0]) * tybuf->interned_cap);
+    memset(tybuf->interned, 0, sizeof(tybuf->interned[0]) * tybuf->interned_cap);
+
     for_n_eq(i, TY_VOID, TY_UQUAD) {
         TY(i,  TyBase)->kind = i;
 
         // init pointer cache
         TY(i + TY_PTR,  TyPtr)->kind = TY_PTR;
         TY(i + TY_PTR,  TyPtr)->to = i;
-        tybuf.ptrs[i] = i + TY_PTR;
+        TY_PTR_TO(i) = i + TY_PTR;
     }
-    tybuf.len = TY_UQUAD + TY_PTR + 1;
+    tybuf->len = TY_UQUAD + TY_PTR + 1;
 }
 
+// tybuf->lock has to be held
 #define ty_allocate(T) ty__allocate(sizeof(T), alignof(T) == 8)
 static TyIndex ty__allocate(usize size, bool align64) {
-    usize old_len = tybuf.len;
-
     usize slots = size / sizeof(TyBufSlot);
-    if (align64 && (tybuf.len & 1)) {
-        tybuf.len += 1; // pad to 64
+    if (align64 && (tybuf->len & 1)) {
+        tybuf->len += 1; // pad to 64
+    }
+    if (tybuf->len % TY_PAGE_SIZE + slots > TY_PAGE_SIZE) {
+        tybuf->len += TY_PAGE_SIZE - tybuf->len % TY_PAGE_SIZE;
+    }
+    if (tybuf->len + slots > TY_INDEX_MAX) {
+        // there's no token to report this at. past here, TY_INDEX_BITS has to go up
+        printf("too many types: the type table is full at %u slots\n", TY_INDEX_MAX);
+        exit(1);
     }
     
-    if (tybuf.len + slots > tybuf.cap) {
-        tybuf.cap += tybuf.cap << 1;
-        tybuf.at = realloc(tybuf.at, sizeof(tybuf.at[0]) * tybuf.cap);
-        tybuf.ptrs = realloc(tybuf.ptrs, sizeof(tybuf.ptrs[0]) * tybuf.cap);
-        memset(&tybuf.ptrs[old_len], 0, sizeof(tybuf.ptrs[0]) * (tybuf.cap - old_len));
+    TyPage** page = &tybuf->pages[tybuf->len / TY_PAGE_SIZE];
+    if (*page == nullptr) {
+        *page = calloc(1, sizeof(TyPage));
     }
 
-    usize pos = tybuf.len;
-    tybuf.len += slots;
+    usize pos = tybuf->len;
+    tybuf->len += slots;
     return pos;
 }
 
@@ -84,17 +124,171 @@ static TyIndex ty_get_ptr(TyIndex t) {
     if (t < TY_PTR) {
         return t + TY_PTR;
     }
-    if (tybuf.ptrs[t] == 0) {
-        // we have to create a pointer type since none exists.
-        TyIndex ptr = ty_allocate(TyPtr);
+    TyIndex ptr = TY_PTR_TO(t);
+    if (ptr != 0) {
+        return ptr;
+    }
+
+    // we have to create a pointer type since none exists,
+    // unless someone else just did
+    mtx_lock(&tybuf->lock);
+    ptr = TY_PTR_TO(t);
+    if (ptr == 0) {
+        ptr = ty_allocate(TyPtr);
         TY(ptr, TyPtr)->kind = TY_PTR;
         TY(ptr, TyPtr)->to = t;
-        
-        tybuf.ptrs[t] = ptr;
-        return ptr;
-    } else {
-        return tybuf.ptrs[t];
+        TY_FORWARD(ptr) = TY_FORWARD(t);
+        TY_PTR_TO(t) = ptr;
+    }
+    mtx_unlock(&tybuf->lock);
+    return ptr;
+}
+
+static u32 ty_hash_mix(u32 hash, u32 x) {
+    return (hash ^ x) * 16777619u;
+}
+
+static u32 ty_hash(TyIndex t) {
+    u32 hash = ty_hash_mix(2166136261u, TY_KIND(t));
+    switch (TY_KIND(t)) {
+    case TY_ARRAY:
+        hash = ty_hash_mix(hash, TY(t, TyArray)->to);
+        return ty_hash_mix(hash, TY(t, TyArray)->len);
+    case TY_FN:
+        TyFn* fn = TY(t, TyFn);
+        hash = ty_hash_mix(hash, fn->len | fn->variadic << 8);
+        hash = ty_hash_mix(hash, fn->ret_ty);
+        for_n(i, 0, fn->len) {
+            Ty_FnParam* param = &fn->params[i];
+            if (fn->variadic && i == fn->len - 1) {
+                hash = ty_hash_mix(hash, param->varargs.argv);
+                hash = ty_hash_mix(hash, param->varargs.argc);
+            } else {
+                hash = ty_hash_mix(hash, param->ty | param->out << TY_INDEX_BITS);
+                hash = ty_hash_mix(hash, param->name);
+            }
+        }
+        return hash;
+    default:
+        UNREACHABLE;
+    }
+}
+
+// children are interned already, so comparing them is comparing indices
+static bool ty_same_structure(TyIndex t1, TyIndex t2) {
+    if (TY_KIND(t1) != TY_KIND(t2)) {
+        return false;
+    }
+    switch (TY_KIND(t1)) {
+    case TY_ARRAY:
+        return TY(t1, TyArray)->to == TY(t2, TyArray)->to && TY(t1, TyArray)->len == TY(t2, TyArray)->len;
+    case TY_FN:
+        TyFn* fn1 = TY(t1, TyFn);
+        TyFn* fn2 = TY(t2, TyFn);
+        if (fn1->len != fn2->len || fn1->variadic != fn2->variadic || fn1->ret_ty != fn2->ret_ty) {
+            return false;
+        }
+        for_n(i, 0, fn1->len) {
+            Ty_FnParam* p1 = &fn1->params[i];
+            Ty_FnParam* p2 = &fn2->params[i];
+            if (fn1->variadic && i == fn1->len - 1) {
+                if (p1->varargs.argv != p2->varargs.argv || p1->varargs.argc != p2->varargs.argc) {
+                    return false;
+                }
+            } else if (p1->ty != p2->ty || p1->out != p2->out || p1->name != p2->name) {
+                return false;
+            }
+        }
+        return true;
+    default:
+        UNREACHABLE;
+    }
+}
+
+static void ty_interned_grow() {
+    u32 old_cap = tybuf->interned_cap;
+    TyInternSlot* old = tybuf->interned;
+
+    tybuf->interned_cap = old_cap * 2;
+    tybuf->interned = malloc(sizeof(tybuf->interned[0]) * tybuf->interned_cap);
+    memset(tybuf->interned, 0, sizeof(tybuf->interned[0]) * tybuf->interned_cap);
+
+    for_n(i, 0, old_cap) {
+        TyInternSlot slot = old[i];
+        if (slot.ty == TY__INVALID) continue;
+        u32 j = slot.hash & (tybuf->interned_cap - 1);
+        while (tybuf->interned[j].ty != TY__INVALID) {
+            j = (j + 1) & (tybuf->interned_cap - 1);
+        }
+        tybuf->interned[j] = slot;
+    }
+    free(old);
+}
+
+// t was just built at the end of tybuf, starting from mark. if the same type
+// already exists, t gets thrown away and the existing one is returned instead.
+static TyIndex ty_intern(TyIndex t, u32 mark) {
+    // keep the load under half so probes stay short
+    if (tybuf->interned_len * 2 >= tybuf->interned_cap) {
+        ty_interned_grow();
+    }
+
+    u32 hash = ty_hash(t);
+    u32 i = hash & (tybuf->interned_cap - 1);
+    for (; tybuf->interned[i].ty != TY__INVALID; i = (i + 1) & (tybuf->interned_cap - 1)) {
+        if (tybuf->interned[i].hash == hash && ty_same_structure(tybuf->interned[i].ty, t)) {
+            tybuf->len = mark;
+            return tybuf->interned[i].ty;
+        }
+    }
+    tybuf->interned[i] = (TyInternSlot){.hash = hash, .ty = t};
+    tybuf->interned_len++;
+    return t;
+}
+
+static TyIndex ty_get_array(TyIndex to, u32 len) {
+    mtx_lock(&tybuf->lock);
+    u32 mark = tybuf->len;
+    TyIndex arr = ty_allocate(TyArray);
+    TY(arr, TyArray)->kind = TY_ARRAY;
+    TY(arr, TyArray)->to = to;
+    TY(arr, TyArray)->len = len;
+    TY_FORWARD(arr) = TY_FORWARD(to);
+    arr = ty_intern(arr, mark);
+    mtx_unlock(&tybuf->lock);
+    return arr;
+}
+
+static TyIndex ty_get_fn(TyIndex ret_ty, bool variadic, Ty_FnParam* params, usize params_len) {
+    mtx_lock(&tybuf->lock);
+    u32 mark = tybuf->len;
+    TyIndex proto = ty__allocate(sizeof(TyFn) + sizeof(Ty_FnParam) * params_len, max(alignof(TyFn), alignof(Ty_FnParam)) == 8);
+    TyFn* fn = TY(proto, TyFn);
+    fn->kind = TY_FN;
+    fn->len = params_len;
+    fn->variadic = variadic;
+    fn->ret_ty = ret_ty;
+    fn->name = (CompactString){};
+    memcpy(fn->params, params, sizeof(Ty_FnParam) * params_len);
+
+    bool forward = TY_FORWARD(ret_ty);
+    for_n(i, 0, params_len - variadic) {
+        forward |= TY_FORWARD(params[i].ty);
     }
+    TY_FORWARD(proto) = forward;
+    proto = ty_intern(proto, mark);
+    mtx_unlock(&tybuf->lock);
+    return proto;
+}
+
+static TyIndex ty_new_incomplete(Entity* entity) {
+    mtx_lock(&tybuf->lock);
+    TyIndex t = ty_allocate(TyAlias);
+    TY_KIND(t) = TY_ALIAS_INCOMPLETE;
+    TY(t, TyAlias)->entity = entity;
+    TY_FORWARD(t) = true;
+    mtx_unlock(&tybuf->lock);
+    return t;
 }
 
 
@@ -116,8 +310,7 @@ static void _ty_name(Vec(char)* v, TyIndex t) {
         return;
     case TY_ALIAS:
     case TY_ALIAS_INCOMPLETE:
-        CompactString compact_name = TY(t, TyAlias)->entity->name;
-        string name = from_compact(compact_name);
+        string name = atom_str(TY(t, TyAlias)->entity->name);
         vec_char_append_many(v, name.raw, name.len);
         return;
     default: vec_char_append_str(v, "???");
@@ -152,7 +345,7 @@ static bool ty_is_integer(TyIndex t) {
     return false;
 }
 
-static bool ty_is_signed(TyIndex t) {
+bool ty_is_signed(TyIndex t) {
     switch (t) {
     case TY_BYTE:
     case TY_INT:
@@ -169,7 +362,7 @@ thread_local static TyIndex target_word  = TY_LONG;
 thread_local static TyIndex target_uword = TY_ULONG;
 #define TY_VOIDPTR (TY_VOID + TY_PTR)
 
-static usize ty_size(TyIndex t) {
+usize ty_size(TyIndex t) {
     switch (t) {
     case TY_VOID: return 0;
     case TY_BYTE:
@@ -192,79 +385,114 @@ static usize ty_size(TyIndex t) {
     TODO("AAAA");
 }
 
-static bool ty_equal(TyIndex t1, TyIndex t2) {
-    if (t1 == t2) {
-        return true;
-    }
-    while (TY_KIND(t1) == TY_ALIAS) {
-        t1 = TY(t1, TyAlias)->aliasing;
-    }
-    while (TY_KIND(t2) == TY_ALIAS) {
-        t2 = TY(t2, TyAlias)->aliasing;
-    }
-    if (t1 == t2) {
-        return true;
+static TyIndex ty_unalias(TyIndex t) {
+    while (TY_KIND(t) == TY_ALIAS) {
+        t = TY(t, TyAlias)->aliasing;
     }
+    return t;
+}
+
+TyKind ty_kind(TyIndex t) {
+    return TY_KIND(ty_unalias(t));
+}
 
-    if (TY_KIND(t1) == TY_PTR && TY_KIND(t2) == TY_PTR) {
-        return ty_equal(TY(t1, TyPtr)->to, TY(t2, TyPtr)->to);
+TyFn* ty_fn(TyIndex t) {
+    t = ty_unalias(t);
+    if (TY_KIND(t) != TY_FN) {
+        CRASH("ty_fn on a %s", ty_name(t));
     }
+    return TY(t, TyFn);
+}
 
-    // function type checking
-    if (TY_KIND(t1) == TY_FN && TY_KIND(t2) == TY_FN) {
-        TyFn* fn1 = TY(t1, TyFn);
-        TyFn* fn2 = TY(t2, TyFn);
+TyIndex ty_target(TyIndex t) {
+    return ty_get_ptr_target(ty_unalias(t));
+}
 
-        if (fn1->len != fn2->len || fn1->variadic != fn2->variadic) {
-            return false;
-        }
+TyIndex ty_pointer_to(TyIndex t) {
+    return ty_get_ptr(t);
+}
 
-        if (!ty_equal(fn1->ret_ty, fn2->ret_ty)) {
-            return false;
+void ty_table_stats(u32* slots, usize* bytes) {
+    mtx_lock(&tybuf->lock);
+    *slots = tybuf->len;
+    *bytes = sizeof(TyBuf) + sizeof(tybuf->interned[0]) * tybuf->interned_cap;
+    for_n(i, 0, TY_MAX_PAGES) {
+        if (tybuf->pages[i] != nullptr) {
+            *bytes += sizeof(TyPage);
         }
+    }
+    mtx_unlock(&tybuf->lock);
+}
 
-        for_n(i, 0, fn1->len - 1) {
-            Ty_FnParam p1 = fn1->params[i];
-            Ty_FnParam p2 = fn2->params[i];
-            
-            if (p1.out != p2.out) {
-                return false;
-            }
-            if (!ty_equal(p1.ty, p2.ty)) {
-                return false;
-            }
-            if (!string_eq(from_compact(p1.name), from_compact(p2.name))) {
-                return false;
-            }
+// aliases ty_canonical is in the middle of. one that comes up again inside
+// itself is recursive, like TYPE Node : ^Node, and stays an alias from there.
+#define TY_CANONICAL_MAX_DEPTH 64
+thread_local static TyIndex canonical_aliases[TY_CANONICAL_MAX_DEPTH];
+thread_local static u32 canonical_aliases_len = 0;
+
+static TyIndex ty_canonical_unaliased(TyIndex t);
+
+// the type t would have been if every alias it was built on had been
+// declared already. only different from t if it's forward.
+static TyIndex ty_canonical(TyIndex t) {
+    if (TY_KIND(t) != TY_ALIAS) {
+        return ty_canonical_unaliased(t);
+    }
+    for_n(i, 0, canonical_aliases_len) {
+        if (canonical_aliases[i] == t) {
+            return t;
         }
+    }
+    if (canonical_aliases_len == TY_CANONICAL_MAX_DEPTH) {
+        return ty_unalias(t);
+    }
+    canonical_aliases[canonical_aliases_len++] = t;
+    TyIndex canonical = ty_canonical_unaliased(ty_unalias(t));
+    canonical_aliases_len--;
+    return canonical;
+}
 
-        if (fn1->variadic) {
-            Ty_FnParam p1 = fn1->params[fn1->len - 1];
-            Ty_FnParam p2 = fn2->params[fn1->len - 1];
-            if (!string_eq(from_compact(p1.varargs.argv), from_compact(p2.varargs.argv))) {
-                return false;
-            }
-            if (!string_eq(from_compact(p1.varargs.argc), from_compact(p2.varargs.argc))) {
-                return false;
-            }
-        } else if (fn1->len != 0) {
-            Ty_FnParam p1 = fn1->params[fn1->len - 1];
-            Ty_FnParam p2 = fn2->params[fn1->len - 1];
-            
-            if (p1.out != p2.out) {
-                return false;
-            }
-            if (!ty_equal(p1.ty, p2.ty)) {
-                return false;
-            }
-            if (!string_eq(from_compact(p1.name), from_compact(p2.name))) {
-                return false;
-            }
+static TyIndex ty_canonical_unaliased(TyIndex t) {
+    if (!TY_FORWARD(t)) {
+        return t;
+    }
+    switch (TY_KIND(t)) {
+    case TY_PTR:
+        return ty_get_ptr(ty_canonical(TY(t, TyPtr)->to));
+    case TY_ARRAY:
+        return ty_get_array(ty_canonical(TY(t, TyArray)->to), TY(t, TyArray)->len);
+    case TY_FN:
+        // t is interned and other types share it, so canonicalize the params in a copy
+        ArenaScratch scratch = arena_scratch_begin();
+        TyFn* fn = TY(t, TyFn);
+        usize len = fn->len;
+        bool variadic = fn->variadic;
+        TyIndex ret_ty = fn->ret_ty;
+        Ty_FnParam* params = arena_alloc(scratch.arena, sizeof(Ty_FnParam) * len, alignof(Ty_FnParam));
+        memcpy(params, fn->params, sizeof(Ty_FnParam) * len);
+        for_n(i, 0, len - variadic) {
+            params[i].ty = ty_canonical(params[i].ty);
         }
-        return true; // guess they are equal after all...
+        TyIndex canonical = ty_get_fn(ty_canonical(ret_ty), variadic, params, len);
+        arena_scratch_end(scratch);
+        return canonical;
+    default:
+        return t; // still incomplete
     }
+}
 
-    return t1 == t2;
+static bool ty_equal(TyIndex t1, TyIndex t2) {
+    t1 = ty_unalias(t1);
+    t2 = ty_unalias(t2);
+    if (t1 == t2) {
+        return true;
+    }
+    // the same structure always has the same index, unless part of it was an alias
+    // that got declared after the type was built
+    if (!TY_FORWARD(t1) && !TY_FORWARD(t2)) {
+        return false;
+    }
+    return ty_canonical(t1) == ty_canonical(t2);
 }
 
 static bool ty_compatible(TyIndex dst, TyIndex src, bool src_is_constant) {
@@ -287,31 +515,31 @@ static bool ty_compatible(TyIndex dst, TyIndex src, bool src_is_constant) {
     return false;
 }
 
-void enter_scope(Parser* p) {
-    // re-use subscope if possible
-    if (p->current_scope->sub) {
-        p->current_scope = p->current_scope->sub;
-        if (p->current_scope->map.size != 0) {
-            strmap_reset(&p->current_scope->map);
-        }
-        return;
-    }
+static u32 innermost_binding(ParseScopes* s, Atom name) {
+    return name < s->innermost.len ? s->innermost.at[name] : NO_BINDING;
+}
 
-    // create a new scope
-    ParseScope* scope = malloc(sizeof(ParseScope));
-    scope->sub = nullptr;
-    scope->super = p->current_scope;
-    p->current_scope->sub = scope;
-    strmap_init(&scope->map, 128);
+static void set_innermost_binding(ParseScopes* s, Atom name, u32 index) {
+    while (s->innermost.len <= name) {
+        vec_append(&s->innermost, NO_BINDING);
+    }
+    s->innermost.at[name] = index;
+}
 
-    p->current_scope = p->current_scope->sub;
+void enter_scope(Parser* p) {
+    vec_append(&p->scopes.marks, p->scopes.bindings.len);
 }
 
 void exit_scope(Parser* p) {
-    if (p->current_scope == p->global_scope) {
+    ParseScopes* s = &p->scopes;
+    if (s->marks.len == 0) {
         CRASH("exited global scope");
     }
-    p->current_scope = p->current_scope->super;
+    u32 start = vec_pop(&s->marks);
+    while (s->bindings.len > start) {
+        ScopeBinding* b = &s->bindings.at[--s->bindings.len];
+        set_innermost_binding(s, b->name, b->shadowed);
+    }
 }
 
 // general dynamic buffer for parsing shit
@@ -333,34 +561,68 @@ static inline usize dynbuf_len(usize start) {
 
 static inline void** dynbuf_to_arena(Parser* p, usize start) {
     usize len = dynbuf.len - start;
-    void** items = arena_alloc(&p->arena, len * sizeof(items[0]), alignof(void*));
-    memcpy(items, &dynbuf.at[len], len * sizeof(items[0]));
+    void** items = arena_alloc(&p->nodes, len * sizeof(items[0]), alignof(void*));
+    memcpy(items, &dynbuf.at[start], len * sizeof(items[0]));
     return items;
 }
 
-Entity* new_entity(Parser* p, string ident, EntityKind kind) {
+// declare it in the current scope, regardless of where the cursor is
+static Entity* new_entity_in_scope(Parser* p, Atom name, EntityKind kind) {
     Entity* entity = arena_alloc(&p->arena, sizeof(Entity), alignof(Entity));
-    entity->name = to_compact(ident);
+    *entity = (Entity){};
+    entity->name = name;
     entity->kind = kind;
     entity->ty = TY__INVALID;
-    strmap_put(&p->current_scope->map, ident, entity);
+    if (name == ATOM_NONE) {
+        return entity;
+    }
+
+    ParseScopes* s = &p->scopes;
+    u32 i = innermost_binding(s, name);
+    u32 scope_start = s->marks.len != 0 ? s->marks.at[s->marks.len - 1] : 0;
+    if (i != NO_BINDING && i >= scope_start) {
+        // already in this scope, the new one replaces it
+        s->bindings.at[i].entity = entity;
+        return entity;
+    }
+    ScopeBinding b = {
+        .name = name,
+        .shadowed = i,
+        .entity = entity,
+    };
+    vec_append(&s->bindings, b);
+    set_innermost_binding(s, name, s->bindings.len - 1);
     return entity;
 }
 
-Entity* get_entity(Parser* p, string key) {
-    ParseScope* scope = p->current_scope;
-    while (scope) {
-        Entity* entity = strmap_get(&scope->map, key);
-        if (entity != STRMAP_NOT_FOUND) {
-            return entity;
-        }
-        scope = scope->super;
+// declare it where the cursor is. things declared inside an expansion stay inside it,
+// and since most never declare anything, they only get a scope once they do.
+Entity* new_entity(Parser* p, Atom name, EntityKind kind) {
+    if (p->expansion_depth != 0 && p->expansion_scopes[p->expansion_depth - 1] == 0) {
+        enter_scope(p);
+        p->expansion_scopes[p->expansion_depth - 1] = p->scopes.marks.len;
     }
-    return nullptr;
+    return new_entity_in_scope(p, name, kind);
+}
+
+static void fn_body_record_lookup(Parser* p, Atom name);
+static void global_will_change(Parser* p, Entity* entity, bool alias);
+
+Entity* get_entity(Parser* p, Atom key) {
+    ParseScopes* s = &p->scopes;
+    u32 i = innermost_binding(s, key);
+    while (i != NO_BINDING && s->globals_visible <= i && i < s->globals_len) {
+        i = s->bindings.at[i].shadowed;
+    }
+    // a body only gets recorded on its own thread, so globals_len is where its locals start
+    if (p->recording != nullptr && (i == NO_BINDING || i < s->globals_len)) {
+        fn_body_record_lookup(p, key);
+    }
+    return i != NO_BINDING ? s->bindings.at[i].entity : nullptr;
 }
 
 static bool token_is_within(SrcFile* f, char* raw) {
-    return (uintptr_t)f->src.raw < (uintptr_t)raw
+    return (uintptr_t)f->src.raw <= (uintptr_t)raw
         && (uintptr_t)f->src.raw + f->src.len > (uintptr_t)raw;
 }
 
@@ -374,75 +636,117 @@ static SrcFile* where_from(Parser* ctx, string span) {
     return nullptr;
 }
 
-static usize preproc_depth(Parser* ctx, u32 index) {
-    usize depth = 0;
-    for_n(i, 0, index) {
-        Token t = ctx->tokens[i];
-        switch (t.kind) {
-        case TOK_PREPROC_MACRO_PASTE:
-        case TOK_PREPROC_DEFINE_PASTE:
+// the INCLUDE_PASTE markers of the files index is in, innermost first.
+// when streaming, only the ones still in the window.
+static u32 includes_around(Parser* ctx, u32 index, u32* includes) {
+    u32 len = 0;
+    if (ctx->includes_changed < index && index <= ctx->cursor) {
+        // nothing's been included or ended between index and the cursor
+        for (u32 i = ctx->includes_len; i != 0 && ctx->includes[i - 1] >= ctx->window_start; --i) {
+            includes[len++] = ctx->includes[i - 1];
+        }
+        return len;
+    }
+
+    i32 unmatched_include_ends = 0;
+    for (i64 i = (i64)index; i >= ctx->window_start; --i) {
+        switch (tok_at(ctx, i).kind) {
         case TOK_PREPROC_INCLUDE_PASTE:
-            depth++;
+            if (unmatched_include_ends != 0) {
+                unmatched_include_ends--;
+                break;
+            }
+            includes[len++] = i;
             break;
-        case TOK_PREPROC_PASTE_END:
-            depth--;
+        case TOK_PREPROC_INCLUDE_END:
+            unmatched_include_ends++;
             break;
         }
     }
-    return depth;
+    return len;
+}
+
+// an error doesn't come back, so the lexer thread shouldn't wait for this parser
+// to make room. only once the line's been put together, since that can still pull.
+static void token_error_stop_stream(Parser* ctx, ReportKind kind) {
+    if (kind == REPORT_ERROR && ctx->stream != nullptr) {
+        token_stream_cancel(ctx->stream);
+    }
 }
 
 void token_error(Parser* ctx, ReportKind kind, u32 start_index, u32 end_index, const char* msg) {
-    // find out if we're in a macro somewhere
-    bool inside_preproc = preproc_depth(ctx, start_index) != 0 || preproc_depth(ctx, end_index) != 0;
+    // anything before the window has already been dropped by the token stream
+    start_index = max(start_index, ctx->window_start);
+    end_index = max(end_index, start_index);
+
+    // find out if we're in a macro somewhere.
+    // when streaming, expansions that ended before the window are already gone,
+    // but those can't be around anything in it anyway.
+    u32 start_expansion = tok_expansion(ctx, start_index);
+    u32 end_expansion = tok_expansion(ctx, end_index);
+    bool inside_preproc = start_expansion != EXPANSION_NONE || end_expansion != EXPANSION_NONE;
 
     Vec_typedef(ReportLine);
     Vec(ReportLine) reports = vec_new(ReportLine, 8);
 
-    i32 unmatched_ends = 0;
-    for (i64 i = (i64)start_index; i > 0; --i) {
-        Token t = ctx->tokens[i];
+    // notes go innermost first, by where each include or expansion starts.
+    // an include marker goes before an expansion that starts on it.
+    u32 includes[MAX_INCLUDE_DEPTH];
+    u32 includes_len = includes_around(ctx, start_index, includes);
+    u32 e = start_expansion;
+    u32 k = 0;
+    while (true) {
+        bool have_include = k < includes_len;
+        bool have_expansion = e != EXPANSION_NONE && expansion_at(ctx, e)->start >= ctx->window_start;
+        if (!have_include && !have_expansion) {
+            break;
+        }
 
         ReportLine report = {};
         report.kind = REPORT_NOTE;
+        report.token_index = start_index;
 
-        switch (t.kind) {
-        case TOK_PREPROC_DEFINE_PASTE:
-        case TOK_PREPROC_MACRO_PASTE:
-            if (unmatched_ends != 0) {
-                unmatched_ends--;
-                break;
+        if (have_include && (!have_expansion || includes[k] >= expansion_at(ctx, e)->start)) {
+            Token t = tok_at(ctx, includes[k++]);
+            SrcFile* includer = where_from(ctx, tok_span(t));
+            if (!includer) {
+                CRASH("unable to locate include span source file");
             }
-            SrcFile* from = where_from(ctx, tok_span(t));
+            report.msg = constr("included from here");
+            report.file = includer;
+            report.snippet = tok_span(t);
+        } else {
+            Token site = expansion_at(ctx, e)->site;
+            SrcFile* from = where_from(ctx, tok_span(site));
             if (!from) {
                 CRASH("unable to locate macro paste span source file");
             }
-            report.msg = strprintf("using macro '"str_fmt"'", str_arg(tok_span(t)));
-            report.path = from->path;
-            report.src = from->src;
-            report.snippet = tok_span(t);
-            vec_append(&reports, report);
-            break;
-        case TOK_PREPROC_PASTE_END:
-            unmatched_ends++;
-            break;
+            report.msg = strprintf("using macro '"str_fmt"'", str_arg(tok_span(site)));
+            report.file = from;
+            report.snippet = tok_span(site);
+            e = expansion_at(ctx, e)->parent;
         }
+        vec_append(&reports, report);
     }
 
+    for_n(i, 0, reports.len) {
+        report_line(&reports.at[i]);
+    }
     
     // find main line snippet
     SrcFile* main_file = ctx->sources.at[0];
     if (inside_preproc) {
-        for_n(i, 0, reports.len) {
-            report_line(&reports.at[i]);
-        }
-
+        // where the outermost expansion around the end was used, if it's done yet
         string main_highlight = {};
-        for_n(i, end_index, ctx->tokens_len) {
-            Token t = ctx->tokens[i];
-            if (t.kind == TOK_PREPROC_PASTE_END && preproc_depth(ctx, i + 1) == 0) {
-                main_highlight = tok_span(t);
-                break;
+        if (end_expansion != EXPANSION_NONE) {
+            u32 outer = end_expansion;
+            while (expansion_at(ctx, outer)->parent != EXPANSION_NONE
+                && expansion_at(ctx, outer)->parent >= ctx->expansions_start
+            ) {
+                outer = expansion_at(ctx, outer)->parent;
+            }
+            if (expansion_at(ctx, outer)->end != EXPANSION_OPEN) {
+                main_highlight = tok_span(expansion_at(ctx, outer)->call);
             }
         }
 
@@ -451,23 +755,16 @@ void token_error(Parser* ctx, ReportKind kind, u32 start_index, u32 end_index, c
 
         // construct the line
         u32 expanded_snippet_begin_index = start_index;    
-        while (true) {
-            u8 kind = ctx->tokens[expanded_snippet_begin_index].kind;
-            if (kind == TOK_NEWLINE) {
-                expanded_snippet_begin_index += 1;
-                break;
-            }
-            if (expanded_snippet_begin_index == 0) {
-                break;
-            }
+        while (expanded_snippet_begin_index != ctx->window_start
+            && !tok_newline_before(ctx, expanded_snippet_begin_index)
+        ) {
             expanded_snippet_begin_index -= 1;
         }
         u32 expanded_snippet_end_index = end_index;
-        while (true) {
-            u8 kind = ctx->tokens[expanded_snippet_end_index].kind;
-            if (kind == TOK_NEWLINE || expanded_snippet_end_index == ctx->tokens_len - 1) {
-                break;
-            }
+        while (expanded_snippet_end_index != ctx->tokens_len - 1
+            && tok_at(ctx, expanded_snippet_end_index).kind != TOK_EOF
+            && !tok_newline_before(ctx, expanded_snippet_end_index + 1)
+        ) {
             expanded_snippet_end_index += 1;
         }
 
@@ -480,11 +777,12 @@ void token_error(Parser* ctx, ReportKind kind, u32 start_index, u32 end_index, c
             if (i == start_index) {
                 expanded_snippet_highlight_start = expanded_snippet.len;
             }
-            Token t = ctx->tokens[i];
+            Token t = tok_at(ctx, i);
             if (_TOK_LEX_IGNORE < t.kind) {
                 continue;
             }
-            vec_char_append_many(&expanded_snippet, tok_raw(t), t.len);
+            string span = tok_span_at(ctx, i);
+            vec_char_append_many(&expanded_snippet, span.raw, span.len);
             if (i == end_index) {
                 expanded_snippet_highlight_len = expanded_snippet.len - expanded_snippet_highlight_start;
             }
@@ -500,75 +798,139 @@ void token_error(Parser* ctx, ReportKind kind, u32 start_index, u32 end_index, c
             .len = expanded_snippet_highlight_len,
         };
 
+        SrcFile* from = where_from(ctx, main_highlight);
+        if (from) {
+            main_file = from;
+        }
+
         ReportLine rep = {
             .kind = kind,
+            .token_index = start_index,
             .msg = str(msg),
-            .path = main_file->path,
-            .src = main_file->src,
+            .file = main_file,
             .snippet = main_highlight,
 
             .reconstructed_line = src,
             .reconstructed_snippet = snippet,
         };
 
+        token_error_stop_stream(ctx, kind);
         report_line(&rep);
     } else {
-        string start_span = tok_span(ctx->tokens[start_index]);
-        string end_span = tok_span(ctx->tokens[end_index]);
+        string start_span = tok_span_at(ctx, start_index);
+        string end_span = tok_span_at(ctx, end_index);
         string span = {
             .raw = start_span.raw,
             .len = (usize)end_span.raw - (usize)start_span.raw + end_span.len,
         };
+        SrcFile* from = where_from(ctx, span);
+        if (from) {
+            main_file = from;
+        }
         ReportLine rep = {
             .kind = kind,
+            .token_index = start_index,
             .msg = str(msg),
-            .path = main_file->path,
+            .file = main_file,
             .snippet = span,
-            .src = main_file->src,
         };
 
+        token_error_stop_stream(ctx, kind);
         report_line(&rep);
     }
 }
 
+// leave the expansions the cursor went past the end of and enter the ones it went into,
+// then work out how far it can go before it has to come back here.
+// in streaming mode, ends can still show up later, so it comes back once per pull too.
+static void update_expansions(Parser* p) {
+    while (true) {
+        if (p->expansion_depth != 0) {
+            u32 end = expansion_at(p, p->expansion)->end;
+            if (end != EXPANSION_OPEN && end <= p->cursor) {
+                p->expansion_depth--;
+                // unless it ended halfway through something with a scope of its own
+                u32 depth = p->expansion_scopes[p->expansion_depth];
+                if (depth != 0 && depth == p->scopes.marks.len) {
+                    exit_scope(p);
+                }
+                p->expansion = expansion_at(p, p->expansion)->parent;
+                continue;
+            }
+        }
+        if (p->next_expansion < p->expansions_len && expansion_at(p, p->next_expansion)->start <= p->cursor) {
+            // anything that ended before the cursor gets left right away
+            p->expansion = p->next_expansion++;
+            p->expansion_scopes[p->expansion_depth++] = 0;
+            continue;
+        }
+        break;
+    }
+
+    u32 boundary = p->tokens_len;
+    if (p->next_expansion < p->expansions_len) {
+        boundary = min(boundary, expansion_at(p, p->next_expansion)->start);
+    }
+    if (p->expansion_depth != 0) {
+        boundary = min(boundary, expansion_at(p, p->expansion)->end);
+    }
+    p->expansion_boundary = boundary;
+}
+
+// keep Parser.includes up to date with a transparent token the cursor went over
+static void pass_marker(Parser* p, u32 index) {
+    switch (tok_at(p, index).kind) {
+    case TOK_PREPROC_INCLUDE_PASTE:
+        if (p->includes_len == MAX_INCLUDE_DEPTH) {
+            TODO("error: max include depth reached");
+        }
+        p->includes[p->includes_len++] = index;
+        p->includes_changed = index;
+        break;
+    case TOK_PREPROC_INCLUDE_END:
+        if (p->includes_len != 0) {
+            p->includes_len--;
+        }
+        p->includes_changed = index;
+        break;
+    }
+}
+
 static void advance(Parser* p) {
     do { // skip past "transparent" tokens.
-        if (p->tokens[p->cursor].kind == TOK_EOF) {
+        if (tok_at(p, p->cursor).kind == TOK_EOF) {
             break;
         }
         ++p->cursor;
-        switch (p->tokens[p->cursor].kind) {
-        case TOK_PREPROC_DEFINE_PASTE:
-        case TOK_PREPROC_MACRO_PASTE:
-            enter_scope(p);
-            break;
-        case TOK_PREPROC_PASTE_END:
-            exit_scope(p);
-            break;
+        if (_TOK_LEX_IGNORE < tok_at(p, p->cursor).kind) {
+            pass_marker(p, p->cursor);
         }
-    } while (_TOK_LEX_IGNORE < p->tokens[p->cursor].kind);
-    p->current = p->tokens[p->cursor];
+    } while (_TOK_LEX_IGNORE < tok_at(p, p->cursor).kind);
+    p->current = tok_at(p, p->cursor);
+    if (p->cursor >= p->expansion_boundary) {
+        update_expansions(p);
+    }
 }
 
 static Token peek(Parser* p, usize n) {
     u32 cursor = p->cursor;
     for_n(_, 0, n) {
         do { // skip past "transparent" tokens.
-            if (p->tokens[cursor].kind == TOK_EOF) {
-                return p->tokens[cursor];
+            if (tok_at(p, cursor).kind == TOK_EOF) {
+                return tok_at(p, cursor);
             }
             ++cursor;
-        } while (_TOK_LEX_IGNORE < p->tokens[cursor].kind);
+        } while (_TOK_LEX_IGNORE < tok_at(p, cursor).kind);
     }
-    return p->tokens[cursor];
+    return tok_at(p, cursor);
 }
 
 static bool has_eof_or_nl(Parser* p, u32 pos) {
-    while (p->tokens[pos].kind != TOK_EOF) {
-        if (p->tokens[pos].kind == TOK_NEWLINE) {
+    while (tok_at(p, pos).kind != TOK_EOF) {
+        if (tok_newline_before(p, pos)) {
             return true;
         }
-        if (p->tokens[pos].kind > _TOK_LEX_IGNORE) {
+        if (tok_at(p, pos).kind > _TOK_LEX_IGNORE) {
             pos++;
             continue;
         }
@@ -582,6 +944,8 @@ static bool match(Parser* p, u8 kind) {
     return p->current.kind == kind;
 }
 
+static void fn_body_record(Parser* p, ReportKind kind, u32 start, u32 end, const char* msg);
+
 static void parse_error(Parser* p, u32 start, u32 end, ReportKind kind, const char* fmt, ...) {
     va_list args;
     va_start(args, fmt);
@@ -596,6 +960,9 @@ static void parse_error(Parser* p, u32 start, u32 end, ReportKind kind, const ch
 
     va_end(args);
 
+    if (p->recording != nullptr) {
+        fn_body_record(p, kind, start, end, sprintf_buf);
+    }
     token_error(p, kind, start, end, sprintf_buf);
 }
 
@@ -614,29 +981,22 @@ static void expect_advance(Parser* p, u8 kind) {
     new_expr_(p, kind, ty, offsetof(Expr, extra) + sizeof(((Expr*)nullptr)->field))
 
 static Expr* new_expr_(Parser* p, u8 kind, TyIndex ty, usize size) {
-    Expr* expr = arena_alloc(&p->arena, size, alignof(Expr));
+    Expr* expr = arena_alloc(&p->nodes, size, alignof(Expr));
     expr->kind = kind;
     expr->ty = ty;
     expr->token_index = p->cursor;
     return expr;
 }
 
-static i64 eval_integer(Parser* p, Token t, u32 index) {
-    i64 val = 0;
-    char* raw = tok_raw(t);
-    bool is_negative = raw[0] == '-';
-
-    for (usize i = is_negative; i < t.len; ++i) {
-        val *= 10;
-        isize char_val = raw[i] - '0';
-        if (char_val < 0 || char_val > 9) {
-            // TODO("invalid digit");
-            parse_error(p, index, index, REPORT_ERROR, "invalid digit '%c'", raw[i]);
-        }
-        val += raw[i] - '0';
+static TokenPayload* literal_payload(Parser* p, u32 index, const char* what) {
+    TokenPayload* payload = tok_payload(p, index);
+    if (payload == nullptr) {
+        CRASH("literal token has no payload");
     }
-
-    return is_negative ? -val : val;
+    if (payload->malformed) {
+        parse_error(p, index, index, REPORT_ERROR, "invalid %s literal", what);
+    }
+    return payload;
 }
 
 u32 expr_leftmost_token(Expr* expr) {
@@ -644,6 +1004,7 @@ u32 expr_leftmost_token(Expr* expr) {
     case EXPR_LITERAL:
     case EXPR_STR_LITERAL:
     case EXPR_NOT:
+    case EXPR_BOOL_NOT:
     case EXPR_ENTITY:
         return expr->token_index;
     case EXPR_DEREF:
@@ -658,6 +1019,14 @@ u32 expr_leftmost_token(Expr* expr) {
     case EXPR_XOR:
     case EXPR_LSH:
     case EXPR_RSH:
+    case EXPR_EQ:
+    case EXPR_NEQ:
+    case EXPR_LESS_EQ:
+    case EXPR_GREATER_EQ:
+    case EXPR_LESS:
+    case EXPR_GREATER:
+    case EXPR_BOOL_AND:
+    case EXPR_BOOL_OR:
         return expr_leftmost_token(expr->binary.lhs);
     default:
         TODO("unknown expr kind %u", expr->kind);
@@ -672,6 +1041,7 @@ u32 expr_rightmost_token(Expr* expr) {
     case EXPR_ENTITY:
         return expr->token_index;
     case EXPR_NOT:
+    case EXPR_BOOL_NOT:
         return expr_rightmost_token(expr->unary);
     case EXPR_ADD:
     case EXPR_SUB:
@@ -683,6 +1053,14 @@ u32 expr_rightmost_token(Expr* expr) {
     case EXPR_XOR:
     case EXPR_LSH:
     case EXPR_RSH:
+    case EXPR_EQ:
+    case EXPR_NEQ:
+    case EXPR_LESS_EQ:
+    case EXPR_GREATER_EQ:
+    case EXPR_LESS:
+    case EXPR_GREATER:
+    case EXPR_BOOL_AND:
+    case EXPR_BOOL_OR:
         return expr_rightmost_token(expr->binary.rhs);
     default:
         TODO("unknown expr kind %u", expr->kind);
@@ -692,6 +1070,18 @@ u32 expr_rightmost_token(Expr* expr) {
 #define error_at_expr(p, expr, report_kind, msg, ...) \
     parse_error(p, expr_leftmost_token(expr), expr_rightmost_token(expr), report_kind, msg __VA_OPT__(,) __VA_ARGS__)
 
+Entity* get_incomplete_type_entity(Parser* p, Atom identifier) {
+    Entity* entity = get_entity(p, identifier);
+    if (!entity) {
+        entity = new_entity(p, identifier, ENTKIND_TYPE);
+        entity->ty = ty_new_incomplete(entity);
+    } else if (entity->kind != ENTKIND_TYPE) {
+        parse_error(p, p->cursor, p->cursor, REPORT_ERROR, 
+            "symbol already declared");
+    }
+    return entity;
+}
+
 TyIndex parse_type_terminal(Parser* p, bool allow_incomplete) {
     switch (p->current.kind) {
     case TOK_KW_VOID:  advance(p); return TY_VOID;
@@ -715,17 +1105,15 @@ TyIndex parse_type_terminal(Parser* p, bool allow_incomplete) {
         return ty_get_ptr(parse_type_terminal(p, true));
     case TOK_IDENTIFIER:
         ;
-        string span = tok_span(p->current);
-        Entity* entity = get_entity(p, span);
+        Atom name = tok_atom(p, p->cursor);
+        Entity* entity = get_entity(p, name);
         if (!entity) { // create an incomplete type
             if (!allow_incomplete) {
                 parse_error(p, p->cursor, p->cursor, REPORT_ERROR, "cannot use incomplete type");
             }
-            TyIndex incomplete = ty_allocate(TyAlias);
-            entity = new_entity(p, span, ENTKIND_TYPE);
-            entity->ty = incomplete;
+            entity = get_incomplete_type_entity(p, name);
             advance(p);
-            return incomplete;
+            return entity->ty;
         }
         if (entity->kind != ENTKIND_TYPE) {
             parse_error(p, p->cursor, p->cursor, REPORT_ERROR, "symbol is not a type");
@@ -752,9 +1140,6 @@ TyIndex parse_type(Parser* p, bool allow_incomplete) {
             parse_error(p, p->cursor, p->cursor, REPORT_ERROR, "cannot use incomplete type");
         }
         advance(p);
-        TyIndex arr = ty_allocate(TyArray);
-        TY(arr, TyArray)->to = left;
-        TY(arr, TyArray)->kind = TY_ARRAY;
         Expr* len_expr = parse_expr(p);
 
         if (!ty_is_integer(len_expr->ty)) {
@@ -766,9 +1151,8 @@ TyIndex parse_type(Parser* p, bool allow_incomplete) {
         if (len_expr->literal > (u64)INT32_MAX) {
             error_at_expr(p, len_expr, REPORT_WARNING, "array length is... excessive");
         }
-        TY(arr, TyArray)->len = len_expr->literal;
         expect_advance(p, TOK_CLOSE_BRACKET);
-        left = arr;
+        left = ty_get_array(left, len_expr->literal);
     }
     return left;
 }
@@ -789,7 +1173,6 @@ static bool is_lvalue(Expr* e) {
 }
 
 Expr* parse_atom_terminal(Parser* p) {
-    string span = tok_span(p->current);
     Expr* atom = nullptr;
     switch (p->current.kind) {
     case TOK_OPEN_PAREN:
@@ -799,7 +1182,28 @@ Expr* parse_atom_terminal(Parser* p) {
         break;
     case TOK_INTEGER:
         atom = new_expr(p, EXPR_LITERAL, target_uword, literal);
-        atom->literal = eval_integer(p, p->current, p->cursor);
+        atom->literal = literal_payload(p, p->cursor, "integer")->integer;
+        advance(p);
+        break;
+    case TOK_CHAR:
+        atom = new_expr(p, EXPR_LITERAL, target_uword, literal);
+        atom->literal = literal_payload(p, p->cursor, "char")->integer;
+        advance(p);
+        break;
+    case TOK_STRING:
+        atom = new_expr(p, EXPR_STR_LITERAL, ty_get_ptr(TY_UBYTE), lit_string);
+        string contents = tok_payload_string(p, literal_payload(p, p->cursor, "string"));
+        if (contents.len > COMPACT_STR_MAX_LEN) {
+            parse_error(p, p->cursor, p->cursor, REPORT_ERROR, "string literal is too long");
+        }
+        if (p->stream || p->flags.resident) {
+            // the stream's byte ring gets reused, and a resident unit's text and
+            // payload bytes get replaced, so keep our own copy
+            char* raw = arena_alloc(&p->arena, contents.len, 1);
+            memcpy(raw, contents.raw, contents.len);
+            contents.raw = raw;
+        }
+        atom->lit_string = to_compact(contents);
         advance(p);
         break;
     case TOK_KW_TRUE:
@@ -826,7 +1230,7 @@ Expr* parse_atom_terminal(Parser* p) {
     case TOK_IDENTIFIER:
         // find an entity
         atom = new_expr(p, EXPR_ENTITY, TY__INVALID, entity);
-        Entity* entity = get_entity(p, span);
+        Entity* entity = get_entity(p, tok_atom(p, p->cursor));
         if (entity == nullptr) {
             parse_error(p, p->cursor, p->cursor, REPORT_ERROR, 
                 "symbol does not exist");
@@ -882,7 +1286,7 @@ Expr* parse_atom(Parser* p) {
 }
 
 Expr* parse_unary(Parser* p) {
-    ArenaState save = arena_save(&p->arena);
+    ArenaState save = arena_save(&p->nodes);
 
     u32 op_position = p->cursor;
 
@@ -939,11 +1343,65 @@ static isize bin_precedence(u8 kind) {
 }
 
 static ExprKind binary_expr_kind(u8 tok_kind) {
+    switch (tok_kind) {
+    case TOK_KW_AND: return EXPR_BOOL_AND;
+    case TOK_KW_OR:  return EXPR_BOOL_OR;
+    }
     return tok_kind - TOK_PLUS + EXPR_ADD;
 }
 
+// work out an operator over two literals, the same as it would go at runtime.
+// constants fold in 64 bits and only get truncated where they end up stored.
+// returns false for anything that has to be left to runtime.
+static bool fold_binary(ExprKind op, bool signed_op, u64 lhs, u64 rhs, u64* result) {
+    i64 ilhs = (i64)lhs;
+    i64 irhs = (i64)rhs;
+    switch (op) {
+    case EXPR_ADD: *result = lhs + rhs; break;
+    case EXPR_SUB: *result = lhs - rhs; break;
+    case EXPR_MUL: *result = lhs * rhs; break;
+    case EXPR_DIV:
+    case EXPR_MOD:
+        if (rhs == 0) {
+            return false;
+        }
+        if (signed_op && ilhs == INT64_MIN && irhs == -1) {
+            // traps on the host, -fwrapv doesn't cover division
+            *result = op == EXPR_DIV ? lhs : 0;
+        } else if (signed_op) {
+            *result = op == EXPR_DIV ? (u64)(ilhs / irhs) : (u64)(ilhs % irhs);
+        } else {
+            *result = op == EXPR_DIV ? lhs / rhs : lhs % rhs;
+        }
+        break;
+    case EXPR_AND: *result = lhs & rhs; break;
+    case EXPR_OR:  *result = lhs | rhs; break;
+    case EXPR_XOR: *result = lhs ^ rhs; break;
+    // shifting everything out is well-defined here, unlike in C
+    case EXPR_LSH: *result = rhs >= 64 ? 0 : lhs << rhs; break;
+    case EXPR_RSH:
+        if (signed_op) {
+            *result = (u64)(ilhs >> min(rhs, 63));
+        } else {
+            *result = rhs >= 64 ? 0 : lhs >> rhs;
+        }
+        break;
+    case EXPR_EQ:  *result = lhs == rhs; break;
+    case EXPR_NEQ: *result = lhs != rhs; break;
+    case EXPR_LESS_EQ:    *result = signed_op ? ilhs <= irhs : lhs <= rhs; break;
+    case EXPR_GREATER_EQ: *result = signed_op ? ilhs >= irhs : lhs >= rhs; break;
+    case EXPR_LESS:       *result = signed_op ? ilhs < irhs  : lhs < rhs; break;
+    case EXPR_GREATER:    *result = signed_op ? ilhs > irhs  : lhs > rhs; break;
+    case EXPR_BOOL_AND: *result = lhs != 0 && rhs != 0; break;
+    case EXPR_BOOL_OR:  *result = lhs != 0 || rhs != 0; break;
+    default:
+        UNREACHABLE;
+    }
+    return true;
+}
+
 Expr* parse_binary(Parser* p, isize precedence) {
-    ArenaState save = arena_save(&p->arena);
+    ArenaState save = arena_save(&p->nodes);
     Expr* lhs = parse_unary(p);
     
     while (precedence < bin_precedence(p->current.kind)) {
@@ -959,83 +1417,27 @@ Expr* parse_binary(Parser* p, isize precedence) {
                 "type %s and %s are not compatible", ty_name(lhs->ty), ty_name(rhs->ty));
         }
 
+        // the left operand's type wins, except a bare constant takes after
+        // whatever it's being used with
         TyIndex op_ty = lhs->ty;
-        if (lhs->kind == EXPR_LITERAL && rhs->ty != EXPR_LITERAL) {
+        if (lhs->kind == EXPR_LITERAL && rhs->kind != EXPR_LITERAL) {
             op_ty = rhs->ty;
         }
-        
-        if (lhs->kind == EXPR_LITERAL && rhs->kind == EXPR_LITERAL) {
-            bool signed_op = ty_is_signed(lhs->ty) || ty_is_signed(rhs->ty);
-            u64 lhs_val = lhs->literal;
-            u64 rhs_val = rhs->literal;
-            u32 leftmost = expr_leftmost_token(lhs);
 
-            arena_restore(&p->arena, save);
+        u64 folded;
+        bool can_fold = lhs->kind == EXPR_LITERAL && rhs->kind == EXPR_LITERAL;
+        if (can_fold && !fold_binary(op_kind, ty_is_signed(op_ty), lhs->literal, rhs->literal, &folded)) {
+            parse_error(p, op_token, op_token, REPORT_WARNING, "division by zero");
+            can_fold = false;
+        }
+
+        if (can_fold) {
+            // neither side is needed anymore, so reuse their space
+            u32 leftmost = expr_leftmost_token(lhs);
+            arena_restore(&p->nodes, save);
             Expr* lit = new_expr(p, EXPR_LITERAL, op_ty, literal);
             lit->token_index = leftmost;
-            
-            switch (op_kind) {
-            case EXPR_ADD: lit->literal = lhs_val + rhs_val; break;
-            case EXPR_SUB: lit->literal = lhs_val - rhs_val; break;
-            case EXPR_MUL: lit->literal = lhs_val * rhs_val; break;
-            case EXPR_DIV: 
-                if (signed_op) {
-                    lit->literal = (isize)lhs_val / (isize)rhs_val;
-                } else {
-                    lit->literal = lhs_val / rhs_val;
-                }
-                break;
-            case EXPR_MOD: 
-                if (signed_op) {
-                    lit->literal = (isize)lhs_val % (isize)rhs_val;
-                } else {
-                    lit->literal = lhs_val % rhs_val;
-                }
-                break;
-            case EXPR_AND: lit->literal = lhs_val & rhs_val; break;
-            case EXPR_OR:  lit->literal = lhs_val | rhs_val; break;
-            case EXPR_XOR: lit->literal = lhs_val ^ rhs_val; break;
-            case EXPR_LSH: lit->literal = lhs_val << rhs_val; break;
-            case EXPR_RSH:
-                if (signed_op) {
-                    lit->literal = (isize)lhs_val >> (isize)rhs_val;
-                } else {
-                    lit->literal = lhs_val >> rhs_val;
-                }
-                break;
-            case EXPR_EQ:  lit->literal = lhs_val == rhs_val; break;
-            case EXPR_NEQ: lit->literal = lhs_val != rhs_val; break;
-            case EXPR_LESS_EQ:
-                if (signed_op) {
-                    lit->literal = (isize)lhs_val <= (isize)rhs_val;
-                } else {
-                    lit->literal = lhs_val <= rhs_val;
-                }
-                break;
-            case EXPR_GREATER_EQ:
-                if (signed_op) {
-                    lit->literal = (isize)lhs_val >= (isize)rhs_val;
-                } else {
-                    lit->literal = lhs_val >= rhs_val;
-                }
-                break;
-            case EXPR_LESS:
-                if (signed_op) {
-                    lit->literal = (isize)lhs_val < (isize)rhs_val;
-                } else {
-                    lit->literal = lhs_val < rhs_val;
-                }
-                break;
-            case EXPR_GREATER:
-                if (signed_op) {
-                    lit->literal = (isize)lhs_val > (isize)rhs_val;
-                } else {
-                    lit->literal = lhs_val > rhs_val;
-                }
-                break;
-            default:
-                UNREACHABLE;
-            }
+            lit->literal = folded;
             lhs = lit;
         } else {
             Expr* op = new_expr(p, op_kind, op_ty, binary); 
@@ -1056,19 +1458,22 @@ Expr* parse_expr(Parser* p) {
     new_stmt_(p, kind, offsetof(Stmt, extra) + sizeof(((Stmt*)nullptr)->field))
 
 static Stmt* new_stmt_(Parser* p, u8 kind, usize size) {
-    Stmt* stmt = arena_alloc(&p->arena, size, alignof(Stmt));
+    Stmt* stmt = arena_alloc(&p->nodes, size, alignof(Stmt));
     memset(stmt, 0, size);
     stmt->kind = kind;
     stmt->token_index = p->cursor;
     return stmt;
 }
 
-static Entity* get_or_create(Parser* p, string ident) {
+static Entity* get_or_create(Parser* p, Atom ident) {
     Entity* entity = get_entity(p, ident);
     if (!entity) {
         entity = new_entity(p, ident, ENTKIND_VAR);
     } else if (entity->storage != STORAGE_EXTERN) {
         parse_error(p, p->cursor, p->cursor, REPORT_ERROR, "symbol already exists");
+    } else if (p->current_function != nullptr) {
+        // only a global can be what an EXTERN was declaring
+        entity = new_entity(p, ident, ENTKIND_VAR);
     }
     return entity;
 }
@@ -1076,9 +1481,11 @@ static Entity* get_or_create(Parser* p, string ident) {
 Stmt* parse_var_decl(Parser* p, StorageKind storage) {
     Stmt* decl = new_stmt(p, STMT_VAR_DECL, var_decl);
     
-    string identifier = tok_span(p->current);
-    Entity* var = get_or_create(p, identifier);
+    Entity* var = get_or_create(p, tok_atom(p, p->cursor));
     decl->var_decl.var = var;
+    if (var->storage == STORAGE_EXTERN) {
+        global_will_change(p, var, false);
+    }
     if (var->storage == STORAGE_EXTERN && storage == STORAGE_PRIVATE) {
         parse_error(p, p->cursor, p->cursor, REPORT_ERROR, "previously EXTERN variable cannot be PRIVATE");
     }
@@ -1133,6 +1540,9 @@ Stmt* parse_var_decl(Parser* p, StorageKind storage) {
 
 Stmt* parse_stmt_assign(Parser* p, Expr* left_expr) {
     Stmt* assign = new_stmt(p, STMT_ASSIGN, assign);
+    // the compound ones are in the same order as their tokens
+    static_assert(STMT_ASSIGN_RSH - STMT_ASSIGN == TOK_RSHIFT_EQ - TOK_EQ);
+    assign->kind = STMT_ASSIGN + (p->current.kind - TOK_EQ);
     assign->assign.lhs = left_expr;
     if (!is_lvalue(left_expr)) {
         error_at_expr(p, left_expr, REPORT_ERROR, "expression is not an l-value");
@@ -1235,56 +1645,46 @@ Stmt* parse_stmt(Parser* p) {
     return nullptr;
 }
 
-Entity* get_incomplete_type_entity(Parser* p, string identifier) {
-    Entity* entity = get_entity(p, identifier);
-    if (!entity) {
-        entity = new_entity(p, identifier, ENTKIND_TYPE);
-        entity->ty = ty_allocate(TyAlias);
-        TY_KIND(entity->ty) = TY_ALIAS_INCOMPLETE;
-        TY(entity->ty, TyAlias)->entity = entity;
-    } else if (entity->kind != ENTKIND_TYPE) {
-        parse_error(p, p->cursor, p->cursor, REPORT_ERROR, 
-            "symbol already declared");
-    }
-    return entity;
-}
-
 TyIndex parse_fn_prototype(Parser* p) {
-    ArenaState a_save = arena_save(&p->arena);
+    ArenaScratch scratch = arena_scratch_begin();
 
     usize params_len = 0;
-    // temporarily allocate a bunch of function params
-    Ty_FnParam* params = arena_alloc(&p->arena, sizeof(Ty_FnParam) * TY_FN_MAX_PARAMS, alignof(Ty_FnParam));
+    // temporarily allocate a bunch of function params. forward-declared types that
+    // parse_type makes along the way go in p->arena, so they stick around.
+    Ty_FnParam* params = arena_alloc(scratch.arena, sizeof(Ty_FnParam) * TY_FN_MAX_PARAMS, alignof(Ty_FnParam));
 
     bool is_variadic = false;
 
     expect_advance(p,TOK_OPEN_PAREN);
     while (p->current.kind != TOK_CLOSE_PAREN) {
+        if (params_len == TY_FN_MAX_PARAMS) {
+            parse_error(p, p->cursor, p->cursor, REPORT_ERROR, "too many parameters");
+        }
         Ty_FnParam* param = &params[params_len];
 
         if (match(p, TOK_VARARG)) {
             is_variadic = true;
             advance(p);
             expect(p, TOK_IDENTIFIER);
-            string argv = tok_span(p->current);
+            Atom argv = tok_atom(p, p->cursor);
             for_n(i, 0, params_len) {
-                if (string_eq(from_compact(params[i].name), argv)) {
+                if (params[i].name == argv) {
                     parse_error(p, p->cursor, p->cursor, REPORT_ERROR, "parameter name already used");
                 }
             }
-            param->varargs.argv = to_compact(argv);
+            param->varargs.argv = argv;
             advance(p);
             expect(p, TOK_IDENTIFIER);
-            string argc = tok_span(p->current);
+            Atom argc = tok_atom(p, p->cursor);
             for_n(i, 0, params_len) {
-                if (string_eq(from_compact(params[i].name), argc)) {
+                if (params[i].name == argc) {
                     parse_error(p, p->cursor, p->cursor, REPORT_ERROR, "parameter name already used");
                 }
             }
-            if (string_eq(argv, argc)) {
+            if (argv == argc) {
                 parse_error(p, p->cursor, p->cursor, REPORT_ERROR, "parameter name already used");
             }
-            param->varargs.argc = to_compact(argc);
+            param->varargs.argc = argc;
             advance(p);
             params_len++;
             break;
@@ -1300,20 +1700,21 @@ TyIndex parse_fn_prototype(Parser* p) {
             advance(p);
             break;
         default:
+            param->out = false;
             if (p->flags.strict) {
                 parse_error(p, p->cursor, p->cursor, REPORT_WARNING, "implicit IN is non-standard");
             }
         }
 
         expect(p, TOK_IDENTIFIER);
-        string ident = tok_span(p->current);
+        Atom ident = tok_atom(p, p->cursor);
         for_n(i, 0, params_len) {
-            if (string_eq(from_compact(params[i].name), ident)) {
+            if (params[i].name == ident) {
                 parse_error(p, p->cursor, p->cursor, REPORT_ERROR, "parameter name already used");
             }
         }
 
-        param->name = to_compact(ident);
+        param->name = ident;
 
         advance(p);
         expect_advance(p, TOK_COLON);
@@ -1337,27 +1738,824 @@ TyIndex parse_fn_prototype(Parser* p) {
         ret_ty = parse_type(p, false);
     }
 
-    // allocate final type
-    TyIndex proto = ty__allocate(sizeof(TyFn) + sizeof(Ty_FnParam) * params_len, max(alignof(TyFn), alignof(Ty_FnParam)) == 8);
-    TyFn* fn = TY(proto, TyFn);
-    fn->kind = TY_FN;
-    fn->len = params_len;
-    fn->variadic = is_variadic;
-    fn->ret_ty = ret_ty;
-    memcpy(fn->params, params, sizeof(Ty_FnParam) * params_len);
+    TyIndex proto = ty_get_fn(ret_ty, is_variadic, params, params_len);
 
-    arena_restore(&p->arena, a_save);
+    arena_scratch_end(scratch);
     return proto;
 }
 
+// the cursor's on the first token of the body. leaves it past the END.
+static void parse_fn_body(Parser* p, Entity* fn, Stmt* fn_decl, u32 ident_pos) {
+    p->current_function = fn;
+    ArenaState nodes = arena_save(&p->nodes);
+
+    enter_scope(p);
+
+    // define parameters. the cursor's already on the body,
+    // which might have started with an expansion
+    TyFn* fn_type = TY(fn->ty, TyFn);
+    for_n(i, 0, fn_type->len - 1) {
+        Ty_FnParam* param = &fn_type->params[i];
+        Entity* param_entity = new_entity_in_scope(p, param->name, ENTKIND_VAR);
+        param_entity->ty = param->ty;
+        param_entity->storage = param->out ? STORAGE_OUT_PARAM : STORAGE_LOCAL;
+    }
+    if (fn_type->variadic) {
+        Ty_FnParam* param = &fn_type->params[fn_type->len - 1];
+        Entity* argv_entity = new_entity_in_scope(p, param->varargs.argv, ENTKIND_VAR);
+        argv_entity->ty = ty_get_ptr(TY_VOIDPTR);
+        argv_entity->storage = STORAGE_LOCAL;
+        Entity* argc_entity = new_entity_in_scope(p, param->varargs.argc, ENTKIND_VAR);
+        argc_entity->storage = STORAGE_LOCAL;
+        argc_entity->ty = target_uword;
+    } else if (fn_type->len != 0) {
+        Ty_FnParam* param = &fn_type->params[fn_type->len - 1];
+        Entity* param_entity = new_entity_in_scope(p, param->name, ENTKIND_VAR);
+        param_entity->ty = param->ty;
+        param_entity->storage = param->out ? STORAGE_OUT_PARAM : STORAGE_LOCAL;
+    }
+
+    u32 stmts_start = dynbuf_start();
+    u32 stmts_len = 0;
+    bool has_returned = false;
+    while (!match(p, TOK_KW_END)) {
+        Stmt* stmt = parse_stmt(p);
+        if (stmt == nullptr) {
+            continue;
+        }
+        if (stmt->retkind == RETKIND_YES) {
+            has_returned = true;
+        }
+        vec_append(&dynbuf, stmt);
+        stmts_len++;
+    }
+    if (!has_returned && fn_type->ret_ty != TY_VOID) {
+        parse_error(p, ident_pos, ident_pos, REPORT_NOTE, "in function '"str_fmt"'", str_arg(atom_str(fn->name)));
+        parse_error(p, p->cursor, p->cursor, REPORT_WARNING, "function may not return with defined value");
+    }
+    advance(p);
+
+    Stmt** stmts = (Stmt**)dynbuf_to_arena(p, stmts_start);
+    
+    exit_scope(p);
+
+    p->current_function = nullptr;
+
+    dynbuf_restore(stmts_start);
+    fn_decl->fn_decl.body.stmts = stmts;
+    fn_decl->fn_decl.body.len = stmts_len;
+
+    if (p->ast != nullptr) {
+        ast_flatten_fn(p->ast, fn_decl);
+        fn_decl->fn_decl.body = (StmtList){};
+        arena_restore(&p->nodes, nodes);
+    }
+}
+
+// the cursor's on the first token of the body. leaves it past the END
+// without looking at anything in between.
+static void skip_fn_body(Parser* p) {
+    u32 depth = 0;
+    while (p->current.kind != TOK_EOF) {
+        if (p->current.kind == TOK_KW_IF || p->current.kind == TOK_KW_WHILE) {
+            depth++;
+        } else if (p->current.kind == TOK_KW_END) {
+            if (depth == 0) {
+                advance(p);
+                return;
+            }
+            depth--;
+        }
+        advance(p);
+    }
+}
+
+// ------------------------- FN BODY CACHE -------------------------
+
+// the compile server (see serve.c) keeps one of these for every file it compiles.
+// what a FN body reports only depends on its own tokens, on the FN it's the body of,
+// and on whatever the names it looks up in the global scope turned out to be. so a body
+// is keyed on the first two, and remembers which names it looked up along with one
+// fingerprint of what they all were, found or not. if the key is the same as last
+// time and so is that fingerprint, it just reports the same things again, relative
+// to wherever it starts now, without being parsed at all. editing one global only
+// gets the bodies that use it parsed again, not every body after it.
+
+typedef struct {
+    i32 start; // relative to the first token of the body
+    i32 end;
+    ReportKind kind;
+    char* msg;
+} CachedReport;
+
+Vec_typedef(CachedReport);
+
+#define BODY_DIDNT_FAIL INT32_MIN
+
+typedef struct {
+    u64 key;
+    CachedReport* reports;
+    u32 reports_len;
+    i32 failed_at; // where the cursor was when it errored, relative like the reports
+    // the names it looked up in the global scope, in FnBodyCache.names,
+    // and what they all were, see deps_fingerprint
+    u32* deps;
+    u32 deps_len;
+    u64 deps_fingerprint;
+    bool used; // by this compile. the rest gets dropped when it's saved.
+} CachedBody;
+
+Vec_typedef(CachedBody);
+
+// atoms are different in every compile, so the cache keeps the names themselves
+typedef struct {
+    string str;
+    Atom atom; // in this compile, see fn_body_cache_bind
+} CachedName;
+
+Vec_typedef(CachedName);
+
+typedef struct FnBodyCache {
+    mtx_t lock;
+    Vec(CachedBody) bodies;
+    // open addressing, from a key to its index in bodies plus one
+    u32* index;
+    u32 index_cap;
+    Vec(CachedName) names;
+    Vec(u32) name_of_atom; // index in names plus one, 0 if it's not there
+    // bodies since the last sweep
+    u32 replayed;
+    u32 parsed;
+} FnBodyCache;
+
+typedef struct BodyRecording {
+    u64 key;
+    u32 base; // first token of the body
+    Vec(CachedReport) reports;
+    i32 failed_at;
+    Vec(Atom) lookups; // in the global scope, with duplicates
+    bool replayed; // from the cache, so there's nothing new to put in it
+} BodyRecording;
+
+#define BODY_HASH_SEED 0xcbf29ce484222325ull
+
+static u64 hash_word(u64 h, u64 x) {
+    h = (h ^ x) * 0x9e3779b97f4a7c15ull;
+    return h ^ (h >> 29);
+}
+
+static u64 hash_bytes(u64 h, string s) {
+    usize i = 0;
+    for (; i + 8 <= s.len; i += 8) {
+        u64 word;
+        memcpy(&word, s.raw + i, 8);
+        h = hash_word(h, word);
+    }
+    u64 tail = 0;
+    memcpy(&tail, s.raw + i, s.len - i);
+    return hash_word(h, tail);
+}
+
+// everything about the tokens [from, to) the parser could ever look at
+static u64 tokens_hash(Parser* p, u64 h, u32 from, u32 to) {
+    for (u32 i = from; i < to; ++i) {
+        Token t = tok_at(p, i);
+        string span = tok_span_at(p, i);
+        h = hash_word(h, t.kind | (u64)tok_newline_before(p, i) << 8 | (u64)span.len << 32);
+        h = hash_bytes(h, span);
+        // payloads are decoded from the text, except for tokens the preprocessor made up
+        if (t.generated) {
+            TokenPayload* payload = tok_payload(p, i);
+            if (payload != nullptr) {
+                h = hash_word(h, payload->integer ^ (u64)payload->malformed << 63);
+                if (t.kind == TOK_STRING) {
+                    h = hash_bytes(h, tok_payload_string(p, payload));
+                }
+            }
+        }
+    }
+
+    // where expansions start and end decides what's visible inside them
+    u32 lo = 0;
+    u32 hi = p->expansions_len;
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        if (expansion_at(p, mid)->start < from) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (u32 i = lo; i < p->expansions_len && expansion_at(p, i)->start < to; ++i) {
+        Expansion* e = expansion_at(p, i);
+        h = hash_word(h, (u64)(e->start - from) << 32 | (u32)(e->end - from));
+    }
+    return h;
+}
+
+#define FINGERPRINT_MAX_ALIASES 64
+
+// what a type looks like to a body that uses it. tybuf indices can't go in,
+// since they depend on the order everything before it got declared in.
+static u64 ty_fingerprint(u64 h, TyIndex t, TyIndex* aliases, u32 aliases_len) {
+    h = hash_word(h, TY_KIND(t));
+    switch (TY_KIND(t)) {
+    case TY_PTR:
+        return ty_fingerprint(h, TY(t, TyPtr)->to, aliases, aliases_len);
+    case TY_ARRAY:
+        h = hash_word(h, TY(t, TyArray)->len);
+        return ty_fingerprint(h, TY(t, TyArray)->to, aliases, aliases_len);
+    case TY_FN:
+        TyFn* fn = TY(t, TyFn);
+        h = hash_word(h, fn->len | fn->variadic << 8);
+        h = ty_fingerprint(h, fn->ret_ty, aliases, aliases_len);
+        for_n(i, 0, fn->len) {
+            Ty_FnParam* param = &fn->params[i];
+            if (fn->variadic && i == fn->len - 1) {
+                h = hash_bytes(h, atom_str(param->varargs.argv));
+                h = hash_bytes(h, atom_str(param->varargs.argc));
+            } else {
+                h = hash_word(h, param->out);
+                h = hash_bytes(h, atom_str(param->name));
+                h = ty_fingerprint(h, param->ty, aliases, aliases_len);
+            }
+        }
+        return h;
+    case TY_ALIAS_INCOMPLETE:
+        return hash_bytes(h, atom_str(TY(t, TyAlias)->entity->name));
+    case TY_ALIAS:
+        h = hash_bytes(h, atom_str(TY(t, TyAlias)->entity->name));
+        // a recursive one only goes in once, like TYPE Node : ^Node
+        for_n(i, 0, aliases_len) {
+            if (aliases[i] == t) {
+                return hash_word(h, i);
+            }
+        }
+        if (aliases_len == FINGERPRINT_MAX_ALIASES) {
+            // where it is in tybuf has to do this deep down
+            return hash_word(h, t);
+        }
+        aliases[aliases_len] = t;
+        return ty_fingerprint(h, TY(t, TyAlias)->aliasing, aliases, aliases_len + 1);
+    default:
+        return h;
+    }
+}
+
+// what a body can tell about the names it looked up in the global scope,
+// some of which might not have been there at all. this is always taken while
+// the body is being parsed or replayed, so it's the globals as the body saw
+// them, with any later changes undone (see PARALLEL FN BODIES).
+static u64 deps_fingerprint(Parser* p, FnBodyCache* c, u32* deps, u32 deps_len) {
+    u64 h = BODY_HASH_SEED;
+    for_n(i, 0, deps_len) {
+        Entity* e = get_entity(p, c->names.at[deps[i]].atom);
+        if (e == nullptr) {
+            h = hash_word(h, 0);
+            continue;
+        }
+        TyIndex aliases[FINGERPRINT_MAX_ALIASES];
+        h = hash_word(h, 1 | e->kind << 8 | e->storage << 16);
+        h = ty_fingerprint(h, e->ty, aliases, 0);
+    }
+    return h;
+}
+
+FnBodyCache* fn_body_cache_new() {
+    FnBodyCache* c = malloc(sizeof(FnBodyCache));
+    mtx_init(&c->lock, mtx_plain);
+    c->bodies = vec_new(CachedBody, 64);
+    c->index_cap = 128;
+    c->index = calloc(c->index_cap, sizeof(c->index[0]));
+    c->names = vec_new(CachedName, 64);
+    c->name_of_atom = vec_new(u32, 256);
+    c->replayed = 0;
+    c->parsed = 0;
+    return c;
+}
+
+static void cached_body_free(CachedBody* b) {
+    for_n(j, 0, b->reports_len) {
+        free(b->reports[j].msg);
+    }
+    free(b->reports);
+    free(b->deps);
+}
+
+void fn_body_cache_destroy(FnBodyCache* c) {
+    for_n(i, 0, c->bodies.len) {
+        cached_body_free(&c->bodies.at[i]);
+    }
+    vec_destroy(&c->bodies);
+    for_n(i, 0, c->names.len) {
+        free(c->names.at[i].str.raw);
+    }
+    vec_destroy(&c->names);
+    vec_destroy(&c->name_of_atom);
+    free(c->index);
+    mtx_destroy(&c->lock);
+    free(c);
+}
+
+// where key is in the index, or where it would go
+static u32 fn_body_cache_slot(FnBodyCache* c, u64 key) {
+    u32 mask = c->index_cap - 1;
+    u32 i = key & mask;
+    while (c->index[i] != 0 && c->bodies.at[c->index[i] - 1].key != key) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// takes ownership of the body's reports and deps. if there's one with the same key
+// already, it got parsed again because a global it looked up changed, so it's replaced.
+static void fn_body_cache_put(FnBodyCache* c, CachedBody body) {
+    if ((c->bodies.len + 1) * 2 > c->index_cap) {
+        free(c->index);
+        c->index_cap *= 2;
+        c->index = calloc(c->index_cap, sizeof(c->index[0]));
+        for_n(i, 0, c->bodies.len) {
+            c->index[fn_body_cache_slot(c, c->bodies.at[i].key)] = i + 1;
+        }
+    }
+    body.used = true;
+    u32 slot = fn_body_cache_slot(c, body.key);
+    if (c->index[slot] != 0) {
+        CachedBody* old = &c->bodies.at[c->index[slot] - 1];
+        cached_body_free(old);
+        *old = body;
+        return;
+    }
+    vec_append(&c->bodies, body);
+    c->index[slot] = c->bodies.len;
+}
+
+// c->lock has to be held, unless it's before the bodies get parsed
+static void fn_body_cache_name_atom(FnBodyCache* c, Atom atom, u32 name) {
+    while (c->name_of_atom.len <= atom) {
+        vec_append(&c->name_of_atom, 0);
+    }
+    c->name_of_atom.at[atom] = name + 1;
+}
+
+// where the name is in names, adding it if it isn't. c->lock has to be held.
+static u32 fn_body_cache_name(FnBodyCache* c, Atom atom) {
+    if (atom < c->name_of_atom.len && c->name_of_atom.at[atom] != 0) {
+        return c->name_of_atom.at[atom] - 1;
+    }
+    string str = atom_str(atom);
+    CachedName name = {
+        .str = {.raw = malloc(str.len), .len = str.len},
+        .atom = atom,
+    };
+    memcpy(name.str.raw, str.raw, str.len);
+    vec_append(&c->names, name);
+    fn_body_cache_name_atom(c, atom, c->names.len - 1);
+    return c->names.len - 1;
+}
+
+// atoms are only good for one compile, so every name in the cache gets its atom
+// in this one before any body is looked up
+static void fn_body_cache_bind(FnBodyCache* c) {
+    vec_clear(&c->name_of_atom);
+    for_n(i, 0, c->names.len) {
+        CachedName* name = &c->names.at[i];
+        name->atom = atom_intern(name->str);
+        fn_body_cache_name_atom(c, name->atom, i);
+    }
+}
+
+static void fn_body_record(Parser* p, ReportKind kind, u32 start, u32 end, const char* msg) {
+    BodyRecording* r = p->recording;
+    CachedReport report = {
+        .start = (i32)(start - r->base),
+        .end = (i32)(end - r->base),
+        .kind = kind,
+        .msg = strdup(msg),
+    };
+    vec_append(&r->reports, report);
+}
+
+static void fn_body_record_lookup(Parser* p, Atom name) {
+    vec_append(&p->recording->lookups, name);
+}
+
+static int atom_compare(const void* a, const void* b) {
+    Atom x = *(const Atom*)a;
+    Atom y = *(const Atom*)b;
+    return (x > y) - (x < y);
+}
+
+// whatever got recorded goes in the cache, even if the body ended in an error.
+// the body's scopes have to be gone by now, and p can't be recording anymore,
+// since every global it looked up gets looked up again.
+static void fn_body_cache_finish(Parser* p, FnBodyCache* c, BodyRecording* r) {
+    CachedBody body = {
+        .key = r->key,
+        .reports_len = r->reports.len,
+        .failed_at = r->failed_at,
+    };
+    if (r->reports.len != 0) {
+        body.reports = malloc(sizeof(body.reports[0]) * r->reports.len);
+        memcpy(body.reports, r->reports.at, sizeof(body.reports[0]) * r->reports.len);
+    }
+
+    // the same few names get looked up over and over
+    qsort(r->lookups.at, r->lookups.len, sizeof(r->lookups.at[0]), atom_compare);
+    if (r->lookups.len != 0) {
+        body.deps = malloc(sizeof(body.deps[0]) * r->lookups.len);
+    }
+
+    mtx_lock(&c->lock);
+    for_n(i, 0, r->lookups.len) {
+        if (i == 0 || r->lookups.at[i] != r->lookups.at[i - 1]) {
+            body.deps[body.deps_len++] = fn_body_cache_name(c, r->lookups.at[i]);
+        }
+    }
+    body.deps_fingerprint = deps_fingerprint(p, c, body.deps, body.deps_len);
+    fn_body_cache_put(c, body);
+    c->parsed++;
+    mtx_unlock(&c->lock);
+    vec_clear(&r->reports);
+    vec_clear(&r->lookups);
+    r->failed_at = BODY_DIDNT_FAIL;
+}
+
+// report whatever the body reported last time, if it's been seen before and
+// every global it looked up is still what it was.
+// an error longjmps out just like it would have from parsing it.
+static bool fn_body_cache_replay(Parser* p, FnBodyCache* c, u64 key, u32 base) {
+    mtx_lock(&c->lock);
+    u32 slot = fn_body_cache_slot(c, key);
+    if (c->index[slot] == 0) {
+        mtx_unlock(&c->lock);
+        return false;
+    }
+    CachedBody* cached = &c->bodies.at[c->index[slot] - 1];
+    if (deps_fingerprint(p, c, cached->deps, cached->deps_len) != cached->deps_fingerprint) {
+        mtx_unlock(&c->lock);
+        return false;
+    }
+    cached->used = true;
+    CachedBody body = *cached;
+    c->replayed++;
+    mtx_unlock(&c->lock);
+
+    // a resident unit keeps what every body reported, replayed or not
+    if (p->recording != nullptr) {
+        p->recording->replayed = true;
+    }
+    for_n(i, 0, body.reports_len) {
+        CachedReport* r = &body.reports[i];
+        if (r->kind == REPORT_ERROR) {
+            // whatever comes after where it stopped gets thrown out
+            p->cursor = base + body.failed_at;
+        }
+        if (p->recording != nullptr) {
+            fn_body_record(p, r->kind, base + r->start, base + r->end, r->msg);
+        }
+        token_error(p, r->kind, base + r->start, base + r->end, r->msg);
+    }
+    return true;
+}
+
+#define BODY_CACHE_MAGIC 0x43425943u // "CYBC"
+
+void fn_body_cache_save(FnBodyCache* c, FILE* out) {
+    u32 header[3] = {BODY_CACHE_MAGIC, c->names.len, c->bodies.len};
+    fwrite(header, sizeof(header), 1, out);
+    for_n(i, 0, c->names.len) {
+        u32 len = c->names.at[i].str.len;
+        fwrite(&len, sizeof(len), 1, out);
+        fwrite(c->names.at[i].str.raw, 1, len, out);
+    }
+    for_n(i, 0, c->bodies.len) {
+        CachedBody* b = &c->bodies.at[i];
+        u32 used = b->used;
+        fwrite(&b->key, sizeof(b->key), 1, out);
+        fwrite(&used, sizeof(used), 1, out);
+        fwrite(&b->failed_at, sizeof(b->failed_at), 1, out);
+        fwrite(&b->reports_len, sizeof(b->reports_len), 1, out);
+        fwrite(&b->deps_len, sizeof(b->deps_len), 1, out);
+        fwrite(&b->deps_fingerprint, sizeof(b->deps_fingerprint), 1, out);
+        for_n(j, 0, b->reports_len) {
+            CachedReport* r = &b->reports[j];
+            u32 fields[4] = {(u32)r->start, (u32)r->end, r->kind, strlen(r->msg)};
+            fwrite(fields, sizeof(fields), 1, out);
+            fwrite(r->msg, 1, fields[3], out);
+        }
+        fwrite(b->deps, sizeof(b->deps[0]), b->deps_len, out);
+    }
+    fflush(out);
+}
+
+// nullptr if it's cut short or not a cache at all
+FnBodyCache* fn_body_cache_load(FILE* in) {
+    u32 header[3];
+    if (fread(header, sizeof(header), 1, in) != 1 || header[0] != BODY_CACHE_MAGIC) {
+        return nullptr;
+    }
+    FnBodyCache* c = fn_body_cache_new();
+    for_n(i, 0, header[1]) {
+        u32 len;
+        if (fread(&len, sizeof(len), 1, in) != 1) {
+            fn_body_cache_destroy(c);
+            return nullptr;
+        }
+        CachedName name = {
+            .str = {.raw = malloc(len), .len = len},
+            .atom = ATOM_NONE,
+        };
+        vec_append(&c->names, name);
+        if (fread(name.str.raw, 1, len, in) != len) {
+            fn_body_cache_destroy(c);
+            return nullptr;
+        }
+    }
+    for_n(i, 0, header[2]) {
+        CachedBody body = {};
+        u32 used;
+        if (fread(&body.key, sizeof(body.key), 1, in) != 1 || fread(&used, sizeof(used), 1, in) != 1
+            || fread(&body.failed_at, sizeof(body.failed_at), 1, in) != 1
+            || fread(&body.reports_len, sizeof(body.reports_len), 1, in) != 1
+            || fread(&body.deps_len, sizeof(body.deps_len), 1, in) != 1
+            || fread(&body.deps_fingerprint, sizeof(body.deps_fingerprint), 1, in) != 1) {
+            fn_body_cache_destroy(c);
+            return nullptr;
+        }
+        u32 reports_len = body.reports_len;
+        body.reports = reports_len == 0 ? nullptr : calloc(reports_len, sizeof(body.reports[0]));
+        body.deps = body.deps_len == 0 ? nullptr : malloc(sizeof(body.deps[0]) * body.deps_len);
+        // only the messages that got read in are there to free
+        body.reports_len = 0;
+        bool ok = true;
+        for_n(j, 0, reports_len) {
+            u32 fields[4];
+            if (fread(fields, sizeof(fields), 1, in) != 1) {
+                ok = false;
+                break;
+            }
+            char* msg = malloc(fields[3] + 1);
+            body.reports[body.reports_len++] = (CachedReport){
+                .start = (i32)fields[0],
+                .end = (i32)fields[1],
+                .kind = fields[2],
+                .msg = msg,
+            };
+            if (fread(msg, 1, fields[3], in) != fields[3]) {
+                msg[0] = '\0';
+                ok = false;
+                break;
+            }
+            msg[fields[3]] = '\0';
+        }
+        if (ok && fread(body.deps, sizeof(body.deps[0]), body.deps_len, in) != body.deps_len) {
+            ok = false;
+        }
+        for (u32 j = 0; ok && j < body.deps_len; ++j) {
+            ok = body.deps[j] < c->names.len;
+        }
+        fn_body_cache_put(c, body);
+        if (!ok) {
+            fn_body_cache_destroy(c);
+            return nullptr;
+        }
+        c->bodies.at[c->bodies.len - 1].used = used;
+    }
+    return c;
+}
+
+// get ready for the next compile. if the last one got all the way through, what it
+// didn't use has been edited away, so that goes, along with the names only it looked up.
+void fn_body_cache_sweep(FnBodyCache* c, bool drop_unused) {
+    usize kept = 0;
+    for_n(i, 0, c->bodies.len) {
+        CachedBody* b = &c->bodies.at[i];
+        if (drop_unused && !b->used) {
+            cached_body_free(b);
+            continue;
+        }
+        b->used = false;
+        c->bodies.at[kept++] = *b;
+    }
+    c->bodies.len = kept;
+    c->replayed = 0;
+    c->parsed = 0;
+    memset(c->index, 0, sizeof(c->index[0]) * c->index_cap);
+    for_n(i, 0, c->bodies.len) {
+        c->index[fn_body_cache_slot(c, c->bodies.at[i].key)] = i + 1;
+    }
+
+    if (drop_unused && c->names.len != 0) {
+        u32* moved_to = malloc(sizeof(moved_to[0]) * c->names.len);
+        memset(moved_to, 0xff, sizeof(moved_to[0]) * c->names.len);
+        for_n(i, 0, c->bodies.len) {
+            CachedBody* b = &c->bodies.at[i];
+            for_n(j, 0, b->deps_len) {
+                moved_to[b->deps[j]] = 0;
+            }
+        }
+        usize names_kept = 0;
+        for_n(i, 0, c->names.len) {
+            if (moved_to[i] == UINT32_MAX) {
+                free(c->names.at[i].str.raw);
+                continue;
+            }
+            moved_to[i] = names_kept;
+            c->names.at[names_kept++] = c->names.at[i];
+        }
+        c->names.len = names_kept;
+        for_n(i, 0, c->bodies.len) {
+            CachedBody* b = &c->bodies.at[i];
+            for_n(j, 0, b->deps_len) {
+                b->deps[j] = moved_to[b->deps[j]];
+            }
+        }
+        free(moved_to);
+    }
+}
+
+void fn_body_cache_counts(FnBodyCache* c, u32* replayed, u32* parsed) {
+    *replayed = c->replayed;
+    *parsed = c->parsed;
+}
+
+// ------------------------- PARALLEL FN BODIES -------------------------
+
+// in parallel mode, parse_unit goes through the global declarations first and
+// skips over FN bodies, then parses the bodies on a bunch of threads, each into its
+// own arena. a body sees the global scope as it was right where the body was,
+// and reports come out sorted by token anyway, so nothing looks any different
+// from parsing everything in order.
+//
+// hiding the globals declared after a body isn't quite enough, since a later
+// declaration can also change one from before it: defining what was EXTERN, or
+// finishing a TYPE that was only used so far. those go in FnBodyQueue.changes, and
+// a body that mentions one of them (or anything whose type a finished TYPE might be
+// part of) gets parsed once the threads are done, with the changes after it undone.
+
+typedef struct {
+    Entity* fn;
+    Stmt* fn_decl;
+    u32 ident_pos;
+    u32 start; // first token of the body
+    u32 end; // just past its END
+    u32 globals; // how many global bindings there were by then
+    u32 next_expansion;
+    u32 includes_len;
+    u32 includes_start; // in FnBodyQueue.includes
+    u32 includes_changed;
+    bool serial; // it might see something in FnBodyQueue.changes
+
+    // with FnBodyQueue.keep_reports, everything it reported, see RESIDENT UNITS
+    CachedReport* reports;
+    u32 reports_len;
+    i32 failed_at;
+} FnBody;
+
+Vec_typedef(FnBody);
+
+// a global that changed after some bodies were skipped, with whatever the other
+// state of it is. applying one swaps the two, so undoing them back to front and
+// redoing them front to back ends up where it started.
+typedef struct {
+    Entity* entity;
+    TyIndex ty;
+    StorageKind storage;
+    TyKind alias_kind; // for a TYPE, the kind of its alias instead
+    bool alias;
+    u32 bodies_len; // how many bodies had been skipped by then
+} GlobalChange;
+
+Vec_typedef(GlobalChange);
+
+typedef struct FnBodyQueue {
+    Vec(FnBody) bodies;
+    Vec(u32) includes; // Parser.includes at the start of each body
+    Vec(GlobalChange) changes;
+
+    // where the first error was, UINT32_MAX if there hasn't been one.
+    // bodies past it don't get parsed, since they wouldn't have been.
+    _Atomic(u32) failed_at;
+    _Atomic(u32) next; // first body no thread has taken yet
+    TyBuf* tybuf;
+
+    FnBodyCache* cache; // nullptr if there isn't one
+    u64 seed; // goes into every body's key, see FN BODY CACHE
+    // for a resident unit. every body gets parsed even after an error, since an
+    // edit could fix it, and keeps its reports.
+    bool keep_reports;
+} FnBodyQueue;
+
+// the cursor's on the first token of the body. leaves it past the END.
+static void defer_fn_body(Parser* p, Entity* fn, Stmt* fn_decl, u32 ident_pos) {
+    FnBodyQueue* q = p->fn_bodies;
+    FnBody body = {
+        .fn = fn,
+        .fn_decl = fn_decl,
+        .ident_pos = ident_pos,
+        .start = p->cursor,
+        .globals = p->scopes.bindings.len,
+        .next_expansion = p->next_expansion,
+        .includes_len = p->includes_len,
+        .includes_start = q->includes.len,
+        .includes_changed = p->includes_changed,
+    };
+    for_n(i, 0, p->includes_len) {
+        vec_append(&q->includes, p->includes[i]);
+    }
+
+    // whatever's wrong with the body gets reported once it's parsed
+    skip_fn_body(p);
+    body.end = p->cursor;
+    vec_append(&q->bodies, body);
+}
+
+// a global declaration is about to change entity, which a body that's been skipped
+// might have seen the way it was. a TYPE that's being finished is an alias change.
+static void global_will_change(Parser* p, Entity* entity, bool alias) {
+    FnBodyQueue* q = p->fn_bodies;
+    if (q == nullptr || q->bodies.len == 0 || p->current_function != nullptr) {
+        return;
+    }
+    // declared after the last body, so none of them can see it
+    u32 i = innermost_binding(&p->scopes, entity->name);
+    if (i == NO_BINDING || i >= q->bodies.at[q->bodies.len - 1].globals || p->scopes.bindings.at[i].entity != entity) {
+        return;
+    }
+    GlobalChange change = {
+        .entity = entity,
+        .ty = entity->ty,
+        .storage = entity->storage,
+        .alias_kind = TY_KIND(entity->ty),
+        .alias = alias,
+        .bodies_len = q->bodies.len,
+    };
+    vec_append(&q->changes, change);
+}
+
+static void global_change_apply(GlobalChange* change) {
+    Entity* e = change->entity;
+    if (change->alias) {
+        TyKind kind = TY_KIND(e->ty);
+        TY_KIND(e->ty) = change->alias_kind;
+        change->alias_kind = kind;
+        return;
+    }
+    TyIndex ty = e->ty;
+    StorageKind storage = e->storage;
+    e->ty = change->ty;
+    e->storage = change->storage;
+    change->ty = ty;
+    change->storage = storage;
+}
+
+// mark every body that could tell a change after it apart from how it was
+// when the body was skipped. a body only sees globals through the names in it,
+// except that a finished TYPE can also be part of the type of anything it uses.
+static void fn_bodies_find_serial(Parser* p, FnBodyQueue* q) {
+    u32 atoms_len = p->scopes.innermost.len;
+    u32* changed_before = calloc(atoms_len, sizeof(changed_before[0]));
+    u32 last_alias = 0;
+    u32 last = 0;
+    for_vec(GlobalChange* change, &q->changes) {
+        Atom name = change->entity->name;
+        changed_before[name] = max(changed_before[name], change->bodies_len);
+        if (change->alias) {
+            last_alias = max(last_alias, change->bodies_len);
+        }
+        last = max(last, change->bodies_len);
+    }
+
+    for_n(k, 0, last) {
+        FnBody* body = &q->bodies.at[k];
+        body->serial = k < last_alias && TY_FORWARD(body->fn->ty);
+        for (u32 i = body->start; i < body->end && !body->serial; ++i) {
+            if (tok_at(p, i).kind != TOK_IDENTIFIER) {
+                continue;
+            }
+            Atom name = tok_atom(p, i);
+            if (name >= atoms_len) {
+                continue;
+            }
+            if (changed_before[name] > k) {
+                body->serial = true;
+            } else if (k < last_alias) {
+                u32 b = innermost_binding(&p->scopes, name);
+                body->serial = b != NO_BINDING && TY_FORWARD(p->scopes.bindings.at[b].entity->ty);
+            }
+        }
+    }
+    free(changed_before);
+}
+
 Stmt* parse_fn_decl(Parser* p, u8 storage) {
     // advance(p);
     advance(p);
     // no fnptr specifier yet
     expect(p, TOK_IDENTIFIER);
     u32 ident_pos = p->cursor;
-    string identifier = tok_span(p->current);
-    Entity* fn = get_or_create(p, identifier);
+    Entity* fn = get_or_create(p, tok_atom(p, p->cursor));
     if (fn->storage == STORAGE_EXTERN && storage == STORAGE_PRIVATE) {
         parse_error(p, p->cursor, p->cursor, REPORT_ERROR, "previously EXTERN function cannot be PRIVATE");
     }
@@ -1367,67 +2565,28 @@ Stmt* parse_fn_decl(Parser* p, u8 storage) {
         parse_error(p, ident_pos, ident_pos, REPORT_ERROR, "type %s differs from previous EXTERN type %s",
             ty_name(decl_ty), ty_name(fn->ty));
     }
+    if (fn->storage == STORAGE_EXTERN) {
+        global_will_change(p, fn, false);
+    }
     fn->ty = decl_ty;
     if (storage != STORAGE_EXTERN) {
         Stmt* fn_decl = new_stmt(p, STMT_FN_DECL, fn_decl);
         fn_decl->fn_decl.fn = fn;
-
-        p->current_function = fn;
-
-        enter_scope(p);
-
-        // define parameters
-        TyFn* fn_type = TY(decl_ty, TyFn);
-        for_n(i, 0, fn_type->len - 1) {
-            Ty_FnParam* param = &fn_type->params[i];
-            Entity* param_entity = new_entity(p, from_compact(param->name), ENTKIND_VAR);
-            param_entity->ty = param->ty;
-            param_entity->storage = param->out ? STORAGE_OUT_PARAM : STORAGE_LOCAL;
-        }
-        if (fn_type->variadic) {
-            Ty_FnParam* param = &fn_type->params[fn_type->len - 1];
-            Entity* argv_entity = new_entity(p, from_compact(param->varargs.argv), ENTKIND_VAR);
-            argv_entity->ty = ty_get_ptr(TY_VOIDPTR);
-            argv_entity->storage = STORAGE_LOCAL;
-            Entity* argc_entity = new_entity(p, from_compact(param->varargs.argc), ENTKIND_VAR);
-            argc_entity->storage = STORAGE_LOCAL;
-            argc_entity->ty = target_uword;
-        } else if (fn_type->len != 0) {
-            Ty_FnParam* param = &fn_type->params[fn_type->len - 1];
-            Entity* param_entity = new_entity(p, from_compact(param->name), ENTKIND_VAR);
-            param_entity->ty = param->ty;
-            param_entity->storage = param->out ? STORAGE_OUT_PARAM : STORAGE_LOCAL;
-        }
-
-        u32 stmts_start = dynbuf_start();
-        u32 stmts_len = 0;
-        bool has_returned = false;
-        while (!match(p, TOK_KW_END)) {
-            Stmt* stmt = parse_stmt(p);
-            if (stmt == nullptr) {
-                continue;
-            }
-            if (stmt->retkind == RETKIND_YES) {
-                has_returned = true;
-            }
-            vec_append(&dynbuf, stmt);
-            stmts_len++;
-        }
-        if (!has_returned && fn_type->ret_ty != TY_VOID) {
-            parse_error(p, ident_pos, ident_pos, REPORT_NOTE, "in function '"str_fmt"'", str_arg(identifier));
-            parse_error(p, p->cursor, p->cursor, REPORT_WARNING, "function may not return with defined value");
+        fn->decl = fn_decl;
+
+        // bodies inside an expansion might see things that are only around
+        // until it ends, so those don't go anywhere
+        if (p->flags.interface_only) {
+            skip_fn_body(p);
+        } else if (p->fn_bodies != nullptr && p->expansion_depth == 0) {
+            defer_fn_body(p, fn, fn_decl, ident_pos);
+        } else {
+            parse_fn_body(p, fn, fn_decl, ident_pos);
         }
-        advance(p);
-
-        Stmt** stmts = (Stmt**)dynbuf_to_arena(p, stmts_start);
-        
-        exit_scope(p);
-
-        p->current_function = nullptr;
-
-        dynbuf_restore(stmts_start);
-        fn_decl->fn_decl.body.stmts = stmts;
-        fn_decl->fn_decl.body.len = stmts_len;
+    }
+    // its own body saw it as EXTERN too
+    if (fn->storage == STORAGE_EXTERN && storage != STORAGE_EXTERN) {
+        global_will_change(p, fn, false);
     }
     fn->storage = storage;
     return nullptr;
@@ -1441,16 +2600,21 @@ Stmt* parse_global_decl(Parser* p) {
     case TOK_KW_TYPE: {
         advance(p);
         expect(p, TOK_IDENTIFIER);
-        string identifier = tok_span(p->current);
-        Entity* entity = get_incomplete_type_entity(p, identifier);
-        if (TY_KIND(entity->ty) != TY_ALIAS) {
+        Entity* entity = get_incomplete_type_entity(p, tok_atom(p, p->cursor));
+        if (TY_KIND(entity->ty) != TY_ALIAS_INCOMPLETE) {
             parse_error(p, p->cursor, p->cursor, REPORT_ERROR, 
-                "TYPE declaration cannot declare incomplete type");
+                "type already declared");
         }
         advance(p);
         expect_advance(p, TOK_COLON);
         // TY_KIND(entity->ty) = TY_ALIAS_IN_PROGRESS;
-        TY(entity->ty, TyAlias)->aliasing = parse_type(p, false);
+        u32 type_start = p->cursor;
+        TyIndex aliasing = parse_type(p, false);
+        if (aliasing == entity->ty) {
+            parse_error(p, type_start, p->cursor - 1, REPORT_ERROR, "type cannot alias itself");
+        }
+        TY(entity->ty, TyAlias)->aliasing = aliasing;
+        global_will_change(p, entity, true);
         TY_KIND(entity->ty) = TY_ALIAS;
         TY(entity->ty, TyAlias)->entity = entity;
     } break;
@@ -1476,23 +2640,1377 @@ Stmt* parse_global_decl(Parser* p) {
     return nullptr;
 }
 
-CompilationUnit parse_unit(Parser* p) {
-    ty_init();
+#define PARSE_MAX_WORKERS 64
+// not worth starting a thread for fewer bodies than this
+#define PARSE_WORKER_MIN_BODIES 16
+
+typedef struct {
+    Parser p;
+    FnBodyQueue* q;
+    thrd_t thread;
+    BodyRecording recording;
+} FnBodyWorker;
+
+// what parse_unit leaves around for edits, see RESIDENT UNITS
+typedef struct ResidentUnit {
+    SrcFile* file; // its text is malloc'd, and every edit replaces it
+    Parser p; // has every token, and the global scope
+    CompilationUnit cu;
+    FnBodyQueue* bodies;
+    FnBodyWorker* worker; // parses the bodies that get edited
+    BodyRecording globals; // what the global declarations reported, from token 0
+    u32 failed_at; // where they stopped, UINT32_MAX if they didn't
+    u32 payload_bytes_len;
+    u32 edits_part; // the AstBuilder in cu.ast_parts edited bodies go into, 0 until there is one
+} ResidentUnit;
+
+static FnBodyQueue* fn_body_queue_new() {
+    FnBodyQueue* q = malloc(sizeof(FnBodyQueue));
+    q->bodies = vec_new(FnBody, 64);
+    q->includes = vec_new(u32, 64);
+    q->changes = vec_new(GlobalChange, 16);
+    q->failed_at = UINT32_MAX;
+    q->next = 0;
+    q->tybuf = tybuf;
+    q->cache = nullptr;
+    q->keep_reports = false;
+    return q;
+}
 
-    dynbuf = vecptr_new(void, 256);
+// whatever got recorded goes in the cache if it didn't just come out of it,
+// and stays with the body too if it's going to be reported again
+static void fn_body_finish(FnBodyWorker* w, FnBody* body) {
+    FnBodyQueue* q = w->q;
+    BodyRecording* r = &w->recording;
+    bool to_cache = q->cache != nullptr && !r->replayed;
+    if (q->keep_reports) {
+        body->reports_len = r->reports.len;
+        body->reports = malloc(sizeof(body->reports[0]) * max(r->reports.len, 1));
+        memcpy(body->reports, r->reports.at, sizeof(body->reports[0]) * r->reports.len);
+        body->failed_at = r->failed_at;
+        // the cache owns the messages it gets
+        if (to_cache) {
+            for_n(i, 0, body->reports_len) {
+                body->reports[i].msg = strdup(body->reports[i].msg);
+            }
+        }
+    } else if (!to_cache) {
+        for_vec(CachedReport* report, &r->reports) {
+            free(report->msg);
+        }
+    }
 
-    while (p->current.kind != TOK_EOF) {
-        parse_global_decl(p);
+    if (to_cache) {
+        fn_body_cache_finish(&w->p, q->cache, r);
+    } else {
+        vec_clear(&r->reports);
+        vec_clear(&r->lookups);
+        r->failed_at = BODY_DIDNT_FAIL;
     }
+    r->replayed = false;
+}
 
-    CompilationUnit cu = {};
-    cu.tokens = p->tokens;
-    cu.tokens_len = p->tokens_len;
-    cu.sources = p->sources;
-    cu.top_scope = p->global_scope;
-    cu.arena = p->arena;
+// parse one body on the worker's parser, or replay what it reported last time.
+// an error is caught here, and only moves failed_at back if it's the first.
+static void fn_body_parse(FnBodyWorker* w, FnBody* body) {
+    FnBodyQueue* q = w->q;
+    Parser* p = &w->p;
+
+    // put the parser back how it was when it got to the body
+    p->cursor = body->start;
+    p->current = tok_at(p, p->cursor);
+    p->expansion_depth = 0;
+    p->next_expansion = body->next_expansion;
+    p->includes_len = body->includes_len;
+    memcpy(p->includes, &q->includes.at[body->includes_start], sizeof(p->includes[0]) * body->includes_len);
+    p->includes_changed = body->includes_changed;
+    p->scopes.globals_visible = body->globals;
+    update_expansions(p);
+
+    if (q->cache != nullptr) {
+        // everything about the FN it's the body of, then its own tokens.
+        // the token right after the END might get peeked at
+        TyIndex aliases[FINGERPRINT_MAX_ALIASES];
+        u64 key = hash_bytes(q->seed, atom_str(body->fn->name));
+        key = hash_word(key, body->start - body->ident_pos);
+        key = ty_fingerprint(key, body->fn->ty, aliases, 0);
+        w->recording.key = tokens_hash(p, key, body->start, min(body->end + 1, p->tokens_len));
+    }
+    w->recording.base = body->start;
+    p->recording = q->cache != nullptr || q->keep_reports ? &w->recording : nullptr;
+
+    jmp_buf catch;
+    report_catch_errors(&catch);
+    if (setjmp(catch) == 0) {
+        if (q->cache == nullptr || !fn_body_cache_replay(p, q->cache, w->recording.key, body->start)) {
+            parse_fn_body(p, body->fn, body->fn_decl, body->ident_pos);
+        }
+        report_catch_errors(nullptr);
+    } else {
+        report_catch_errors(nullptr);
 
-    vec_destroy(&dynbuf);
+        // an error, which might not be the first one
+        u32 failed_at = q->failed_at;
+        while (p->cursor < failed_at && !atomic_compare_exchange_weak(&q->failed_at, &failed_at, p->cursor)) {}
+        while (p->scopes.marks.len != 0) {
+            exit_scope(p);
+        }
+        w->recording.failed_at = p->cursor - w->recording.base;
+        dynbuf_restore(0);
+        p->current_function = nullptr;
+    }
 
-    return cu;
+    if (p->recording != nullptr) {
+        p->recording = nullptr;
+        fn_body_finish(w, body);
+    }
+}
+
+// keep taking bodies off the queue until there aren't any left.
+// the serial ones are left for fn_bodies_parse_serial.
+static int fn_body_worker(void* arg) {
+    FnBodyWorker* w = arg;
+    FnBodyQueue* q = w->q;
+
+    tybuf = q->tybuf;
+    bool own_dynbuf = dynbuf.at == nullptr;
+    if (own_dynbuf) {
+        dynbuf = vecptr_new(void, 256);
+    }
+
+    while (true) {
+        u32 i = q->next++;
+        if (i >= q->bodies.len) {
+            break;
+        }
+        FnBody* body = &q->bodies.at[i];
+        if ((body->start > q->failed_at && !q->keep_reports) || body->serial) {
+            continue;
+        }
+        fn_body_parse(w, body);
+    }
+
+    if (own_dynbuf) {
+        vec_destroy(&dynbuf);
+        arena_scratch_release();
+    }
+    return 0;
+}
+
+// the bodies fn_bodies_find_serial marked, once nothing else is looking at the globals.
+// the last one first, so changes only ever have to be undone on the way, then
+// everything gets redone at the end.
+static void fn_bodies_parse_serial(FnBodyWorker* w) {
+    FnBodyQueue* q = w->q;
+    u32 undone = q->changes.len;
+    for (u32 k = q->bodies.len; k-- > 0;) {
+        FnBody* body = &q->bodies.at[k];
+        if (!body->serial || (body->start > q->failed_at && !q->keep_reports)) {
+            continue;
+        }
+        while (undone != 0 && q->changes.at[undone - 1].bodies_len > k) {
+            global_change_apply(&q->changes.at[--undone]);
+        }
+        fn_body_parse(w, body);
+    }
+    for_n(i, undone, q->changes.len) {
+        global_change_apply(&q->changes.at[i]);
+    }
+}
+
+// parse everything defer_fn_body queued up, then exit if any of it
+// (or the global declarations) had an error. a resident unit keeps the queue
+// and the first worker instead, and reports whatever happened later.
+static void parse_fn_bodies(Parser* p, FnBodyQueue* q, CompilationUnit* cu, ResidentUnit* keep) {
+    usize workers_len = min(min(fs_cpu_count(), PARSE_MAX_WORKERS), max(q->bodies.len / PARSE_WORKER_MIN_BODIES, 1));
+    FnBodyWorker* workers = malloc(sizeof(FnBodyWorker) * workers_len);
+
+    if (q->changes.len != 0) {
+        fn_bodies_find_serial(p, q);
+    }
+
+    ParseScopes* globals = &p->scopes;
+    for_n(i, 0, workers_len) {
+        FnBodyWorker* w = &workers[i];
+        w->q = q;
+        w->p = *p;
+        arena_init(&w->p.arena);
+        arena_init(&w->p.nodes);
+        w->p.ast = p->flags.ast ? ast_builder_new(1 + i, p->tokens_len) : nullptr;
+        w->recording = (BodyRecording){
+            .reports = vec_new(CachedReport, 16),
+            .failed_at = BODY_DIDNT_FAIL,
+            .lookups = vec_new(Atom, 64),
+        };
+
+        // the global bindings stay where they are, the body's go on top
+        ParseScopes* s = &w->p.scopes;
+        s->bindings = vec_new(ScopeBinding, globals->bindings.len + 256);
+        memcpy(s->bindings.at, globals->bindings.at, sizeof(globals->bindings.at[0]) * globals->bindings.len);
+        s->bindings.len = globals->bindings.len;
+        s->innermost = vec_new(u32, globals->innermost.len + 256);
+        memcpy(s->innermost.at, globals->innermost.at, sizeof(globals->innermost.at[0]) * globals->innermost.len);
+        s->innermost.len = globals->innermost.len;
+        s->marks = vec_new(u32, 64);
+        s->globals_len = globals->bindings.len;
+    }
+
+    for_n(i, 1, workers_len) {
+        if (thrd_create(&workers[i].thread, fn_body_worker, &workers[i]) != thrd_success) {
+            CRASH("unable to start parser thread");
+        }
+    }
+    fn_body_worker(&workers[0]);
+    for_n(i, 1, workers_len) {
+        thrd_join(workers[i].thread, nullptr);
+    }
+    if (q->changes.len != 0) {
+        fn_bodies_parse_serial(&workers[0]);
+    }
+
+    if (q->failed_at != UINT32_MAX && keep == nullptr) {
+        // whatever came after the first error wouldn't have been parsed
+        report_discard_after(q->failed_at);
+        report_flush();
+        exit(3);
+    }
+
+    cu->body_arenas = malloc(sizeof(Arena) * 2 * workers_len);
+    cu->body_arenas_len = 2 * workers_len;
+    if (p->flags.ast) {
+        cu->ast_parts = realloc(cu->ast_parts, sizeof(cu->ast_parts[0]) * (1 + workers_len));
+        cu->ast_parts_len = 1 + workers_len;
+    }
+    for_n(i, 0, workers_len) {
+        cu->body_arenas[2 * i] = workers[i].p.arena;
+        cu->body_arenas[2 * i + 1] = workers[i].p.nodes;
+        if (p->flags.ast) {
+            cu->ast_parts[1 + i] = workers[i].p.ast;
+        }
+        if (keep != nullptr && i == 0) {
+            continue;
+        }
+        vec_destroy(&workers[i].p.scopes.bindings);
+        vec_destroy(&workers[i].p.scopes.innermost);
+        vec_destroy(&workers[i].p.scopes.marks);
+        vec_destroy(&workers[i].recording.reports);
+        vec_destroy(&workers[i].recording.lookups);
+    }
+    if (keep != nullptr) {
+        keep->bodies = q;
+        keep->worker = malloc(sizeof(FnBodyWorker));
+        *keep->worker = workers[0];
+        // what it's parsed so far went to cu with the rest
+        arena_init(&keep->worker->p.arena);
+        arena_init(&keep->worker->p.nodes);
+        keep->worker->p.ast = nullptr;
+        free(workers);
+        return;
+    }
+    free(workers);
+    vec_destroy(&q->bodies);
+    vec_destroy(&q->includes);
+    vec_destroy(&q->changes);
+    free(q);
+}
+
+// ------------------------- INTERFACE FILES -------------------------
+
+// an interface file has everything another compilation unit needs to use this one:
+// its TYPEs, and the types of whatever it makes PUBLIC, EXPORTs or declares EXTERN.
+// --emit-interface writes one without parsing any FN bodies, and --interface loads
+// one in before parsing starts, with its variables and functions as EXTERN.
+//
+// like include cache files, they don't contain any pointers. types refer to each
+// other by index into the file's types, offset by IFACE_BUILTIN_TYPES. anything
+// below that is one of the builtin types itself.
+
+#define IFACE_MAGIC 0x49505943u // "CYPI"
+#define IFACE_VERSION 1
+#define IFACE_NONE UINT32_MAX
+#define IFACE_BUILTIN_TYPES TY_PTR
+#define PARSE_MAX_INTERFACES 256
+
+// an array in the interface file, as a byte offset from its start and an item count
+typedef struct {
+    u32 offset;
+    u32 len;
+} IfaceArray;
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    IfaceArray types;    // IfaceType
+    IfaceArray params;   // IfaceParam
+    IfaceArray entities; // IfaceEntity
+    IfaceArray names;    // IfaceArray, into strings
+    IfaceArray strings;  // char
+} IfaceHeader;
+
+// a type only refers to types that come before it, except an alias,
+// which might be part of its own definition
+typedef struct {
+    u8 kind; // TY_PTR, TY_ARRAY, TY_FN, TY_ALIAS or TY_ALIAS_INCOMPLETE
+    bool variadic;
+    u16 _pad;
+    u32 to; // what it points to or aliases, the element type, or the return type
+    u32 len; // array length, or how many params
+    u32 params; // index of the first param
+    u32 name; // aliases only
+} IfaceType;
+
+typedef struct {
+    u32 ty; // IFACE_NONE for the variadic parameter
+    u32 name; // or argv
+    u32 argc; // variadic parameter only
+    bool out;
+    u8 _pad[3];
+} IfaceParam;
+
+typedef struct {
+    u32 name;
+    u32 ty;
+    u8 kind;
+    u8 storage;
+    u16 _pad;
+} IfaceEntity;
+
+Vec_typedef(IfaceType);
+Vec_typedef(IfaceParam);
+Vec_typedef(IfaceEntity);
+Vec_typedef(IfaceArray);
+
+static const char* interfaces[PARSE_MAX_INTERFACES];
+static u32 interfaces_len = 0;
+
+void parse_add_interface(const char* path) {
+    if (interfaces_len == PARSE_MAX_INTERFACES) {
+        CRASH("too many interfaces");
+    }
+    interfaces[interfaces_len++] = path;
+}
+
+typedef struct {
+    u32* type_indices; // tybuf index -> file index + 1
+    AtomMap name_indices; // atom -> index + 1
+    Vec(Atom) names;
+    Vec(IfaceType) types;
+    Vec(IfaceParam) params;
+    Vec(IfaceEntity) entities;
+} IfaceWriter;
+
+static u32 iface_name(IfaceWriter* w, Atom a) {
+    usize index = (usize)atommap_get(&w->name_indices, a);
+    if (index == (usize)ATOMMAP_NOT_FOUND) {
+        vec_append(&w->names, a);
+        index = w->names.len;
+        atommap_put(&w->name_indices, a, (void*)index);
+    }
+    return index - 1;
+}
+
+static u32 iface_type(IfaceWriter* w, TyIndex t) {
+    if (t < IFACE_BUILTIN_TYPES) {
+        return t;
+    }
+    if (w->type_indices[t] != 0) {
+        return w->type_indices[t] - 1;
+    }
+
+    IfaceType it = {.kind = TY_KIND(t)};
+    switch (TY_KIND(t)) {
+    case TY_ALIAS:
+    case TY_ALIAS_INCOMPLETE:
+        ;
+        // take a spot before going into what it aliases, which might lead back here
+        u32 index = w->types.len;
+        vec_append(&w->types, it);
+        w->type_indices[t] = index + IFACE_BUILTIN_TYPES + 1;
+        it.name = iface_name(w, TY(t, TyAlias)->entity->name);
+        it.to = TY_KIND(t) == TY_ALIAS ? iface_type(w, TY(t, TyAlias)->aliasing) : IFACE_NONE;
+        w->types.at[index] = it;
+        return index + IFACE_BUILTIN_TYPES;
+    case TY_PTR:
+        it.to = iface_type(w, TY(t, TyPtr)->to);
+        break;
+    case TY_ARRAY:
+        it.to = iface_type(w, TY(t, TyArray)->to);
+        it.len = TY(t, TyArray)->len;
+        break;
+    case TY_FN:
+        ;
+        TyFn* fn = TY(t, TyFn);
+        it.to = iface_type(w, fn->ret_ty);
+        it.len = fn->len;
+        it.variadic = fn->variadic;
+        // the parameter types go in first
+        IfaceParam params[TY_FN_MAX_PARAMS];
+        for_n(i, 0, fn->len) {
+            Ty_FnParam* param = &fn->params[i];
+            if (fn->variadic && i == fn->len - 1) {
+                params[i] = (IfaceParam){
+                    .ty = IFACE_NONE,
+                    .name = iface_name(w, param->varargs.argv),
+                    .argc = iface_name(w, param->varargs.argc),
+                };
+            } else {
+                params[i] = (IfaceParam){
+                    .ty = iface_type(w, param->ty),
+                    .name = iface_name(w, param->name),
+                    .argc = IFACE_NONE,
+                    .out = param->out,
+                };
+            }
+        }
+        it.params = w->params.len;
+        for_n(i, 0, fn->len) {
+            vec_append(&w->params, params[i]);
+        }
+        break;
+    default:
+        UNREACHABLE;
+    }
+    vec_append(&w->types, it);
+    w->type_indices[t] = w->types.len + IFACE_BUILTIN_TYPES;
+    return w->types.len - 1 + IFACE_BUILTIN_TYPES;
+}
+
+// append an array to the file, 8-byte aligned
+static IfaceArray iface_put(Vec(char)* out, const void* items, usize len, usize stride) {
+    while (out->len % 8 != 0) {
+        vec_append(out, 0);
+    }
+    IfaceArray array = {.offset = out->len, .len = len};
+    vec_reserve(out, len * stride);
+    memcpy(&out->at[out->len], items, len * stride);
+    out->len += len * stride;
+    return array;
+}
+
+void parse_write_interface(CompilationUnit* cu, const char* path) {
+    IfaceWriter w = {
+        .type_indices = calloc(tybuf->len, sizeof(u32)),
+        .names = vec_new(Atom, 256),
+        .types = vec_new(IfaceType, 256),
+        .params = vec_new(IfaceParam, 256),
+        .entities = vec_new(IfaceEntity, 256),
+    };
+    atommap_init(&w.name_indices, 256);
+
+    for_n(i, 0, cu->scopes.bindings.len) {
+        Entity* entity = cu->scopes.bindings.at[i].entity;
+        if (entity->kind == ENTKIND_TYPE) {
+            // types carry their own names
+            iface_type(&w, entity->ty);
+            continue;
+        }
+        if (entity->storage == STORAGE_PRIVATE || entity->kind == ENTKIND_LABEL) {
+            continue;
+        }
+        IfaceEntity e = {
+            .name = iface_name(&w, entity->name),
+            .ty = iface_type(&w, entity->ty),
+            .kind = entity->kind,
+            .storage = entity->storage,
+        };
+        vec_append(&w.entities, e);
+    }
+
+    Vec(char) strings = vec_new(char, 1024);
+    Vec(IfaceArray) names = vec_new(IfaceArray, w.names.len + 8);
+    for_n(i, 0, w.names.len) {
+        string name = atom_str(w.names.at[i]);
+        vec_append(&names, ((IfaceArray){.offset = strings.len, .len = name.len}));
+        vec_reserve(&strings, name.len);
+        memcpy(&strings.at[strings.len], name.raw, name.len);
+        strings.len += name.len;
+    }
+
+    Vec(char) out = vec_new(char, 4096);
+    IfaceHeader header = {
+        .magic = IFACE_MAGIC,
+        .version = IFACE_VERSION,
+    };
+    vec_reserve(&out, sizeof(header));
+    out.len = sizeof(header);
+    header.types    = iface_put(&out, w.types.at, w.types.len, sizeof(IfaceType));
+    header.params   = iface_put(&out, w.params.at, w.params.len, sizeof(IfaceParam));
+    header.entities = iface_put(&out, w.entities.at, w.entities.len, sizeof(IfaceEntity));
+    header.names    = iface_put(&out, names.at, names.len, sizeof(IfaceArray));
+    header.strings  = iface_put(&out, strings.at, strings.len, 1);
+    memcpy(out.at, &header, sizeof(header));
+
+    // write it next to where it goes and then move it in,
+    // so nobody ever loads a half-written interface
+    string temp = strprintf("%s.tmp", path);
+    FsFile* f = fs_open(temp.raw, true, true);
+    if (f == nullptr) {
+        CRASH("unable to write interface '%s'", path);
+    }
+    bool written = fs_write(f, out.at, out.len) == out.len;
+    fs_destroy(f);
+    if (!written || !fs_rename(temp.raw, path)) {
+        remove(temp.raw);
+        CRASH("unable to write interface '%s'", path);
+    }
+    string_free(temp);
+
+    vec_destroy(&out);
+    vec_destroy(&strings);
+    vec_destroy(&names);
+    free(w.type_indices);
+    atommap_destroy(&w.name_indices);
+    vec_destroy(&w.names);
+    vec_destroy(&w.types);
+    vec_destroy(&w.params);
+    vec_destroy(&w.entities);
+}
+
+// ----- loading
+
+typedef struct {
+    string data;
+    IfaceHeader* header;
+    Atom* names;
+    TyIndex* types;
+} IfaceFile;
+
+#define iface_array(f, field, type) ((type*)((f)->data.raw + (f)->header->field.offset))
+
+static bool iface_array_fits(IfaceFile* f, IfaceArray array, usize stride) {
+    return array.offset % 8 == 0
+        && array.offset <= f->data.len
+        && (u64)array.len * stride <= f->data.len - array.offset;
+}
+
+// a type, counting the builtin ones, from anywhere before limit
+static bool iface_ref_fits(u32 ref, u32 limit) {
+    return ref < IFACE_BUILTIN_TYPES + limit;
+}
+
+// check every index once, so loading doesn't have to
+static bool iface_fits(IfaceFile* f) {
+    IfaceHeader* h = f->header;
+    if (f->data.len < sizeof(IfaceHeader)
+        || h->magic != IFACE_MAGIC
+        || h->version != IFACE_VERSION
+        || !iface_array_fits(f, h->types, sizeof(IfaceType))
+        || !iface_array_fits(f, h->params, sizeof(IfaceParam))
+        || !iface_array_fits(f, h->entities, sizeof(IfaceEntity))
+        || !iface_array_fits(f, h->names, sizeof(IfaceArray))
+        || !iface_array_fits(f, h->strings, 1)
+    ) {
+        return false;
+    }
+
+    IfaceArray* names = iface_array(f, names, IfaceArray);
+    for_n(i, 0, h->names.len) {
+        if (names[i].offset > h->strings.len || names[i].len > h->strings.len - names[i].offset) {
+            return false;
+        }
+    }
+    IfaceType* types = iface_array(f, types, IfaceType);
+    IfaceParam* params = iface_array(f, params, IfaceParam);
+    for_n(i, 0, h->types.len) {
+        IfaceType t = types[i];
+        switch (t.kind) {
+        case TY_ALIAS_INCOMPLETE:
+            if (t.name >= h->names.len) return false;
+            break;
+        case TY_ALIAS:
+            if (t.name >= h->names.len || !iface_ref_fits(t.to, h->types.len)) return false;
+            // a chain of aliases has to end somewhere
+            u32 to = t.to;
+            u32 steps = 0;
+            while (to >= IFACE_BUILTIN_TYPES && types[to - IFACE_BUILTIN_TYPES].kind == TY_ALIAS) {
+                to = types[to - IFACE_BUILTIN_TYPES].to;
+                if (!iface_ref_fits(to, h->types.len) || ++steps > h->types.len) return false;
+            }
+            break;
+        case TY_PTR:
+        case TY_ARRAY:
+            if (!iface_ref_fits(t.to, i)) return false;
+            break;
+        case TY_FN:
+            if (!iface_ref_fits(t.to, i)
+                || t.len > TY_FN_MAX_PARAMS
+                || (t.variadic && t.len == 0)
+                || t.params > h->params.len
+                || t.len > h->params.len - t.params
+            ) {
+                return false;
+            }
+            for_n(j, 0, t.len) {
+                IfaceParam param = params[t.params + j];
+                if (param.name >= h->names.len) return false;
+                if (t.variadic && j == t.len - 1) {
+                    if (param.argc >= h->names.len) return false;
+                } else if (!iface_ref_fits(param.ty, i)) {
+                    return false;
+                }
+            }
+            break;
+        default:
+            return false;
+        }
+    }
+    IfaceEntity* entities = iface_array(f, entities, IfaceEntity);
+    for_n(i, 0, h->entities.len) {
+        IfaceEntity e = entities[i];
+        if (e.name >= h->names.len
+            || !iface_ref_fits(e.ty, h->types.len)
+            || (e.kind != ENTKIND_VAR && e.kind != ENTKIND_FN)
+        ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static TyIndex iface_resolve(IfaceFile* f, u32 ref) {
+    return ref < IFACE_BUILTIN_TYPES ? ref : f->types[ref - IFACE_BUILTIN_TYPES];
+}
+
+static void iface_conflict(const char* path, Atom name) {
+    printf("interface %s: conflicting declaration of '"str_fmt"'\n", path, str_arg(atom_str(name)));
+    exit(1);
+}
+
+// declare everything in it in the global scope
+static void load_interface(Parser* p, const char* path) {
+    FsFile* handle = fs_open(path, false, false);
+    if (handle == nullptr) {
+        printf("cannot open interface %s\n", path);
+        exit(1);
+    }
+    IfaceFile f = {.data = fs_map_entire(handle)};
+    f.header = (IfaceHeader*)f.data.raw;
+    if (!iface_fits(&f)) {
+        printf("%s is not a valid interface\n", path);
+        exit(1);
+    }
+    IfaceHeader* h = f.header;
+
+    IfaceArray* names = iface_array(&f, names, IfaceArray);
+    char* strings = iface_array(&f, strings, char);
+    f.names = malloc(sizeof(Atom) * h->names.len);
+    for_n(i, 0, h->names.len) {
+        f.names[i] = atom_intern((string){.raw = &strings[names[i].offset], .len = names[i].len});
+    }
+
+    // aliases first, since anything can point to them. the same TYPE
+    // can come from several interfaces, and they all get the same one.
+    IfaceType* types = iface_array(&f, types, IfaceType);
+    f.types = malloc(sizeof(TyIndex) * h->types.len);
+    for_n(i, 0, h->types.len) {
+        if (types[i].kind != TY_ALIAS && types[i].kind != TY_ALIAS_INCOMPLETE) {
+            continue;
+        }
+        Atom name = f.names[types[i].name];
+        Entity* entity = get_entity(p, name);
+        if (entity == nullptr) {
+            entity = new_entity_in_scope(p, name, ENTKIND_TYPE);
+            entity->ty = ty_new_incomplete(entity);
+        } else if (entity->kind != ENTKIND_TYPE) {
+            iface_conflict(path, name);
+        }
+        f.types[i] = entity->ty;
+    }
+
+    IfaceParam* params = iface_array(&f, params, IfaceParam);
+    for_n(i, 0, h->types.len) {
+        IfaceType t = types[i];
+        switch (t.kind) {
+        case TY_PTR:
+            f.types[i] = ty_get_ptr(iface_resolve(&f, t.to));
+            break;
+        case TY_ARRAY:
+            f.types[i] = ty_get_array(iface_resolve(&f, t.to), t.len);
+            break;
+        case TY_FN:
+            ;
+            Ty_FnParam fn_params[TY_FN_MAX_PARAMS];
+            for_n(j, 0, t.len) {
+                IfaceParam param = params[t.params + j];
+                if (t.variadic && j == t.len - 1) {
+                    fn_params[j] = (Ty_FnParam){.varargs = {.argv = f.names[param.name], .argc = f.names[param.argc]}};
+                } else {
+                    fn_params[j] = (Ty_FnParam){.ty = iface_resolve(&f, param.ty), .out = param.out, .name = f.names[param.name]};
+                }
+            }
+            f.types[i] = ty_get_fn(iface_resolve(&f, t.to), t.variadic, fn_params, t.len);
+            break;
+        }
+    }
+
+    for_n(i, 0, h->types.len) {
+        if (types[i].kind != TY_ALIAS) {
+            continue;
+        }
+        TyIndex alias = f.types[i];
+        TyIndex aliasing = iface_resolve(&f, types[i].to);
+        if (TY_KIND(alias) == TY_ALIAS_INCOMPLETE) {
+            TY(alias, TyAlias)->aliasing = aliasing;
+            TY_KIND(alias) = TY_ALIAS;
+        } else if (!ty_equal(TY(alias, TyAlias)->aliasing, aliasing)) {
+            iface_conflict(path, f.names[types[i].name]);
+        }
+    }
+
+    // whatever it defines is defined somewhere else as far as this unit is concerned
+    IfaceEntity* entities = iface_array(&f, entities, IfaceEntity);
+    for_n(i, 0, h->entities.len) {
+        IfaceEntity e = entities[i];
+        Atom name = f.names[e.name];
+        TyIndex ty = iface_resolve(&f, e.ty);
+        Entity* entity = get_entity(p, name);
+        if (entity == nullptr) {
+            entity = new_entity_in_scope(p, name, e.kind);
+            entity->ty = ty;
+            entity->storage = STORAGE_EXTERN;
+        } else if (entity->kind != e.kind || entity->storage != STORAGE_EXTERN || !ty_equal(entity->ty, ty)) {
+            iface_conflict(path, name);
+        }
+    }
+
+    // the names were interned straight out of it, so it stays mapped
+    free(f.names);
+    free(f.types);
+    fs_destroy(handle);
+}
+
+static CompilationUnit parse_unit_keeping(Parser* p, ResidentUnit* keep) {
+    ty_init();
+
+    dynbuf = vecptr_new(void, 256);
+
+    // the first token might already be inside something
+    for_n(i, 0, p->cursor) {
+        pass_marker(p, i);
+    }
+    update_expansions(p);
+
+    for_n(i, 0, interfaces_len) {
+        load_interface(p, interfaces[i]);
+    }
+
+    if (p->flags.ast) {
+        p->ast = ast_builder_new(0, p->tokens_len);
+    }
+
+    // the tokens have to all be there to skip over bodies
+    FnBodyQueue* bodies = nullptr;
+    if (!(p->flags.parallel || p->body_cache != nullptr || keep != nullptr) || p->stream != nullptr) {
+        while (p->current.kind != TOK_EOF) {
+            parse_global_decl(p);
+        }
+    } else {
+        bodies = fn_body_queue_new();
+        if (p->body_cache != nullptr) {
+            bodies->cache = p->body_cache;
+            // the flags change what gets reported too
+            bodies->seed = hash_word(BODY_HASH_SEED, p->flags.strict | p->flags.error_on_warn << 1);
+            fn_body_cache_bind(bodies->cache);
+        }
+        p->fn_bodies = bodies;
+        if (keep != nullptr) {
+            bodies->keep_reports = true;
+            p->recording = &keep->globals;
+        }
+        jmp_buf catch;
+        report_catch_errors(&catch);
+        if (setjmp(catch) == 0) {
+            while (p->current.kind != TOK_EOF) {
+                parse_global_decl(p);
+            }
+        } else {
+            // the bodies before it still get parsed
+            bodies->failed_at = p->cursor;
+        }
+        report_catch_errors(nullptr);
+        p->fn_bodies = nullptr;
+        if (keep != nullptr) {
+            p->recording = nullptr;
+            keep->failed_at = bodies->failed_at;
+        }
+    }
+
+    CompilationUnit cu = {};
+    // a stream's rings have moved on by now, so it doesn't get any tokens
+    if (p->stream == nullptr) {
+        cu.tokens = p->tokens;
+        cu.tokens_len = p->tokens_len;
+        cu.atoms = p->atoms;
+        cu.newlines = p->newlines;
+        cu.payloads = p->payloads;
+        cu.payloads_len = p->payloads_len;
+        cu.payload_bytes = p->payload_bytes;
+        cu.expansions = p->expansions;
+        cu.expansions_len = p->expansions_len;
+    }
+    cu.sources = p->sources;
+    cu.scopes = p->scopes;
+    cu.arena = p->arena;
+    cu.nodes = p->nodes;
+    if (p->ast != nullptr) {
+        cu.ast_parts = malloc(sizeof(cu.ast_parts[0]));
+        cu.ast_parts[0] = p->ast;
+        cu.ast_parts_len = 1;
+        p->ast = nullptr;
+    }
+
+    if (bodies != nullptr) {
+        parse_fn_bodies(p, bodies, &cu, keep);
+    }
+
+    vec_destroy(&dynbuf);
+    arena_scratch_release();
+
+    return cu;
+}
+
+CompilationUnit parse_unit(Parser* p) {
+    return parse_unit_keeping(p, nullptr);
+}
+
+// ------------------------- RESIDENT UNITS -------------------------
+
+// the compile server (see serve.c) keeps every file it's asked about parsed, in a
+// process of its own, with every FN body deferred (see PARALLEL FN BODIES) and what
+// each one and the global declarations reported kept. an edit that stays inside one
+// of those bodies only gets the tokens it touched lexed again (see lex_relex), spliced
+// in with everything after them moved along, and then just that body parsed again, into
+// an AST part for edits. every other body keeps its AST and what it reported, and all of
+// it gets reported again from wherever the tokens are now. anything else, like an edit
+// to a global or one the preprocessor would have had to see, gets a new unit instead.
+
+ResidentUnit* resident_unit_new(SrcFile* f, FlagSet flags, FnBodyCache* cache) {
+    ResidentUnit* u = malloc(sizeof(ResidentUnit));
+    *u = (ResidentUnit){
+        .file = f,
+        .globals = {
+            .reports = vec_new(CachedReport, 16),
+            .failed_at = BODY_DIDNT_FAIL,
+            .lookups = vec_new(Atom, 16),
+        },
+    };
+    Parser* p = &u->p;
+    *p = lex_entrypoint(f);
+    p->flags = flags;
+    p->flags.stream = false;
+    p->flags.interface_only = false;
+    p->flags.ast = true;
+    p->flags.resident = true;
+    p->body_cache = cache;
+    u->cu = parse_unit_keeping(p, u);
+    // edits don't go in the cache, it only has to get the next unit started
+    p->body_cache = nullptr;
+    u->bodies->cache = nullptr;
+    vec_destroy(&u->globals.lookups);
+    u->globals.lookups = vec_new(Atom, 16);
+    // it all gets reported again by resident_unit_report
+    report_clear();
+
+    for_n(i, 0, p->payloads_len) {
+        TokenPayload* payload = &p->payloads[i];
+        if (p->tokens[payload->token_index].kind == TOK_STRING && payload->string.len != payload->span_len) {
+            u->payload_bytes_len = max(u->payload_bytes_len, payload->string.offset + payload->string.len);
+        }
+    }
+    return u;
+}
+
+CompilationUnit* resident_unit_cu(ResidentUnit* u, Parser** p) {
+    *p = &u->p;
+    return &u->cu;
+}
+
+// ----- finding what changed
+
+// how many bytes a and b start with in common, and end with
+static usize common_prefix(const char* a, const char* b, usize len) {
+    usize i = 0;
+    while (i + 4096 <= len && memcmp(a + i, b + i, 4096) == 0) {
+        i += 4096;
+    }
+    while (i < len && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+static usize common_suffix(const char* a_end, const char* b_end, usize len) {
+    usize i = 0;
+    while (i + 4096 <= len && memcmp(a_end - i - 4096, b_end - i - 4096, 4096) == 0) {
+        i += 4096;
+    }
+    while (i < len && a_end[-(isize)i - 1] == b_end[-(isize)i - 1]) {
+        i++;
+    }
+    return i;
+}
+
+// the token is right there in the file's text, just as it was lexed
+static bool resident_tok_in_text(ResidentUnit* u, u32 index) {
+    Token t = u->p.tokens[index];
+    return !t.generated && t.kind < _TOK_LEX_IGNORE && t.kind != TOK_EOF && token_is_within(u->file, tok_raw(t));
+}
+
+static usize resident_tok_start(ResidentUnit* u, u32 index) {
+    return tok_raw(u->p.tokens[index]) - u->file->src.raw;
+}
+
+// strings don't include their closing quote
+static usize resident_tok_end(ResidentUnit* u, u32 index) {
+    return resident_tok_start(u, index) + tok_span_at(&u->p, index).len + (u->p.tokens[index].kind == TOK_STRING);
+}
+
+// the body is still the same IFs and WHILEs deep at every END it had, see skip_fn_body
+static bool body_depth_step(u8 kind, u32* depth) {
+    if (kind == TOK_KW_IF || kind == TOK_KW_WHILE) {
+        (*depth)++;
+    } else if (kind == TOK_KW_END) {
+        if (*depth == 0) {
+            return false;
+        }
+        (*depth)--;
+    }
+    return true;
+}
+
+// a word, which can't be more of the prototype a body comes after
+static bool is_word_token(u8 kind) {
+    return kind == TOK_IDENTIFIER || (kind > _TOK_KEYWORDS_BEGIN && kind < _TOK_KEYWORDS_END);
+}
+
+// ----- splicing it in
+
+static bool bit_at(u64* bits, u32 i) {
+    return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+// len bits of from, starting at from_at, ORed into to at to_at, a word at a time
+static void bits_copy(u64* to, u32 to_at, u64* from, u32 from_at, u32 len) {
+    while (len != 0) {
+        u32 n = min(len, 64 - to_at % 64);
+        u32 shift = from_at % 64;
+        u64 word = from[from_at / 64] >> shift;
+        if (shift + n > 64) {
+            word |= from[from_at / 64 + 1] << (64 - shift);
+        }
+        if (n < 64) {
+            word &= ((u64)1 << n) - 1;
+        }
+        to[to_at / 64] |= word << (to_at % 64);
+        to_at += n;
+        from_at += n;
+        len -= n;
+    }
+}
+
+// the first payload for a token at or after index
+static u32 payload_at_or_after(Parser* p, u32 index) {
+    u32 lo = 0;
+    u32 hi = p->payloads_len;
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        if (p->payloads[mid].token_index < index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void expr_move_tokens(Expr* expr, u32 from, i32 by) {
+    if (expr == nullptr) {
+        return;
+    }
+    if (expr->token_index >= from) {
+        expr->token_index += by;
+    }
+    switch (expr->kind) {
+    case EXPR_ADD:
+    case EXPR_SUB:
+    case EXPR_MUL:
+    case EXPR_DIV:
+    case EXPR_MOD:
+    case EXPR_AND:
+    case EXPR_OR:
+    case EXPR_XOR:
+    case EXPR_LSH:
+    case EXPR_RSH:
+    case EXPR_EQ:
+    case EXPR_NEQ:
+    case EXPR_LESS_EQ:
+    case EXPR_GREATER_EQ:
+    case EXPR_LESS:
+    case EXPR_GREATER:
+    case EXPR_BOOL_AND:
+    case EXPR_BOOL_OR:
+    case EXPR_SUBSCRIPT:
+        expr_move_tokens(expr->binary.lhs, from, by);
+        expr_move_tokens(expr->binary.rhs, from, by);
+        break;
+    case EXPR_ADDROF:
+    case EXPR_NEG:
+    case EXPR_NOT:
+    case EXPR_BOOL_NOT:
+    case EXPR_SIZEOFVALUE:
+    case EXPR_OUT_ARG:
+    case EXPR_CONTAINEROF:
+    case EXPR_CAST:
+    case EXPR_DEREF:
+    case EXPR_DEREF_MEMBER:
+    case EXPR_MEMBER:
+        expr_move_tokens(expr->unary, from, by);
+        break;
+    case EXPR_CALL:
+        expr_move_tokens(expr->call.callee, from, by);
+        for_n(i, 0, expr->call.args_len) {
+            expr_move_tokens(expr->call.args[i], from, by);
+        }
+        break;
+    case EXPR_ARRAY_LITERAL:
+        for_n(i, 0, expr->lit_array.len) {
+            expr_move_tokens(expr->lit_array.values[i], from, by);
+        }
+        break;
+    case EXPR_STRUCT_LITERAL:
+        for_n(i, 0, expr->lit_struct.len) {
+            expr_move_tokens(expr->lit_struct.values[i], from, by);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// from the old text to the new one, where everything from old_end on moved along
+static void token_rebase(Token* t, string old, string src, usize old_end) {
+    char* raw = tok_raw(*t);
+    if (old.raw <= raw && raw <= old.raw + old.len) {
+        usize offset = raw - old.raw;
+        t->raw = (i64)(src.raw + offset + (offset >= old_end ? (isize)src.len - (isize)old.len : 0));
+    }
+}
+
+// the tokens [i0, i1) of body k are now r's, lexed from src, which old_end bytes into
+// the old text is delta bytes further along. nothing can go wrong from here on.
+static void resident_splice(ResidentUnit* u, u32 k, u32 i0, u32 i1, Relexed* r, string src, usize old_end) {
+    Parser* p = &u->p;
+    FnBodyQueue* q = u->bodies;
+    string old = u->file->src;
+    u32 old_len = p->tokens_len;
+    i32 dk = (i32)r->tokens_len - (i32)(i1 - i0);
+    u32 new_len = old_len + dk;
+
+    // everything that points into the old text gets pointed at the new one,
+    // while the tokens are still where they were
+    for_n(i, 0, old_len) {
+        token_rebase(&p->tokens[i], old, src, old_end);
+    }
+    for_n(i, 0, p->expansions_len) {
+        Expansion* e = &p->expansions[i];
+        token_rebase(&e->site, old, src, old_end);
+        token_rebase(&e->call, old, src, old_end);
+        if (e->start >= i1) {
+            e->start += dk;
+        }
+        if (e->end != EXPANSION_OPEN && e->end >= i1) {
+            e->end += dk;
+        }
+    }
+
+    if (new_len > old_len) {
+        p->tokens = realloc(p->tokens, sizeof(p->tokens[0]) * new_len);
+        p->atoms = realloc(p->atoms, sizeof(p->atoms[0]) * new_len);
+    }
+    if (dk != 0) {
+        memmove(&p->tokens[i0 + r->tokens_len], &p->tokens[i1], sizeof(p->tokens[0]) * (old_len - i1));
+        memmove(&p->atoms[i0 + r->tokens_len], &p->atoms[i1], sizeof(p->atoms[0]) * (old_len - i1));
+    }
+    memcpy(&p->tokens[i0], r->tokens, sizeof(p->tokens[0]) * r->tokens_len);
+    memcpy(&p->atoms[i0], r->atoms, sizeof(p->atoms[0]) * r->tokens_len);
+
+    u64* newlines = calloc((new_len + 63) / 64, sizeof(newlines[0]));
+    bits_copy(newlines, 0, p->newlines, 0, i0);
+    bits_copy(newlines, i0, r->newlines, 0, r->tokens_len);
+    // whatever was between the last of them and the first token after them
+    newlines[(i1 + dk) / 64] |= (u64)r->newline_after << ((i1 + dk) % 64);
+    bits_copy(newlines, i1 + dk + 1, p->newlines, i1 + 1, old_len - i1 - 1);
+    free(p->newlines);
+    p->newlines = newlines;
+
+    // their payloads go where the old ones were, with their strings at the end
+    u32 first = payload_at_or_after(p, i0);
+    u32 last = payload_at_or_after(p, i1);
+    u32 payloads_len = p->payloads_len - (last - first) + r->payloads_len;
+    if (payloads_len > p->payloads_len) {
+        p->payloads = realloc(p->payloads, sizeof(p->payloads[0]) * payloads_len);
+    }
+    TokenPayload* payloads = p->payloads;
+    memmove(&payloads[first + r->payloads_len], &payloads[last], sizeof(payloads[0]) * (p->payloads_len - last));
+    for_n(i, 0, r->payloads_len) {
+        TokenPayload payload = r->payloads[i];
+        if (r->tokens[payload.token_index].kind == TOK_STRING) {
+            payload.string.offset += u->payload_bytes_len;
+        }
+        payload.token_index += i0;
+        payloads[first + i] = payload;
+    }
+    if (dk != 0) {
+        for_n(i, first + r->payloads_len, payloads_len) {
+            payloads[i].token_index += dk;
+        }
+    }
+    p->payloads_len = payloads_len;
+    p->payload_bytes = realloc(p->payload_bytes, max(u->payload_bytes_len + r->payload_bytes_len, 1));
+    memcpy(p->payload_bytes + u->payload_bytes_len, r->payload_bytes, r->payload_bytes_len);
+    u->payload_bytes_len += r->payload_bytes_len;
+
+    // everything that remembers a token after them
+    q->bodies.at[k].end += dk;
+    for_n(j, k + 1, q->bodies.len) {
+        FnBody* body = &q->bodies.at[j];
+        body->ident_pos += dk;
+        body->start += dk;
+        body->end += dk;
+        if (body->includes_changed >= i1) {
+            body->includes_changed += dk;
+        }
+    }
+    for_vec(u32* include, &q->includes) {
+        if (*include >= i1) {
+            *include += dk;
+        }
+    }
+    for_vec(CachedReport* report, &u->globals.reports) {
+        if (report->start >= (i32)i1) {
+            report->start += dk;
+        }
+        if (report->end >= (i32)i1) {
+            report->end += dk;
+        }
+    }
+    if (u->failed_at != UINT32_MAX && u->failed_at >= i1) {
+        u->failed_at += dk;
+    }
+    for_vec(ScopeBinding* binding, &p->scopes.bindings) {
+        Stmt* decl = binding->entity->decl;
+        if (decl == nullptr) {
+            continue;
+        }
+        if (decl->token_index >= i1) {
+            decl->token_index += dk;
+        }
+        if (decl->kind == STMT_VAR_DECL) {
+            expr_move_tokens(decl->var_decl.expr, i1, dk);
+        }
+    }
+    for_n(i, 0, u->cu.ast_parts_len) {
+        ast_move_tokens(u->cu.ast_parts[i], i1, dk);
+    }
+
+    p->tokens_len = new_len;
+    p->cursor += dk;
+    p->current = p->tokens[p->cursor];
+
+    free(old.raw);
+    u->file->src = src;
+    free(u->file->line_starts);
+    u->file->line_starts = nullptr;
+    u->file->lines_len = 0;
+}
+
+// the worker and cu see the tokens wherever they are now
+static void resident_sync(ResidentUnit* u) {
+    Parser* p = &u->p;
+    Parser* w = &u->worker->p;
+    w->tokens = p->tokens;
+    w->tokens_len = p->tokens_len;
+    w->atoms = p->atoms;
+    w->newlines = p->newlines;
+    w->payloads = p->payloads;
+    w->payloads_len = p->payloads_len;
+    w->payload_bytes = p->payload_bytes;
+
+    CompilationUnit* cu = &u->cu;
+    cu->tokens = p->tokens;
+    cu->tokens_len = p->tokens_len;
+    cu->atoms = p->atoms;
+    cu->newlines = p->newlines;
+    cu->payloads = p->payloads;
+    cu->payloads_len = p->payloads_len;
+    cu->payload_bytes = p->payload_bytes;
+}
+
+// body k parsed again, seeing the globals as they were where it is, like
+// fn_bodies_parse_serial does
+static void resident_reparse(ResidentUnit* u, u32 k) {
+    FnBodyQueue* q = u->bodies;
+    FnBodyWorker* w = u->worker;
+    FnBody* body = &q->bodies.at[k];
+    for_n(i, 0, body->reports_len) {
+        free(body->reports[i].msg);
+    }
+    free(body->reports);
+    body->reports = nullptr;
+    body->reports_len = 0;
+    body->failed_at = BODY_DIDNT_FAIL;
+
+    if (u->edits_part == 0) {
+        CompilationUnit* cu = &u->cu;
+        u->edits_part = cu->ast_parts_len;
+        cu->ast_parts = realloc(cu->ast_parts, sizeof(cu->ast_parts[0]) * (cu->ast_parts_len + 1));
+        cu->ast_parts[cu->ast_parts_len++] = ast_builder_new(u->edits_part, body->end - body->start);
+    }
+    // its old nodes just don't get used anymore
+    w->p.ast = u->cu.ast_parts[u->edits_part];
+    body->fn_decl->fn_decl.flat = AST_NONE;
+
+    u32 undone = q->changes.len;
+    while (undone != 0 && q->changes.at[undone - 1].bodies_len > k) {
+        global_change_apply(&q->changes.at[--undone]);
+    }
+    dynbuf = vecptr_new(void, 256);
+    fn_body_parse(w, body);
+    vec_destroy(&dynbuf);
+    arena_scratch_release();
+    for_n(i, undone, q->changes.len) {
+        global_change_apply(&q->changes.at[i]);
+    }
+}
+
+bool resident_unit_edit(ResidentUnit* u, string src) {
+    Parser* p = &u->p;
+    FnBodyQueue* q = u->bodies;
+    string old = u->file->src;
+    usize prefix = common_prefix(old.raw, src.raw, min(old.len, src.len));
+    if (prefix == old.len && old.len == src.len) {
+        free(src.raw);
+        return true;
+    }
+    usize suffix = common_suffix(old.raw + old.len, src.raw + src.len, min(old.len, src.len) - prefix);
+    // the bytes [prefix, old_end) of the old text are what changed
+    usize old_end = old.len - suffix;
+    isize delta = (isize)src.len - (isize)old.len;
+
+    // the body it's all inside of, between the end of the FN's prototype and the start of its END
+    u32 k = 0;
+    for (; k < q->bodies.len; ++k) {
+        FnBody* body = &q->bodies.at[k];
+        if (resident_tok_in_text(u, body->start - 1) && resident_tok_in_text(u, body->end - 1)
+            && resident_tok_end(u, body->start - 1) < prefix && old_end < resident_tok_start(u, body->end - 1)
+        ) {
+            break;
+        }
+    }
+    if (k == q->bodies.len) {
+        free(src.raw);
+        return false;
+    }
+    FnBody* body = &q->bodies.at[k];
+    u32 end_index = body->end - 1;
+    for_n(i, body->start, end_index) {
+        if (!resident_tok_in_text(u, i)) {
+            free(src.raw);
+            return false;
+        }
+    }
+
+    // the first token that could have changed, and the first one after that that can't have.
+    // a token touching the edit might not be the same token anymore.
+    u32 i0 = body->start;
+    while (resident_tok_end(u, i0) < prefix) {
+        i0++;
+    }
+    u32 i1 = i0;
+    while (resident_tok_start(u, i1) <= old_end) {
+        i1++;
+    }
+
+    Relexed r;
+    if (!lex_relex(src, resident_tok_end(u, i0 - 1), resident_tok_start(u, i1) + delta, &r)) {
+        free(src.raw);
+        return false;
+    }
+    bool fits = true;
+    // the FN's prototype ended where it did because of how its body started
+    if (i0 == body->start) {
+        fits = r.tokens_len != 0 && bit_at(r.newlines, 0) == tok_newline_before(p, i0)
+            && (r.tokens[0].kind == p->tokens[i0].kind
+                || (is_word_token(r.tokens[0].kind) && is_word_token(p->tokens[i0].kind)));
+    }
+    u32 depth = 0;
+    for (u32 i = body->start; i < i0 && fits; ++i) {
+        fits = body_depth_step(p->tokens[i].kind, &depth);
+    }
+    for (u32 i = 0; i < r.tokens_len && fits; ++i) {
+        fits = body_depth_step(r.tokens[i].kind, &depth);
+    }
+    for (u32 i = i1; i < end_index && fits; ++i) {
+        fits = body_depth_step(p->tokens[i].kind, &depth);
+    }
+    if (!fits || depth != 0) {
+        lex_relexed_free(&r);
+        free(src.raw);
+        return false;
+    }
+
+    resident_splice(u, k, i0, i1, &r, src, old_end);
+    lex_relexed_free(&r);
+    resident_sync(u);
+    resident_reparse(u, k);
+    return true;
+}
+
+// ----- reporting it all again
+
+static void resident_replay(Parser* p, CachedReport* reports, u32 reports_len, u32 base) {
+    jmp_buf catch;
+    report_catch_errors(&catch);
+    for (volatile u32 i = 0; i < reports_len; ++i) {
+        CachedReport* r = &reports[i];
+        if (setjmp(catch) == 0) {
+            token_error(p, r->kind, base + r->start, base + r->end, r->msg);
+        }
+    }
+    report_catch_errors(nullptr);
+}
+
+int resident_unit_report(ResidentUnit* u) {
+    Parser* p = &u->p;
+    FnBodyQueue* q = u->bodies;
+    report_clear();
+
+    // nothing to go by for which files the globals are in, so those get looked for
+    u32 failed_at = u->failed_at;
+    p->cursor = 0;
+    p->includes_len = 0;
+    resident_replay(p, u->globals.reports.at, u->globals.reports.len, 0);
+
+    for_vec(FnBody* body, &q->bodies) {
+        if (body->failed_at != BODY_DIDNT_FAIL) {
+            failed_at = min(failed_at, body->start + body->failed_at);
+        }
+        if (body->reports_len == 0) {
+            continue;
+        }
+        // every report is somewhere in the body, see includes_around
+        p->cursor = body->end;
+        p->includes_len = body->includes_len;
+        memcpy(p->includes, &q->includes.at[body->includes_start], sizeof(p->includes[0]) * body->includes_len);
+        p->includes_changed = body->includes_changed;
+        resident_replay(p, body->reports, body->reports_len, body->start);
+    }
+
+    p->cursor = p->tokens_len - 1;
+    if (failed_at != UINT32_MAX) {
+        // whatever came after the first error wouldn't have been parsed
+        report_discard_after(failed_at);
+    }
+    report_flush();
+    return failed_at != UINT32_MAX ? 3 : 0;
 }
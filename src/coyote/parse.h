@@ -1,6 +1,9 @@
 #ifndef PARSE_H
 #define PARSE_H
 
+#include <stddef.h>
+#include <stdio.h>
+
 #include "common/vec.h"
 #include "coyote.h"
 #include "lex.h"
@@ -34,7 +37,11 @@ typedef enum : u8 {
     TY_ALIAS,
 } TyKind;
 
-typedef u16 TyIndex;
+// type handles are only 24 bits, so structs can fit one in the same word as a
+// kind byte. that's still 16M slots of tybuf.
+typedef u32 TyIndex;
+#define TY_INDEX_BITS 24
+#define TY_INDEX_MAX ((1u << TY_INDEX_BITS) - 1)
 typedef struct {u32 _;} TyBufSlot;
 
 typedef struct {
@@ -43,18 +50,19 @@ typedef struct {
 
 typedef struct {
     u8 kind;
-    TyIndex to;
+    TyIndex to : TY_INDEX_BITS;
 } TyPtr;
+static_assert(sizeof(TyPtr) == sizeof(TyBufSlot));
 
 typedef struct {
     u8 kind;
-    TyIndex to;
+    TyIndex to : TY_INDEX_BITS;
     u32 len;
 } TyArray;
 
 typedef struct {
     u8 kind;
-    TyIndex aliasing;
+    TyIndex aliasing : TY_INDEX_BITS;
     Entity* entity;
 } TyAlias;
 
@@ -76,15 +84,16 @@ typedef struct {
 
 typedef union {
     struct {    
-        TyIndex ty;
+        TyIndex ty : TY_INDEX_BITS;
         bool out;
-        CompactString name;
+        Atom name;
     };
     struct {
-        CompactString argv;
-        CompactString argc;
+        Atom argv;
+        Atom argc;
     } varargs;
 } Ty_FnParam;
+static_assert(sizeof(Ty_FnParam) == 8);
 
 #define TY_FN_MAX_PARAMS 32 // reasonable
 typedef struct {
@@ -98,6 +107,17 @@ typedef struct {
 
 void ty_init();
 
+// for passes that come after parsing, which can't see tybuf
+TyKind ty_kind(TyIndex t);
+TyFn* ty_fn(TyIndex t);
+TyIndex ty_target(TyIndex t); // what a pointer points to
+TyIndex ty_pointer_to(TyIndex t); // made if there isn't one yet
+usize ty_size(TyIndex t);
+bool ty_is_signed(TyIndex t);
+const char* ty_name(TyIndex t);
+// how many slots of tybuf are taken and how much it all takes up, for the bench
+void ty_table_stats(u32* slots, usize* bytes);
+
 // ------------------- PARSE/SEMA ------------------- 
 
 void token_error(Parser* ctx, ReportKind kind, u32 start_index, u32 end_index, const char* msg);
@@ -122,14 +142,15 @@ typedef enum : u8 {
 } EntityKind;
 
 typedef struct Entity {
-    CompactString name;
+    Atom name;
 
-    EntityKind kind;
-    StorageKind storage;
-    TyIndex ty;
+    TyIndex ty : TY_INDEX_BITS;
+    EntityKind kind : 4;
+    StorageKind storage : 4;
 
-    Stmt* decl;
+    Stmt* decl; // locals lose theirs once they're in the compact AST, see ast_flatten_fn
 } Entity;
+static_assert(sizeof(Entity) == 16);
 
 typedef enum : u8 {
     
@@ -194,7 +215,9 @@ typedef struct Stmt {
 
         struct {
             Entity* fn;
-            StmtList body;
+            StmtList body; // empty once it's been flattened
+            u32 flat; // its node in the AstBuilder it was flattened into, or AST_NONE
+            u32 part; // which of CompilationUnit.ast_parts that is
         } fn_decl;
 
         struct {
@@ -244,6 +267,9 @@ typedef enum : u8 {
     EXPR_LESS,
     EXPR_GREATER,
 
+    EXPR_BOOL_AND,
+    EXPR_BOOL_OR,
+
     EXPR_ADDROF,
     EXPR_NEG,
     EXPR_NOT,
@@ -276,7 +302,7 @@ typedef enum : u8 {
 
 typedef struct Expr {
     ExprKind kind;
-    TyIndex ty;
+    TyIndex ty : TY_INDEX_BITS;
     u32 token_index;
     
     union { // allocated in the arena as-needed
@@ -314,6 +340,7 @@ typedef struct Expr {
 
     };
 } Expr;
+static_assert(offsetof(Expr, extra) == 8);
 
 Stmt* parse_stmt(Parser* p);
 Expr* parse_expr(Parser* p);
@@ -323,14 +350,146 @@ VecPtr_typedef(Entity);
 
 typedef struct CompilationUnit {
     Arena arena;
-    ParseScope* top_scope;
-
+    Arena nodes;
+    // in parallel mode, FN bodies were parsed into these instead,
+    // each thread's arena followed by its nodes
+    Arena* body_arenas;
+    u32 body_arenas_len;
+    // with FlagSet.ast, what each parser flattened its FN bodies into.
+    // ast_build takes them.
+    AstBuilder** ast_parts;
+    u32 ast_parts_len;
+    ParseScopes scopes; // only the global scope is left by now
+
+    // none of these if the tokens were streamed, see lex_entrypoint_streaming
     Token* tokens;
     u32 tokens_len;
+    Atom* atoms;
+    u64* newlines;
+
+    TokenPayload* payloads;
+    u32 payloads_len;
+    char* payload_bytes;
+
+    Expansion* expansions;
+    u32 expansions_len;
 
     VecPtr(SrcFile) sources;
 } CompilationUnit;
 
 CompilationUnit parse_unit(Parser* p);
 
+// ------------------- COMPACT AST -------------------
+
+// the same tree as Stmt and Expr, flattened out once parsing's done, so later
+// passes walk dense arrays instead of chasing pointers through the arenas.
+// nodes are indices and come in pre-order, so a node's first child is always
+// the node right after it. each node has one more word of data, and whatever
+// else it has goes in extra. see ast.c for what each kind keeps where.
+//
+// it isn't much smaller than the tree: every node still has a kind, a type, a
+// token and a data word, 13 bytes, so it comes to about 60% of the size of the
+// Stmt and Expr nodes it's built from. so with FlagSet.ast, each FN body gets
+// flattened as soon as it's parsed and its nodes given back, and the tree and the
+// AST are never both around. on a 16MB file that takes parsing and building the
+// AST from 74MB at their peak down to 36MB. the bench prints both.
+
+typedef u32 AstNode;
+#define AST_NONE 0 // node 0 is never used, so it stands in for a missing child
+
+// statement kinds are used as-is, expression kinds come after them
+#define AST_EXPR 64
+static_assert(STMT_GOTO < AST_EXPR);
+
+// literals that don't fit in the data word are in extra, low word first
+#define AST_BIG_LITERAL (1u << 31)
+
+typedef struct Ast {
+    u8* kinds;
+    TyIndex* tys; // ReturnKind for statements
+    u32* tokens;
+    u32* data;
+    u32 len;
+
+    u32* extra;
+    u32 extra_len;
+
+    Entity** entities; // nodes refer to these by index, and AST_NONE is nullptr
+    u32 entities_len;
+
+    // global VAR_DECLs and FN_DECLs, in the order they're in the source.
+    // their nodes don't have to be, see ast_build.
+    AstNode* decls;
+    u32 decls_len;
+} Ast;
+
+// statements never show up inside an expression, so whatever comes right after
+// a statement is only an expression if it's that statement's own
+static inline bool ast_has_expr(Ast* ast, AstNode node) {
+    return node + 1 < ast->len && ast->kinds[node + 1] >= AST_EXPR;
+}
+
+static inline u64 ast_literal(Ast* ast, AstNode node) {
+    u32 data = ast->data[node];
+    if (data & AST_BIG_LITERAL) {
+        u32* words = &ast->extra[data & ~AST_BIG_LITERAL];
+        return (u64)words[1] << 32 | words[0];
+    }
+    return data;
+}
+
+Ast ast_build(CompilationUnit* cu);
+void ast_destroy(Ast* ast);
+
+// what parse_unit gives each parser with FlagSet.ast
+AstBuilder* ast_builder_new(u32 part, u32 tokens_len);
+// flattens a FN_DECL, body and all, and records where in the FN_DECL.
+// nothing in the body has to be kept around after this.
+AstNode ast_flatten_fn(AstBuilder* b, Stmt* fn_decl);
+// an edit moved every token from `from` on along by `by`, see RESIDENT UNITS in parse.c
+void ast_move_tokens(AstBuilder* b, u32 from, i32 by);
+
+// interface files, see INTERFACE FILES in parse.c.
+// everything added gets declared by parse_unit before it starts.
+void parse_add_interface(const char* path);
+void parse_write_interface(CompilationUnit* cu, const char* path);
+
+// what FN bodies reported, so unchanged ones don't get parsed again.
+// set Parser.body_cache before parse_unit. see FN BODY CACHE in parse.c.
+FnBodyCache* fn_body_cache_new();
+void fn_body_cache_destroy(FnBodyCache* c);
+void fn_body_cache_save(FnBodyCache* c, FILE* out);
+FnBodyCache* fn_body_cache_load(FILE* in);
+void fn_body_cache_sweep(FnBodyCache* c, bool drop_unused);
+// how many bodies were replayed and how many got parsed since the last sweep
+void fn_body_cache_counts(FnBodyCache* c, u32* replayed, u32* parsed);
+
+// a unit the compile server keeps parsed between edits, see RESIDENT UNITS in parse.c.
+// f's text has to be malloc'd, since the unit takes it over. it all gets reported
+// by resident_unit_report, not right away.
+typedef struct ResidentUnit ResidentUnit;
+ResidentUnit* resident_unit_new(SrcFile* f, FlagSet flags, FnBodyCache* cache);
+// the file's text is src now, which the unit takes over either way. false if the edit
+// can't be made in place, and there has to be a new unit for it.
+bool resident_unit_edit(ResidentUnit* u, string src);
+// reports everything again, and gives back what coyote would have exited with
+int resident_unit_report(ResidentUnit* u);
+// the unit as it is now, and the parser to lower it with. ast_build takes its
+// AST parts, so it can't be edited after that.
+CompilationUnit* resident_unit_cu(ResidentUnit* u, Parser** p);
+
+// ------------------- LOWERING -------------------
+
+typedef struct FeModule FeModule;
+typedef struct FeInstPool FeInstPool;
+typedef struct FeVRegBuffer FeVRegBuffer;
+
+// puts every FN in the unit into mod as iron, already in SSA. see lower.c.
+// p is only for reporting what can't be lowered yet.
+void lower_unit(Parser* p, Ast* ast, FeModule* mod, FeInstPool* ipool, FeVRegBuffer* vregs);
+
+// incremental compile server, see serve.c
+int serve(const char* socket_path);
+int serve_connect(const char* socket_path, const char* file, FlagSet flags, ReportFormat format);
+
 #endif // PARSE_H
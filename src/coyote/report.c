@@ -1,66 +1,59 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <threads.h>
 
 #include "lex.h"
 #include "common/ansi.h"
 
-static u32 line_number(string src, string snippet) {
-    u32 line = 1;
-    char* current = src.raw;
-    while (current != snippet.raw) {
-        if (*current == '\n') line++;
-        current++;
-    }
+// ------------------------- LINE TABLES -------------------------
 
-    return line;
-}
+static void build_line_starts(SrcFile* f) {
+    u32 cap = 64;
+    u32* starts = malloc(sizeof(starts[0]) * cap);
+    u32 len = 0;
+    starts[len++] = 0;
 
-static u32 col_number(string src, string snippet) {
-    u32 col = 1;
-    char* current = src.raw;
-    while (current != snippet.raw) {
-        if (*current == '\n') col = 0;
-        col++;
-        current++;
+    char* current = f->src.raw;
+    char* end = f->src.raw + f->src.len;
+    while ((current = memchr(current, '\n', end - current)) != nullptr) {
+        ++current;
+        if (len == cap) {
+            cap *= 2;
+            starts = realloc(starts, sizeof(starts[0]) * cap);
+        }
+        starts[len++] = current - f->src.raw;
     }
 
-    return col;
+    f->line_starts = starts;
+    f->lines_len = len;
 }
 
-static void print_snippet(string line, string snippet, const char* color, usize pad) {
-    
-    fprintf(stderr, "| ");
-
-    for_n(i, 0, line.len) {
-        if (line.raw + i == snippet.raw) {
-            fprintf(stderr, Bold "%s", color);
-        }
-        if (line.raw + i == snippet.raw + snippet.len) {
-            fprintf(stderr, Reset);
-        }
-        fprintf(stderr, "%c", line.raw[i]);
-    }
-    fprintf(stderr, Reset);
-    fprintf(stderr, "\n");
-    for_n(i, 0, pad) {
-        fprintf(stderr, " ");
+// zero-based, for wherever in the file offset is
+static u32 line_index(SrcFile* f, u32 offset) {
+    if (f->line_starts == nullptr) {
+        build_line_starts(f);
     }
-    fprintf(stderr, "| ");
-    for_n(i, 0, line.len) {
-        if (line.raw + i < snippet.raw) {
-            fprintf(stderr, " ");
-        }
-        if (line.raw + i == snippet.raw) {
-            fprintf(stderr, Bold "%s^", color);
-        }
-        if (line.raw + i == snippet.raw + snippet.len) {
-            break;
-        }
-        if (line.raw + i > snippet.raw) {
-            fprintf(stderr, "~");
+    // last line that starts at or before offset
+    u32 lo = 0;
+    u32 hi = f->lines_len;
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        if (f->line_starts[mid] <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
-    fprintf(stderr, Reset"\n");
+    return lo - 1;
+}
+
+// snippets that don't point into their file (like a paste that isn't closed yet) go at the start
+static u32 snippet_offset(SrcFile* f, string snippet) {
+    if ((uintptr_t)snippet.raw < (uintptr_t)f->src.raw || (uintptr_t)snippet.raw > (uintptr_t)f->src.raw + f->src.len) {
+        return 0;
+    }
+    return snippet.raw - f->src.raw;
 }
 
 bool is_whitespace(char c) {
@@ -75,17 +68,8 @@ bool is_whitespace(char c) {
     return false;
 }
 
-string snippet_line(string src, string snippet) {
-    string line = snippet;
-    // expand line backwards
-    while (true) {
-        if (line.raw == src.raw) break;
-        if (*line.raw == '\n') {
-            line.raw++;
-            break;
-        }
-        line.raw--;
-    }
+// line starts out where the line does, and as long as the snippet
+static string finish_line(string src, string line) {
     // trim leading whitespace
     while (is_whitespace(line.raw[0])) {
         line.raw++;
@@ -102,36 +86,320 @@ string snippet_line(string src, string snippet) {
     return line;
 }
 
-void report_line(ReportLine* report) {
+// for text that isn't in a file, so it has no line table
+string snippet_line(string src, string snippet) {
+    string line = snippet;
+    // expand line backwards
+    while (true) {
+        if (line.raw == src.raw) break;
+        if (*line.raw == '\n') {
+            line.raw++;
+            break;
+        }
+        line.raw--;
+    }
+    return finish_line(src, line);
+}
+
+static string file_line(SrcFile* f, u32 line, string snippet) {
+    return finish_line(f->src, (string){
+        .raw = f->src.raw + f->line_starts[line],
+        .len = snippet.len,
+    });
+}
+
+// ------------------------- RENDERING -------------------------
+
+static void out_str(Vec(char)* out, string s) {
+    vec_reserve(out, s.len);
+    memcpy(&out->at[out->len], s.raw, s.len);
+    out->len += s.len;
+}
+
+static void out_char(Vec(char)* out, char c) {
+    vec_append(out, c);
+}
+
+static void out_printf(Vec(char)* out, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(nullptr, 0, format, args);
+    va_end(args);
+
+    vec_reserve(out, len + 1);
+    va_start(args, format);
+    vsnprintf(&out->at[out->len], len + 1, format, args);
+    va_end(args);
+    out->len += len;
+}
+
+static void print_snippet(Vec(char)* out, string line, string snippet, const char* color, usize pad) {
+
+    out_printf(out, "| ");
+
+    for_n(i, 0, line.len) {
+        if (line.raw + i == snippet.raw) {
+            out_printf(out, Bold "%s", color);
+        }
+        if (line.raw + i == snippet.raw + snippet.len) {
+            out_printf(out, Reset);
+        }
+        out_char(out, line.raw[i]);
+    }
+    out_printf(out, Reset);
+    out_printf(out, "\n");
+    for_n(i, 0, pad) {
+        out_char(out, ' ');
+    }
+    out_printf(out, "| ");
+    for_n(i, 0, line.len) {
+        if (line.raw + i < snippet.raw) {
+            out_char(out, ' ');
+        }
+        if (line.raw + i == snippet.raw) {
+            out_printf(out, Bold "%s^", color);
+        }
+        if (line.raw + i == snippet.raw + snippet.len) {
+            break;
+        }
+        if (line.raw + i > snippet.raw) {
+            out_char(out, '~');
+        }
+    }
+    out_printf(out, Reset"\n");
+}
 
+static void render_text(Vec(char)* out, ReportLine* report, u32 line, u32 col) {
     const char* color = White;
 
     switch (report->kind) {
-    case REPORT_ERROR: fprintf(stderr, Bold Red"ERROR"Reset); color = Red; break;
-    case REPORT_WARNING: fprintf(stderr, Bold Yellow"WARN"Reset); color = Yellow; break;
-    case REPORT_NOTE: fprintf(stderr, Bold Cyan"NOTE"Reset); color = Cyan; break;
+    case REPORT_ERROR: out_printf(out, Bold Red"ERROR"Reset); color = Red; break;
+    case REPORT_WARNING: out_printf(out, Bold Yellow"WARN"Reset); color = Yellow; break;
+    case REPORT_NOTE: out_printf(out, Bold Cyan"NOTE"Reset); color = Cyan; break;
     }
 
-    u32 line_num = line_number(report->src, report->snippet);
-    u32 col_num  = col_number(report->src, report->snippet);
+    out_printf(out, " ["Bold str_fmt Reset":%u:%u] ", str_arg(report->file->path), line + 1, col);
+    out_str(out, report->msg);
+    out_printf(out, "\n");
 
-    fprintf(stderr, " ["Bold str_fmt Reset":%u:%u] ", str_arg(report->path), line_num, col_num);
-    fprintf(stderr, str_fmt, str_arg(report->msg));
-    fprintf(stderr, "\n");
+    if (report->reconstructed_line.raw != nullptr) {
+        out_printf(out, "%4u ", line + 1);
+        string reconstructed = snippet_line(report->reconstructed_line, report->reconstructed_snippet);
+        print_snippet(out, reconstructed, report->reconstructed_snippet, color, 5);
+        out_printf(out, "expanded from: "Reset"\n");
+    }
 
+    out_printf(out, "%4u ", line + 1);
+    print_snippet(out, file_line(report->file, line, report->snippet), report->snippet, color, 5);
+}
+
+static void json_string(Vec(char)* out, string s) {
+    out_char(out, '"');
+    for_n(i, 0, s.len) {
+        u8 c = s.raw[i];
+        switch (c) {
+        case '"':  out_printf(out, "\\\""); break;
+        case '\\': out_printf(out, "\\\\"); break;
+        case '\n': out_printf(out, "\\n"); break;
+        case '\r': out_printf(out, "\\r"); break;
+        case '\t': out_printf(out, "\\t"); break;
+        default:
+            if (c < 0x20) {
+                out_printf(out, "\\u%04x", c);
+            } else {
+                out_char(out, c);
+            }
+        }
+    }
+    out_char(out, '"');
+}
+
+// the fields every report has. the caller closes the object.
+static void render_json(Vec(char)* out, ReportLine* report, u32 line, u32 col) {
+    const char* severity = "note";
+    switch (report->kind) {
+    case REPORT_ERROR: severity = "error"; break;
+    case REPORT_WARNING: severity = "warning"; break;
+    case REPORT_NOTE: break;
+    }
+    out_printf(out, "{\"severity\":\"%s\",\"file\":", severity);
+    json_string(out, report->file->path);
+    out_printf(out, ",\"line\":%u,\"column\":%u,\"length\":%zu,\"message\":", line + 1, col, report->snippet.len);
+    json_string(out, report->msg);
     if (report->reconstructed_line.raw != nullptr) {
-        fprintf(stderr, "%4u ", line_num);
-        // fprintf(stderr, "     ");
-        string line = snippet_line(report->reconstructed_line, report->reconstructed_snippet);
-        print_snippet(line, report->reconstructed_snippet, color, 5);
-        fprintf(stderr, "expanded from: "Reset"\n");
-    }
-    
-    fprintf(stderr, "%4u ", line_num);
-    string line = snippet_line(report->src, report->snippet);
-    print_snippet(line, report->snippet, color, 5);
-    
+        string reconstructed = snippet_line(report->reconstructed_line, report->reconstructed_snippet);
+        out_printf(out, ",\"expanded\":{\"text\":");
+        json_string(out, reconstructed);
+        out_printf(out, ",\"column\":%zu,\"length\":%zu}",
+            (usize)(report->reconstructed_snippet.raw - reconstructed.raw) + 1, report->reconstructed_snippet.len);
+    }
+}
+
+// ------------------------- BUFFERING -------------------------
+
+// an error or warning, along with the notes that came before it
+typedef struct {
+    u32 token_index;
+    u32 seq;
+    u32 text_start;
+    u32 text_len;
+} Diagnostic;
+
+Vec_typedef(Diagnostic);
+static once_flag report_once = ONCE_FLAG_INIT;
+// function bodies can be parsed on several threads at once.
+// recursive, since exiting on an error flushes again on the way out.
+static mtx_t report_lock;
+static Vec(Diagnostic) diags;
+// everything rendered so far
+static Vec(char) diag_text;
+static ReportFormat format = REPORT_FORMAT_TEXT;
+
+// the notes this thread has been collecting for its next error or warning
+static thread_local Vec(char) group_text;
+static thread_local u32 group_notes;
+static thread_local jmp_buf* error_catch;
+
+static void report_init() {
+    mtx_init(&report_lock, mtx_plain | mtx_recursive);
+    diags = vec_new(Diagnostic, 16);
+    diag_text = vec_new(char, 1024);
+    // anything still buffered goes out however the program ends
+    atexit(report_flush);
+}
+
+void report_set_format(ReportFormat f) {
+    format = f;
+}
+
+void report_catch_errors(jmp_buf* catch) {
+    error_catch = catch;
+}
+
+static int diag_compare(const void* a, const void* b) {
+    const Diagnostic* x = a;
+    const Diagnostic* y = b;
+    if (x->token_index != y->token_index) return x->token_index < y->token_index ? -1 : 1;
+    if (x->seq != y->seq) return x->seq < y->seq ? -1 : 1;
+    return 0;
+}
+
+void report_flush() {
+    call_once(&report_once, report_init);
+    mtx_lock(&report_lock);
+    if (diags.len == 0) {
+        mtx_unlock(&report_lock);
+        return;
+    }
+    qsort(diags.at, diags.len, sizeof(diags.at[0]), diag_compare);
+
+    Vec(char) out = vec_new(char, diag_text.len + 16);
+    for_n(i, 0, diags.len) {
+        Diagnostic* d = &diags.at[i];
+        string text = {diag_text.at + d->text_start, d->text_len};
+        // the same thing reported from the same place twice only shows up once
+        bool duplicate = false;
+        for (usize j = i; j != 0 && diags.at[j - 1].token_index == d->token_index; --j) {
+            Diagnostic* prev = &diags.at[j - 1];
+            if (string_eq(text, (string){diag_text.at + prev->text_start, prev->text_len})) {
+                duplicate = true;
+                break;
+            }
+        }
+        if (!duplicate) {
+            out_str(&out, text);
+        }
+    }
+    fwrite(out.at, 1, out.len, stderr);
+    fflush(stderr);
+    vec_destroy(&out);
+
+    vec_clear(&diags);
+    vec_clear(&diag_text);
+    mtx_unlock(&report_lock);
+}
+
+void report_discard_after(u32 token_index) {
+    call_once(&report_once, report_init);
+    mtx_lock(&report_lock);
+    usize kept = 0;
+    for_n(i, 0, diags.len) {
+        if (diags.at[i].token_index <= token_index) {
+            diags.at[kept++] = diags.at[i];
+        }
+    }
+    diags.len = kept;
+    mtx_unlock(&report_lock);
+}
+
+void report_clear() {
+    call_once(&report_once, report_init);
+    mtx_lock(&report_lock);
+    vec_clear(&diags);
+    vec_clear(&diag_text);
+    mtx_unlock(&report_lock);
+    if (group_text.at != nullptr) {
+        vec_clear(&group_text);
+    }
+    group_notes = 0;
+}
+
+void report_line(ReportLine* report) {
+    call_once(&report_once, report_init);
+    if (group_text.at == nullptr) {
+        group_text = vec_new(char, 256);
+    }
+
+    // line tables get built the first time they're needed
+    mtx_lock(&report_lock);
+    u32 offset = snippet_offset(report->file, report->snippet);
+    u32 line = line_index(report->file, offset);
+    u32 col = offset - report->file->line_starts[line] + 1;
+    mtx_unlock(&report_lock);
+
+    if (format == REPORT_FORMAT_JSON) {
+        if (report->kind == REPORT_NOTE) {
+            // notes are rendered into the "notes" of whatever comes next
+            out_printf(&group_text, group_notes == 0 ? "" : ",");
+            render_json(&group_text, report, line, col);
+            out_printf(&group_text, "}");
+        } else {
+            // put the notes after the report itself
+            Vec(char) notes = group_text;
+            group_text = vec_new(char, 256);
+            render_json(&group_text, report, line, col);
+            out_printf(&group_text, ",\"notes\":[");
+            out_str(&group_text, (string){notes.at, notes.len});
+            out_printf(&group_text, "]}\n");
+            vec_destroy(&notes);
+        }
+    } else {
+        render_text(&group_text, report, line, col);
+    }
+
+    if (report->kind == REPORT_NOTE) {
+        group_notes++;
+        return;
+    }
+
+    mtx_lock(&report_lock);
+    Diagnostic d = {
+        .token_index = report->token_index,
+        .seq = diags.len,
+        .text_start = diag_text.len,
+        .text_len = group_text.len,
+    };
+    vec_append(&diags, d);
+    out_str(&diag_text, (string){group_text.at, group_text.len});
+    mtx_unlock(&report_lock);
+    vec_clear(&group_text);
+    group_notes = 0;
+
     if (report->kind == REPORT_ERROR) {
+        if (error_catch != nullptr) {
+            longjmp(*error_catch, 1);
+        }
+        report_flush();
         exit(3);
     }
 }
@@ -0,0 +1,219 @@
+#include "lex.h"
+
+// bulk scanning kernels for the raw lexer.
+// every kernel takes a start index and returns the index of the first byte
+// that stops the scan, clamped to len. vector kernels load whole blocks,
+// so they may read up to SCAN_OVERREAD bytes past len. this is fine since
+// source buffers are always followed by FS_MAP_PADDING zero bytes (and
+// sub-lexers over macro bodies only ever look at slices of those buffers).
+
+static_assert(SCAN_OVERREAD <= FS_MAP_PADDING);
+
+static bool class_whitespace(char c) {
+    switch (c) {
+    case '\0': case ' ': case '\t': case '\r': case '\v':
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool class_ident(char c) {
+    return
+        ('a' <= c && c <= 'z') ||
+        ('A' <= c && c <= 'Z') ||
+        ('0' <= c && c <= '9') ||
+        c == '_';
+}
+
+// ------------------------- SCALAR -------------------------
+
+static usize scan_whitespace_scalar(const char* s, usize i, usize len) {
+    while (i < len && class_whitespace(s[i])) ++i;
+    return i;
+}
+
+static usize scan_line_end_scalar(const char* s, usize i, usize len) {
+    while (i < len && s[i] != '\n') ++i;
+    return i;
+}
+
+static usize scan_ident_scalar(const char* s, usize i, usize len) {
+    while (i < len && class_ident(s[i])) ++i;
+    return i;
+}
+
+static usize scan_string_scalar(const char* s, usize i, usize len) {
+    while (i < len && s[i] != '\"' && s[i] != '\\') ++i;
+    return i;
+}
+
+// ------------------------- SSE2 -------------------------
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+// v in [lo, hi], using a signed compare since SSE2 doesn't have unsigned ones
+#define sse2_in_range(v, lo, hi) _mm_cmplt_epi8( \
+    _mm_add_epi8((v), _mm_set1_epi8((char)(0x80 - (lo)))), \
+    _mm_set1_epi8((char)((hi) - (lo) + 1 - 0x80)))
+
+static inline __m128i sse2_whitespace(__m128i v) {
+    __m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    // \t \v are 9 and 11, \r is 13
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\v')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    return m;
+}
+
+static inline __m128i sse2_ident(__m128i v) {
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20)); // fold A-Z onto a-z
+    __m128i m = sse2_in_range(lower, 'a', 'z');
+    m = _mm_or_si128(m, sse2_in_range(v, '0', '9'));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    return m;
+}
+
+static inline __m128i sse2_line_end(__m128i v) {
+    return _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+}
+
+static inline __m128i sse2_string(__m128i v) {
+    return _mm_or_si128(
+        _mm_cmpeq_epi8(v, _mm_set1_epi8('\"')),
+        _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))
+    );
+}
+
+// skip = true scans past bytes in the class, skip = false scans up to one.
+#define SSE2_KERNEL(name, classify, skip) \
+    static usize name(const char* s, usize i, usize len) { \
+        while (i < len) { \
+            __m128i v = _mm_loadu_si128((const __m128i*)(s + i)); \
+            u32 mask = (u32)_mm_movemask_epi8(classify(v)); \
+            if (skip) mask = ~mask & 0xFFFF; \
+            if (mask) return min(i + __builtin_ctz(mask), len); \
+            i += 16; \
+        } \
+        return len; \
+    }
+
+SSE2_KERNEL(scan_whitespace_sse2, sse2_whitespace, true)
+SSE2_KERNEL(scan_line_end_sse2,   sse2_line_end,   false)
+SSE2_KERNEL(scan_ident_sse2,      sse2_ident,      true)
+SSE2_KERNEL(scan_string_sse2,     sse2_string,     false)
+
+#endif
+
+// ------------------------- AVX2 -------------------------
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SCAN_HAS_AVX2
+#include <immintrin.h>
+
+#define AVX2 __attribute__((target("avx2")))
+
+#define avx2_in_range(v, lo, hi) _mm256_cmpgt_epi8( \
+    _mm256_set1_epi8((char)((hi) - (lo) + 1 - 0x80)), \
+    _mm256_add_epi8((v), _mm256_set1_epi8((char)(0x80 - (lo)))))
+
+static inline AVX2 __m256i avx2_whitespace(__m256i v) {
+    __m256i m = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\v')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+    return m;
+}
+
+static inline AVX2 __m256i avx2_ident(__m256i v) {
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i m = avx2_in_range(lower, 'a', 'z');
+    m = _mm256_or_si256(m, avx2_in_range(v, '0', '9'));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+    return m;
+}
+
+static inline AVX2 __m256i avx2_line_end(__m256i v) {
+    return _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'));
+}
+
+static inline AVX2 __m256i avx2_string(__m256i v) {
+    return _mm256_or_si256(
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\"')),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))
+    );
+}
+
+#define AVX2_KERNEL(name, classify, skip) \
+    static AVX2 usize name(const char* s, usize i, usize len) { \
+        while (i < len) { \
+            __m256i v = _mm256_loadu_si256((const __m256i*)(s + i)); \
+            u32 mask = (u32)_mm256_movemask_epi8(classify(v)); \
+            if (skip) mask = ~mask; \
+            if (mask) return min(i + __builtin_ctz(mask), len); \
+            i += 32; \
+        } \
+        return len; \
+    }
+
+AVX2_KERNEL(scan_whitespace_avx2, avx2_whitespace, true)
+AVX2_KERNEL(scan_line_end_avx2,   avx2_line_end,   false)
+AVX2_KERNEL(scan_ident_avx2,      avx2_ident,      true)
+AVX2_KERNEL(scan_string_avx2,     avx2_string,     false)
+
+#endif
+
+// ------------------------- DISPATCH -------------------------
+
+ScanKernels scan = {
+#if defined(__SSE2__)
+    .whitespace = scan_whitespace_sse2,
+    .line_end   = scan_line_end_sse2,
+    .ident      = scan_ident_sse2,
+    .string     = scan_string_sse2,
+#else
+    .whitespace = scan_whitespace_scalar,
+    .line_end   = scan_line_end_scalar,
+    .ident      = scan_ident_scalar,
+    .string     = scan_string_scalar,
+#endif
+};
+
+void scan_init(ScanLevel level) {
+#if defined(SCAN_HAS_AVX2)
+    if (level == SCAN_BEST) {
+        __builtin_cpu_init();
+        level = __builtin_cpu_supports("avx2") ? SCAN_AVX2 : SCAN_SSE2;
+    }
+#endif
+    switch (level) {
+    case SCAN_SCALAR:
+        scan.whitespace = scan_whitespace_scalar;
+        scan.line_end   = scan_line_end_scalar;
+        scan.ident      = scan_ident_scalar;
+        scan.string     = scan_string_scalar;
+        break;
+#if defined(__SSE2__)
+    case SCAN_SSE2:
+        scan.whitespace = scan_whitespace_sse2;
+        scan.line_end   = scan_line_end_sse2;
+        scan.ident      = scan_ident_sse2;
+        scan.string     = scan_string_sse2;
+        break;
+#endif
+#if defined(SCAN_HAS_AVX2)
+    case SCAN_AVX2:
+        scan.whitespace = scan_whitespace_avx2;
+        scan.line_end   = scan_line_end_avx2;
+        scan.ident      = scan_ident_avx2;
+        scan.string     = scan_string_avx2;
+        break;
+#endif
+    default:
+        // whatever was compiled in by default
+        break;
+    }
+}
@@ -0,0 +1,461 @@
+// incremental compile server. it stays up and keeps every file it's asked about
+// parsed, in a child process of its own (see RESIDENT UNITS in parse.c): the tokens,
+// tybuf, the global scope, every body's AST and what everything reported. an edit
+// that stays inside one FN body only gets the tokens it touched lexed again and that
+// body parsed again, and then everything gets reported from wherever it is now.
+//
+//     coyote --serve <socket> [--cache <dir>]
+//     coyote --connect <socket> [--strict] [--error-on-warn] [--json-diagnostics] <file>
+//
+// the preprocessor's state isn't kept around at every point in the file, so nothing
+// it would have had to see gets done in place: a directive, a name that was ever
+// defined, an edit outside of any body, or to an included file. those get a new child
+// that compiles the file from scratch, with the server's FN BODY CACHE so that only
+// the bodies that changed or that look up a global that did get parsed again.
+//
+// on a 16MB file on one core, an edit inside a body takes about 45ms, most of it
+// reading the file and moving every token after the edit along, against 500-650ms
+// for a whole compile. a new global at the top starts over, in about 440ms. with
+// --cache the included files don't get lexed again either.
+
+#include <stdio.h>
+
+#include "common/orbit.h"
+
+#include "common/util.h"
+#include "common/strmap.h"
+#include "lex.h"
+#include "parse.h"
+
+#if defined(OS_LINUX)
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define SERVE_MAGIC 0x53505943u // "CYPS"
+
+typedef struct {
+    u32 magic;
+    FlagSet flags;
+    u8 format;
+    u16 path_len; // the file's real path comes right after
+} ServeRequest;
+
+typedef struct {
+    i32 status; // what coyote would have exited with
+    u32 len; // of the diagnostics that come right after
+} ServeReply;
+
+static bool write_all(int fd, const void* buf, usize len) {
+    while (len != 0) {
+        isize n = write(fd, buf, len);
+        if (n <= 0) return false;
+        buf = (const u8*)buf + n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* buf, usize len) {
+    while (len != 0) {
+        isize n = read(fd, buf, len);
+        if (n <= 0) return false;
+        buf = (u8*)buf + n;
+        len -= n;
+    }
+    return true;
+}
+
+// ------------------------- RESIDENT CHILD -------------------------
+
+// every file gets a child process of its own, which keeps it parsed (see RESIDENT
+// UNITS in parse.c) and checks it again whenever it's asked to. the front end exits
+// on errors and keeps plenty of global state around, so the unit can't live in the
+// server itself. the child starts out with the server's cache for free, and sends
+// it back once it's compiled the file from scratch.
+
+typedef struct {
+    i32 status; // what coyote would have exited with
+    bool cold; // it got compiled from scratch, and the cache is in ServedFile.cache_file
+    bool rebuild; // the edit can't be made in place, there has to be a new child
+    bool exiting; // it's exiting instead, status is whatever the server finds out
+} ChildReply;
+
+typedef struct {
+    string path;
+    usize last_modified;
+} IncludedFile;
+
+Vec_typedef(IncludedFile);
+
+static FnBodyCache* child_cache;
+static FILE* child_cache_file;
+static int child_fd;
+static bool child_cold; // compiling from scratch, so the cache is worth sending back
+
+// the front end exits on whatever it can't go on from, which is the end of
+// this child, but the cache is still good
+static void child_send_cache() {
+    if (child_cold) {
+        rewind(child_cache_file);
+        fn_body_cache_save(child_cache, child_cache_file);
+        fflush(child_cache_file);
+        ChildReply reply = {.cold = true, .exiting = true};
+        write_all(child_fd, &reply, sizeof(reply));
+    }
+}
+
+// the whole file in memory of its own, followed by FS_MAP_PADDING zero bytes.
+// the unit takes it over.
+static bool read_src(const char* path, string* src) {
+    FsFile* file = fs_open(path, false, false);
+    if (file == nullptr) {
+        return false;
+    }
+    usize cap = max(file->size, 4096);
+    char* raw = malloc(cap + FS_MAP_PADDING);
+    usize len = 0;
+    while (true) {
+        if (len == cap) {
+            cap *= 2;
+            raw = realloc(raw, cap + FS_MAP_PADDING);
+        }
+        usize n = fs_read(file, raw + len, cap - len);
+        if (n == 0) {
+            break;
+        }
+        len += n;
+    }
+    fs_destroy(file);
+    memset(raw + len, 0, FS_MAP_PADDING);
+    *src = (string){.raw = raw, .len = len};
+    return true;
+}
+
+static usize last_modified(string path) {
+    string terminated = strprintf(str_fmt, str_arg(path));
+    FsFile* file = fs_open(terminated.raw, false, false);
+    free(terminated.raw);
+    if (file == nullptr) {
+        return 0;
+    }
+    usize modified = file->last_modified;
+    fs_destroy(file);
+    return modified;
+}
+
+[[noreturn]] static void resident_child(const char* path, ServeRequest* req, FnBodyCache* cache, int fd, int out_fd) {
+    dup2(out_fd, STDOUT_FILENO);
+    dup2(out_fd, STDERR_FILENO);
+    close(out_fd);
+    report_set_format(req->format);
+
+    child_cache = cache;
+    child_fd = fd;
+    atexit(child_send_cache);
+
+    ResidentUnit* u = nullptr;
+    // the included files only get lexed with the whole file
+    Vec(IncludedFile) included = vec_new(IncludedFile, 8);
+    u8 check;
+    while (read_all(fd, &check, sizeof(check))) {
+        string src;
+        if (!read_src(path, &src)) {
+            printf("cannot open file %s\n", path);
+            exit(1);
+        }
+
+        ChildReply reply = {};
+        if (u == nullptr) {
+            SrcFile* f = malloc(sizeof(SrcFile));
+            *f = (SrcFile){
+                .src = src,
+                .path = strprintf("%s", path),
+            };
+            child_cold = true;
+            u = resident_unit_new(f, req->flags, cache);
+            reply.cold = true;
+
+            Parser* p;
+            CompilationUnit* cu = resident_unit_cu(u, &p);
+            for_n(i, 0, cu->sources.len) {
+                SrcFile* source = cu->sources.at[i];
+                if (source != f) {
+                    vec_append(&included, ((IncludedFile){source->path, last_modified(source->path)}));
+                }
+            }
+        } else {
+            bool same = true;
+            for_vec(IncludedFile* inc, &included) {
+                same &= last_modified(inc->path) == inc->last_modified;
+            }
+            if (!same) {
+                free(src.raw);
+                reply.rebuild = true;
+            } else {
+                reply.rebuild = !resident_unit_edit(u, src);
+            }
+        }
+        if (reply.rebuild) {
+            write_all(fd, &reply, sizeof(reply));
+            exit(0);
+        }
+
+        reply.status = resident_unit_report(u);
+        fflush(stdout);
+        fflush(stderr);
+        if (reply.cold) {
+            rewind(child_cache_file);
+            fn_body_cache_save(cache, child_cache_file);
+            fflush(child_cache_file);
+            child_cold = false;
+        }
+        if (!write_all(fd, &reply, sizeof(reply))) {
+            break;
+        }
+    }
+    // the server's gone
+    exit(0);
+}
+
+// ------------------------- SERVER -------------------------
+
+typedef struct {
+    FnBodyCache* cache;
+    // its child, 0 if there isn't one right now
+    pid_t child;
+    int fd;
+    FlagSet flags;
+    u8 format;
+    // the child writes to these through its own descriptors
+    FILE* out;
+    FILE* cache_file;
+} ServedFile;
+
+// from a file's real path to what's known about it
+static StrMap served;
+static int listener;
+
+static void served_start(ServedFile* file, const char* path, ServeRequest* req, int client) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        CRASH("unable to set up a compile");
+    }
+    fflush(stdout);
+    pid_t child = fork();
+    if (child < 0) {
+        CRASH("unable to fork a compile");
+    }
+    if (child == 0) {
+        close(listener);
+        close(client);
+        close(fds[0]);
+        child_cache_file = file->cache_file;
+        resident_child(path, req, file->cache, fds[1], fileno(file->out));
+    }
+    close(fds[1]);
+    file->child = child;
+    file->fd = fds[0];
+    file->flags = req->flags;
+    file->format = req->format;
+}
+
+// gives back how it exited, for waitpid
+static int served_stop(ServedFile* file, bool kill_it) {
+    if (kill_it) {
+        kill(file->child, SIGKILL);
+    }
+    close(file->fd);
+    int wait_status;
+    waitpid(file->child, &wait_status, 0);
+    file->child = 0;
+    return wait_status;
+}
+
+// the cache the child sent back, if it could
+static void served_take_cache(ServedFile* file, i32 status) {
+    rewind(file->cache_file);
+    FnBodyCache* fresh = fn_body_cache_load(file->cache_file);
+    if (fresh != nullptr) {
+        fn_body_cache_destroy(file->cache);
+        file->cache = fresh;
+    }
+    fn_body_cache_sweep(file->cache, status == 0);
+}
+
+static void serve_request(int client) {
+    ServeRequest req;
+    char path[PATH_MAX];
+    if (!read_all(client, &req, sizeof(req)) || req.magic != SERVE_MAGIC || req.path_len >= PATH_MAX) {
+        return;
+    }
+    if (!read_all(client, path, req.path_len)) {
+        return;
+    }
+    path[req.path_len] = '\0';
+
+    ServedFile* file = strmap_get(&served, (string){.raw = path, .len = req.path_len});
+    if (file == STRMAP_NOT_FOUND) {
+        file = malloc(sizeof(ServedFile));
+        *file = (ServedFile){
+            .cache = fn_body_cache_new(),
+            .out = tmpfile(),
+            .cache_file = tmpfile(),
+        };
+        if (file->out == nullptr || file->cache_file == nullptr) {
+            CRASH("unable to set up a compile");
+        }
+        strmap_put(&served, strprintf("%s", path), file);
+    }
+    // what gets reported depends on these too
+    if (file->child != 0 && (memcmp(&file->flags, &req.flags, sizeof(FlagSet)) != 0 || file->format != req.format)) {
+        served_stop(file, true);
+    }
+
+    ServeReply reply = {.status = 1};
+    while (true) {
+        if (file->child == 0) {
+            served_start(file, path, &req, client);
+        }
+        ftruncate(fileno(file->out), 0);
+        rewind(file->out);
+        ftruncate(fileno(file->cache_file), 0);
+        rewind(file->cache_file);
+
+        u8 check = 1;
+        ChildReply child_reply;
+        if (!write_all(file->fd, &check, sizeof(check)) || !read_all(file->fd, &child_reply, sizeof(child_reply))) {
+            child_reply = (ChildReply){.exiting = true};
+        }
+        if (child_reply.rebuild) {
+            served_stop(file, false);
+            continue;
+        }
+        if (!child_reply.exiting) {
+            reply.status = child_reply.status;
+            if (child_reply.cold) {
+                served_take_cache(file, reply.status);
+            }
+            break;
+        }
+
+        int wait_status = served_stop(file, false);
+        if (WIFEXITED(wait_status)) {
+            reply.status = WEXITSTATUS(wait_status);
+        } else if (WIFSIGNALED(wait_status)) {
+            reply.status = 128 + WTERMSIG(wait_status);
+            fprintf(file->out, "compile of %s died with signal %d\n", path, WTERMSIG(wait_status));
+            fflush(file->out);
+        }
+        // if the child didn't get to send anything back, the old cache is still good
+        if (child_reply.cold) {
+            served_take_cache(file, reply.status);
+        }
+        break;
+    }
+
+    // the child wrote through its own descriptors, so go by the file's size
+    struct stat info;
+    fstat(fileno(file->out), &info);
+    char* text = malloc(info.st_size + 1);
+    isize len = pread(fileno(file->out), text, info.st_size, 0);
+    reply.len = max(len, 0);
+
+    // a client that went away doesn't matter
+    if (write_all(client, &reply, sizeof(reply))) {
+        write_all(client, text, reply.len);
+    }
+    free(text);
+}
+
+int serve(const char* socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        printf("socket path %s is too long\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    // whatever's left over from the last server
+    unlink(socket_path);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 16) != 0) {
+        printf("cannot listen on %s\n", socket_path);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    strmap_init(&served, 64);
+
+    // one at a time, compiles already spread out over every core
+    while (true) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            continue;
+        }
+        serve_request(client);
+        close(client);
+    }
+}
+
+// ------------------------- CLIENT -------------------------
+
+int serve_connect(const char* socket_path, const char* file, FlagSet flags, ReportFormat format) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        printf("socket path %s is too long\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    // the server's working directory is probably somewhere else
+    FsPath path;
+    if (!fs_real_path(file, &path)) {
+        printf("cannot open file %s\n", file);
+        return 1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        printf("cannot connect to a compile server at %s\n", socket_path);
+        return 1;
+    }
+
+    ServeRequest req = {
+        .magic = SERVE_MAGIC,
+        .flags = flags,
+        .format = format,
+        .path_len = path.len,
+    };
+    ServeReply reply;
+    if (!write_all(fd, &req, sizeof(req)) || !write_all(fd, path.raw, path.len)
+        || !read_all(fd, &reply, sizeof(reply))) {
+        printf("compile server at %s hung up\n", socket_path);
+        return 1;
+    }
+    char* text = malloc(reply.len);
+    if (!read_all(fd, text, reply.len)) {
+        printf("compile server at %s hung up\n", socket_path);
+        return 1;
+    }
+    close(fd);
+
+    fwrite(text, 1, reply.len, stderr);
+    free(text);
+    return reply.status;
+}
+
+#else
+
+int serve(const char* socket_path) {
+    CRASH("the compile server only runs on linux for now");
+}
+
+int serve_connect(const char* socket_path, const char* file, FlagSet flags, ReportFormat format) {
+    CRASH("the compile server only runs on linux for now");
+}
+
+#endif
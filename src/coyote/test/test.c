@@ -0,0 +1,1552 @@
+// front-end tests, for the parts that are hard to get at from a .jkl file.
+//
+//     bin/coyote-test
+//
+// prints every check that fails, and exits with 1 if any did.
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "common/orbit.h"
+
+#include "common/util.h"
+#include "coyote/lex.h"
+#include "coyote/parse.h"
+#include "iron/iron.h"
+
+thread_local FlagSet flags = {};
+
+static u32 checks_failed = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        checks_failed++; \
+    } \
+} while (0)
+
+static bool all_bytes(u8* mem, usize len, u8 byte) {
+    for_n(i, 0, len) {
+        if (mem[i] != byte) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// a source file that only exists in memory
+static SrcFile src_from(const char* name, const char* text) {
+    usize len = strlen(text);
+    // scanners read past the end, see FS_MAP_PADDING
+    char* raw = malloc(len + FS_MAP_PADDING);
+    memcpy(raw, text, len);
+    memset(&raw[len], 0, FS_MAP_PADDING);
+    return (SrcFile){
+        .src = {.raw = raw, .len = len},
+        .path = strprintf("<%s>", name),
+    };
+}
+
+// ------------------------- ARENA -------------------------
+
+static void test_scratch_keeps_other_arenas() {
+    Arena arena;
+    arena_init(&arena);
+
+    ArenaScratch scratch = arena_scratch_begin();
+    u8* temp = arena_alloc(scratch.arena, 1000, 1);
+    memset(temp, 0x11, 1000);
+    // has to outlive the scope
+    u8* kept = arena_alloc(&arena, 1000, 1);
+    memset(kept, 0xAB, 1000);
+    arena_scratch_end(scratch);
+
+    // whatever reuses the scratch space can't land on it
+    scratch = arena_scratch_begin();
+    u8* reused = arena_alloc(scratch.arena, 4000, 1);
+    memset(reused, 0xCD, 4000);
+    CHECK(reused == temp);
+    arena_scratch_end(scratch);
+    CHECK(all_bytes(kept, 1000, 0xAB));
+
+    // and neither can what comes after it in its own arena
+    u8* next = arena_alloc(&arena, 1000, 1);
+    memset(next, 0xEF, 1000);
+    CHECK(next >= kept + 1000);
+    CHECK(all_bytes(kept, 1000, 0xAB));
+
+    arena_destroy(&arena);
+}
+
+static void test_scratch_nesting() {
+    ArenaScratch outer = arena_scratch_begin();
+    u8* a = arena_alloc(outer.arena, 100, 1);
+    memset(a, 0x11, 100);
+
+    ArenaScratch inner = arena_scratch_begin();
+    u8* b = arena_alloc(inner.arena, 100, 1);
+    memset(b, 0x22, 100);
+    // too big for a chunk
+    u8* big = arena_alloc(inner.arena, 100000, 1);
+    memset(big, 0x33, 100000);
+    arena_scratch_end(inner);
+
+    // the inner scope's space is free again, the outer one's isn't
+    u8* c = arena_alloc(outer.arena, 100, 1);
+    CHECK(c == b);
+    CHECK(all_bytes(a, 100, 0x11));
+    CHECK(outer.arena->big == outer.save.big);
+    arena_scratch_end(outer);
+
+    arena_scratch_release();
+}
+
+static void test_stats_after_restore() {
+    Arena arena;
+    arena_init(&arena);
+
+    arena_alloc(&arena, 3, 1);
+    arena_alloc(&arena, 8, 8); // 5 bytes of padding
+    ArenaState outer = arena_save(&arena);
+    ArenaStats before = arena.stats;
+    CHECK(before.requested == 11 && before.wasted == 5);
+
+    // fill the first chunk up and spill into the next, leaving its end behind
+    for_n(i, 0, 40) {
+        arena_alloc(&arena, 1000, 1);
+    }
+    ArenaState inner = arena_save(&arena);
+    arena_alloc(&arena, 1, 1);
+    arena_alloc(&arena, 8, 8);
+    arena_alloc(&arena, 100000, 1); // big
+    arena_restore(&arena, inner);
+    CHECK(arena.stats.requested - arena.stats.restored == before.requested + 40 * 1000);
+    CHECK(arena.stats.wasted > before.wasted);
+
+    // rewinding back into the first chunk gets its end back, and restores
+    // inside restores don't count twice
+    arena_restore(&arena, outer);
+    CHECK(arena.stats.requested - arena.stats.restored == before.requested);
+    CHECK(arena.stats.wasted == before.wasted);
+    // the second chunk stays around to be reused, the big block doesn't
+    CHECK(arena.stats.chunks == 2 && arena.stats.bigs == 1);
+    CHECK(arena.stats.reserved < before.reserved * 4);
+
+    arena_destroy(&arena);
+}
+
+// FN prototypes keep their parameters in a scratch scope, and forward-declared
+// types that come up in them used to go away with it
+static void test_prototype_forward_types() {
+    SrcFile f = src_from("forward",
+        "EXTERN FN F(IN a : ^Foo, IN b : ^Bar) : ^Foo\n"
+        "FN G(IN a : ^Foo) : ^Foo\n"
+        "    RETURN a\n"
+        "END\n"
+        "TYPE Foo : UWORD\n"
+    );
+    Parser p = lex_entrypoint(&f);
+    p.flags = flags;
+    CompilationUnit cu = parse_unit(&p);
+    Ast ast = ast_build(&cu);
+    CHECK(ast.decls_len != 0);
+    ast_destroy(&ast);
+}
+
+// ------------------------- STREAMING -------------------------
+
+typedef struct {
+    char* at;
+    usize len;
+    usize cap;
+} TextBuf;
+
+static void text_printf(TextBuf* t, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(nullptr, 0, fmt, args);
+    va_end(args);
+    while (t->len + len + 1 > t->cap) {
+        t->cap = max(t->cap * 2, 4096);
+        t->at = realloc(t->at, t->cap);
+    }
+    va_start(args, fmt);
+    vsnprintf(&t->at[t->len], len + 1, fmt, args);
+    va_end(args);
+    t->len += len;
+}
+
+// more tokens than TOKEN_STREAM_CAP, and one expansion that stays open
+// around 16^4 others, more than fit in the stream's expansion ring
+static char* stream_big_input() {
+    TextBuf t = {};
+    text_printf(&t, "#DEFINE ONE [1]\n#MACRO A() [");
+    for_n(i, 0, 16) {
+        text_printf(&t, " ONE +");
+    }
+    text_printf(&t, " ]\n");
+    for (char m = 'B'; m <= 'E'; ++m) {
+        text_printf(&t, "#MACRO %c() [", m);
+        for_n(i, 0, 16) {
+            text_printf(&t, " %c()", m - 1);
+        }
+        text_printf(&t, " ]\n");
+    }
+    text_printf(&t, "FN Big() : ULONG\n    v : ULONG = E() 0\n    RETURN v\nEND\n");
+    for_n(i, 0, 4000) {
+        text_printf(&t, "FN F%u(IN a : UWORD) : UWORD\n    b : UWORD = a + %u\n    RETURN b\nEND\n", (u32)i, (u32)i);
+    }
+    return t.at;
+}
+
+// parsed both ways, with whether it reported an error
+static void stream_parse_both(const char* name, const char* text, CompilationUnit* units, bool* reported) {
+    SrcFile* f = malloc(sizeof(SrcFile));
+    *f = src_from(name, text);
+    for_n(streamed, 0, 2) {
+        Parser p = streamed ? lex_entrypoint_streaming(f) : lex_entrypoint(f);
+        p.flags = flags;
+        reported[streamed] = false;
+        jmp_buf catch;
+        report_catch_errors(&catch);
+        if (setjmp(catch) == 0) {
+            units[streamed] = parse_unit(&p);
+        } else {
+            reported[streamed] = true;
+        }
+        report_catch_errors(nullptr);
+        report_discard_after(0);
+    }
+}
+
+// input the rings are too small for used to crash the lexer, now they grow
+static void test_stream_outgrows_rings() {
+    CompilationUnit units[2];
+    bool reported[2];
+    char* big = stream_big_input();
+    stream_parse_both("stream", big, units, reported);
+    CHECK(!reported[0] && !reported[1]);
+    CHECK(units[0].scopes.bindings.len == units[1].scopes.bindings.len);
+    // most of the streamed unit's ring got reused long ago, so it doesn't hand it out
+    CHECK(units[0].tokens_len > TOKEN_STREAM_CAP);
+    CHECK(units[1].tokens == nullptr && units[1].tokens_len == 0);
+
+    // the parser bails out long before the lexer's done, with the lexer stuck waiting
+    // on it for room. the next stream (or file) mustn't wait on that lexer forever.
+    char* bad = strprintf("FN Bad( : UWORD\n%s", big).raw;
+    stream_parse_both("stream-bad", bad, units, reported);
+    CHECK(reported[0] && reported[1]);
+    stream_parse_both("stream", big, units, reported);
+    CHECK(!reported[0] && !reported[1]);
+    free(bad);
+    free(big);
+}
+
+// decoded strings only go through the stream's byte ring if they have an escape in them.
+// the first STREAM_SPREAD_STRINGS come far enough apart that the parser's done with
+// the early ones by the time the ring wraps around to where they were, the rest all come
+// at once and don't fit in it unless it grows.
+#define STREAM_STRING_LEN       50000
+#define STREAM_SPREAD_STRINGS   30
+#define STREAM_PACKED_STRINGS   30
+static_assert(STREAM_SPREAD_STRINGS * STREAM_STRING_LEN > TOKEN_STREAM_BYTES_CAP);
+static_assert(STREAM_PACKED_STRINGS * STREAM_STRING_LEN > TOKEN_STREAM_BYTES_CAP);
+
+static char* stream_strings_input() {
+    TextBuf t = {};
+    for_n(i, 0, STREAM_SPREAD_STRINGS + STREAM_PACKED_STRINGS) {
+        text_printf(&t, "s%u : ^UBYTE = \"", (u32)i);
+        for_n(j, 0, STREAM_STRING_LEN / 100) {
+            for_n(k, 0, 99) {
+                text_printf(&t, "%c", 'a' + (char)((i + j + k) % 26));
+            }
+            text_printf(&t, "\\t");
+        }
+        text_printf(&t, "\"\n");
+        if (i < STREAM_SPREAD_STRINGS) {
+            // more than TOKEN_STREAM_HISTORY tokens between one string and the ring coming back around
+            text_printf(&t, "f%u : UWORD = 1", (u32)i);
+            for_n(j, 0, TOKEN_STREAM_HISTORY / 16) {
+                text_printf(&t, " + 1");
+            }
+            text_printf(&t, "\n");
+        }
+    }
+    return t.at;
+}
+
+// the byte ring wraps and then grows, and every string comes out of it the same as
+// it does without streaming
+static void test_stream_string_bytes() {
+    CompilationUnit units[2];
+    bool reported[2];
+    char* text = stream_strings_input();
+    stream_parse_both("stream-strings", text, units, reported);
+    CHECK(!reported[0] && !reported[1]);
+    CHECK(units[0].scopes.bindings.len == units[1].scopes.bindings.len);
+
+    u32 strings = 0;
+    for_n(i, 0, units[0].scopes.bindings.len) {
+        Entity* a = units[0].scopes.bindings.at[i].entity;
+        Entity* b = units[1].scopes.bindings.at[i].entity;
+        CHECK(a->name == b->name);
+        Expr* x = a->decl->var_decl.expr;
+        Expr* y = b->decl->var_decl.expr;
+        CHECK(x->kind == y->kind);
+        if (x->kind != EXPR_STR_LITERAL) {
+            continue;
+        }
+        string sx = from_compact(x->lit_string);
+        string sy = from_compact(y->lit_string);
+        CHECK(sx.len == STREAM_STRING_LEN && string_eq(sx, sy));
+        ++strings;
+    }
+    CHECK(strings == STREAM_SPREAD_STRINGS + STREAM_PACKED_STRINGS);
+    free(text);
+}
+
+// ------------------------- PARALLEL FN BODIES -------------------------
+
+// everything compiling it reports, then how it exited. the bodies exit on an error
+// instead of longjmping anywhere, so this happens in a child. with a cache, the child
+// sends it back however it exits, like it does for the compile server.
+static FnBodyCache* child_cache;
+static FILE* child_cache_out;
+
+static void child_send_cache() {
+    fn_body_cache_save(child_cache, child_cache_out);
+}
+
+static string compile_reports(const char* name, const char* text, FlagSet with, FnBodyCache** cache, int* status) {
+    FILE* out = tmpfile();
+    FILE* cache_out = tmpfile();
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        dup2(fileno(out), STDERR_FILENO);
+        SrcFile* f = malloc(sizeof(SrcFile));
+        *f = src_from(name, text);
+        Parser p = lex_entrypoint(f);
+        p.flags = with;
+        if (cache != nullptr) {
+            child_cache = p.body_cache = *cache;
+            child_cache_out = cache_out;
+            atexit(child_send_cache);
+        }
+        parse_unit(&p);
+        exit(0);
+    }
+    waitpid(child, status, 0);
+    *status = WIFEXITED(*status) ? WEXITSTATUS(*status) : -1;
+
+    if (cache != nullptr) {
+        rewind(cache_out);
+        FnBodyCache* fresh = fn_body_cache_load(cache_out);
+        CHECK(fresh != nullptr);
+        if (fresh != nullptr) {
+            fn_body_cache_destroy(*cache);
+            *cache = fresh;
+        }
+        fn_body_cache_sweep(*cache, *status == 0);
+    }
+    fclose(cache_out);
+
+    string reports = {.len = ftell(out)};
+    reports.raw = malloc(reports.len + 1);
+    rewind(out);
+    reports.len = fread(reports.raw, 1, reports.len, out);
+    fclose(out);
+    return reports;
+}
+
+// a global declared after a body isn't the only thing it mustn't see
+static const char* later_changes[] = {
+    // T is finished after the body that needs its size
+    "EXTERN p : ^T\n"
+    "FN Foo() : UWORD\n"
+    "    v : T = 0\n"
+    "    RETURN v\n"
+    "END\n"
+    "TYPE T : UWORD\n",
+    // or that gets at it through p's type
+    "EXTERN p : ^T\n"
+    "FN Foo() : UWORD\n"
+    "    q : ^UWORD = p\n"
+    "    RETURN 0\n"
+    "END\n"
+    "TYPE T : UWORD\n",
+    // a local can have the name of something EXTERN, not of something defined
+    "EXTERN x : UWORD\n"
+    "FN Foo() : UWORD\n"
+    "    x : UWORD = 1\n"
+    "    RETURN x\n"
+    "END\n"
+    "PUBLIC x : UWORD = 5\n",
+    "EXTERN FN Bar() : UWORD\n"
+    "FN Foo() : UWORD\n"
+    "    Bar : UWORD = 1\n"
+    "    RETURN Bar\n"
+    "END\n"
+    "FN Bar() : UWORD\n"
+    "    Bar : UWORD = 2\n"
+    "    RETURN Bar\n"
+    "END\n",
+    // the first error is still the one that stops it
+    "EXTERN x : UWORD\n"
+    "FN A() : UWORD\n"
+    "    x : UWORD = 1\n"
+    "    RETURN x\n"
+    "END\n"
+    "PUBLIC x : UWORD = 5\n"
+    "FN B() : UWORD\n"
+    "    x : UWORD = 2\n"
+    "    RETURN x\n"
+    "END\n",
+};
+
+static void test_parallel_reports_match() {
+    FlagSet parallel = flags;
+    parallel.parallel = true;
+    for_n(i, 0, sizeof(later_changes) / sizeof(later_changes[0])) {
+        int status, parallel_status;
+        string reports = compile_reports("later", later_changes[i], flags, nullptr, &status);
+        string parallel_reports = compile_reports("later", later_changes[i], parallel, nullptr, &parallel_status);
+        CHECK(status == parallel_status && string_eq(reports, parallel_reports));
+        free(reports.raw);
+        free(parallel_reports.raw);
+    }
+}
+
+// ------------------------- FN BODY CACHE -------------------------
+
+static const char* cached_three =
+    "FN A(IN a : ULONG) : ULONG\n"
+    "    RETURN a + 1\n"
+    "END\n"
+    "FN B(IN a : ULONG) : ULONG\n"
+    "    RETURN a + 2\n"
+    "END\n"
+    "FN C(IN a : ULONG) : ULONG\n"
+    "    RETURN a + 3\n"
+    "END\n";
+
+// one compile like the server does it, then what it replayed and parsed
+static void cached_compile(FnBodyCache* cache, const char* name, const char* text, u32* replayed, u32* parsed) {
+    SrcFile* f = malloc(sizeof(SrcFile));
+    *f = src_from(name, text);
+    Parser p = lex_entrypoint(f);
+    p.flags = flags;
+    p.body_cache = cache;
+    parse_unit(&p);
+    fn_body_cache_counts(cache, replayed, parsed);
+    fn_body_cache_sweep(cache, true);
+}
+
+// the file still gets lexed and its globals parsed from the top every time, but only
+// the bodies that changed, or that look up a global that did, get parsed again
+static void test_body_cache_reparses_edits() {
+    FnBodyCache* cache = fn_body_cache_new();
+    u32 replayed, parsed;
+
+    cached_compile(cache, "cached", cached_three, &replayed, &parsed);
+    CHECK(replayed == 0 && parsed == 3);
+
+    cached_compile(cache, "cached", cached_three, &replayed, &parsed);
+    CHECK(replayed == 3 && parsed == 0);
+
+    // the edit moves C, which doesn't matter
+    cached_compile(cache, "cached",
+        "FN A(IN a : ULONG) : ULONG\n"
+        "    RETURN a + 1\n"
+        "END\n"
+        "FN B(IN a : ULONG) : ULONG\n"
+        "    x : ULONG = a * 20\n"
+        "    RETURN x + 2\n"
+        "END\n"
+        "FN C(IN a : ULONG) : ULONG\n"
+        "    RETURN a + 3\n"
+        "END\n",
+        &replayed, &parsed);
+    CHECK(replayed == 2 && parsed == 1);
+
+    // C doesn't look up anything called g, but B might have peeked at it past its END
+    cached_compile(cache, "cached",
+        "FN A(IN a : ULONG) : ULONG\n"
+        "    RETURN a + 1\n"
+        "END\n"
+        "FN B(IN a : ULONG) : ULONG\n"
+        "    x : ULONG = a * 20\n"
+        "    RETURN x + 2\n"
+        "END\n"
+        "g : UINT = 4\n"
+        "FN C(IN a : ULONG) : ULONG\n"
+        "    RETURN a + 3\n"
+        "END\n",
+        &replayed, &parsed);
+    CHECK(replayed == 2 && parsed == 1);
+
+    static const char* uses_g =
+        "FN A(IN a : ULONG) : ULONG\n"
+        "    RETURN a + 1\n"
+        "END\n"
+        "FN B(IN a : ULONG) : ULONG\n"
+        "    x : ULONG = a * 20\n"
+        "    RETURN x + 2\n"
+        "END\n"
+        "g : UINT = 4\n"
+        "FN C(IN a : ULONG) : ULONG\n"
+        "    RETURN a + g\n"
+        "END\n";
+    cached_compile(cache, "cached", uses_g, &replayed, &parsed);
+    CHECK(replayed == 2 && parsed == 1);
+
+    // g's value isn't something C can tell apart
+    cached_compile(cache, "cached",
+        "FN A(IN a : ULONG) : ULONG\n"
+        "    RETURN a + 1\n"
+        "END\n"
+        "FN B(IN a : ULONG) : ULONG\n"
+        "    x : ULONG = a * 20\n"
+        "    RETURN x + 2\n"
+        "END\n"
+        "g : UINT = 5\n"
+        "FN C(IN a : ULONG) : ULONG\n"
+        "    RETURN a + g\n"
+        "END\n",
+        &replayed, &parsed);
+    CHECK(replayed == 3 && parsed == 0);
+
+    // but its type is
+    cached_compile(cache, "cached",
+        "FN A(IN a : ULONG) : ULONG\n"
+        "    RETURN a + 1\n"
+        "END\n"
+        "FN B(IN a : ULONG) : ULONG\n"
+        "    x : ULONG = a * 20\n"
+        "    RETURN x + 2\n"
+        "END\n"
+        "g : ULONG = 5\n"
+        "FN C(IN a : ULONG) : ULONG\n"
+        "    RETURN a + g\n"
+        "END\n",
+        &replayed, &parsed);
+    CHECK(replayed == 2 && parsed == 1);
+
+    // only the last version of a body is kept, so going back gets C parsed again
+    cached_compile(cache, "cached", uses_g, &replayed, &parsed);
+    CHECK(replayed == 2 && parsed == 1);
+
+    fn_body_cache_destroy(cache);
+}
+
+// a cache puts every body off until after the globals, and the globals a body looked up
+// are fingerprinted the way it saw them, not the way they ended up
+static void test_body_cache_later_changes() {
+    static const char* finished_first =
+        "TYPE T : UWORD\n"
+        "EXTERN p : ^T\n"
+        "FN Foo() : UWORD\n"
+        "    v : T = 0\n"
+        "    RETURN v\n"
+        "END\n";
+    const char* edits[] = {later_changes[0], later_changes[0], finished_first, later_changes[0]};
+
+    FnBodyCache* cache = fn_body_cache_new();
+    for_n(i, 0, sizeof(edits) / sizeof(edits[0])) {
+        int status, cached_status;
+        string reports = compile_reports("forward", edits[i], flags, nullptr, &status);
+        string cached_reports = compile_reports("forward", edits[i], flags, &cache, &cached_status);
+        CHECK(status == (edits[i] == finished_first ? 0 : 3));
+        CHECK(status == cached_status && string_eq(reports, cached_reports));
+        free(reports.raw);
+        free(cached_reports.raw);
+    }
+    fn_body_cache_destroy(cache);
+
+    cache = fn_body_cache_new();
+    for_n(i, 0, sizeof(later_changes) / sizeof(later_changes[0])) {
+        // the second time around, everything gets replayed
+        for_n(again, 0, 2) {
+            int status, cached_status;
+            string reports = compile_reports("later", later_changes[i], flags, nullptr, &status);
+            string cached_reports = compile_reports("later", later_changes[i], flags, &cache, &cached_status);
+            CHECK(status == cached_status && string_eq(reports, cached_reports));
+            free(reports.raw);
+            free(cached_reports.raw);
+        }
+    }
+    fn_body_cache_destroy(cache);
+}
+
+// ------------------------- COMPACT AST -------------------------
+
+static const char* flatten_src =
+    "g : ULONG = 4\n"
+    "FN Callee(IN a : ULONG, OUT b : ULONG) : ULONG\n"
+    "    b = a * g\n"
+    "    RETURN a + 1\n"
+    "END\n"
+    "h : ULONG = 9\n"
+    "FN Caller(IN n : ULONG, IN p : ^ULONG) : ULONG\n"
+    "    s : ULONG = n\n"
+    "    s += n * h\n"
+    "    s = s - g\n"
+    "    RETURN s\n"
+    "END\n"
+    "FN Last(IN n : ULONG) : ULONG\n"
+    "    t : ULONG = n\n"
+    "    t <<= 2\n"
+    "    RETURN t + g\n"
+    "END\n";
+
+// the iron of every FN in a unit, once its AST is built
+static string unit_ir(Parser* p, CompilationUnit* cu) {
+    Ast ast = ast_build(cu);
+    FeModule* mod = fe_module_new(FE_ARCH_XR17032, FE_SYSTEM_FREESTANDING);
+    FeInstPool ipool;
+    fe_ipool_init(&ipool);
+    FeVRegBuffer vregs;
+    fe_vrbuf_init(&vregs, 256);
+    lower_unit(p, &ast, mod, &ipool, &vregs);
+    ast_destroy(&ast);
+
+    FeDataBuffer db;
+    fe_db_init(&db, 2048);
+    for_funcs(func, mod) {
+        fe_emit_ir_func(&db, func, false);
+    }
+    string ir = strprintf("%.*s", (int)db.len, db.at);
+    fe_db_destroy(&db);
+    return ir;
+}
+
+// the iron of every FN, and how much of the tree was still around after parsing
+static string flatten_lower(const char* text, FlagSet with, usize* nodes_live) {
+    SrcFile* f = malloc(sizeof(SrcFile));
+    *f = src_from("flatten", text);
+    Parser p = lex_entrypoint(f);
+    p.flags = with;
+    CompilationUnit cu = parse_unit(&p);
+    *nodes_live = cu.nodes.stats.requested - cu.nodes.stats.restored;
+    for_n(i, 0, cu.body_arenas_len) {
+        *nodes_live += cu.body_arenas[i].stats.requested - cu.body_arenas[i].stats.restored;
+    }
+    return unit_ir(&p, &cu);
+}
+
+// bodies flattened as they're parsed come out just like the whole tree flattened
+// at once, whether they were parsed in order or on their own threads
+static void test_ast_flattened_per_body() {
+    usize tree_live, flat_live, parallel_live;
+    string tree = flatten_lower(flatten_src, (FlagSet){}, &tree_live);
+    string flat = flatten_lower(flatten_src, (FlagSet){.ast = true}, &flat_live);
+    string parallel = flatten_lower(flatten_src, (FlagSet){.ast = true, .parallel = true}, &parallel_live);
+    CHECK(tree.len != 0);
+    CHECK(string_eq(tree, flat));
+    CHECK(string_eq(tree, parallel));
+    // only the global declarations are left
+    CHECK(flat_live < tree_live / 2);
+    CHECK(parallel_live < tree_live / 2);
+}
+
+// ------------------------- RESIDENT UNITS -------------------------
+
+// one file, edited over and over. after each edit, the unit has to report exactly
+// what compiling it from scratch does, whether or not it could make the edit in place.
+static const struct {
+    const char* text;
+    bool in_place;
+} resident_edits[] = {
+    {
+        "g : ULONG = 4\n"
+        "FN A(IN a : ULONG) : ULONG\n"
+        "    RETURN a + 1\n"
+        "END\n"
+        "FN B(IN a : ULONG) : ULONG\n"
+        "    x : ULONG = a * 20\n"
+        "    RETURN x + g\n"
+        "END\n"
+        "FN C(IN a : ULONG) : ULONG\n"
+        "    s : ^UBYTE = \"hi\\n\"\n"
+        "    RETURN a + 3\n"
+        "END\n",
+        false,
+    },
+    // an error in B
+    {
+        "g : ULONG = 4\n"
+        "FN A(IN a : ULONG) : ULONG\n"
+        "    RETURN a + 1\n"
+        "END\n"
+        "FN B(IN a : ULONG) : ULONG\n"
+        "    x : ULONG = a * nope\n"
+        "    RETURN x + g\n"
+        "END\n"
+        "FN C(IN a : ULONG) : ULONG\n"
+        "    s : ^UBYTE = \"hi\\n\"\n"
+        "    RETURN a + 3\n"
+        "END\n",
+        true,
+    },
+    // that moves down a line, and A doesn't always return anymore
+    {
+        "g : ULONG = 4\n"
+        "FN A(IN a : ULONG) : ULONG\n"
+        "    y : ULONG = a\n"
+        "    y += 1\n"
+        "END\n"
+        "FN B(IN a : ULONG) : ULONG\n"
+        "    x : ULONG = a * nope\n"
+        "    RETURN x + g\n"
+        "END\n"
+        "FN C(IN a : ULONG) : ULONG\n"
+        "    s : ^UBYTE = \"hi\\n\"\n"
+        "    RETURN a + 3\n"
+        "END\n",
+        true,
+    },
+    // and gets fixed
+    {
+        "g : ULONG = 4\n"
+        "FN A(IN a : ULONG) : ULONG\n"
+        "    y : ULONG = a\n"
+        "    y += 1\n"
+        "END\n"
+        "FN B(IN a : ULONG) : ULONG\n"
+        "    x : ULONG = a * 20\n"
+        "    RETURN x + g\n"
+        "END\n"
+        "FN C(IN a : ULONG) : ULONG\n"
+        "    s : ^UBYTE = \"hi\\n\"\n"
+        "    RETURN a + 3\n"
+        "END\n",
+        true,
+    },
+    // a string with more escapes, and an error after it
+    {
+        "g : ULONG = 4\n"
+        "FN A(IN a : ULONG) : ULONG\n"
+        "    y : ULONG = a\n"
+        "    y += 1\n"
+        "END\n"
+        "FN B(IN a : ULONG) : ULONG\n"
+        "    x : ULONG = a * 20\n"
+        "    RETURN x + g\n"
+        "END\n"
+        "FN C(IN a : ULONG) : ULONG\n"
+        "    s : ^UBYTE = \"a\\tb\\\\c\\n\"\n"
+        "    RETURN a + s\n"
+        "END\n",
+        true,
+    },
+    // a global changes what the bodies see
+    {
+        "g : ^UBYTE = 4\n"
+        "FN A(IN a : ULONG) : ULONG\n"
+        "    y : ULONG = a\n"
+        "    y += 1\n"
+        "END\n"
+        "FN B(IN a : ULONG) : ULONG\n"
+        "    x : ULONG = a * 20\n"
+        "    RETURN x + g\n"
+        "END\n"
+        "FN C(IN a : ULONG) : ULONG\n"
+        "    s : ^UBYTE = \"a\\tb\\\\c\\n\"\n"
+        "    RETURN a + s\n"
+        "END\n",
+        false,
+    },
+    // B ends early, and D starts where it used to
+    {
+        "g : ^UBYTE = 4\n"
+        "FN A(IN a : ULONG) : ULONG\n"
+        "    y : ULONG = a\n"
+        "    y += 1\n"
+        "END\n"
+        "FN B(IN a : ULONG) : ULONG\n"
+        "    RETURN 1\n"
+        "END\n"
+        "FN D(IN a : ULONG) : ULONG\n"
+        "    x : ULONG = a * 20\n"
+        "    RETURN x + g\n"
+        "END\n"
+        "FN C(IN a : ULONG) : ULONG\n"
+        "    s : ^UBYTE = \"a\\tb\\\\c\\n\"\n"
+        "    RETURN a + s\n"
+        "END\n",
+        false,
+    },
+    // only the preprocessor knows what TEN is
+    {
+        "#DEFINE TEN 10\n"
+        "g : ^UBYTE = 4\n"
+        "FN A(IN a : ULONG) : ULONG\n"
+        "    y : ULONG = a\n"
+        "    y += 1\n"
+        "END\n"
+        "FN B(IN a : ULONG) : ULONG\n"
+        "    RETURN 1\n"
+        "END\n",
+        false,
+    },
+    {
+        "#DEFINE TEN 10\n"
+        "g : ^UBYTE = 4\n"
+        "FN A(IN a : ULONG) : ULONG\n"
+        "    y : ULONG = a\n"
+        "    y += 1\n"
+        "END\n"
+        "FN B(IN a : ULONG) : ULONG\n"
+        "    RETURN TEN\n"
+        "END\n",
+        false,
+    },
+};
+
+#define RESIDENT_EDITS (sizeof(resident_edits) / sizeof(resident_edits[0]))
+
+typedef struct {
+    i32 status;
+    bool in_place;
+    long reported; // how far into the reports it got
+} ResidentStep;
+
+static void test_resident_reports_match() {
+    FILE* out = tmpfile();
+    int steps[2];
+    CHECK(pipe(steps) == 0);
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        dup2(fileno(out), STDERR_FILENO);
+        ResidentUnit* u = nullptr;
+        for_n(i, 0, RESIDENT_EDITS) {
+            ResidentStep step = {};
+            if (u != nullptr) {
+                step.in_place = resident_unit_edit(u, src_from("resident", resident_edits[i].text).src);
+            }
+            if (!step.in_place) {
+                // like the server does it, in a process of its own
+                SrcFile* fresh = malloc(sizeof(SrcFile));
+                *fresh = src_from("resident", resident_edits[i].text);
+                u = resident_unit_new(fresh, flags, nullptr);
+            }
+            step.status = resident_unit_report(u);
+            fflush(stderr);
+            step.reported = lseek(STDERR_FILENO, 0, SEEK_CUR);
+            write(steps[1], &step, sizeof(step));
+        }
+        exit(0);
+    }
+    close(steps[1]);
+
+    long reported = 0;
+    for_n(i, 0, RESIDENT_EDITS) {
+        ResidentStep step;
+        if (read(steps[0], &step, sizeof(step)) != sizeof(step)) {
+            CHECK(!"the resident unit crashed");
+            break;
+        }
+        CHECK(step.in_place == resident_edits[i].in_place);
+
+        string resident = {.len = step.reported - reported};
+        resident.raw = malloc(resident.len + 1);
+        resident.len = pread(fileno(out), resident.raw, resident.len, reported);
+        reported = step.reported;
+
+        int status;
+        string cold = compile_reports("resident", resident_edits[i].text, flags, nullptr, &status);
+        CHECK(step.status == status && string_eq(resident, cold));
+        free(resident.raw);
+        free(cold.raw);
+    }
+    close(steps[0]);
+    waitpid(child, nullptr, 0);
+    fclose(out);
+}
+
+// a body that was parsed again gets lowered from its new AST, and the others from
+// the AST they already had, with their tokens wherever they are now
+static void test_resident_ast_edited() {
+    static const char* edited =
+        "g : ULONG = 4\n"
+        "FN Callee(IN a : ULONG, OUT b : ULONG) : ULONG\n"
+        "    b = a * g\n"
+        "    RETURN a + 1\n"
+        "END\n"
+        "h : ULONG = 9\n"
+        "FN Caller(IN n : ULONG, IN p : ^ULONG) : ULONG\n"
+        "    s : ULONG = n\n"
+        "    s += n * h\n"
+        "    s *= n + h\n"
+        "    s = s - g\n"
+        "    RETURN s\n"
+        "END\n"
+        "FN Last(IN n : ULONG) : ULONG\n"
+        "    t : ULONG = n\n"
+        "    t <<= 2\n"
+        "    RETURN t + g\n"
+        "END\n";
+
+    int status[2];
+    CHECK(pipe(status) == 0);
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        SrcFile* f = malloc(sizeof(SrcFile));
+        *f = src_from("flatten", flatten_src);
+        ResidentUnit* u = resident_unit_new(f, (FlagSet){}, nullptr);
+        bool same = resident_unit_edit(u, src_from("flatten", edited).src);
+        Parser* p;
+        CompilationUnit* cu = resident_unit_cu(u, &p);
+        string ir = unit_ir(p, cu);
+
+        usize nodes_live;
+        string cold = flatten_lower(edited, (FlagSet){.ast = true}, &nodes_live);
+        same &= ir.len != 0 && string_eq(ir, cold);
+        write(status[1], &same, sizeof(same));
+        exit(0);
+    }
+    close(status[1]);
+    bool same = false;
+    read(status[0], &same, sizeof(same));
+    CHECK(same);
+    close(status[0]);
+    waitpid(child, nullptr, 0);
+}
+
+// ------------------------- LOWERING -------------------------
+
+// the parser doesn't make IF, WHILE, GOTO or calls yet, so these tests write FN
+// bodies as s-expressions, like
+//
+//     (var s 0) (while (< s n) (+= s 1) (if (== s 5) (break))) (return s)
+//
+// and build their AST by hand, following the layout in ast.c. these are the only
+// tests those parts of lower.c have until the parser makes them. the names are the
+// parameters and locals of the Sketch FN in sketch_stub, and the FNs next to it.
+
+static const char* sketch_stub =
+    "FN Callee(IN a : ULONG, OUT b : ULONG) : ULONG\n"
+    "    b = a\n"
+    "    RETURN a\n"
+    "END\n"
+    "FN Sink(OUT x : ULONG)\n"
+    "    x = 1\n"
+    "END\n"
+    "FN Sketch(IN n : ULONG, IN p : ^ULONG) : ULONG\n"
+    "    i : ULONG = n\n"
+    "    s : ULONG = 0\n"
+    "    q : ^ULONG = p\n"
+    "    RETURN s\n"
+    "END\n";
+
+typedef struct {
+    Parser p; // what the stub was parsed with, for reports
+    Ast stub;
+    Ast ast;
+    const char* at;
+    AstNode loops[64];
+    u32 loops_len;
+} Sketch;
+
+static Sketch sk;
+
+static void sketch_skip_space() {
+    while (*sk.at == ' ' || *sk.at == '\n') {
+        sk.at++;
+    }
+}
+
+static string sketch_word() {
+    sketch_skip_space();
+    const char* start = sk.at;
+    while (*sk.at != ' ' && *sk.at != '\n' && *sk.at != '(' && *sk.at != ')' && *sk.at != '\0') {
+        sk.at++;
+    }
+    return (string){(char*)start, sk.at - start};
+}
+
+static bool sketch_close() {
+    sketch_skip_space();
+    if (*sk.at == ')') {
+        sk.at++;
+        return true;
+    }
+    return false;
+}
+
+static void sketch_open() {
+    sketch_skip_space();
+    if (*sk.at++ != '(') {
+        CRASH("sketch: expected '(' at \"%s\"", sk.at - 1);
+    }
+}
+
+static AstNode sketch_node(u8 kind, TyIndex ty, u32 data) {
+    Ast* ast = &sk.ast;
+    AstNode node = ast->len++;
+    ast->kinds[node] = kind;
+    ast->tys[node] = ty;
+    ast->tokens[node] = 1;
+    ast->data[node] = data;
+    return node;
+}
+
+static u32 sketch_list(AstNode* items, u32 len) {
+    Ast* ast = &sk.ast;
+    u32 list = ast->extra_len;
+    ast->extra[ast->extra_len++] = len;
+    for_n(i, 0, len) {
+        ast->extra[ast->extra_len++] = items[i];
+    }
+    return list;
+}
+
+// labels get made the first time they come up
+static u32 sketch_entity(string name, bool label) {
+    Ast* ast = &sk.ast;
+    for_n(i, 1, ast->entities_len) {
+        if (string_eq(atom_str(ast->entities[i]->name), name)) {
+            return i;
+        }
+    }
+    if (!label) {
+        CRASH("sketch: no entity "str_fmt, str_arg(name));
+    }
+    Entity* e = calloc(1, sizeof(Entity));
+    e->kind = ENTKIND_LABEL;
+    e->name = atom_intern(name);
+    ast->entities[ast->entities_len] = e;
+    return ast->entities_len++;
+}
+
+static const struct {
+    const char* name;
+    ExprKind kind;
+} sketch_binary[] = {
+    {"+", EXPR_ADD}, {"-", EXPR_SUB}, {"*", EXPR_MUL}, {"/", EXPR_DIV}, {"%", EXPR_MOD},
+    {"==", EXPR_EQ}, {"!=", EXPR_NEQ}, {"<", EXPR_LESS}, {">", EXPR_GREATER},
+    {"<=", EXPR_LESS_EQ}, {">=", EXPR_GREATER_EQ}, {"and", EXPR_BOOL_AND}, {"or", EXPR_BOOL_OR},
+};
+
+static AstNode sketch_expr() {
+    Ast* ast = &sk.ast;
+    sketch_skip_space();
+    if (*sk.at != '(') {
+        string word = sketch_word();
+        if (word.raw[0] >= '0' && word.raw[0] <= '9') {
+            return sketch_node(AST_EXPR + EXPR_LITERAL, TY_ULONG, strtoul(word.raw, nullptr, 10));
+        }
+        if (string_eq(word, constr("$str"))) {
+            return sketch_node(AST_EXPR + EXPR_STR_LITERAL, TY_UBYTE + TY_PTR, 0);
+        }
+        u32 e = sketch_entity(word, false);
+        return sketch_node(AST_EXPR + EXPR_ENTITY, ast->entities[e]->ty, e);
+    }
+    sketch_open();
+    string op = sketch_word();
+    AstNode node = sketch_node(AST_EXPR, TY_ULONG, 0);
+    for_n(i, 0, sizeof(sketch_binary) / sizeof(sketch_binary[0])) {
+        if (string_eq(op, str(sketch_binary[i].name))) {
+            ast->kinds[node] += sketch_binary[i].kind;
+            ast->tys[node] = ast->tys[sketch_expr()];
+            ast->data[node] = sketch_expr();
+            sketch_close();
+            return node;
+        }
+    }
+    if (string_eq(op, constr("call"))) {
+        ast->kinds[node] += EXPR_CALL;
+        TyIndex fn_ty = ast->tys[sketch_expr()];
+        if (ty_kind(fn_ty) == TY_PTR) {
+            fn_ty = ty_target(fn_ty);
+        }
+        ast->tys[node] = ty_fn(fn_ty)->ret_ty;
+        AstNode args[TY_FN_MAX_PARAMS];
+        u32 args_len = 0;
+        while (!sketch_close()) {
+            args[args_len++] = sketch_expr();
+        }
+        ast->data[node] = sketch_list(args, args_len);
+        return node;
+    }
+    if (string_eq(op, constr("^"))) {
+        ast->kinds[node] += EXPR_DEREF;
+        ast->tys[node] = ty_target(ast->tys[sketch_expr()]);
+    } else if (string_eq(op, constr("@"))) {
+        ast->kinds[node] += EXPR_SUBSCRIPT;
+        ast->tys[node] = ty_target(ast->tys[sketch_expr()]);
+        ast->data[node] = sketch_expr();
+    } else if (string_eq(op, constr("&"))) {
+        ast->kinds[node] += EXPR_ADDROF;
+        ast->tys[node] = ty_pointer_to(ast->tys[sketch_expr()]);
+    } else if (string_eq(op, constr("fnptr"))) {
+        // (fnptr F x) is x as a pointer to a FN like F, which the parser can't write yet
+        ast->kinds[node] += EXPR_CAST;
+        ast->tys[node] = ty_pointer_to(ast->entities[sketch_entity(sketch_word(), false)]->ty);
+        sketch_expr();
+    } else if (string_eq(op, constr("not"))) {
+        ast->kinds[node] += EXPR_BOOL_NOT;
+        ast->tys[node] = ast->tys[sketch_expr()];
+    } else if (string_eq(op, constr("out"))) {
+        ast->kinds[node] += EXPR_OUT_ARG;
+        ast->tys[node] = ast->tys[sketch_expr()];
+    } else {
+        CRASH("sketch: unknown expression "str_fmt, str_arg(op));
+    }
+    sketch_close();
+    return node;
+}
+
+static AstNode sketch_stmt();
+
+// statements up to the closing paren of whatever they're in
+static u32 sketch_block(u32 extra_before, AstNode* else_) {
+    AstNode stmts[64];
+    u32 len = 0;
+    while (!sketch_close()) {
+        AstNode stmt = sketch_stmt();
+        if (else_ != nullptr && sk.ast.kinds[stmt] == STMT_IF && !ast_has_expr(&sk.ast, stmt)) {
+            *else_ = stmt;
+        } else {
+            stmts[len++] = stmt;
+        }
+    }
+    Ast* ast = &sk.ast;
+    u32 data = ast->extra_len;
+    ast->extra_len += extra_before;
+    sketch_list(stmts, len);
+    return data;
+}
+
+static AstNode sketch_stmt() {
+    Ast* ast = &sk.ast;
+    sketch_open();
+    string op = sketch_word();
+    if (string_eq(op, constr("var"))) {
+        AstNode node = sketch_node(STMT_VAR_DECL, 0, sketch_entity(sketch_word(), false));
+        sketch_expr();
+        sketch_close();
+        return node;
+    }
+    if (op.raw[op.len - 1] == '=' && op.len <= 2) {
+        StmtKind kind = STMT_ASSIGN;
+        if (op.len == 2) {
+            const char* ops = "+-*/%";
+            kind = STMT_ASSIGN_ADD + (strchr(ops, op.raw[0]) - ops);
+        }
+        AstNode node = sketch_node(kind, 0, 0);
+        sketch_expr();
+        ast->data[node] = sketch_expr();
+        sketch_close();
+        return node;
+    }
+    if (string_eq(op, constr("return"))) {
+        AstNode node = sketch_node(STMT_RETURN, 0, 0);
+        if (!sketch_close()) {
+            sketch_expr();
+            sketch_close();
+        }
+        return node;
+    }
+    if (string_eq(op, constr("do"))) {
+        AstNode node = sketch_node(STMT_EXPR, 0, 0);
+        sketch_expr();
+        sketch_close();
+        return node;
+    }
+    if (string_eq(op, constr("if"))) {
+        AstNode node = sketch_node(STMT_IF, 0, 0);
+        sketch_expr();
+        AstNode else_ = AST_NONE;
+        ast->data[node] = sketch_block(1, &else_);
+        ast->extra[ast->data[node]] = else_;
+        return node;
+    }
+    if (string_eq(op, constr("else"))) {
+        AstNode node = sketch_node(STMT_IF, 0, 0);
+        ast->data[node] = sketch_block(1, nullptr);
+        ast->extra[ast->data[node]] = AST_NONE;
+        return node;
+    }
+    if (string_eq(op, constr("while"))) {
+        AstNode node = sketch_node(STMT_WHILE, 0, 0);
+        sketch_expr();
+        sk.loops[sk.loops_len++] = node;
+        ast->data[node] = sketch_block(0, nullptr);
+        sk.loops_len--;
+        return node;
+    }
+    if (string_eq(op, constr("break")) || string_eq(op, constr("continue"))) {
+        StmtKind kind = op.raw[0] == 'b' ? STMT_BREAK : STMT_CONTINUE;
+        AstNode node = sketch_node(kind, 0, sk.loops[sk.loops_len - 1]);
+        sketch_close();
+        return node;
+    }
+    if (string_eq(op, constr("label")) || string_eq(op, constr("goto"))) {
+        StmtKind kind = op.raw[0] == 'l' ? STMT_LABEL : STMT_GOTO;
+        AstNode node = sketch_node(kind, 0, sketch_entity(sketch_word(), true));
+        sketch_close();
+        return node;
+    }
+    CRASH("sketch: unknown statement "str_fmt, str_arg(op));
+}
+
+static void sketch_begin(const char* body) {
+    if (sk.stub.len == 0) {
+        SrcFile* f = malloc(sizeof(SrcFile));
+        *f = src_from("sketch", sketch_stub);
+        sk.p = lex_entrypoint(f);
+        sk.p.flags = flags;
+        CompilationUnit cu = parse_unit(&sk.p);
+        sk.stub = ast_build(&cu);
+    }
+
+    Ast* ast = &sk.ast;
+    *ast = (Ast){
+        .kinds = calloc(4096, sizeof(ast->kinds[0])),
+        .tys = calloc(4096, sizeof(ast->tys[0])),
+        .tokens = calloc(4096, sizeof(ast->tokens[0])),
+        .data = calloc(4096, sizeof(ast->data[0])),
+        .extra = calloc(4096, sizeof(ast->extra[0])),
+        .entities = calloc(256, sizeof(ast->entities[0])),
+        .decls = calloc(1, sizeof(ast->decls[0])),
+    };
+    memcpy(ast->entities, sk.stub.entities, sizeof(ast->entities[0]) * sk.stub.entities_len);
+    ast->entities_len = sk.stub.entities_len;
+    ast->len = 1; // AST_NONE
+
+    AstNode fn = sketch_node(STMT_FN_DECL, 0, 0);
+    sk.at = body;
+    AstNode stmts[64];
+    u32 len = 0;
+    sketch_skip_space();
+    while (*sk.at != '\0') {
+        stmts[len++] = sketch_stmt();
+        sketch_skip_space();
+    }
+    ast->data[fn] = ast->extra_len;
+    ast->extra[ast->extra_len++] = sketch_entity(constr("Sketch"), false);
+    ast->extra[ast->extra_len++] = ast->len;
+    sketch_list(stmts, len);
+    ast->decls[ast->decls_len++] = fn;
+}
+
+static void sketch_end() {
+    Ast* ast = &sk.ast;
+    free(ast->kinds);
+    free(ast->tys);
+    free(ast->tokens);
+    free(ast->data);
+    free(ast->extra);
+    free(ast->entities);
+    free(ast->decls);
+}
+
+static FeModule* sketch_lower(const char* body) {
+    sketch_begin(body);
+    FeModule* mod = fe_module_new(FE_ARCH_XR17032, FE_SYSTEM_FREESTANDING);
+    FeInstPool* ipool = malloc(sizeof(FeInstPool));
+    fe_ipool_init(ipool);
+    FeVRegBuffer* vregs = malloc(sizeof(FeVRegBuffer));
+    fe_vrbuf_init(vregs, 256);
+    lower_unit(&sk.p, &sk.ast, mod, ipool, vregs);
+    sketch_end();
+    return mod;
+}
+
+// whether lowering the body reported an error instead of crashing
+static bool sketch_reports(const char* body) {
+    sketch_begin(body);
+    FeModule* mod = fe_module_new(FE_ARCH_XR17032, FE_SYSTEM_FREESTANDING);
+    FeInstPool ipool;
+    fe_ipool_init(&ipool);
+    FeVRegBuffer vregs;
+    fe_vrbuf_init(&vregs, 256);
+
+    bool reported = false;
+    jmp_buf catch;
+    report_catch_errors(&catch);
+    if (setjmp(catch) == 0) {
+        lower_unit(&sk.p, &sk.ast, mod, &ipool, &vregs);
+    } else {
+        reported = true;
+    }
+    report_catch_errors(nullptr);
+    // it's supposed to be there, so don't print it
+    report_discard_after(0);
+    sketch_end();
+    return reported;
+}
+
+static void sketch_print(FeFunc* f) {
+    FeDataBuffer db;
+    fe_db_init(&db, 2048);
+    fe_emit_ir_func(&db, f, false);
+    printf("%.*s", (int)db.len, db.at);
+}
+
+#define SKETCH_MAX 512
+
+static usize find_block(FeBlock** blocks, usize len, FeBlock* b) {
+    for_n(i, 0, len) {
+        if (blocks[i] == b) {
+            return i;
+        }
+    }
+    return len;
+}
+
+// what lowering promises for every FN: every block ends in a terminator, every
+// phi has been filled in with one source per predecessor (so every block was
+// sealed), no phi is trivial, and nothing uses an instruction that got folded away.
+// gives back how many phis there are.
+static u32 check_ssa(FeModule* mod, FeFunc* f) {
+    u32 failed_before = checks_failed;
+
+    FeBlock* blocks[SKETCH_MAX];
+    usize blocks_len = 0;
+    FeInst* insts[SKETCH_MAX];
+    usize insts_len = 0;
+    for_blocks(b, f) {
+        blocks[blocks_len++] = b;
+        for_inst(inst, b) {
+            insts[insts_len++] = inst;
+        }
+    }
+
+    u32 preds[SKETCH_MAX][8];
+    u32 preds_len[SKETCH_MAX] = {};
+    for_n(i, 0, blocks_len) {
+        FeInst* last = blocks[i]->bookend->prev;
+        CHECK(last->kind != FE_BOOKEND && fe_inst_has_trait(last->kind, FE_TRAIT_TERMINATOR));
+        if (last->kind == FE_BOOKEND || !fe_inst_has_trait(last->kind, FE_TRAIT_TERMINATOR)) {
+            continue;
+        }
+        usize succs_len;
+        FeBlock** succs = fe_inst_list_terminator_successors(mod->target, last, &succs_len);
+        for_n(j, 0, succs_len) {
+            usize s = find_block(blocks, blocks_len, succs[j]);
+            CHECK(s != blocks_len);
+            if (s != blocks_len) {
+                preds[s][preds_len[s]++] = i;
+            }
+        }
+    }
+
+    u32 phis = 0;
+    for_n(i, 0, blocks_len) {
+        for_inst(inst, blocks[i]) {
+            usize inputs_len;
+            FeInst** inputs = fe_inst_list_inputs(mod->target, inst, &inputs_len);
+            for_n(j, 0, inputs_len) {
+                bool found = false;
+                for_n(k, 0, insts_len) {
+                    found |= insts[k] == inputs[j];
+                }
+                CHECK(found);
+            }
+            if (inst->kind != FE_PHI) {
+                continue;
+            }
+            phis++;
+            FeInstPhi* phi = fe_extra(inst);
+            CHECK(inst->flags == 0);
+            CHECK(phi->len == preds_len[i]);
+            FeInst* distinct = nullptr;
+            bool trivial = true;
+            for_n(j, 0, phi->len) {
+                usize from = find_block(blocks, blocks_len, phi->blocks[j]);
+                bool is_pred = false;
+                for_n(k, 0, preds_len[i]) {
+                    is_pred |= preds[i][k] == from;
+                }
+                CHECK(is_pred);
+                FeInst* val = phi->vals[j];
+                if (val == inst || val == distinct) {
+                    continue;
+                }
+                if (distinct != nullptr) {
+                    trivial = false;
+                }
+                distinct = val;
+            }
+            CHECK(!trivial);
+        }
+    }
+
+    if (checks_failed != failed_before) {
+        sketch_print(f);
+    }
+    return phis;
+}
+
+static u32 sketch_phis(const char* body) {
+    FeModule* mod = sketch_lower(body);
+    FeFunc* f = mod->funcs.first;
+    return check_ssa(mod, f);
+}
+
+static u32 count_insts(FeFunc* f, FeInstKind kind) {
+    u32 count = 0;
+    for_blocks(b, f) {
+        for_inst(inst, b) {
+            count += inst->kind == kind;
+        }
+    }
+    return count;
+}
+
+static void test_lower_loops() {
+    // the header needs both, and i isn't read after the loop
+    CHECK(sketch_phis(
+        "(var i 0) (var s 0)"
+        "(while (< i n) (+= s i) (if (> s 100) (break)) (+= i 1))"
+        "(return s)"
+    ) == 3);
+    // the inner header never writes i, so it doesn't get a phi for it
+    CHECK(sketch_phis(
+        "(var i 0) (var s 0)"
+        "(while (< i n) (+= i 1)"
+        "    (while (< s i) (+= s 1) (if (== s 5) (continue)) (+= s 2)))"
+        "(return s)"
+    ) == 3);
+    // nothing changes in the loop
+    CHECK(sketch_phis(
+        "(var s 7) (while (< s n) (do (call Callee s (out i)))) (return s)"
+    ) == 0);
+}
+
+static void test_lower_branches() {
+    CHECK(sketch_phis(
+        "(var s 0)"
+        "(if (and (> n 3) (< n 10)) (= s 1) (else (= s 2)))"
+        "(return s)"
+    ) == 1);
+    // both arms write the same thing
+    CHECK(sketch_phis(
+        "(var s 0) (if (or (> n 3) (not n)) (= s n) (else (= s n))) (return s)"
+    ) == 0);
+    CHECK(sketch_phis(
+        "(var s (and (> n 3) (< n 10))) (return s)"
+    ) == 1);
+}
+
+static void test_lower_gotos() {
+    CHECK(sketch_phis(
+        "(var i 0) (label top) (+= i 1) (if (< i n) (goto top)) (return i)"
+    ) == 1);
+    // a label nothing jumps to again
+    CHECK(sketch_phis(
+        "(var i 0) (label top) (+= i 1) (return i)"
+    ) == 0);
+}
+
+// code after a terminator can't be reached, unless a GOTO jumps into it
+static void test_lower_after_terminator() {
+    FeModule* mod = sketch_lower(
+        "(var s 1) (return s) (+= s 1) (while (< s n) (+= s 1)) (return 0)"
+    );
+    FeFunc* f = mod->funcs.first;
+    CHECK(check_ssa(mod, f) == 0);
+    CHECK(count_insts(f, FE_RETURN) == 1);
+
+    check_ssa(mod, sketch_lower(
+        "(var s 1) (goto skip) (= s 2)"
+        "(while (< s n) (label inner) (+= s 1))"
+        "(label skip) (if (== s 1) (goto inner))"
+        "(return s)"
+    )->funcs.first);
+    check_ssa(mod, sketch_lower(
+        "(var s 1) (return s)"
+        "(if (> s 1) (label back) (+= s 1) (else (= s 3)))"
+        "(if (< s 10) (goto back))"
+        "(return s)"
+    )->funcs.first);
+    check_ssa(mod, sketch_lower(
+        "(while (< i n) (+= i 1) (break) (+= i 2)) (return i)"
+    )->funcs.first);
+}
+
+static void test_lower_memory_and_calls() {
+    // one OUT argument is the call's whole result, more come back as a tuple
+    FeModule* mod = sketch_lower(
+        "(do (call Sink (out s))) (= i (call Callee n (out (^ p))))"
+        "(+= (@ p i) s) (return (+ i (^ p)))"
+    );
+    FeFunc* f = mod->funcs.first;
+    CHECK(check_ssa(mod, f) == 0);
+    CHECK(count_insts(f, FE_CALL) == 2);
+    CHECK(count_insts(f, FE_PROJ) == 2);
+    CHECK(count_insts(f, FE_STORE) == 2);
+    // FNs are called by symbol, not loaded from it
+    CHECK(count_insts(f, FE_LOAD) == 2);
+
+    // a pointer to a FN is already the address to call
+    f = sketch_lower("(= i (call (& Callee) n (out s))) (return (+ i s))")->funcs.first;
+    CHECK(check_ssa(mod, f) == 0);
+    CHECK(count_insts(f, FE_CALL) == 1);
+    CHECK(count_insts(f, FE_SYM_ADDR) == 1);
+    CHECK(count_insts(f, FE_LOAD) == 0);
+
+    // and one that's only known at runtime gets called through, not loaded from
+    f = sketch_lower("(= i (call (fnptr Callee (^ p)) n (out s))) (do (call (fnptr Sink (@ p 1)) (out i))) (return (+ i s))")->funcs.first;
+    CHECK(check_ssa(mod, f) == 0);
+    CHECK(count_insts(f, FE_CALL) == 2);
+    CHECK(count_insts(f, FE_SYM_ADDR) == 0);
+    CHECK(count_insts(f, FE_LOAD) == 2);
+    for_blocks(b, f) {
+        for_inst(inst, b) {
+            if (inst->kind != FE_CALL) {
+                continue;
+            }
+            // whatever got loaded is what's called
+            usize inputs_len;
+            FeInst** inputs = fe_inst_list_inputs(mod->target, inst, &inputs_len);
+            bool loaded = false;
+            for_n(i, 0, inputs_len) {
+                loaded |= inputs[i]->kind == FE_LOAD;
+            }
+            CHECK(loaded);
+        }
+    }
+}
+
+static void test_lower_unsupported() {
+    CHECK(sketch_reports("(var s 0) (do $str) (return s)"));
+    CHECK(sketch_reports("(do (& i)) (return 0)"));
+}
+
+int main(int argc, char** argv) {
+    scan_init(SCAN_BEST);
+
+    test_scratch_keeps_other_arenas();
+    test_scratch_nesting();
+    test_stats_after_restore();
+    test_prototype_forward_types();
+    test_stream_outgrows_rings();
+    test_stream_string_bytes();
+    test_parallel_reports_match();
+    test_body_cache_reparses_edits();
+    test_body_cache_later_changes();
+    test_ast_flattened_per_body();
+    test_resident_reports_match();
+    test_resident_ast_edited();
+
+    test_lower_loops();
+    test_lower_branches();
+    test_lower_gotos();
+    test_lower_after_terminator();
+    test_lower_memory_and_calls();
+    test_lower_unsupported();
+
+    if (checks_failed != 0) {
+        printf("%u checks failed\n", checks_failed);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
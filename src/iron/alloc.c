@@ -22,6 +22,7 @@ static u8 extra_size_table[FE__INST_END] = {
     [FE_BRANCH] = sizeof(FeInstBranch),
     [FE_JUMP] = sizeof(FeInstJump),
     [FE_RETURN] = sizeof(FeInstReturn),
+    [FE_PHI] = sizeof(FeInstPhi),
     
     [FE_CALL] = sizeof(FeInstCall),
 
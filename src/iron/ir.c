@@ -520,6 +520,25 @@ FeInst* fe_inst_binop(FeFunc* f, FeTy ty, FeInstKind kind, FeInst* lhs, FeInst*
     return inst;
 }
 
+FeInst* fe_inst_load(FeFunc* f, FeTy ty, FeInst* ptr) {
+    FeInst* inst = fe_ipool_alloc(f->ipool, sizeof(FeInstLoad));
+    inst->kind = FE_LOAD;
+    inst->ty = ty;
+    fe_extra_T(inst, FeInstLoad)->ptr = ptr;
+    return inst;
+}
+
+FeInst* fe_inst_store(FeFunc* f, FeInst* ptr, FeInst* val, FeTy store_ty) {
+    FeInst* inst = fe_ipool_alloc(f->ipool, sizeof(FeInstStore));
+    inst->kind = FE_STORE;
+    inst->ty = FE_TY_VOID;
+    FeInstStore* store = fe_extra(inst);
+    store->ptr = ptr;
+    store->val = val;
+    store->store_ty = store_ty;
+    return inst;
+}
+
 FeInst* fe_inst_bare(FeFunc* f, FeTy ty, FeInstKind kind) {
     FeInst* inst = fe_ipool_alloc(f->ipool, 0);
     inst->kind = kind;
@@ -629,7 +648,8 @@ void fe_phi_set_src(FeInst* inst, u16 index, FeInst* val, FeBlock* block) {
 void fe_phi_append_src(FeInst* inst, FeInst* val, FeBlock* block) {
     FeInstPhi* phi = fe_extra(inst);
     if (phi->len == phi->cap) {
-        phi->cap += phi->cap >> 1;
+        // phis built up one source at a time start out empty
+        phi->cap = phi->cap < 2 ? 2 : phi->cap + (phi->cap >> 1);
         phi->vals = fe_realloc(phi->vals, sizeof(phi->vals[0]) * phi->cap);
         phi->blocks = fe_realloc(phi->blocks, sizeof(phi->blocks[0]) * phi->cap);
     }
@@ -721,6 +741,16 @@ void fe_call_set_arg(FeInst* call, u16 index, FeInst* arg) {
     }
 }
 
+FeInst* fe_inst_proj(FeFunc* f, FeInst* tuple, usize index) {
+    FeInst* inst = fe_ipool_alloc(f->ipool, sizeof(FeInstProj));
+    inst->kind = FE_PROJ;
+    inst->ty = fe_proj_ty(tuple, index);
+    FeInstProj* proj = fe_extra(inst);
+    proj->val = tuple;
+    proj->idx = index;
+    return inst;
+}
+
 FeTy fe_proj_ty(FeInst* tuple, usize index) {
     if (tuple->ty != FE_TY_TUPLE) {
         fe_runtime_crash("projection on non-tuple inst %s", inst_name(tuple));
@@ -599,6 +599,7 @@ void fe_inst_unordered_remove_use(FeInst* def, FeInst* use);
 FeInst** fe_inst_list_inputs(const FeTarget* t, FeInst* inst, usize* len_out);
 FeBlock** fe_inst_list_terminator_successors(const FeTarget* t, FeInst* term, usize* len_out);
 
+FeInst* fe_inst_proj(FeFunc* f, FeInst* tuple, usize index);
 FeTy fe_proj_ty(FeInst* tuple, usize index);
 
 FeInst* fe_inst_const(FeFunc* f, FeTy ty, u64 val);
@@ -608,6 +609,8 @@ FeInst* fe_inst_const_f16(FeFunc* f, f16 val);
 FeInst* fe_inst_sym_addr(FeFunc* f, FeTy ty, FeSymbol* sym);
 FeInst* fe_inst_unop(FeFunc* f, FeTy ty, FeInstKind kind, FeInst* val);
 FeInst* fe_inst_binop(FeFunc* f, FeTy ty, FeInstKind kind, FeInst* lhs, FeInst* rhs);
+FeInst* fe_inst_load(FeFunc* f, FeTy ty, FeInst* ptr);
+FeInst* fe_inst_store(FeFunc* f, FeInst* ptr, FeInst* val, FeTy store_ty);
 FeInst* fe_inst_bare(FeFunc* f, FeTy ty, FeInstKind kind);
 
 FeInst* fe_inst_call(FeFunc* f, FeInst* callee, FeFuncSig* sig);
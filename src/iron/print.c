@@ -129,12 +129,13 @@ thread_local static bool should_ansi = true;
 
 static void print_inst_ty(FeDataBuffer* db, FeInst* inst) {
     if (inst->ty == FE_TY_TUPLE) {
-        usize index = 0;
-        for (FeTy ty = fe_proj_ty(inst, index); ty != FE_TY_VOID; index++, ty = fe_proj_ty(inst, index)) {
+        // only calls make tuples so far, and fe_proj_ty crashes past the last one
+        FeFuncSig* sig = fe_extra_T(inst, FeInstCall)->sig;
+        for_n(index, 0, sig->return_len) {
             if (index != 0) {
                 fe_db_writecstr(db, ", ");
             }
-            fe_db_writecstr(db, ty_name[ty]);
+            fe_db_writecstr(db, ty_name[fe_proj_ty(inst, index)]);
         }
     } else {
         fe_db_writecstr(db, ty_name[inst->ty]);
@@ -212,6 +213,21 @@ static void print_inst(FeFunc* f, FeDataBuffer* db, FeInst* inst) {
     case FE_PARAM:
         fe_db_writef(db, "%u", fe_extra_T(inst, FeInstParam)->index);
         break;
+    case FE_PROJ:
+    case FE_MACH_PROJ:
+        fe__emit_ir_ref(db, f, fe_extra_T(inst, FeInstProj)->val);
+        fe_db_writef(db, ", %zu", fe_extra_T(inst, FeInstProj)->idx);
+        break;
+    case FE_LOAD ... FE_LOAD_VOLATILE:
+        fe__emit_ir_ref(db, f, fe_extra_T(inst, FeInstLoad)->ptr);
+        break;
+    case FE_STORE ... FE_STORE_VOLATILE:
+        fe__emit_ir_ref(db, f, fe_extra_T(inst, FeInstStore)->ptr);
+        fe_db_writecstr(db, ", ");
+        fe__emit_ir_ref(db, f, fe_extra_T(inst, FeInstStore)->val);
+        fe_db_writecstr(db, ": ");
+        fe_db_writecstr(db, ty_name[fe_extra_T(inst, FeInstStore)->store_ty]);
+        break;
     case FE_RETURN:
         ;
         FeInstReturn* ret = fe_extra(inst);